@@ -62,62 +62,87 @@ void initializeNode(Node* node, TMLClass* cl, char* name) {
    node->assignedAttr = (TMLAttrValue**)malloc(sizeof(TMLAttrValue*)*cl->nattr);
    for (i = 0; i < cl->nattr; i++)
       node->assignedAttr[i] = NULL;
-   node->attrValues = (int**)malloc(sizeof(int*)*cl->nattr);
+   node->attrValues = (TMLValueMask**)malloc(sizeof(TMLValueMask*)*cl->nattr);
    for (i = 0; i < cl->nattr; i++)
       node->attrValues[i] = NULL;
    node->assignedSubcl = -1;
    node->subclMask= NULL;
+   node->subclLogP = NULL;
    node->subcl = NULL;
    node->changed = 1;
    node->par = NULL;
    node->npars = 0;
+   node->slots = NULL;
+   node->nslots = 0;
    node->active = 0;
    node->nmaxgroundliterals = 0;
 }
 
 /**
  * Frees all the nodes in a tree beginning at node.
+ * Subclass nodes are collected in pre-order on a heap stack and
+ * released in reverse, so children are freed before the array
+ * of their parent that holds them.
  *
  * NOTE: This will need to be revised when a node can be the
  * subpart of more than one other node.
  */
 void freeTreeRootedAtNode(Node* node) {
-   int i, j;
-   TMLClass* cl = node->cl;
-   Node* subcl = node->subcl;
+   int i, j, k;
+   TMLClass* cl;
+   Node* subcl;
    Node** part;
+   PtrStack toVisit;
+   PtrStack order;
 
-   if (node->subcl != NULL) {
+   initPtrStack(&toVisit, 64);
+   initPtrStack(&order, 64);
+   pushPtrStack(&toVisit, node);
+   while ((node = (Node*)popPtrStack(&toVisit)) != NULL) {
+      pushPtrStack(&order, node);
+      if (node->subcl == NULL) continue;
+      cl = node->cl;
+      subcl = node->subcl;
       if (node->assignedSubcl != -1 && node->subclMask == NULL)
-         freeTreeRootedAtNode(subcl);
+         pushPtrStack(&toVisit, subcl);
       else {
          for (i = 0; i < cl->nsubcls; i++) {
             if (node->subclMask != NULL && node->subclMask[i] == 0) {
                subcl++; continue;
             }
-            freeTreeRootedAtNode(subcl);
+            pushPtrStack(&toVisit, subcl);
             subcl++;
          }
       }
-      free(node->subcl);
-   }
-   for (j = 0; j < cl->nparts; j++) {
-      part = node->part[j];
-      free(part);
-   }
-   free(node->part);
-   for (i = 0; i < cl->nrels; i++) {
-      free(node->relValues[i]);
    }
-   free(node->relValues);
-   free(node->assignedAttr);
-   for (i = 0; i < cl->nattr; i++) {
-      if (node->attrValues[i] != NULL) free(node->attrValues[i]);
+
+   for (k = order.n_-1; k >= 0; k--) {
+      node = (Node*)order.items_[k];
+      cl = node->cl;
+      if (node->subcl != NULL) free(node->subcl);
+      for (j = 0; j < cl->nparts; j++) {
+         part = node->part[j];
+         free(part);
+      }
+      free(node->part);
+      for (i = 0; i < cl->nrels; i++) {
+         free(node->relValues[i]);
+      }
+      free(node->relValues);
+      free(node->assignedAttr);
+      for (i = 0; i < cl->nattr; i++) {
+         if (node->attrValues[i] != NULL) free(node->attrValues[i]);
+      }
+      free(node->attrValues);
+      if (node->subclMask != NULL)
+         free(node->subclMask);
+      if (node->subclLogP != NULL)
+         free(node->subclLogP);
+      if (node->par != NULL) free(node->par);
+      if (node->slots != NULL) free(node->slots);
    }
-   free(node->attrValues);
-   if (node->subclMask != NULL)
-      free(node->subclMask);
-   if (node->par != NULL) free(node->par);
+   freePtrStack(&toVisit);
+   freePtrStack(&order);
 }
 
 void addParent(Node* node, Node* par) {
@@ -136,6 +161,60 @@ void addParent(Node* node, Node* par) {
    }
 }
 
+/**
+ * Puts partNode in slot n of part p of par, and records the slot on
+ * partNode so membership checks need not scan the part array. The node
+ * it replaces no longer records the slot.
+ *
+ * @param par        node whose part array is set
+ * @param p          index of the part in par->part
+ * @param n          slot in the part array
+ * @param partNode   node to put in the slot, may be NULL
+ */
+void setPartSlot(Node* par, int p, int n, Node* partNode) {
+   Node* old = par->part[p][n];
+   PartSlot* slot;
+   int i;
+
+   if (old == partNode) return;
+   if (old != NULL) {
+      for (i = 0; i < old->nslots; i++) {
+         slot = &(old->slots[i]);
+         if (slot->par == par && slot->part == p && slot->slot == n) {
+            old->nslots--;
+            *slot = old->slots[old->nslots];
+            break;
+         }
+      }
+   }
+   par->part[p][n] = partNode;
+   if (partNode == NULL) return;
+   partNode->slots = (PartSlot*)realloc(partNode->slots, sizeof(PartSlot)*(partNode->nslots+1));
+   slot = &(partNode->slots[partNode->nslots]);
+   slot->par = par;
+   slot->part = p;
+   slot->slot = n;
+   partNode->nslots++;
+}
+
+/**
+ * Finds a slot of par's part arrays that holds node
+ *
+ * @param node   node held
+ * @param par    node whose part arrays are searched
+ * @param p      index of the part in par->part, or -1 for any part
+ * @return  the slot, NULL if par does not hold node
+ */
+PartSlot* findPartSlot(Node* node, Node* par, int p) {
+   int i;
+
+   for (i = 0; i < node->nslots; i++) {
+      if (node->slots[i].par == par && (p == -1 || node->slots[i].part == p))
+         return &(node->slots[i]);
+   }
+   return NULL;
+}
+
 void markNodeAncestorsAsActive(Node* node) {
    Node** par = node->par;
    int p;
@@ -11,6 +11,15 @@ typedef struct TMLObject {
    UT_hash_handle hh; /* makes this structure hashable */
 } TMLObject;
 
+/**
+ * One slot of a part array holding a node: par->part[part][slot]
+ */
+typedef struct PartSlot {
+   struct Node* par;
+   int part;
+   int slot;
+} PartSlot;
+
 /**
  * Node struct for SPN structure/
  * Each node represents a object:class pair
@@ -25,6 +34,10 @@ typedef struct Node {
    // Parent nodes
    struct Node** par;
    int npars;
+   // Part array slots of other nodes that hold this node, kept up to
+   // date by setPartSlot
+   PartSlot* slots;
+   int nslots;
    // If we know finer class information for the object,
    // assignedSubcl is index into cl->subcl for the class. 
    // Otherwise -1.
@@ -41,10 +54,15 @@ typedef struct Node {
    // object are known.
    int** relValues;
    TMLAttrValue** assignedAttr;
-   int** attrValues;
+   // attrValues[i] is a bitset of the values attribute i cannot take
+   // (see TMLValueMask), NULL if none are excluded
+   TMLValueMask** attrValues;
    // If not NULL, identifies which subclass branches are blocked
    // due to queries or !Is(X,C) facts
    int* subclMask;
+   // If not NULL, the log probability of each subclass branch given the
+   // evidence, kept up to date by computeLogZ (see normalizeSPN)
+   float* subclLogP;
    // Current value of the tree rooted at this Node
    float logZ;
    // Boolean stating whether or not the value of this tree has changed
@@ -58,10 +76,18 @@ typedef struct Node {
    UT_hash_handle hh_path; /* makes this structure hashable */
    int active; /* If 1, facts or names have been attributed to this node or a descendant. Otherwise 0.  */
 } Node;
+
+// Shape of the sum node evaluated for a Node by computeLogZ
+#define LOGZ_ASSIGNED 0   // subclass fixed by evidence
+#define LOGZ_OPEN 1       // all subclasses possible
+#define LOGZ_MASKED 2     // some subclasses blocked by subclMask
+#define LOGZ_LEAF 3       // no subclasses
    
 void initializeNode(Node* node, TMLClass* cl, char* name);
 void freeTreeRootedAtNode(Node* node);
 void addParent(Node* node, Node* par);
+void setPartSlot(Node* par, int p, int n, Node* partNode);
+PartSlot* findPartSlot(Node* node, Node* par, int p);
 void markNodeAncestorsAsActive(Node* node);
 
 TMLObject* newTMLObject(char* name);
@@ -1,7 +1,12 @@
 #include "TMLClass.h"
 #include <string.h>
+#include <pthread.h>
 #include "util.h"
 
+// Most distinct masks an attribute caches the log-sum-exp of
+#define MAX_MASK_SUMS 4096
+#define MAX_MASK_SUMS_LOG2 12
+
 /**
  * Creates a new TMLRelation struct 
  *
@@ -100,6 +105,153 @@ void freeTMLRelation(void* obj) {
    free(tmlr);
 }
 
+/* Most distinct masks of an attribute with nvals values that its mask
+ * cache holds */
+static int maxMaskSums(int nvals) {
+   return (nvals < MAX_MASK_SUMS_LOG2) ? (1 << nvals) : MAX_MASK_SUMS;
+}
+
+/* Frees the cached log-sum-exps of the masks of an attribute */
+static void freeMaskSums(TMLAttribute* attr) {
+   int i;
+
+   if (attr->maskSums == NULL) return;
+   for (i = 0; i < 2*maxMaskSums(attr->nvals); i++) {
+      if (attr->maskSums[i] != NULL) {
+         free(attr->maskSums[i]->mask);
+         free(attr->maskSums[i]);
+      }
+   }
+   free(attr->maskSums);
+   attr->maskSums = NULL;
+   attr->nmaskSums = 0;
+}
+
+/* Hashes a mask into the slots of a mask cache, of which there are a
+ * power of 2 */
+static int maskSlot(TMLValueMask* mask, size_t nwords, int nslots) {
+   unsigned long h = 14695981039346656037UL;
+   size_t w;
+
+   for (w = 0; w < nwords; w++)
+      h = (h ^ mask[w]) * 1099511628211UL;
+   return (int)((h ^ (h >> 32)) & (unsigned long)(nslots-1));
+}
+
+/* Returns the entry of a mask cache for mask, NULL if it has none. The
+ * entries are published with release stores, so this reads them without
+ * a lock */
+static TMLMaskSum* findMaskSum(TMLMaskSum** slots, TMLValueMask* mask, size_t nwords, int nslots) {
+   TMLMaskSum* ms;
+   int i;
+
+   for (i = maskSlot(mask, nwords, nslots); ; i = (i+1) & (nslots-1)) {
+      ms = __atomic_load_n(&(slots[i]), __ATOMIC_ACQUIRE);
+      if (ms == NULL || memcmp(ms->mask, mask, sizeof(TMLValueMask)*nwords) == 0)
+         return ms;
+   }
+}
+
+/**
+ * Computes the log-sum-exp of the weights of the values of an attribute
+ * that a mask leaves, without allocating. Matches logsumarr_float.
+ *
+ * @param wts    weights of the values by idx
+ * @param nvals  number of values
+ * @param mask   values to leave out, NULL for none
+ * @return the log-sum-exp, log(0) if every value is masked
+ */
+static float valueLogSum(float* wts, int nvals, TMLValueMask* mask) {
+   float max = 0.0;
+   float sum = 0.0;
+   int maxIdx = -1;
+   int v;
+
+   for (v = 0; v < nvals; v++) {
+      if (mask != NULL && isValueMasked(mask, v)) continue;
+      if (isfinite(wts[v]) && (maxIdx == -1 || wts[v] > max)) {
+         max = wts[v];
+         maxIdx = v;
+      }
+   }
+   if (maxIdx == -1) return log(0.0);
+   for (v = 0; v < nvals; v++) {
+      if (mask != NULL && isValueMasked(mask, v)) continue;
+      if (!isfinite(wts[v])) continue;
+      if (v == maxIdx) sum++;
+      else if (!isinf(exp(wts[v] - max)))
+         sum += exp(wts[v] - max);
+   }
+   return max + log(sum);
+}
+
+/**
+ * Compiles the weights of the values of an attribute into a dense array
+ * indexed by value, and computes their log-sum-exp. Must be called again
+ * whenever a weight of the attribute changes; this also empties the
+ * attribute's mask cache.
+ *
+ * @param attr  attribute to compile
+ */
+void compileTMLAttribute(TMLAttribute* attr) {
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmp;
+
+   if (attr->wts == NULL)
+      attr->wts = (float*)malloc(sizeof(float)*attr->nvals);
+   HASH_ITER(hh, attr->vals, attrval, tmp) {
+      attr->wts[attrval->idx] = attrval->wt;
+   }
+   attr->logSum = valueLogSum(attr->wts, attr->nvals, NULL);
+   freeMaskSums(attr);
+}
+
+/**
+ * Returns the log-sum-exp of the weights of the values of an attribute
+ * that a node's mask leaves. Each distinct mask is summed once and then
+ * looked up.
+ *
+ * Threads answering queries on snapshots of a KB share the cache through
+ * its classes. Looking a mask up takes no lock: the cache has twice as
+ * many slots as it holds masks at most, and its entries are never
+ * changed once published. Only adding a mask takes the attribute's lock.
+ *
+ * @param attr  compiled attribute
+ * @param mask  values the node cannot take, NULL for none
+ * @return the log-sum-exp of the weights of the remaining values
+ */
+float maskedAttrLogSum(TMLAttribute* attr, TMLValueMask* mask) {
+   size_t nwords = valueMaskWords(attr->nvals);
+   int nslots = 2*maxMaskSums(attr->nvals);
+   TMLMaskSum** slots;
+   TMLMaskSum* ms;
+   float logSum;
+   int i;
+
+   if (mask == NULL) return attr->logSum;
+   slots = __atomic_load_n(&(attr->maskSums), __ATOMIC_ACQUIRE);
+   if (slots != NULL && (ms = findMaskSum(slots, mask, nwords, nslots)) != NULL)
+      return ms->logSum;
+   logSum = valueLogSum(attr->wts, attr->nvals, mask);
+   pthread_mutex_lock(&(attr->maskSumLock));
+   slots = attr->maskSums;
+   if (slots == NULL) {
+      slots = (TMLMaskSum**)calloc(nslots, sizeof(TMLMaskSum*));
+      __atomic_store_n(&(attr->maskSums), slots, __ATOMIC_RELEASE);
+   }
+   if (attr->nmaskSums < nslots/2 && findMaskSum(slots, mask, nwords, nslots) == NULL) {
+      ms = (TMLMaskSum*)malloc(sizeof(TMLMaskSum));
+      ms->mask = (TMLValueMask*)malloc(sizeof(TMLValueMask)*nwords);
+      memcpy(ms->mask, mask, sizeof(TMLValueMask)*nwords);
+      ms->logSum = logSum;
+      for (i = maskSlot(mask, nwords, nslots); slots[i] != NULL; i = (i+1) & (nslots-1));
+      __atomic_store_n(&(slots[i]), ms, __ATOMIC_RELEASE);
+      attr->nmaskSums++;
+   }
+   pthread_mutex_unlock(&(attr->maskSumLock));
+   return logSum;
+}
+
 /**
  * frees a TMLAttribute struct
  */
@@ -115,6 +267,10 @@ void freeTMLAttribute(void* obj) {
    }
    if (attr->defaultAttrForSubcl != NULL)
       free(attr->defaultAttrForSubcl);
+   if (attr->wts != NULL)
+      free(attr->wts);
+   freeMaskSums(attr);
+   pthread_mutex_destroy(&(attr->maskSumLock));
    free(attr);
 }
 
@@ -184,6 +340,7 @@ void setUpTMLClass(TMLClass* cl, char* className, int subclIdx) {
    cl->isPart = 0;
    cl->nattr = 0;
    cl->attr = NULL;
+   cl->localKernel = NULL;
 }
 
 /**
@@ -2,18 +2,44 @@
 #define _TMLCLASS_H__
 
 #include <stdlib.h>
+#include <pthread.h>
 #include "uthash.h"
 #include "util.h"
 
 struct TMLClass;
+struct Node;
+
+/* Model-specialized evaluation of the relation and attribute weights of a
+ * node (see printTMLKernel). Adds them to *logZ or to the subclass
+ * branches in subclZ, according to the node's shape (LOGZ_*).
+ */
+typedef void (*TMLLocalKernel)(struct Node* node, int shape, float* logZ, float* subclZ);
 
 typedef struct TMLAttrValue {
    char* name;
    float wt;
    int idx;
+   float cnt; /* times the value was observed, or is expected to be (see setObservedCounts) */
+   int mapCnt; /* times the value is taken in the MAP state */
    UT_hash_handle hh;
 } TMLAttrValue;
 
+/* Values of an attribute that a node cannot take, as a bitset over the
+ * value indices: bit v is set if value v is false for the node.
+ */
+typedef unsigned long TMLValueMask;
+#define VALUE_MASK_BITS (8*sizeof(TMLValueMask))
+#define valueMaskWords(nvals) (((nvals)+VALUE_MASK_BITS-1)/VALUE_MASK_BITS)
+#define isValueMasked(mask,v) (((mask)[(v)/VALUE_MASK_BITS] >> ((v)%VALUE_MASK_BITS)) & 1)
+#define maskValue(mask,v) ((mask)[(v)/VALUE_MASK_BITS] |= ((TMLValueMask)1 << ((v)%VALUE_MASK_BITS)))
+#define unmaskValue(mask,v) ((mask)[(v)/VALUE_MASK_BITS] &= ~((TMLValueMask)1 << ((v)%VALUE_MASK_BITS)))
+
+/* Log-sum-exp of the weights of the values one mask leaves */
+typedef struct TMLMaskSum {
+   TMLValueMask* mask;
+   float logSum;
+} TMLMaskSum;
+
 typedef struct TMLAttribute {
    char* name;
    TMLAttrValue* vals;
@@ -22,6 +48,14 @@ typedef struct TMLAttribute {
    int* defaultAttrForSubcl;
    int idx;
    UT_hash_handle hh;
+
+   float* wts; /* weights of the values by idx, set by compileTMLAttribute */
+   float logSum; /* log-sum-exp of wts, the weight of an unmasked node */
+   TMLMaskSum** maskSums; /* log-sum-exp of wts for the masks seen so far, an
+                             open-addressed table only ever added to, which is
+                             read without a lock (see maskedAttrLogSum) */
+   int nmaskSums;
+   pthread_mutex_t maskSumLock; /* taken to add to maskSums */
 } TMLAttribute;
 
 /* Stores information on one TML relation rule */
@@ -33,8 +67,8 @@ typedef struct TMLRelation {
    int numposs; /* number of possible grounded relations this rule covers for an object */
    float pwt; /* positive log weight */
    float nwt; /* negative log weight */
-   int pcnt; /* positive count */
-   int ncnt; /* negative count */
+   float pcnt; /* positive count */
+   float ncnt; /* negative count */
    int hard; /* 1 if always pos, -1 if always neg, 0 otherwise */
    int defaultRel; /* 1 if subclasses override this relation, 0 otherwise */
    int* defaultRelForSubcl; /* defaultRelForSubcl[i] == 1 if some subparts of subcl i override this class
@@ -66,6 +100,8 @@ TMLRelation* copyTMLRelation(TMLRelation* rel);
 void setUpTMLRelation(TMLRelation* rel, const char* name, int numParts, int numSubcl);
 void freeTMLRelation(void* obj);
 void freeTMLPart(void* obj);
+void compileTMLAttribute(TMLAttribute* attr);
+float maskedAttrLogSum(TMLAttribute* attr, TMLValueMask* mask);
 
 /* Stores information about one class in the TML KB */
 typedef struct TMLClass {
@@ -76,7 +112,7 @@ typedef struct TMLClass {
    int nsubcls; /* number of subclasses */
    struct TMLClass** subcl; /* struct TMLClass* subclasses */
    float* wt; /* weight of subclasses */
-   int* cnt; /* counts of the subclasses */
+   float* cnt; /* counts of the subclasses */
    int totalcnt; /* count of this class */
    int nparts; /* number of subparts */
    TMLPart* part; /* hashtable of struct TMLPart of subparts */
@@ -90,6 +126,8 @@ typedef struct TMLClass {
    TMLAttribute* attr; /* hashtable of attributes for this class */
 
    int mapCnt; /* number of instances in MAP solution */
+
+   TMLLocalKernel localKernel; /* generated kernel for the class's weights, NULL if none is loaded */
 } TMLClass;
 
 TMLClass* TMLClassNew(int id, int subclIdx);
@@ -2,9 +2,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <dlfcn.h>
+#include <pthread.h>
 #include "TMLKB.h"
 #include "util.h"
 #include "Node.h"
+#include "pqueue.h"
 
 #define MAX_LINE_LENGTH 10000
 #define MAX_NAME_LENGTH 1000
@@ -18,38 +22,19 @@
 #define EMPTY_LINE -1
 #define ERROR -2
 
+// pol of a KBEdit for a subclass branch pruned by propagateHardConstraints
+#define PRUNE -2
+
 #define relWeight(relVals,rel) (rel->hard == 0 ? (((relVals[0] != 0) ? relVals[0]*rel->nwt : 0.0) \
    +((relVals[1] != 0) ? relVals[1]*rel->pwt : 0.0) \
    +((relVals[2] != 0) ? relVals[2]*logsum_float(rel->pwt,rel->nwt) : 0.0)) : \
    ((rel->hard == 1) ? (relVals[0] != 0 ? log(0.0) : 0.0) : (relVals[1] != 0 ? log(0.0) : 0.0)))
 
 float attrWeight(Node* node, TMLAttribute* attr) {
-   TMLAttrValue* attrvalue;
-   TMLAttrValue* tmp;
-   float* args;
-   float sum;
-   int* mask = node->attrValues[attr->idx];
    if (node->assignedAttr[attr->idx] != NULL) {
       return node->assignedAttr[attr->idx]->wt;
    }
-   args = (float*)malloc(sizeof(float)*attr->nvals);
-   
-   if (mask == NULL) { 
-      HASH_ITER(hh, attr->vals, attrvalue, tmp) {
-         args[attrvalue->idx] = attrvalue->wt;
-      }
-   } else {
-      HASH_ITER(hh, attr->vals, attrvalue, tmp) {
-         if (mask[attrvalue->idx] < 0) {
-            args[attrvalue->idx] = log(0.0);
-         } else {
-            args[attrvalue->idx] = attrvalue->wt;
-         }
-      }
-   }
-   sum = logsumarr_float(args, attr->nvals);
-   free(args);
-   return sum;
+   return maskedAttrLogSum(attr, node->attrValues[attr->idx]);
 }
 
 /**
@@ -73,14 +58,38 @@ TMLKB* TMLKBNew() {
    kb->logZ = 0.0;
    kb->edits = NULL;
    kb->mapSet = 0;
+   kb->deferLogZ = 0;
+   kb->localMarginals = 0;
+   kb->kernelLib = NULL;
+   kb->prunes = NULL;
+   kb->savepoints = NULL;
+   kb->queryCache = NULL;
+   kb->nodeEpochs = NULL;
+   kb->epoch = 0;
+   kb->epochEdits = NULL;
+   kb->preparedQueries = NULL;
+   kb->queryBlocking = NULL;
+   kb->snapshotOf = NULL;
+   kb->objectsByClass = NULL;
+   kb->nindexedObjects = 0;
+   kb->indexedEpoch = 0;
+   kb->indexedEdits = NULL;
+   kb->now = 0;
+   kb->window = 0;
+   kb->expiries = NULL;
 
    // Learning parameters
    // TODO: read these from somewhere
    kb->scPct = 1;
    kb->relPctT = 1;
    kb->relPctF = 1;
-   kb->l0 = 1.0;
-   kb->l1 = 1.0;
+   kb->l0 = 0.0;
+   kb->l1 = 0.0;
+   kb->withheld = NULL;
+   kb->onlineDirty = NULL;
+   kb->onlineEvery = 0;
+   kb->onlinePending = 0;
+   kb->countedEdits = NULL;
 
    return kb;
 }
@@ -93,6 +102,9 @@ TMLKB* TMLKBNew() {
  * @param subclIdx     If a change of a subclass of node's class, the index of that subclass
  * @param relStr       If an added relation fact, the name of the relation
  * @param relIdx       If an added relation fact, the index of the relation in the array of rels
+ * @param valIdx       If an attribute value change, the index of the value; if a change of
+ *                     subclass, the index of the subclass whose node it listed in
+ *                     kb->classToObjPtrs, -1 if none
  * @param pol          Polarity of the change
  * @param prev         Stack of KBEdits to push onto
  * @return the updated KBEdit stack
@@ -106,6 +118,9 @@ KBEdit* addKBEdit(Node* node, int subclIdx, char* relStr, int relIdx, int valIdx
    newEdit->relIdx = relIdx;
    newEdit->valIdx = valIdx;
    newEdit->pol = pol;
+   newEdit->fact = NULL;
+   newEdit->expires = -1;
+   newEdit->expiry = NULL;
    return newEdit;
 }
 
@@ -118,9 +133,50 @@ KBEdit* addAndCopyKBEdit(KBEdit* copy, KBEdit* prev) {
    newEdit->relIdx = copy->relIdx;
    newEdit->valIdx = copy->valIdx;
    newEdit->pol = copy->pol;
+   newEdit->fact = NULL;
+   newEdit->expires = -1;
+   newEdit->expiry = NULL;
    return newEdit;
 }
 
+/**
+ * Lists node among the objects of class c in kb->classToObjPtrs.
+ */
+static void indexObjectUnderClass(TMLKB* kb, int c, Node* node) {
+   QNode* qnode = (QNode*)malloc(sizeof(QNode));
+
+   qnode->ptr = node;
+   qnode->next = kb->classToObjPtrs[c];
+   kb->classToObjPtrs[c] = qnode;
+}
+
+/**
+ * Takes node out of the objects of class c in kb->classToObjPtrs.
+ *
+ * @return 1 if node was listed, 0 otherwise
+ */
+static int unindexObjectUnderClass(TMLKB* kb, int c, Node* node) {
+   QNode** link;
+   QNode* qnode;
+
+   for (link = &(kb->classToObjPtrs[c]); *link != NULL; link = &((*link)->next)) {
+      if ((*link)->ptr != node) continue;
+      qnode = *link;
+      *link = qnode->next;
+      free(qnode);
+      return 1;
+   }
+   return 0;
+}
+
+static int isObjectIndexedUnderClass(TMLKB* kb, int c, Node* node) {
+   QNode* qnode;
+
+   for (qnode = kb->classToObjPtrs[c]; qnode != NULL; qnode = qnode->next)
+      if (qnode->ptr == node) return 1;
+   return 0;
+}
+
 /**
  * Splits a string of the form %s.%d into its string and number parts
  * If string is not of that form, returns a copy of the string and
@@ -343,25 +399,34 @@ char* createNamedRelStr(TMLKB* kb, Node* node, char* normalizedStr) {
  * @return     normalized string of the relation ground literal
  */
 char* createNormalizedRelStr(TMLKB* kb, char* relation, char* object, Node** argNodes, int nargs, int addBase, int useNames) {
+   char ret[MAX_LINE_LENGTH+1];
+
+   writeNormalizedRelStr(ret, relation, object, argNodes, nargs, addBase, useNames);
+   return strdup(ret);
+}
+
+/**
+ * Writes the string createNormalizedRelStr returns into str, which holds
+ * MAX_LINE_LENGTH+1 chars, without allocating.
+ */
+void writeNormalizedRelStr(char* str, char* relation, char* object, Node** argNodes, int nargs, int addBase, int useNames) {
    int a;
-   char ret_even[MAX_LINE_LENGTH+1];
-   char ret_odd[MAX_LINE_LENGTH+1];
+   int len;
    char* partName;
-//   Node* obj;
    char* partPtr;
 
    if (nargs == 0) {
       if (addBase == 1)
-         snprintf(ret_even, MAX_LINE_LENGTH, "%s(%s)", relation, object);
+         snprintf(str, MAX_LINE_LENGTH, "%s(%s)", relation, object);
       else
-         snprintf(ret_even, MAX_LINE_LENGTH, "%s()", relation);
-      return strdup(ret_even);
+         snprintf(str, MAX_LINE_LENGTH, "%s()", relation);
+      return;
    }
    if (addBase == 1)
-      sprintf(ret_even, "%s(%s,", relation, object);
+      len = snprintf(str, MAX_LINE_LENGTH, "%s(%s,", relation, object);
    else
-      sprintf(ret_even, "%s(", relation);
-   for (a = 0; a < nargs; a++) {
+      len = snprintf(str, MAX_LINE_LENGTH, "%s(", relation);
+   for (a = 0; a < nargs && len < MAX_LINE_LENGTH; a++) {
       if (useNames != 1 || argNodes[a]->name == NULL)
          partName = argNodes[a]->pathname;
       else
@@ -370,34 +435,11 @@ char* createNormalizedRelStr(TMLKB* kb, char* relation, char* object, Node** arg
       partPtr = strrchr(partName, '.');
       if (partPtr == NULL) partPtr = partName;
       else partPtr++;
-      if (strchr(partName, '[') != NULL || (useNames == 1 && strchr(partName, '.') == NULL)) {
-         if (a % 2 == 1) {
-            if (a != nargs-1)
-               sprintf(ret_even, "%s%s,", ret_odd, partPtr);
-            else
-               sprintf(ret_even, "%s%s)", ret_odd, partPtr);
-         } else {
-            if (a != nargs-1)
-               sprintf(ret_odd, "%s%s,", ret_even, partPtr);
-            else
-               sprintf(ret_odd, "%s%s)", ret_even, partPtr);
-         }
-      } else {
-         if (a % 2 == 1) {
-            if (a != nargs-1)
-               sprintf(ret_even, "%s%s[1],", ret_odd, partPtr);
-            else
-               sprintf(ret_even, "%s%s[1])", ret_odd, partPtr);
-         } else {
-            if (a != nargs-1)
-               sprintf(ret_odd, "%s%s[1],", ret_even, partPtr);
-            else
-               sprintf(ret_odd, "%s%s[1])", ret_even, partPtr);
-         }
-      }
+      if (strchr(partName, '[') != NULL || (useNames == 1 && strchr(partName, '.') == NULL))
+         len += snprintf(str+len, MAX_LINE_LENGTH-len, "%s%s", partPtr, (a != nargs-1) ? "," : ")");
+      else
+         len += snprintf(str+len, MAX_LINE_LENGTH-len, "%s[1]%s", partPtr, (a != nargs-1) ? "," : ")");
    }
-   if (nargs % 2 == 1) return strdup(ret_odd);
-   return strdup(ret_even);
 }
 
 /**
@@ -412,7 +454,7 @@ char* createNormalizedRelStr(TMLKB* kb, char* relation, char* object, Node** arg
  */
 char* splitRelArgsAndCreateNormalizedRelStr(TMLKB* kb, char* relStr, char* relation, int* nargs, char*** args, int useNames) {
    int n = 0;
-   char obj_fmt_str[25];
+   char obj_fmt_str[30];
    char* iter = relStr;
    int correctScan;
    char obj[MAX_NAME_LENGTH+1];
@@ -431,7 +473,7 @@ char* splitRelArgsAndCreateNormalizedRelStr(TMLKB* kb, char* relStr, char* relat
       return strdup(ret_even);
    }
    sprintf(ret_even, "%s(", relation);
-   snprintf(obj_fmt_str, 25, " %%%d[]a-zA-Z0-9.[:?] ", MAX_NAME_LENGTH);
+   snprintf(obj_fmt_str, 30, " %%%d[]a-zA-Z0-9.[:?*] ", MAX_NAME_LENGTH);
 
    // Counts how many arguments there are
    while (TRUE) {
@@ -624,8 +666,6 @@ Node* updateClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
    TMLRelation* rel;
    TMLRelation* tmprel;
    int* subclMask;
-   QNode* qnode;
-   QNode* classToObjPtrsList;
    KBEdit* edits = (editPtr == NULL) ? NULL : *editPtr;
 
    // If the class's parent is the same as the previously known finest class information
@@ -653,12 +693,15 @@ Node* updateClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
          topNode->assignedSubcl = cl->subclIdx;
          obj = &(topNode->subcl[cl->subclIdx]);
          if (editPtr != NULL) {
-            edits = addKBEdit(topNode, cl->subclIdx, NULL, -1, -1, 1, edits);
-            classToObjPtrsList = kb->classToObjPtrs[cl->id];
-            qnode = (QNode*)malloc(sizeof(QNode));
-            qnode->ptr = obj; 
-            qnode->next = classToObjPtrsList;
-            kb->classToObjPtrs[cl->id] = qnode;
+            // a prune that left only this subclass open has listed the
+            // node already (see propagateHardConstraints)
+            for (i = 0; i < topNode->cl->nsubcls && (i == cl->subclIdx || topNode->subclMask[i] != 1); i++);
+            if (i < topNode->cl->nsubcls || !isObjectIndexedUnderClass(kb, cl->id, obj)) {
+               edits = addKBEdit(topNode, cl->subclIdx, NULL, -1, cl->subclIdx, 1, edits);
+               indexObjectUnderClass(kb, cl->id, obj);
+            } else {
+               edits = addKBEdit(topNode, cl->subclIdx, NULL, -1, -1, 1, edits);
+            }
          }
          if (editPtr != NULL) *editPtr = edits;
          return obj;
@@ -689,12 +732,8 @@ Node* updateClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
             }
          }
          if (editPtr != NULL) {
-            kb->edits = addKBEdit(par, cl->subclIdx, NULL, -1, -1, 1, kb->edits);
-            classToObjPtrsList = kb->classToObjPtrs[cl->id];
-            qnode = (QNode*)malloc(sizeof(QNode));
-            qnode->ptr = obj; 
-            qnode->next = classToObjPtrsList;
-            kb->classToObjPtrs[cl->id] = qnode;
+            kb->edits = addKBEdit(par, cl->subclIdx, NULL, -1, cl->subclIdx, 1, kb->edits);
+            indexObjectUnderClass(kb, cl->id, &(par->subcl[cl->subclIdx]));
          }
          if (editPtr != NULL) *editPtr = edits;
          return &(par->subcl[cl->subclIdx]);
@@ -706,6 +745,9 @@ Node* updateClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
    if (strchr(name, '.') == NULL)
       obj->name = name;
    obj->changed = 1;
+   obj->slots = NULL;
+   obj->subclLogP = NULL;
+   obj->nslots = 0;
    i = 0;
    obj->part = (Node***)malloc(sizeof(Node**)*cl->nparts);
    HASH_ITER(hh, cl->part, part, tmppart) {
@@ -736,7 +778,7 @@ Node* updateClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
    obj->assignedAttr = (TMLAttrValue**)malloc(sizeof(TMLAttrValue**)*cl->nattr);  
    for (i = 0; i < cl->nattr; i++)
       obj->assignedAttr[i] = NULL;
-   obj->attrValues = (int**)malloc(sizeof(int*)*cl->nattr);  
+   obj->attrValues = (TMLValueMask**)malloc(sizeof(TMLValueMask*)*cl->nattr);  
    for (i = 0; i < cl->nattr; i++)                        
       obj->attrValues[i] = NULL;
    if (cl == finecl) {
@@ -838,7 +880,7 @@ Node* blockClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
                return NULL;
             }
          }
-         if (editPtr == NULL)
+         if (editPtr != NULL)
             edits = addKBEdit(topNode, finecl->subclIdx, NULL, -1, -1, 0, edits);
          if (editPtr != NULL) *editPtr = edits;
          return topNode;
@@ -853,7 +895,7 @@ Node* blockClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
    if (obj->name != NULL) {
       if (finecl->par == obj->cl) {
          if (obj->subclMask == NULL) {
-            obj->subclMask = (int*)malloc(sizeof(int)*cl->nsubcls);
+            obj->subclMask = (int*)malloc(sizeof(int)*obj->cl->nsubcls);
             subclMask = obj->subclMask;
             for (i = 0; i < obj->cl->nsubcls; i++) {
                *subclMask = 1;
@@ -882,7 +924,7 @@ Node* blockClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
                return NULL;
             }
          }
-         if (editPtr == NULL)
+         if (editPtr != NULL)
             edits = addKBEdit(obj, finecl->subclIdx, NULL, -1, -1, 0, edits);
          if (editPtr != NULL) *editPtr = edits;
          return obj;
@@ -896,6 +938,9 @@ Node* blockClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
       if (strchr(name, '.') == NULL)
          obj->name = name;
       obj->changed = 1;
+      obj->slots = NULL;
+      obj->subclLogP = NULL;
+      obj->nslots = 0;
       i = 0;
       HASH_ITER(hh, cl->part, part, tmppart) {
          obj->part[i] = (Node**)malloc(sizeof(Node*)*part->n);
@@ -925,7 +970,7 @@ Node* blockClassForNodeRecHelper(TMLKB* kb, KBEdit** editPtr, char* name, Node*
       obj->assignedAttr = (TMLAttrValue**)malloc(sizeof(TMLAttrValue**)*cl->nattr);  
       for (i = 0; i < cl->nattr; i++)
          obj->assignedAttr[i] = NULL;
-      obj->attrValues = (int**)malloc(sizeof(int*)*cl->nattr);  
+      obj->attrValues = (TMLValueMask**)malloc(sizeof(TMLValueMask*)*cl->nattr);  
       for (i = 0; i < cl->nattr; i++)                        
          obj->attrValues[i] = NULL;
       if (obj->subcl == NULL) {
@@ -981,9 +1026,7 @@ Node* updateClassForNode(TMLKB* kb, KBEdit** editPtr, char* name, Node* node, TM
       if (node->cl != cl) {
          if (tmlFactFile != NULL) {
             printf("Error on line %d in fact file: Object %s has been assigned two mismatching classes: %s and %s.\n", linenum, name, node->cl->name, cl->name);
-            freeTMLKB(kb);
-            fclose(tmlFactFile); 
-            exit(1);
+            return NULL;
          }
          printf("Object %s is of class %s which conflicts with new class information.\n", name, node->cl->name);
          return NULL;
@@ -1129,6 +1172,9 @@ Node* initAnonNodeToClass(TMLClass* cl, char* name, TMLClass* finecl) {
       obj->pathname = (*obj->par)->name;
 
    obj->changed = 1;
+   obj->slots = NULL;
+   obj->subclLogP = NULL;
+   obj->nslots = 0;
    i = 0;
    obj->part = (Node***)malloc(sizeof(Node**)*cl->nparts);
    HASH_ITER(hh, cl->part, part, tmppart) {
@@ -1159,7 +1205,7 @@ Node* initAnonNodeToClass(TMLClass* cl, char* name, TMLClass* finecl) {
    obj->assignedAttr = (TMLAttrValue**)malloc(sizeof(TMLAttrValue**)*cl->nattr);  
    for (i = 0; i < cl->nattr; i++)
       obj->assignedAttr[i] = NULL;
-   obj->attrValues = (int**)malloc(sizeof(int*)*cl->nattr);  
+   obj->attrValues = (TMLValueMask**)malloc(sizeof(TMLValueMask*)*cl->nattr);  
    for (i = 0; i < cl->nattr; i++)                        
       obj->attrValues[i] = NULL;
    if (cl == finecl) {
@@ -1238,6 +1284,9 @@ Node* initNodeToClass(TMLKB* kb, char* name, TMLClass* cl, TMLClass* finecl) {
    if (strchr(name, '.') == NULL)
       obj->name = name;
    obj->changed = 1;
+   obj->slots = NULL;
+   obj->subclLogP = NULL;
+   obj->nslots = 0;
    obj->active = 0;
    i = 0;
    obj->part = (Node***)malloc(sizeof(Node**)*cl->nparts);
@@ -1269,7 +1318,7 @@ Node* initNodeToClass(TMLKB* kb, char* name, TMLClass* cl, TMLClass* finecl) {
    obj->assignedAttr = (TMLAttrValue**)malloc(sizeof(TMLAttrValue**)*cl->nattr);  
    for (i = 0; i < cl->nattr; i++)
       obj->assignedAttr[i] = NULL;
-   obj->attrValues = (int**)malloc(sizeof(int*)*cl->nattr);  
+   obj->attrValues = (TMLValueMask**)malloc(sizeof(TMLValueMask*)*cl->nattr);  
    for (i = 0; i < cl->nattr; i++)                        
       obj->attrValues[i] = NULL;
    if (cl == finecl) {
@@ -1325,7 +1374,7 @@ void addAndInitSubpartRecHelper(TMLKB* kb, Node* par, Node* obj, Node* subpart,
          return;
       }
       i = foundPart->idx;
-      obj->part[foundPart->idx][n] = subpart;
+      setPartSlot(obj, foundPart->idx, n, subpart);
       if (subpart->pathname == NULL) {
          if (obj->pathname == NULL) {
             sprintf(anonArr, "%s.%s[%d]", obj->name, foundPart->name, (j+1));
@@ -1423,7 +1472,7 @@ Node* addAndInitSubpart(TMLKB* kb, char* name, char* subpartname, Node* obj, cha
       return NULL;
    }
    node = initNodeToClass(kb, subpartname, partcl, partcl);
-   obj->part[i][n] = node;
+   setPartSlot(obj, i, n, node);
    addParent(node, obj);
    if (obj->pathname == NULL) {
       sprintf(anonArr, "%s.%s[%d]", obj->name, foundPart->name, (n+1));
@@ -1449,7 +1498,7 @@ Node* addAndInitSubpart(TMLKB* kb, char* name, char* subpartname, Node* obj, cha
             return NULL;
          }
          i = lowestPart->idx;
-         obj->part[i][n] = node;
+         setPartSlot(obj, i, n, node);
          if (cl->nsubcls == 0 || obj->assignedSubcl == -1 || foundPart->defaultPart == 0) break;
          obj = obj->subcl;
          cl = obj->cl;
@@ -1463,7 +1512,7 @@ Node* addAndInitSubpart(TMLKB* kb, char* name, char* subpartname, Node* obj, cha
       cl = tmpNode->cl;
       tmp = getPart(cl, part);
       if (tmp != NULL) {
-         tmpNode->part[tmp->idx][n] = node;
+         setPartSlot(tmpNode, tmp->idx, n, node);
       }
    }
 
@@ -1656,6 +1705,66 @@ char* getLineToSemicolon(FILE* file, char** prev, int* linenum) {
    return out;
 }
 
+/**
+ * Returns 1 if facts about name are withheld from the KB (see
+ * TMLKB.withheld): name is the withheld relation or attribute, or a class
+ * below the withheld class.
+ */
+static int isWithheld(TMLKB* kb, const char* name) {
+   TMLClass* cl;
+
+   if (kb->withheld == NULL) return 0;
+   if (strcmp(name, kb->withheld) == 0) {
+      HASH_FIND_STR(kb->classNameToPtr, name, cl);
+      return (cl == NULL);
+   }
+   HASH_FIND_STR(kb->classNameToPtr, name, cl);
+   if (cl == NULL) return 0;
+   for (cl = cl->par; cl != NULL; cl = cl->par)
+      if (strcmp(cl->name, kb->withheld) == 0) return 1;
+   return 0;
+}
+
+/* Returns 1 if cl defines a relation or attribute named name */
+static int classDefines(TMLClass* cl, const char* name) {
+   return (getRelation(cl, name) != NULL || getAttribute(cl, name) != NULL);
+}
+
+/* Returns 1 if a class below the withheld class defines a relation or
+ * attribute named name */
+static int isDefinedBelowWithheld(TMLKB* kb, const char* name) {
+   TMLClass* cl;
+   int c;
+
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      if (classDefines(cl, name) && isWithheld(kb, cl->name)) return 1;
+   }
+   return 0;
+}
+
+/**
+ * Returns 1 if a relation or attribute fact about node is withheld along
+ * with the subclass facts of a withheld class (see TMLKB.withheld): name
+ * is defined by a class below the withheld class, but not by the classes
+ * node is known to be in, since its subclass below the withheld class is
+ * not read in.
+ */
+static int isWithheldBelowClass(TMLKB* kb, Node* node, const char* name) {
+   TMLClass* cl;
+
+   if (kb->withheld == NULL) return 0;
+   HASH_FIND_STR(kb->classNameToPtr, kb->withheld, cl);
+   if (cl == NULL) return 0;
+   for (cl = node->cl; cl != NULL; cl = cl->par)
+      if (classDefines(cl, name)) return 0;
+   while (node->assignedSubcl != -1) {
+      node = (node->subclMask == NULL) ? node->subcl : &(node->subcl[node->assignedSubcl]);
+      if (classDefines(node->cl, name)) return 0;
+   }
+   return isDefinedBelowWithheld(kb, name);
+}
+
 /**
  * Read in subclasses line in an object description and add
  * that information to the object nodes
@@ -1683,8 +1792,12 @@ int readInObjectClasses(TMLKB* kb, Node* node, FILE* tmlFactFile, int linenum, c
          printf("Error in subclass description for object %s.\n", (node->name == NULL ? node->pathname : node->name));
          return 0;
       }
-      if (className[0] == '!') {
+      if (className[0] == '!' && isWithheld(kb, className+1)) {
+         output = node;
+      } else if (className[0] == '!') {
          output = addClassEvidenceForObj(kb, (node->name == NULL ? node->pathname : node->name), node, className+1, 0, tmlFactFile, linenum);
+      } else if (isWithheld(kb, className)) {
+         output = node;
       } else {
          output = addClassEvidenceForObj(kb, (node->name == NULL ? node->pathname : node->name), node, className, 1, tmlFactFile, linenum);
       }
@@ -1788,7 +1901,7 @@ int readInObjectSubparts(TMLKB* kb, Node* node, char* bestName, FILE* tmlFactFil
             else
               printf("Error in subpart description for object %s. The %dth part %s of object %s has already been declared.\n", bestName, partIdx, partRel, bestName);
          }
-         tmpnode->part[j][partIdx-1] = subpartNode;
+         setPartSlot(tmpnode, j, partIdx-1, subpartNode);
          if (subpartNode->pathname == NULL) {
             if (node->pathname == NULL) {
                sprintf(anonArr, "%s.%s[%d]", node->name, part->name, partIdx);
@@ -1854,9 +1967,7 @@ int readInObjectRelations(TMLKB* kb, Node* node, char* bestName, FILE* tmlFactFi
    Node* subclNode;
    int partCl;
    char* partName;
-   int nump;
    TMLPart* tmppart;
-   TMLPart* foundpart;
    int partIdx;
 
    n = 0;
@@ -1898,6 +2009,15 @@ int readInObjectRelations(TMLKB* kb, Node* node, char* bestName, FILE* tmlFactFi
          relation = relName;
          pol = 1;
       }
+      if (isWithheld(kb, relation) || isWithheldBelowClass(kb, node, relation)) {
+         iter2 = strchr(iter, ')');
+         if (iter2 == NULL)
+            iter = strchr(iter, ',');
+         else
+            iter = strchr(iter2, ',');
+         if (iter != NULL) iter++;
+         continue;
+      }
       if (argsStr[0] == '\0')
          normalizedRelationStr = splitRelArgsAndCreateNormalizedRelStr(kb, NULL, relation, &numparts, &args, 0);
       else
@@ -2009,7 +2129,6 @@ int readInObjectRelations(TMLKB* kb, Node* node, char* bestName, FILE* tmlFactFi
                else
                   subclNode = &(subclNode->subcl[subclNode->assignedSubcl]);
             }
-            nump = getPart(subclNode->cl, partName)->n;
          } else {
             tmppart = getPart(subclNode->cl, partName);
             while (tmppart == NULL) {
@@ -2019,23 +2138,16 @@ int readInObjectRelations(TMLKB* kb, Node* node, char* bestName, FILE* tmlFactFi
                   subclNode = &(subclNode->subcl[subclNode->assignedSubcl]);
                tmppart = getPart(subclNode->cl, partName);
             }
-            nump = tmppart->n;
-         }
-         partIdx = 0;
-         HASH_ITER(hh, subclNode->cl->part, foundpart, tmppart) {
-            if (strcmp(foundpart->name, partName) == 0) break;
-            partIdx++;
          }
-         for (j = 0; j < n; j++) {
-            if (subclNode->part[partIdx][i] == subpartNode) break;
-         }
-         if (j == nump) {
+         partIdx = getPart(subclNode->cl, partName)->idx;
+         if (findPartSlot(subpartNode, subclNode, partIdx) == NULL) {
             printf("Error in fact file: Object %s is not a %s part of object %s.\n",
-                     args[p], subclNode->cl->part[p].name, bestName);
+                     args[p], partName, bestName);
             for (j = 0; j < numparts; j++) {
                free(args[j]);
             }
             free(args);
+            return 0;
          }
       }
       for (j = 0; j < numparts; j++) {
@@ -2081,7 +2193,7 @@ int readInSubclasses(TMLKB* kb, TMLClass* cl, char* line) {
    }
    cl->subcl = (TMLClass**)calloc(n, sizeof(TMLClass*));
    cl->wt = (float*)calloc(n, sizeof(float));
-   cl->cnt = (int*)calloc(n, sizeof(int));
+   cl->cnt = (float*)calloc(n, sizeof(float));
    cl->nsubcls = n;
 
    iter = line;
@@ -2336,6 +2448,7 @@ int readInObjectAttribute(TMLKB* kb, Node* node, char* bestName, char* attrName,
    Node* foundNode;
    TMLAttribute* foundattr;
    int i;
+   size_t w;
 
    snprintf(value_fmt_str, 20, " %%%d[!a-zA-Z0-9:] %%1s", MAX_NAME_LENGTH);
    tmpcl = node->cl;
@@ -2377,13 +2490,13 @@ int readInObjectAttribute(TMLKB* kb, Node* node, char* bestName, char* attrName,
             return 0;
          }
          if (foundNode->attrValues[attr->idx] == NULL) {
-            foundNode->attrValues[attr->idx] = (int*)malloc(sizeof(int)*attr->nvals);
-            for (i = 0; i < attr->nvals; i++)
-               foundNode->attrValues[attr->idx][i] = 0;
+            foundNode->attrValues[attr->idx] = (TMLValueMask*)malloc(sizeof(TMLValueMask)*valueMaskWords(attr->nvals));
+            for (w = 0; w < valueMaskWords(attr->nvals); w++)
+               foundNode->attrValues[attr->idx][w] = 0;
          }
-         foundNode->attrValues[attr->idx][attrval->idx] = -1;
+         maskValue(foundNode->attrValues[attr->idx], attrval->idx);
          for (i = 0; i < attr->nvals; i++) {
-            if (foundNode->attrValues[attr->idx][i] != -1) break;
+            if (!isValueMasked(foundNode->attrValues[attr->idx], i)) break;
          }
          if (i == attr->nvals) {
             printf("Error in attribute %s description for object %s. Attribute values are exhaustive. They cannot all be false.\n", attrName, bestName);
@@ -2481,6 +2594,10 @@ int readInAttribute(TMLKB* kb, TMLClass* cl, char* attrName, char* line) {
    attr->idx = HASH_COUNT(cl->attr);
    attr->defaultAttr = 0;
    attr->defaultAttrForSubcl = NULL;
+   attr->wts = NULL;
+   attr->maskSums = NULL;
+   attr->nmaskSums = 0;
+   pthread_mutex_init(&(attr->maskSumLock), NULL);
    HASH_ADD_KEYPTR(hh, cl->attr, attr->name, strlen(attr->name), attr);
    cl->nattr++;
 
@@ -2507,6 +2624,8 @@ int readInAttribute(TMLKB* kb, TMLClass* cl, char* attrName, char* line) {
       attrval->name = strdup(attrValue);
       attrval->wt = wt;
       attrval->idx = HASH_COUNT(attr->vals);
+      attrval->cnt = 0;
+      attrval->mapCnt = 0;
       HASH_ADD_KEYPTR(hh, attr->vals, attrval->name, strlen(attrval->name), attrval);
       iter = strchr(iter, ',');
       if (iter != NULL)
@@ -2533,6 +2652,8 @@ int readInAttribute(TMLKB* kb, TMLClass* cl, char* attrName, char* line) {
                attrval2->name = strdup(attrValue);
                attrval2->wt = attrval->wt;
                attrval2->idx = HASH_COUNT(attr->vals);
+               attrval2->cnt = 0;
+               attrval2->mapCnt = 0;
                HASH_ADD_KEYPTR(hh, attr->vals, attrval2->name, strlen(attrval2->name), attrval2);
                attr->nvals++;
             }
@@ -2882,6 +3003,8 @@ int readInRelations(TMLKB* kb, TMLClass* cl, char* line) {
 
 /**
  * Read in information for one object description
+ *
+ * @return the new current line number, -1 if the description has an error
  */
 int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE* tmlFactFile, int linenum) {
    char keyword_fmt_str[15];
@@ -2903,17 +3026,13 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
       if (line == NULL) {
          printf("Error ending object %s description. Missing '}'.\n", objectName);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
-         fclose(tmlFactFile);
-         exit(1);
+         return -1;
       }
       if (strchr(line, '{') != NULL) {
          printf("Error in object %s description. Unexpected '{'.\n", objectName);
          free(line);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
-         fclose(tmlFactFile);
-         exit(1);
+         return -1;
       }
       if (strchr(line,'}') != NULL) {
          correctScan = sscanf(line, "%1[}]", endline);
@@ -2921,9 +3040,7 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
             printf("Error ending object %s description: Expecting '}'\n", objectName);
             free(line);
             if (restOfLine != NULL) free(restOfLine);
-            freeTMLKB(kb);
-            fclose(tmlFactFile);
-            exit(1);
+            return -1;
          }
          break;
       }
@@ -2934,9 +3051,7 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
          if (correctScan == 0) {
             free(line);
             if (restOfLine != NULL) free(restOfLine);
-            freeTMLKB(kb);
-            fclose(tmlFactFile);
-            exit(1);
+            return -1;
          }
          fillOutSubclasses(node);
          sawSubcl = 1;
@@ -2950,9 +3065,7 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
          printf("Error on line \"%s\" in description of object %s.\n", line, objectName);
          free(line);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
-         fclose(tmlFactFile);
-         exit(1);
+         return -1;
       }
       free(line);
    }
@@ -2973,17 +3086,13 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
       if (line == NULL) {
          printf("Error ending object %s description. Missing '}'.\n", objectName);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
-         fclose(tmlFactFile);
-         exit(1);
+         return -1;
       }
       if (strchr(line, '{') != NULL) {
          printf("Error in object %s description. Unexpected '{'.\n", objectName);
          free(line);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
-         fclose(tmlFactFile);
-         exit(1);
+         return -1;
       }
       if (strchr(line,'}') != NULL) {
          correctScan = sscanf(line, "%1[}]", endline);
@@ -2991,9 +3100,7 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
             printf("Error ending object %s description: Expecting '}'\n", objectName);
             free(line);
             if (restOfLine != NULL) free(restOfLine);
-            freeTMLKB(kb);
-            fclose(tmlFactFile);
-            exit(1);
+            return -1;
          }
          break;
       }
@@ -3006,9 +3113,7 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
          if (correctScan == 0) {
             free(line);
             if (restOfLine != NULL) free(restOfLine);
-            freeTMLKB(kb);
-            fclose(tmlFactFile);
-            exit(1);
+            return -1;
          }
       } else if (lineType == RELATION) {
          continue;
@@ -3018,9 +3123,7 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
          printf("Error on line \"%s\" in description of object %s. Cannot determine line type.\n", line, objectName);
          free(line);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
-         fclose(tmlFactFile);
-         exit(1);
+         return -1;
       }
       free(line);
    }
@@ -3030,17 +3133,13 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
       if (line == NULL) {
          printf("Error ending object %s description. Missing '}'.\n", objectName);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
-         fclose(tmlFactFile);
-         exit(1);
+         return -1;
       }
       if (strchr(line, '{') != NULL) {
          printf("Error in object %s description. Unexpected '{'.\n", objectName);
          free(line);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
-         fclose(tmlFactFile);
-         exit(1);
+         return -1;
       }
       if (strchr(line,'}') != NULL) {
          correctScan = sscanf(line, "%1[}]", endline);
@@ -3048,9 +3147,7 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
             printf("Error ending object %s description: Expecting '}'\n", objectName);
             free(line);
             if (restOfLine != NULL) free(restOfLine);
-            freeTMLKB(kb);
-            fclose(tmlFactFile);
-            exit(1);
+            return -1;
          }
          break;
       }
@@ -3065,36 +3162,37 @@ int readInOneObject(TMLKB* kb, char* objectName, Node* node, TMLClass* cl, FILE*
          if (correctScan == 0) {
             free(line);
             if (restOfLine != NULL) free(restOfLine);
-            freeTMLKB(kb);
-            fclose(tmlFactFile);
-            exit(1);
+            return -1;
          }
       } else if (lineType == ATTRIBUTE) {
          snprintf(keyword_fmt_str, 15, " %%%ds", MAX_NAME_LENGTH);
          correctScan = sscanf(line, keyword_fmt_str, attrName);
          if (correctScan != 1) {
             printf("Error in description for object %s. Malformed attribute line \"%s\".\n", objectName, line);
-            return 0;
+            free(line);
+            if (restOfLine != NULL) free(restOfLine);
+            return -1;
          }
          iter = strstr(line, attrName)+strlen(attrName);
+         if (isWithheld(kb, attrName) || isWithheldBelowClass(kb, node, attrName)) {
+            free(line);
+            continue;
+         }
          correctScan = readInObjectAttribute(NULL, node, objectName, attrName, iter);
          if (correctScan == 0) {
             free(line);
             if (restOfLine != NULL) free(restOfLine);
-            freeTMLKB(kb);
-            fclose(tmlFactFile);
-            exit(1);
+            return -1;
          }
       } else {
          printf("Error on line %d in description of object %s. Cannot determine line type.\n", linenum, objectName);
          free(line);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
-         fclose(tmlFactFile);
-         exit(1);
+         return -1;
       }
       free(line);
    }
+   return linenum;
 }
 
 /**
@@ -3398,101 +3496,103 @@ int pushDefaultRelationDown(TMLKB* kb, TMLClass* cl, TMLRelation* rel) {
    return 0;
 }
 
+// Progress of a computeLogZ frame
+#define LOGZ_ENTER 0
+#define LOGZ_SUBCL 1
+#define LOGZ_PARTS 2
+
 /**
- * Recursive function to compute the weight of the current state of the world
- *
- * @param node       current node in the SPN
- * @param assignedClassBySuperPart class of node defined by its subpart relation to
- *                   its superpart. This is important when subclasses redefine a part
- *                   to be of a subclass of the class it was first defined.
- * @param spn_func   a function that either computes a sum or a max of an array
- *                   of floats
- * @param recompute  if recompute == 1, recompute the logZ for the node regardless
- *                   of if the node has been changed since the last computation
- *                   (Needed if switching between MAP and query inference)
- * @return     the partition function at node
+ * One pending node evaluation of computeLogZ. Frames live on a heap
+ * stack so that the depth of the class and part hierarchies is not
+ * limited by the C stack.
  */
-float computeLogZ(Node* node, TMLClass* assignedClassBySuperpart, float(*spn_func)(float* arr, int num, int* idx), int recompute) {
-   int i, j, k;
-   int c;
-   float logZ = 0.0;
+typedef struct LogZFrame {
+   Node* node;
+   TMLClass* assignedClassBySuperpart;
+   int descendantIdx;
+   int shape;
+   int state;
+   float logZ;
    float* subclZ;
-   int n;
-   TMLClass* cl = node->cl;
-   Node** partNodes;
+   int maxIdx;
+   // subclass branch whose value is pending, -1 before the first one
+   int i;
+   // part being evaluated, its index into node->part, the subclass its
+   // value is added to (-1 for logZ, -2 before its first group) and slot
+   TMLPart* part;
+   int p;
+   int c;
+   int j;
+   int pending;
+   // used by fillOutSPN: name of the node if it doesn't have one, and the
+   // part node of the current slot with the name to give it (NULL to use
+   // its pathname)
+   char* anonName;
    Node* partNode;
-   Node* subclNode;
+   char* partName;
+} LogZFrame;
+
+static void pushLogZFrame(LogZFrame** frames, int* nframes, int* cap, Node* node, TMLClass* assignedClassBySuperpart, char* anonName) {
+   LogZFrame* f;
+   if (*nframes == *cap) {
+      *cap *= 2;
+      *frames = (LogZFrame*)realloc(*frames, sizeof(LogZFrame)*(*cap));
+   }
+   f = &((*frames)[*nframes]);
+   f->node = node;
+   f->assignedClassBySuperpart = assignedClassBySuperpart;
+   f->anonName = anonName;
+   f->state = LOGZ_ENTER;
+   (*nframes)++;
+}
+
+/**
+ * Adds the relation and attribute weights of the frame's node to its
+ * logZ, or to the subclass branches that do not override them.
+ */
+static void addLocalLogZ(LogZFrame* f) {
+   Node* node = f->node;
+   TMLClass* cl = node->cl;
+   int** relValues = node->relValues;
+   float* subclZ = f->subclZ;
    TMLRelation* rel;
    TMLRelation* tmp;
    TMLAttribute* attr;
    TMLAttribute* tmpa;
-   TMLClass* tmpcl;
-   TMLPart* part;
-   TMLPart* tmppart;
-   int** relValues = node->relValues;
-   Node*** parts = node->part;
-   int maxIdx = -1;
-   int assignedSubcl;
-   int descendantIdx = isDescendant(assignedClassBySuperpart, node->cl);
+   int j;
 
-   if (node->changed == 0 && recompute == 0 && descendantIdx == -1) return node->logZ;
-   if (descendantIdx != -1 && node->assignedSubcl != -1 && node->assignedSubcl != descendantIdx) {
-      node->logZ = log(0.0);
-      node->changed = 0;
-      node->maxSubcl = maxIdx;
-      return node->logZ;
+   if (cl->localKernel != NULL) {
+      cl->localKernel(node, f->shape, &f->logZ, subclZ);
+      return;
    }
 
-   if (node->assignedSubcl != -1 && cl->nsubcls != 0) {
-         assignedSubcl = node->assignedSubcl;
-      if (node->subclMask == NULL)
-         logZ += cl->wt[assignedSubcl]+computeLogZ(node->subcl, assignedClassBySuperpart, spn_func, recompute);
-      else
-         logZ += cl->wt[assignedSubcl]+computeLogZ(&(node->subcl[assignedSubcl]), assignedClassBySuperpart, spn_func, recompute);
+   if (f->shape == LOGZ_ASSIGNED) {
       HASH_ITER(hh, cl->rel, rel, tmp) {
          if (rel->defaultRel == 0) {
-            logZ += relWeight((*relValues), rel);
+            f->logZ += relWeight((*relValues), rel);
          } else {
-            if (rel->defaultRelForSubcl[assignedSubcl] == 0) {
-               logZ += relWeight((*relValues), rel);
+            if (rel->defaultRelForSubcl[node->assignedSubcl] == 0) {
+               f->logZ += relWeight((*relValues), rel);
             }
          }
          relValues++;
       }
       HASH_ITER(hh, cl->attr, attr, tmpa) {
          if (attr->defaultAttr == 0) {
-            logZ += attrWeight(node, attr);
+            f->logZ += attrWeight(node, attr);
          } else {
-            if (attr->defaultAttrForSubcl[assignedSubcl] == 0) {
-               logZ += attrWeight(node, attr);
-            }
-         }
-      }
-      HASH_ITER(hh, cl->part, part, tmppart) {
-         partNodes = *parts;
-         if (part->defaultPart == 0 || part->defaultPartForSubcl[assignedSubcl] == 0) {
-            for (j = 0; j < part->n; j++) {
-               partNode = *partNodes;
-               logZ += computeLogZ(partNode, part->cl, spn_func, recompute);
-               partNodes++;
+            if (attr->defaultAttrForSubcl[node->assignedSubcl] == 0) {
+               f->logZ += attrWeight(node, attr);
             }
          }
-         parts++;
-      }
-   } else if (node->assignedSubcl == -1 && cl->nsubcls != 0 && node->subclMask == NULL) {
-      subclZ = (float*)malloc(sizeof(float)*cl->nsubcls);
-      for (i = 0; i < cl->nsubcls; i++) {
-         subclNode = &(node->subcl[i]);
-         if (descendantIdx != -1 && descendantIdx != i)
-            subclZ[i] = log(0.0);
-         else
-            subclZ[i] = cl->wt[i]+computeLogZ(subclNode, assignedClassBySuperpart, spn_func, recompute);
       }
+   } else if (f->shape == LOGZ_OPEN || f->shape == LOGZ_MASKED) {
       HASH_ITER(hh, cl->rel, rel, tmp) {
          if (rel->defaultRel == 0) {
-            logZ += relWeight((*relValues), rel);
+            f->logZ += relWeight((*relValues), rel);
          } else {
             for (j = 0; j < cl->nsubcls; j++) {
+               if (f->shape == LOGZ_MASKED && node->subclMask[j] != 1) continue;
                if (rel->defaultRelForSubcl[j] == 0) {
                   subclZ[j] += relWeight((*relValues), rel);
                }
@@ -3502,124 +3602,215 @@ float computeLogZ(Node* node, TMLClass* assignedClassBySuperpart, float(*spn_fun
       }
       HASH_ITER(hh, cl->attr, attr, tmpa) {
          if (attr->defaultAttr == 0) {
-            logZ += attrWeight(node, attr);
+            f->logZ += attrWeight(node, attr);
          } else {
             for (j = 0; j < cl->nsubcls; j++) {
+               if (f->shape == LOGZ_MASKED && node->subclMask[j] != 1) continue;
                if (attr->defaultAttrForSubcl[j] == 0) {
                   subclZ[j] += attrWeight(node, attr);
                }
             }
          }
       }
-      HASH_ITER(hh, cl->part, part, tmppart) {
-         if (part->defaultPart == 0) {
-            partNodes = *parts;
-            for (j = 0; j < part->n; j++) {
-               partNode = *partNodes;
-               logZ += computeLogZ(partNode, part->cl, spn_func, recompute);
-               partNodes++;
-            }
-         } else {
-            for (c = 0; c < cl->nsubcls; c++) {
-               partNodes = *parts;
-               if (part->defaultPartForSubcl[c] == 0) {
-                  for (j = 0; j < part->n; j++) {
-                     partNode = *partNodes;
-                     subclZ[c] += computeLogZ(partNode, part->cl, spn_func, recompute);
-                     partNodes++;
-                  }
-               }
-            }
-         }
-         parts++;
-      }
-      logZ += spn_func(subclZ, cl->nsubcls, &maxIdx);
-      free(subclZ);
-   } else if (node->assignedSubcl == -1 && node->subclMask != NULL) {
-      subclZ = (float*)malloc(sizeof(float)*cl->nsubcls);
-      for (i = 0; i < cl->nsubcls; i++) {
-         if (node->subclMask[i] != 1 || (descendantIdx != -1 && descendantIdx != i)) {
-            subclZ[i] = log(0.0);
-         } else {
-            subclNode = &(node->subcl[i]);
-            subclZ[i] = cl->wt[i]+computeLogZ(subclNode, assignedClassBySuperpart, spn_func, recompute);
-         }
-      }
-      HASH_ITER(hh, cl->rel, rel, tmp) {
-         if (rel->defaultRel == 0) {
-            logZ += relWeight((*relValues), rel);
-         } else {
-            for (j = 0; j < cl->nsubcls; j++) {
-               if (node->subclMask[j] == 1 && rel->defaultRelForSubcl[j] == 0) {
-                  subclZ[j] += relWeight((*relValues), rel);
-               }
-            }
-         }
-         relValues++;
-      }
-      HASH_ITER(hh, cl->attr, attr, tmpa) {
-         if (attr->defaultAttr == 0) {
-            logZ += attrWeight(node, attr);
-         } else {
-            for (j = 0; j < cl->nsubcls; j++) {
-               if (node->subclMask[j] == 1 && attr->defaultAttrForSubcl[j] == 0) {
-                  subclZ[j] += attrWeight(node, attr);
-               }
-            }
-         }
-      }
-      HASH_ITER(hh, cl->part, part, tmppart) {
-         if (part->defaultPart == 0) {
-            partNodes = *parts;
-            for (j = 0; j < part->n; j++) {
-               partNode = *partNodes;
-               logZ += computeLogZ(partNode, part->cl, spn_func, recompute);
-               partNodes++;
-            }
-         } else {
-            for (c = 0; c < cl->nsubcls; c++) {
-               partNodes = *parts;
-               if (node->subclMask[c] != 1) continue;
-               if (part->defaultPartForSubcl[c] == 0) {
-                  for (j = 0; j < part->n; j++) {
-                     partNode = *partNodes;
-                     subclZ[c] += computeLogZ(partNode, part->cl, spn_func, recompute);
-                     partNodes++;
-                  }
-               }
-            }
-         }
-         parts++;
-      }
-      logZ += spn_func(subclZ, cl->nsubcls, &maxIdx);
-      free(subclZ);
    } else {
       HASH_ITER(hh, cl->rel, rel, tmp) {
-         logZ += relWeight((*relValues), rel);
+         f->logZ += relWeight((*relValues), rel);
          relValues++;
       }
       HASH_ITER(hh, cl->attr, attr, tmpa) {
-            logZ += attrWeight(node, attr);
+         f->logZ += attrWeight(node, attr);
       }
-      HASH_ITER(hh, cl->part, part, tmppart) {
-         partNodes = *parts;
-         for (j = 0; j < part->n; j++) {
-            partNode = *partNodes;
-            logZ += computeLogZ(partNode, part->cl, spn_func, recompute);
-            partNodes++;
-         }
-         parts++;
-      }   
    }
+}
 
-   node->logZ = logZ;
-   node->changed = 0;
-   node->maxSubcl = maxIdx;
-   return logZ;
+/**
+ * Returns the next subclass branch a part of the frame's node contributes
+ * to after f->c (-1 for the node's own logZ), or -3 if there are no more.
+ * If checkMask == 1, branches blocked by the node's subclMask are skipped.
+ */
+static int nextLogZPartGroup(LogZFrame* f, int checkMask) {
+   Node* node = f->node;
+   TMLPart* part = f->part;
+   int c;
+
+   if (f->shape == LOGZ_LEAF)
+      return (f->c == -2) ? -1 : -3;
+   if (f->shape == LOGZ_ASSIGNED) {
+      if (f->c == -2 && (part->defaultPart == 0 || part->defaultPartForSubcl[node->assignedSubcl] == 0))
+         return -1;
+      return -3;
+   }
+   if (part->defaultPart == 0)
+      return (f->c == -2) ? -1 : -3;
+   for (c = (f->c < 0) ? 0 : f->c+1; c < node->cl->nsubcls; c++) {
+      if (checkMask == 1 && f->shape == LOGZ_MASKED && node->subclMask[c] != 1) continue;
+      if (part->defaultPartForSubcl[c] == 0) return c;
+   }
+   return -3;
 }
 
 /**
- * If node has a part named name with at least n parts, set the part_n
+ * Advances the frame to the next part node to evaluate, in the same order
+ * parts, subclass branches and slots were visited by the recursive form.
+ *
+ * @return the part node, NULL once all parts have been evaluated
+ */
+static Node* nextLogZPartNode(LogZFrame* f) {
+   while (f->part != NULL) {
+      if (f->c != -2 && ++(f->j) < f->part->n)
+         return f->node->part[f->p][f->j];
+      f->c = nextLogZPartGroup(f, 1);
+      f->j = -1;
+      if (f->c == -3) {
+         f->part = (TMLPart*)(f->part->hh.next);
+         f->p++;
+         f->c = -2;
+      }
+   }
+   return NULL;
+}
+
+/**
+ * Computes the weight of the current state of the world
+ *
+ * The SPN is traversed depth first over an explicit stack of frames, so
+ * the depth of the KB is limited by memory rather than the C stack.
+ *
+ * @param node       current node in the SPN
+ * @param assignedClassBySuperPart class of node defined by its subpart relation to
+ *                   its superpart. This is important when subclasses redefine a part
+ *                   to be of a subclass of the class it was first defined.
+ * @param spn_func   a function that either computes a sum or a max of an array
+ *                   of floats
+ * @param recompute  if recompute == 1, recompute the logZ for the node regardless
+ *                   of if the node has been changed since the last computation
+ *                   (Needed if switching between MAP and query inference)
+ * @return     the partition function at node
+ */
+float computeLogZ(Node* node, TMLClass* assignedClassBySuperpart, float(*spn_func)(float* arr, int num, int* idx), int recompute) {
+   LogZFrame* frames;
+   LogZFrame* f;
+   int nframes = 0;
+   int cap = 64;
+   float ret = 0.0;
+   float sumZ;
+   TMLClass* cl;
+   Node* child;
+   TMLClass* childCl;
+   int i;
+
+   frames = (LogZFrame*)malloc(sizeof(LogZFrame)*cap);
+   pushLogZFrame(&frames, &nframes, &cap, node, assignedClassBySuperpart, NULL);
+   while (nframes > 0) {
+      f = &(frames[nframes-1]);
+      node = f->node;
+      cl = node->cl;
+      if (f->state == LOGZ_ENTER) {
+         f->descendantIdx = isDescendant(f->assignedClassBySuperpart, cl);
+         if (node->changed == 0 && recompute == 0 && f->descendantIdx == -1) {
+            ret = node->logZ;
+            nframes--;
+            continue;
+         }
+         if (f->descendantIdx != -1 && node->assignedSubcl != -1 && node->assignedSubcl != f->descendantIdx) {
+            node->logZ = log(0.0);
+            node->changed = 0;
+            node->maxSubcl = -1;
+            ret = node->logZ;
+            nframes--;
+            continue;
+         }
+         f->logZ = 0.0;
+         f->subclZ = NULL;
+         f->maxIdx = -1;
+         f->i = -1;
+         f->part = cl->part;
+         f->p = 0;
+         f->c = -2;
+         f->j = -1;
+         f->pending = 0;
+         if (node->assignedSubcl != -1 && cl->nsubcls != 0) {
+            f->shape = LOGZ_ASSIGNED;
+            f->state = LOGZ_SUBCL;
+            if (node->subclMask == NULL)
+               child = node->subcl;
+            else
+               child = &(node->subcl[node->assignedSubcl]);
+            pushLogZFrame(&frames, &nframes, &cap, child, f->assignedClassBySuperpart, NULL);
+         } else if (node->assignedSubcl == -1 && cl->nsubcls != 0 && node->subclMask == NULL) {
+            f->shape = LOGZ_OPEN;
+            f->state = LOGZ_SUBCL;
+            f->subclZ = (float*)malloc(sizeof(float)*cl->nsubcls);
+         } else if (node->assignedSubcl == -1 && node->subclMask != NULL) {
+            f->shape = LOGZ_MASKED;
+            f->state = LOGZ_SUBCL;
+            f->subclZ = (float*)malloc(sizeof(float)*cl->nsubcls);
+         } else {
+            f->shape = LOGZ_LEAF;
+            f->state = LOGZ_PARTS;
+            addLocalLogZ(f);
+         }
+         continue;
+      }
+
+      if (f->state == LOGZ_SUBCL) {
+         if (f->shape == LOGZ_ASSIGNED) {
+            f->logZ += cl->wt[node->assignedSubcl]+ret;
+         } else {
+            if (f->i >= 0)
+               f->subclZ[f->i] = cl->wt[f->i]+ret;
+            for (f->i++; f->i < cl->nsubcls; f->i++) {
+               if ((f->shape == LOGZ_MASKED && node->subclMask[f->i] != 1)
+                     || (f->descendantIdx != -1 && f->descendantIdx != f->i))
+                  f->subclZ[f->i] = log(0.0);
+               else
+                  break;
+            }
+            if (f->i < cl->nsubcls) {
+               pushLogZFrame(&frames, &nframes, &cap, &(node->subcl[f->i]), f->assignedClassBySuperpart, NULL);
+               continue;
+            }
+         }
+         addLocalLogZ(f);
+         f->state = LOGZ_PARTS;
+      }
+
+      // LOGZ_PARTS
+      if (f->pending == 1) {
+         if (f->c == -1)
+            f->logZ += ret;
+         else
+            f->subclZ[f->c] += ret;
+         f->pending = 0;
+      }
+      child = nextLogZPartNode(f);
+      if (child != NULL) {
+         f->pending = 1;
+         childCl = f->part->cl;
+         pushLogZFrame(&frames, &nframes, &cap, child, childCl, NULL);
+         continue;
+      }
+      if (f->subclZ != NULL) {
+         sumZ = spn_func(f->subclZ, cl->nsubcls, &(f->maxIdx));
+         f->logZ += sumZ;
+         if (node->subclLogP != NULL && spn_func == spn_logsum) {
+            for (i = 0; i < cl->nsubcls; i++)
+               node->subclLogP[i] = f->subclZ[i] - sumZ;
+         }
+         free(f->subclZ);
+      }
+      node->logZ = f->logZ;
+      node->changed = 0;
+      node->maxSubcl = f->maxIdx;
+      ret = f->logZ;
+      nframes--;
+   }
+   free(frames);
+   return ret;
+}
+
+/**
+ * If node has a part named name with at least n parts, set the part_n
  * subpart of node to be partNode.
  * Recurses up the tree
  *
@@ -3630,22 +3821,14 @@ float computeLogZ(Node* node, TMLClass* assignedClassBySuperpart, float(*spn_fun
  */
 void propagatePartUp(Node* node, Node* partNode, const char* name, int n) {
    TMLPart* part = getPart(node->cl, name);
-   TMLPart* tmp;
-   int i;
 
    if (part == NULL) {
       if (node->cl->par != NULL) {
          propagatePartUp(*(node->par), partNode, name, n);
       }
    } else {
-      if (part->n >= (n+1)) {
-         i = 0;
-         HASH_ITER(hh, node->cl->part, part, tmp) {
-            if (strcmp(part->name, name) == 0) break;
-            i++;
-         }
-         node->part[i][n] = partNode;
-      }
+      if (part->n >= (n+1))
+         setPartSlot(node, part->idx, n, partNode);
       if (node->cl->par != NULL) {
          propagatePartUp(*(node->par), partNode, name, n);
       }
@@ -3667,7 +3850,6 @@ void propagatePartUp(Node* node, Node* partNode, const char* name, int n) {
  */
 Node* findPartUp(Node* node, const char* name, int n, int* maxParts) {
    TMLPart* part;
-   TMLPart* tmp;
    int i;
    Node* par;
    Node* found;
@@ -3686,12 +3868,7 @@ Node* findPartUp(Node* node, const char* name, int n, int* maxParts) {
       }
    } else {
       if (part->n >= (n+1)) {
-         i = 0;
-         HASH_ITER(hh, par->cl->part, part, tmp) {
-            if (strcmp(part->name, name) == 0) break;
-            i++;
-         }
-         found = par->part[i][n];
+         found = par->part[part->idx][n];
          *maxParts = part->maxNumParts;
          if (found != NULL) return found;
       } else if (part->overridePart == 1) {
@@ -3743,55 +3920,63 @@ void renameNode(TMLKB* kb, Node* node, char* newName) {
  * @return   subpart if found, NULL otherwise
  */
 Node* findPartDown(Node* node, const char* name, int n, int print, int* maxParts) {
-   int i, p;
+   int i;
+   int m;
    TMLPart* part;
-   TMLPart* tmp;
-   Node* found;
-   char* anonName;
-   char anonArr[MAX_NAME_LENGTH];
-   Name_and_Ptr* name_and_ptr;
-   Node* subclNode;
-   QNode* classToObjPtrsList;
-   QNode* qnode;
-
-   HASH_FIND_STR(node->cl->part, name, part);
-   if (part != NULL) {
-      if ((n != -1 && part->n >= n) || (n == -1 && part->n == 1)) {
-         if (n == -1) n = 1;
-         p = 0;
-         HASH_ITER(hh, node->cl->part, part, tmp) {
-            if (strcmp(part->name, name) == 0) break;
-            p++;
+   Node* top = node;
+   Node* found = NULL;
+   int topResolved = 0;
+   int from;
+   PtrStack toVisit;
+
+   // Depth-first search over the subclass branches below node. Branches
+   // are pushed in reverse so they are searched in declaration order.
+   initPtrStack(&toVisit, 16);
+   pushPtrStack(&toVisit, node);
+   while ((node = (Node*)popPtrStack(&toVisit)) != NULL) {
+      m = n;
+      HASH_FIND_STR(node->cl->part, name, part);
+      if (part != NULL) {
+         if ((m != -1 && part->n >= m) || (m == -1 && part->n == 1)) {
+            if (m == -1) m = 1;
+            *maxParts = part->maxNumParts;
+            found = node->part[part->idx][m-1];
+            if (node == top) topResolved = 1;
+            if (found != NULL) break;
+            continue;
+         } else if (m == -1 && part->n != 1) {
+            if (print == 1 && node == top)
+               printf("%s has %d subparts with the subpart relation %s. Please specify which one using the PartName_# syntax (e.g., Adult_2).\n", node->name, part->n, name);
+            if (node == top) topResolved = 1;
+            continue;
+         } else if (part->defaultPart == 0) {
+            if (m == -1) m = 1;
+            if (node->cl->par == NULL && print == 1) printf("%s does not have a %dth %s part.\n", node->name, m, name);
+            if (node == top) topResolved = 1;
+            continue;
          }
-         *maxParts = part->maxNumParts;
-         return node->part[p][n-1];
-      } else if (n == -1 && part->n != 1) {
-         if (print == 1)
-            printf("%s has %d subparts with the subpart relation %s. Please specify which one using the PartName_# syntax (e.g., Adult_2).\n", node->name, part->n, name);
-         return NULL;
-      } else if (part->defaultPart == 0) {
-         if (n == -1) n = 1;
-         if (node->cl->par == NULL && print == 1) printf("%s does not have a %dth %s part.\n", node->name, n, name);
-         return NULL;
       }
-   }
-   if (node->cl->nsubcls != 0) {
-      if (node->assignedSubcl != -1 && node->subclMask == NULL) {
-         found = findPartDown(node->subcl, name, n, print, maxParts);
-         if (found != NULL) return found;
-      } else {
-         for (i = 0; i < node->cl->nsubcls; i++) {
-            if (node->subclMask != NULL && node->subclMask[i] != 1) continue;
-            if (part != NULL && part->defaultPartForSubcl[i] == 0) continue;
-            found = findPartDown(&(node->subcl[i]), name, n, print, maxParts);
-            if (found != NULL) return found;
+      if (node->cl->nsubcls != 0) {
+         if (node->assignedSubcl != -1 && node->subclMask == NULL) {
+            pushPtrStack(&toVisit, node->subcl);
+         } else {
+            from = toVisit.n_;
+            for (i = 0; i < node->cl->nsubcls; i++) {
+               if (node->subclMask != NULL && node->subclMask[i] != 1) continue;
+               if (part != NULL && part->defaultPartForSubcl[i] == 0) continue;
+               pushPtrStack(&toVisit, &(node->subcl[i]));
+            }
+            reversePtrStackFrom(&toVisit, from);
          }
       }
-      if (node->cl->par == NULL && print == 1) printf("%s does not have a %dth %s part.\n", node->name, n, name);
-      return found;
    }
-   if (n == -1) n = 1;
-   if (node->cl->par == NULL && print == 1) printf("%s does not have a %dth %s part.\n", node->name, n, name);
+   freePtrStack(&toVisit);
+   if (found != NULL || topResolved == 1) return found;
+
+   if (top->cl->par == NULL && print == 1) {
+      if (top->cl->nsubcls == 0 && n == -1) n = 1;
+      printf("%s does not have a %dth %s part.\n", top->name, n, name);
+   }
    return NULL;
 }
 
@@ -3808,7 +3993,6 @@ Node* findPartDown(Node* node, const char* name, int n, int print, int* maxParts
 Node* findAndInitPartDown(TMLKB* kb, Node* node, const char* name, int n, const char* anonStr) {
    int i, p;
    TMLPart* part;
-   TMLPart* tmp;
    Node* found;
    char* anonName;
    char anonArr[MAX_NAME_LENGTH];
@@ -3819,18 +4003,14 @@ Node* findAndInitPartDown(TMLKB* kb, Node* node, const char* name, int n, const
 
    HASH_FIND_STR(node->cl->part, name, part);
    if (part != NULL && part->n >= n) {
-      p = 0;
-      HASH_ITER(hh, node->cl->part, part, tmp) {
-         if (strcmp(part->name, name) == 0) break;
-         p++;
-      }
+      p = part->idx;
       found = node->part[p][n-1];
       if (found == NULL) {
          sprintf(anonArr, "%s.%s[%d]", anonStr, part->name, n);
          anonName = strdup(anonArr);
          found = initAnonNodeToClass(part->cl, anonName, part->cl);
          addParent(found, node);
-         node->part[p][n-1] = found;
+         setPartSlot(node, p, n-1, found);
       }
       return found;
    } else if (part != NULL && part->defaultPart == 0) return NULL;
@@ -3901,383 +4081,292 @@ void fillOutSubclasses(Node* node) {
    }
 }
 
+/**
+ * Creates the anonymous pathname parName.partName[n]. The name is sized
+ * to fit, since pathnames grow with the depth of the part hierarchy.
+ */
+static char* createAnonPartName(const char* parName, const char* partName, int n) {
+   char* name = (char*)malloc(strlen(parName)+strlen(partName)+16);
+   sprintf(name, "%s.%s[%d]", parName, partName, n);
+   return name;
+}
+
+/**
+ * Advances a fillOutSPN frame to the next part node to fill out. Each slot
+ * of each part is resolved once (found up the hierarchy or created as an
+ * anonymous node) and then returned once for every subclass branch it
+ * contributes to.
+ *
+ * @param kb         TML KB
+ * @param f          frame of the node whose parts are being filled out
+ * @return the part node, NULL once all parts have been filled out
+ */
+static Node* nextFillOutPartNode(TMLKB* kb, LogZFrame* f) {
+   Node* node = f->node;
+   TMLClass* cl = node->cl;
+   TMLPart* part;
+   Node* partNode;
+   char* newAnonName;
+   int maxParts;
+   int j;
+
+   while (f->part != NULL) {
+      part = f->part;
+      if (f->partNode != NULL) {
+         f->c = nextLogZPartGroup(f, 0);
+         if (f->c != -3) return f->partNode;
+         f->partNode = NULL;
+      }
+      j = ++(f->j);
+      if (j >= part->n) {
+         f->part = (TMLPart*)(part->hh.next);
+         f->p++;
+         f->j = -1;
+         continue;
+      }
+      f->c = -2;
+      f->partName = NULL;
+      maxParts = part->n;
+      partNode = node->part[f->p][j];
+      if (partNode == NULL && cl->par != NULL) {
+         partNode = findPartUp(node, part->name, j, &maxParts);
+         if (partNode != NULL) {
+            setPartSlot(node, f->p, j, partNode);
+            if (partNode->pathname == NULL) {
+               partNode->pathname = createAnonPartName(f->anonName, part->name, j+1);
+            }
+         }
+      } else if (partNode != NULL) {
+         if (partNode->pathname == NULL) {
+            partNode->pathname = createAnonPartName(f->anonName, part->name, j+1);
+         }
+      }
+      if (partNode == NULL) {
+         newAnonName = createAnonPartName(f->anonName, part->name, j+1);
+         partNode = initAnonNodeToClass(part->clOfOverriddenPart, newAnonName, part->clOfOverriddenPart);
+         fillOutSubclasses(partNode);
+         addParent(partNode, node);
+         setPartSlot(node, f->p, j, partNode);
+         if (node->cl->par != NULL)
+            propagatePartUp(*(node->par),partNode,part->name,j);
+         f->partName = newAnonName;
+      }
+      f->partNode = partNode;
+   }
+   return NULL;
+}
+
+/**
+ * Advances a fillOutSPN frame to the next subclass node to fill out.
+ * Branches blocked by the node's subclMask get a weight of zero.
+ *
+ * @return the subclass node, NULL once all branches have been filled out
+ */
+static Node* nextFillOutSubclNode(LogZFrame* f) {
+   Node* node = f->node;
+   TMLClass* cl = node->cl;
+
+   if (f->shape == LOGZ_LEAF) return NULL;
+   if (f->shape == LOGZ_ASSIGNED) {
+      if (f->i != -1) return NULL;
+      f->i = node->assignedSubcl;
+      if (node->subclMask == NULL) return node->subcl;
+      return &(node->subcl[node->assignedSubcl]);
+   }
+   if (f->shape == LOGZ_OPEN && f->descendantIdx != -1) {
+      if (f->i != -1) return NULL;
+      f->i = f->descendantIdx;
+      return &(node->subcl[f->descendantIdx]);
+   }
+   for (f->i++; f->i < cl->nsubcls; f->i++) {
+      if (f->shape == LOGZ_MASKED && (node->subclMask[f->i] != 1 || (f->descendantIdx != -1 && f->descendantIdx != f->i))) {
+         f->subclZ[f->i] += log(0.0);
+         continue;
+      }
+      return &(node->subcl[f->i]);
+   }
+   return NULL;
+}
+
 /**
  * Fill out an SPN to add in subpart objects that were never named
  *
+ * Like computeLogZ, the SPN is traversed over an explicit stack of frames.
+ *
  * @param kb         TML KB
  * @param node       node whose subpart and subclass nodes need to be created if anonymous
  * @param anonName   name of the node if it doesn't have one
  * @return weight of the world rooted at node
  */ 
 float fillOutSPN(TMLKB* kb, Node* node, TMLClass* assignedClassBySuperpart, char* anonName) {
-   int i, j;
-   int c;
-   float logZ = 0.0;
-   float* subclZ;
-   int n;
-   TMLClass* cl = node->cl;
-   Node** partNodes;
-   Node* partNode;
-   Node* subclNode;
+   int i;
+   LogZFrame* frames;
+   LogZFrame* f;
+   int nframes = 0;
+   int cap = 64;
+   float ret = 0.0;
+   TMLClass* cl;
+   Node* child;
    Node* tmpNode;
-   char anonArr[MAX_LINE_LENGTH+1];
-   char* newAnonName;   
-   Name_and_Ptr* name_and_ptr;
-   TMLRelation* rel;
-   TMLRelation* tmp;
-   TMLAttribute* attr;
-   TMLAttribute* tmpa;
-   TMLClass* tmpcl;
-   TMLClass* partcl;
-   TMLPart* part;
-   TMLPart* tmppart;
+   TMLClass* childCl;
+   char* childName;
    QNode* qnode;
    QNode* classToObjPtrsList;
-   int maxParts = -1;
-   int p;
-   char** pn;
-   Name_and_Ptr* traversal;
-   int** relValues = node->relValues;
-   int descendantIdx = isDescendant(assignedClassBySuperpart, node->cl);
-
-   if (node->cl->par != NULL) {
-      node->pathname = (*(node->par))->pathname;
-   }
-   if (node->changed == 0 && descendantIdx == -1) return node->logZ;
-   if (node->cl->par == NULL) {
-      HASH_FIND(hh_path, kb->objectPathToPtr, node->pathname, strlen(node->pathname), tmpNode);
-      if (tmpNode == NULL)
-         HASH_ADD_KEYPTR(hh_path, kb->objectPathToPtr, node->pathname, strlen(node->pathname), node);
-   }
-   if (node->cl->par == NULL || (*(node->par))->assignedSubcl != -1) {
-      classToObjPtrsList = kb->classToObjPtrs[node->cl->id];
-      qnode = (QNode*)malloc(sizeof(QNode));
-      qnode->ptr = node;
-      qnode->next = classToObjPtrsList;
-      kb->classToObjPtrs[node->cl->id] = qnode;
-   }
-
 
-   // If not complete, fill out subclasses
-   if (node->assignedSubcl == -1 && cl->nsubcls != 0 && node->subclMask == NULL) {
-      subclZ = (float*)malloc(sizeof(float)*cl->nsubcls);
-      for (i = 0; i < cl->nsubcls; i++) subclZ[i] = 0.0;
-      i = 0;
-      HASH_ITER(hh, cl->rel, rel, tmp) {
-         if (rel->defaultRel == 0) {
-            logZ += relWeight((*relValues), rel);
-         } else {
-            for (j = 0; j < cl->nsubcls; j++) {
-               if (rel->defaultRelForSubcl[j] == 0) {
-                  subclZ[j] += relWeight((*relValues), rel);
-               }
-            }
+   frames = (LogZFrame*)malloc(sizeof(LogZFrame)*cap);
+   pushLogZFrame(&frames, &nframes, &cap, node, assignedClassBySuperpart, anonName);
+   while (nframes > 0) {
+      f = &(frames[nframes-1]);
+      node = f->node;
+      cl = node->cl;
+      if (f->state == LOGZ_ENTER) {
+         f->descendantIdx = isDescendant(f->assignedClassBySuperpart, cl);
+         if (node->cl->par != NULL) {
+            node->pathname = (*(node->par))->pathname;
+         }
+         if (node->changed == 0 && f->descendantIdx == -1) {
+            ret = node->logZ;
+            nframes--;
+            continue;
          }
-         i++;
-         relValues++;
+         if (node->cl->par == NULL) {
+            HASH_FIND(hh_path, kb->objectPathToPtr, node->pathname, strlen(node->pathname), tmpNode);
+            if (tmpNode == NULL)
+               HASH_ADD_KEYPTR(hh_path, kb->objectPathToPtr, node->pathname, strlen(node->pathname), node);
+         }
+         if (node->cl->par == NULL || (*(node->par))->assignedSubcl != -1) {
+            classToObjPtrsList = kb->classToObjPtrs[node->cl->id];
+            qnode = (QNode*)malloc(sizeof(QNode));
+            qnode->ptr = node;
+            qnode->next = classToObjPtrsList;
+            kb->classToObjPtrs[node->cl->id] = qnode;
+         }
+
+         f->logZ = 0.0;
+         f->subclZ = NULL;
+         f->maxIdx = -1;
+         f->i = -1;
+         f->part = cl->part;
+         f->p = 0;
+         f->c = -2;
+         f->j = -1;
+         f->pending = 0;
+         f->partNode = NULL;
+         f->partName = NULL;
+         if (node->assignedSubcl == -1 && cl->nsubcls != 0 && node->subclMask == NULL)
+            f->shape = LOGZ_OPEN;
+         else if (node->assignedSubcl == -1 && node->subclMask != NULL)
+            f->shape = LOGZ_MASKED;
+         else if (node->assignedSubcl != -1 && cl->nsubcls != 0)
+            f->shape = LOGZ_ASSIGNED;
+         else
+            f->shape = LOGZ_LEAF;
+         if (f->shape == LOGZ_OPEN || f->shape == LOGZ_MASKED) {
+            f->subclZ = (float*)malloc(sizeof(float)*cl->nsubcls);
+            for (i = 0; i < cl->nsubcls; i++) f->subclZ[i] = 0.0;
+         }
+         addLocalLogZ(f);
+         f->state = LOGZ_PARTS;
       }
-      HASH_ITER(hh, cl->attr, attr, tmpa) {
-         if (attr->defaultAttr == 0) {
-            logZ += attrWeight(node, attr);
-         } else {
-            for (j = 0; j < cl->nsubcls; j++) {
-               if (attr->defaultAttrForSubcl[j] == 0) {
-                  subclZ[j] += attrWeight(node, attr);
-               }
-            }
+
+      if (f->state == LOGZ_PARTS) {
+         if (f->pending == 1) {
+            if (f->c == -1)
+               f->logZ += ret;
+            else
+               f->subclZ[f->c] += ret;
+            f->pending = 0;
+         }
+         child = nextFillOutPartNode(kb, f);
+         if (child != NULL) {
+            f->pending = 1;
+            childCl = f->part->cl;
+            childName = (f->partName != NULL) ? f->partName : child->pathname;
+            pushLogZFrame(&frames, &nframes, &cap, child, childCl, childName);
+            continue;
          }
+         if (f->shape == LOGZ_OPEN && node->subcl == NULL)
+            fillOutSubclasses(node);
+         f->state = LOGZ_SUBCL;
       }
-      i = 0;
-      HASH_ITER(hh, cl->part, part, tmppart) {
-         maxParts = part->n;
-            for (j = 0; j < part->n; j++) {
-               partNode = node->part[i][j];
-               if (partNode == NULL) {
-                  if (cl->par != NULL) {
-                     partNode = findPartUp(node, part->name, j, &maxParts);
-                     if (partNode != NULL) {
-                        node->part[i][j] = partNode;
-                        if (partNode->pathname == NULL) {
-                           sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                           partNode->pathname = strdup(anonArr);
-                        }
-                        if (part->defaultPart == 0)
-                           logZ += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                        else {
-                           for (c = 0; c < cl->nsubcls; c++) {
-                              if (part->defaultPartForSubcl[c] == 0)
-                                 subclZ[c] += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                           }
-                        }
-                        continue;
-                     }
-                  }
-                  sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                  newAnonName = strdup(anonArr);
-                  partNode = initAnonNodeToClass(part->clOfOverriddenPart, newAnonName, part->clOfOverriddenPart);
-                  fillOutSubclasses(partNode);
-                  addParent(partNode, node);
-                  subclNode = partNode;
-                  node->part[i][j] = partNode;
-                  if (node->cl->par != NULL)
-                     propagatePartUp(*(node->par),partNode,part->name,j);
-                  if (part->defaultPart == 0)
-                     logZ += fillOutSPN(kb, partNode, part->cl, newAnonName);
-                  else {
-                     for (c = 0; c < cl->nsubcls; c++) {
-                        if (part->defaultPartForSubcl[c] == 0)
-                           subclZ[c] += fillOutSPN(kb, partNode, part->cl, newAnonName);
-                     }
-                  }
-               } else {
-                  if (partNode->pathname == NULL) {
-                     sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                     partNode->pathname = strdup(anonArr);
-                  }
-                  if (part->defaultPart == 0)
-                     logZ += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                  else {
-                     for (c = 0; c < cl->nsubcls; c++) {
-                        if (part->defaultPartForSubcl[c] == 0)
-                           subclZ[c] += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                     }
-                  }
-               }
-            }
-         i++;
+
+      // LOGZ_SUBCL
+      if (f->pending == 1) {
+         if (f->shape == LOGZ_ASSIGNED || (f->shape == LOGZ_OPEN && f->descendantIdx != -1))
+            f->logZ += cl->wt[f->i]+ret;
+         else
+            f->subclZ[f->i] += cl->wt[f->i]+ret;
+         f->pending = 0;
       }
-      if (node->subcl == NULL)
-         fillOutSubclasses(node);
-      if (descendantIdx != -1) {
-         subclNode = &(node->subcl[descendantIdx]);
-         logZ += cl->wt[descendantIdx]+fillOutSPN(kb, subclNode, assignedClassBySuperpart, anonName);
-      } else {
-         for (i = 0; i < cl->nsubcls; i++) {
-            subclNode = &(node->subcl[i]);
-            subclZ[i] += cl->wt[i]+fillOutSPN(kb, subclNode, assignedClassBySuperpart, anonName);
-         }
-         logZ += logsumarr_float(subclZ, cl->nsubcls);
+      child = nextFillOutSubclNode(f);
+      if (child != NULL) {
+         f->pending = 1;
+         pushLogZFrame(&frames, &nframes, &cap, child, f->assignedClassBySuperpart, f->anonName);
+         continue;
       }
-      free(subclZ);
-   } else if (node->assignedSubcl == -1 && node->subclMask != NULL) {
-      subclZ = (float*)malloc(sizeof(float)*cl->nsubcls);
-      for (i = 0; i < cl->nsubcls; i++) subclZ[i] = 0.0;
-      i = 0;
-      HASH_ITER(hh, cl->rel, rel, tmp) {
-         if (rel->defaultRel == 0) {
-            logZ += relWeight((*relValues), rel);
-         } else {
-            for (j = 0; j < cl->nsubcls; j++) {
-               if (node->subclMask[j] == 1 && rel->defaultRelForSubcl[j] == 0) {
-                  subclZ[j] += relWeight((*relValues), rel);
-               }
-            }
+      if (f->shape == LOGZ_MASKED || (f->shape == LOGZ_OPEN && f->descendantIdx == -1))
+         f->logZ += logsumarr_float(f->subclZ, cl->nsubcls);
+      if (f->subclZ != NULL) free(f->subclZ);
+      node->logZ = f->logZ;
+      node->changed = 0;
+      ret = f->logZ;
+      nframes--;
+   }
+   free(frames);
+   return ret;
+}
+
+
+/**
+ * Makes every node with subclass branches keep the log probability of
+ * each branch given the evidence (subclLogP). The distributions are
+ * filled in by the next computeLogZ that evaluates the node with
+ * spn_logsum.
+ */
+static void trackSubclLogP(TMLKB* kb) {
+   Node* obj;
+   Node* node;
+   PtrStack toVisit;
+   int c;
+
+   initPtrStack(&toVisit, 64);
+   for (obj = kb->objectPathToPtr; obj != NULL; obj = (Node*)(obj->hh_path.next)) {
+      pushPtrStack(&toVisit, obj);
+      while ((node = (Node*)popPtrStack(&toVisit)) != NULL) {
+         if (node->cl->nsubcls == 0 || node->subcl == NULL) continue;
+         if (node->subclLogP == NULL)
+            node->subclLogP = (float*)malloc(sizeof(float)*node->cl->nsubcls);
+         if (node->assignedSubcl != -1 && node->subclMask == NULL) {
+            pushPtrStack(&toVisit, node->subcl);
+            continue;
          }
-         i++;
-         relValues++;
-      }
-      HASH_ITER(hh, cl->attr, attr, tmpa) {
-         if (attr->defaultAttr == 0) {
-            logZ += attrWeight(node, attr);
-         } else {
-            for (j = 0; j < cl->nsubcls; j++) {
-               if (node->subclMask[j] == 1 && attr->defaultAttrForSubcl[j] == 0) {
-                  subclZ[j] += attrWeight(node, attr);
-               }
-            }
+         for (c = 0; c < node->cl->nsubcls; c++) {
+            if (node->subclMask != NULL && node->subclMask[c] == 0) continue;
+            pushPtrStack(&toVisit, &(node->subcl[c]));
          }
       }
-      i = 0;
-      HASH_ITER(hh, cl->part, part, tmppart) {
-         maxParts = part->n;
-            for (j = 0; j < part->n; j++) {
-               partNode = node->part[i][j];
-               if (partNode == NULL) {
-                  if (cl->par != NULL) {
-                     partNode = findPartUp(node, part->name, j, &maxParts);
-                     if (partNode != NULL) {
-                        node->part[i][j] = partNode;
-                        if (partNode->pathname == NULL) {
-                           sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                           partNode->pathname = strdup(anonArr);
-                        }
-                        if (part->defaultPart == 0)
-                           logZ += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                        else {
-                           for (c = 0; c < cl->nsubcls; c++) {
-                              if (part->defaultPartForSubcl[c] == 0)
-                                 subclZ[c] += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                           }
-                        }
-                        continue;
-                     }
-                  }
-                  sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                  newAnonName = strdup(anonArr);
-                  partNode = initAnonNodeToClass(part->clOfOverriddenPart, newAnonName, part->clOfOverriddenPart);
-                  fillOutSubclasses(partNode);
-                  partNode->par = (Node**)malloc(sizeof(Node*));
-                  *(partNode->par) = node;
-                  partNode->npars = 1;
-                  node->part[i][j] = partNode;
-                  if (node->cl->par != NULL)
-                     propagatePartUp(*(node->par),partNode,part->name,j);
-                  if (part->defaultPart == 0)
-                     logZ += fillOutSPN(kb, partNode, part->cl, newAnonName);
-                  else {
-                     for (c = 0; c < cl->nsubcls; c++) {
-                        if (part->defaultPartForSubcl[c] == 0)
-                           subclZ[c] += fillOutSPN(kb, partNode, part->cl, newAnonName);
-                     }
-                  }
-               } else {
-                  if (partNode->pathname == NULL) {
-                     sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                     partNode->pathname = strdup(anonArr);
-                  }
-                  if (part->defaultPart == 0)
-                     logZ += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                  else {
-                     for (c = 0; c < cl->nsubcls; c++) {
-                        if (part->defaultPartForSubcl[c] == 0)
-                           subclZ[c] += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                     }
-                  }
-               }
-            }
-         i++;
-      }
-      for (i = 0; i < cl->nsubcls; i++) {
-         if (node->subclMask[i] != 1 || (descendantIdx != -1 && descendantIdx != i)) {
-            subclZ[i] += log(0.0);
-         } else {
-            subclNode = &(node->subcl[i]);
-            subclZ[i] += cl->wt[i]+fillOutSPN(kb, subclNode, assignedClassBySuperpart, anonName);
-         }
-      }
-      logZ += logsumarr_float(subclZ, cl->nsubcls);
-      free(subclZ);
-   } else if (node->assignedSubcl != -1 && cl->nsubcls != 0) {
-      i = 0;
-      HASH_ITER(hh, cl->rel, rel, tmp) {
-         if (rel->defaultRel == 0) {
-            logZ += relWeight((*relValues), rel);
-         } else {
-            if (rel->defaultRelForSubcl[node->assignedSubcl] == 0) {
-               logZ += relWeight((*relValues), rel);
-            }
-         }
-         i++;
-         relValues++;
-      }
-      HASH_ITER(hh, cl->attr, attr, tmpa) {
-         if (attr->defaultAttr == 0) {
-            logZ += attrWeight(node, attr);
-         } else {
-            if (attr->defaultAttrForSubcl[node->assignedSubcl] == 0) {
-               logZ += attrWeight(node, attr);
-            }
-         }
-      }
-      i = 0;
-      HASH_ITER(hh, cl->part, part, tmppart) {
-            maxParts = part->n;
-            for (j = 0; j < part->n; j++) {
-               partNode = node->part[i][j];
-               if (partNode == NULL) {
-                  if (cl->par != NULL) {
-                     partNode = findPartUp(node, part->name, j, &maxParts);
-                     if (partNode != NULL) {
-                        node->part[i][j] = partNode;
-                        if (partNode->pathname == NULL) {
-                           sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                           partNode->pathname = strdup(anonArr);
-                        }
-                        if (part->defaultPart == 0 || part->defaultPartForSubcl[node->assignedSubcl] == 0)
-                           logZ += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                        continue;
-                     }
-                  }
-                  sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                  newAnonName = strdup(anonArr);
-                  partNode = initAnonNodeToClass(part->clOfOverriddenPart, newAnonName, part->clOfOverriddenPart);
-                  fillOutSubclasses(partNode);
-                  partNode->par = (Node**)malloc(sizeof(Node*));
-                  *(partNode->par) = node;
-                  partNode->npars = 1;
-                  node->part[i][j] = partNode;
-                  if (node->cl->par != NULL)
-                     propagatePartUp(*(node->par),partNode,part->name,j);
-                  if (part->defaultPart == 0 || part->defaultPartForSubcl[node->assignedSubcl] == 0)
-                     logZ += fillOutSPN(kb, partNode, part->cl, newAnonName);
-               } else {
-                  if (partNode->pathname == NULL) {
-                     sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                     partNode->pathname = strdup(anonArr);
-                  }
-                  if (part->defaultPart == 0 || part->defaultPartForSubcl[node->assignedSubcl] == 0)
-                     logZ += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-               }
-            }
-         i++;
-      }
-      if (node->subclMask == NULL)
-         logZ += cl->wt[node->assignedSubcl]+fillOutSPN(kb, node->subcl, assignedClassBySuperpart, anonName);
-      else
-         logZ += cl->wt[node->assignedSubcl]+fillOutSPN(kb, &(node->subcl[node->assignedSubcl]), assignedClassBySuperpart, anonName);
-   } else {
-      i = 0;
-      HASH_ITER(hh, cl->rel, rel, tmp) {
-         logZ += relWeight((*relValues), rel);
-         i++;
-         relValues++;
-      }
-      HASH_ITER(hh, cl->attr, attr, tmpa) {
-         logZ += attrWeight(node, attr);
-      }
-      i = 0;
-      HASH_ITER(hh, cl->part, part, tmppart) {
-         maxParts = part->n;
-         for (j = 0; j < part->n; j++) {
-            partNode = node->part[i][j];
-            if (partNode == NULL) {
-               if (cl->par != NULL) {
-                  partNode = findPartUp(node, part->name, j, &maxParts);
-                  if (partNode != NULL) {
-                     node->part[i][j] = partNode;
-                     if (partNode->pathname == NULL) {
-                        sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                        partNode->pathname = strdup(anonArr);
-                     }
-                     logZ += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-                     continue;
-                  }
-               }
-               sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-               newAnonName = strdup(anonArr);
-               partNode = initAnonNodeToClass(part->clOfOverriddenPart, newAnonName, part->clOfOverriddenPart);
-               fillOutSubclasses(partNode);
-               partNode->par = (Node**)malloc(sizeof(Node*));
-               *(partNode->par) = node;
-               partNode->npars = 1;
-               node->part[i][j] = partNode;
-               if (node->cl->par != NULL)
-                  propagatePartUp(*(node->par),partNode,part->name,j);
-               logZ += fillOutSPN(kb, partNode, part->cl, newAnonName);
-            } else {
-               if (partNode->pathname == NULL) {
-                  sprintf(anonArr, "%s.%s[%d]", anonName, part->name, (j+1));
-                  partNode->pathname = strdup(anonArr);
-               }
-               logZ += fillOutSPN(kb, partNode, part->cl, partNode->pathname);
-            }
-         }
-         i++;
-      }   
    }
-   node->logZ = logZ;
-   node->changed = 0;
-   return logZ;
+   freePtrStack(&toVisit);
+}
+
+/**
+ * Puts the SPN in locally normalized form: every node with subclass
+ * branches keeps the log probability of each branch given the evidence,
+ * so that relation and class marginals of an object can be read off the
+ * path to it (see localRelationQueryProb) instead of from a second
+ * evaluation of the whole SPN. The distributions are filled in by
+ * computeLogZ, and so follow the evidence as it changes.
+ *
+ * @param kb   TML KB, already filled out by fillOutSPN
+ * @return log of Z
+ */
+float normalizeSPN(TMLKB* kb) {
+   Node* root = (Node*)(kb->root->ptr);
+
+   trackSubclLogP(kb);
+   kb->localMarginals = 1;
+   kb->mapSet = 0;
+   return computeLogZ(root, root->cl, spn_logsum, 1);
 }
 
 
@@ -4350,13 +4439,23 @@ int determineObjectLineType(TMLKB* kb, TMLClass* cl, char* line) {
          if (rel != NULL) return RELATION; // relation
          tmpcl = tmpcl->par;
       }
+      // a relation of a subclass withheld with its class (see isWithheldBelowClass)
+      if (kb->withheld != NULL && isDefinedBelowWithheld(kb, (str1[0] == '!') ? str1+1 : str1))
+         return RELATION;
       return ERROR;
    } else {
       return EMPTY_LINE; // empty line
    }
 }
 
-void readInTMLFacts(TMLKB* kb, const char* tmlFactFileName) {
+/**
+ * Reads the objects and facts of a fact file into the KB, whose rules
+ * are already read in.
+ *
+ * @return 1 on success, 0 if the file could not be found or has an
+ *         error, in which case the KB is left partly filled out
+ */
+int readInTMLFacts(TMLKB* kb, const char* tmlFactFileName) {
    FILE* tmlFactFile = fopen(tmlFactFileName, "r");
    char objectName[MAX_NAME_LENGTH+1];
    char tmpline[MAX_LINE_LENGTH+1];
@@ -4392,8 +4491,7 @@ void readInTMLFacts(TMLKB* kb, const char* tmlFactFileName) {
       tmlFactFile = fopen(objectName, "r");
       if (tmlFactFile == NULL) {
          printf("Error. Cannot find fact file named %s.\n", tmlFactFileName);
-         freeTMLKB(kb);
-         exit(1);
+         return 0;
       }
    }
    snprintf(obj_fmt_str, 50, "%%%d[a-zA-Z0-9:] %%%d[]a-zA-Z0-9:[.] %%1[{]", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
@@ -4419,7 +4517,7 @@ void readInTMLFacts(TMLKB* kb, const char* tmlFactFileName) {
       node->pathname = strdup(objName);
       kb->root->ptr  = node;
       fclose(tmlFactFile);
-      return;
+      return 1;
    }
    while (line != NULL) {
       // read in object name and class
@@ -4428,27 +4526,26 @@ void readInTMLFacts(TMLKB* kb, const char* tmlFactFileName) {
          printf("Error on line \"%s\" in fact file: Expected \" ObjectClass ObjectName {\"\n", line);
          free(line);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
          fclose(tmlFactFile);
-         exit(1);
+         return 0;
       }
       HASH_FIND_STR(kb->classNameToPtr, objectName, cl);
       if (cl != NULL) {
          printf("Error in fact file: %s is already the name of a class.\n", objectName);
          free(line);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
          fclose(tmlFactFile);
-         exit(1);
+         return 0;
       }
+      if (isWithheld(kb, className))
+         snprintf(className, MAX_NAME_LENGTH+1, "%s", kb->withheld);
       HASH_FIND_STR(kb->classNameToPtr, className, cl);
       if (cl == NULL) {
          printf("Error in fact file: %s is not the name of a class, but is named as the class for object %s.\n", className, objectName);
          free(line);
          if (restOfLine != NULL) free(restOfLine);
-         freeTMLKB(kb);
          fclose(tmlFactFile);
-         exit(1);
+         return 0;
       }
       HASH_FIND_STR(kb->objectNameToPtr, objectName, node);
       if (node == NULL) {
@@ -4457,26 +4554,23 @@ void readInTMLFacts(TMLKB* kb, const char* tmlFactFileName) {
                printf("Error in fact file: Object names must begin with a letter. %s does not.\n", objectName);
                free(line);
                if (restOfLine != NULL) free(restOfLine);
-               freeTMLKB(kb);
                fclose(tmlFactFile);
-               exit(1);
+               return 0;
             }
             if (cl == kb->topcl) {
                if (kb->root != NULL) {
                   printf("Error in fact file. Multiple objects were designated with as the TopClass. Only one object can be of this class.\n");
                   free(line);
                   if (restOfLine != NULL) free(restOfLine);
-                  freeTMLKB(kb);
                   fclose(tmlFactFile);
-                  exit(1);
+                  return 0;
                }
                if (strchr(objectName, '.') != NULL) {
                   printf("The top object %s should not have a pathname.\n", objectName);
                   free(line);
                   if (restOfLine != NULL) free(restOfLine);
-                  freeTMLKB(kb);
                   fclose(tmlFactFile);
-                  exit(1);
+                  return 0;
                }
                kb->root = (Name_and_Ptr*)malloc(sizeof(Name_and_Ptr));
                kb->root->name = strdup(objectName);
@@ -4495,9 +4589,8 @@ void readInTMLFacts(TMLKB* kb, const char* tmlFactFileName) {
                printf("Error in fact file: Pathname %s is unknown for the TML KB.\n", objectName);
                free(line);
                if (restOfLine != NULL) free(restOfLine);
-               freeTMLKB(kb);
                fclose(tmlFactFile);
-               exit(1);
+               return 0;
             }
          }
       } else {
@@ -4505,23 +4598,27 @@ void readInTMLFacts(TMLKB* kb, const char* tmlFactFileName) {
          if (output == NULL) {
             free(line);
             if (restOfLine != NULL) free(restOfLine);
-            freeTMLKB(kb);
             fclose(tmlFactFile);
-            exit(1);
+            return 0;
          }
       }
       linenum = readInOneObject(kb, objectName, node, cl, tmlFactFile, linenum);
       free(line);
+      if (linenum == -1) {
+         fclose(tmlFactFile);
+         return 0;
+      }
       line = getLineToSemicolon(tmlFactFile, &restOfLine, &linenum);
       o++;
    }
    if (o != numObjects) {
       printf("Error on line %d of fact file.\n", linenum);
       if (restOfLine != NULL) free(restOfLine);
-      freeTMLKB(kb);
       fclose(tmlFactFile);
-      exit(1);
+      return 0;
    }
+   fclose(tmlFactFile);
+   return 1;
 }
 
 void readInTMLRules(TMLKB* kb, const char* tmlRuleFileName) {
@@ -4541,6 +4638,8 @@ void readInTMLRules(TMLKB* kb, const char* tmlRuleFileName) {
    TMLClass* rootCl;
    QNode* rootQueue = NULL;
    QNode* root;
+   TMLAttribute* attr;
+   TMLAttribute* tmpattr;
    int lost;
    char cl_fmt_str[50];
    char bracket[2];
@@ -4679,6 +4778,10 @@ void readInTMLRules(TMLKB* kb, const char* tmlRuleFileName) {
       free(root);
       root = rootQueue;
    }
+   for (i = 0; i < kb->numClasses; i++) {
+      HASH_ITER(hh, kb->classes[i].attr, attr, tmpattr)
+         compileTMLAttribute(attr);
+   }
    rewind(tmlRuleFile);
 }
 
@@ -4755,6 +4858,7 @@ void addAttributeToKB(TMLKB* kb, Node* obj, const char* attrStr, const char* att
    TMLClass* cl = obj->cl;
    TMLAttribute* attr = getAttribute(cl, attrStr);
    int i, c;
+   size_t w;
    TMLAttrValue* attrval;
    Node* subcl = obj->subcl;
 
@@ -4763,11 +4867,11 @@ void addAttributeToKB(TMLKB* kb, Node* obj, const char* attrStr, const char* att
       if (attrval != NULL) {
          if (pol == 0) {
             if (obj->attrValues[attr->idx] == NULL) {
-               obj->attrValues[attr->idx] = (int*)malloc(sizeof(int)*attr->nvals);
-               for (i = 0; i < attr->nvals; i++)
-                  obj->attrValues[attr->idx][i] = 0;
+               obj->attrValues[attr->idx] = (TMLValueMask*)malloc(sizeof(TMLValueMask)*valueMaskWords(attr->nvals));
+               for (w = 0; w < valueMaskWords(attr->nvals); w++)
+                  obj->attrValues[attr->idx][w] = 0;
             }
-            obj->attrValues[attr->idx][attrval->idx] = -1;
+            maskValue(obj->attrValues[attr->idx], attrval->idx);
          } else {
             obj->assignedAttr[attr->idx] = attrval;
          }
@@ -4811,7 +4915,7 @@ void removeAttributeToKB(Node* obj, const char* attrStr, const char* attrvalStr,
       HASH_FIND_STR(attr->vals, attrvalStr, attrval);
       if (attrval != NULL) {
          if (pol == 0) {
-            obj->attrValues[attr->idx][attrval->idx] = 0;
+            unmaskValue(obj->attrValues[attr->idx], attrval->idx);
          } else {
             obj->assignedAttr[attr->idx] = NULL;
          }
@@ -4885,6 +4989,193 @@ void removeRelationToKB(Node* obj, const char* relStr, int pol) {
    }
 }
 
+/**
+ * Returns 1 if a hard rule or the evidence at node makes it impossible
+ * whatever its subclass. Otherwise marks in dead the subclass branches
+ * they make impossible through relations and attributes the branches
+ * inherit from node's class. The conditions are the ones under which
+ * relWeight and attrWeight are log(0).
+ */
+static int hardConstraintsViolatedAt(Node* node, int* dead) {
+   TMLClass* cl = node->cl;
+   int** relValues = node->relValues;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLValueMask* mask;
+   int j, v;
+
+   HASH_ITER(hh, cl->rel, rel, tmp) {
+      if ((rel->hard == 1 && (*relValues)[0] != 0) || (rel->hard == -1 && (*relValues)[1] != 0)) {
+         if (rel->defaultRel == 0 || cl->nsubcls == 0) return 1;
+         for (j = 0; j < cl->nsubcls; j++)
+            if (rel->defaultRelForSubcl[j] == 0) dead[j] = 1;
+      }
+      relValues++;
+   }
+   HASH_ITER(hh, cl->attr, attr, tmpa) {
+      mask = node->attrValues[attr->idx];
+      if (node->assignedAttr[attr->idx] != NULL || mask == NULL) continue;
+      for (v = 0; v < attr->nvals && isValueMasked(mask, v); v++);
+      if (v < attr->nvals) continue;
+      if (attr->defaultAttr == 0 || cl->nsubcls == 0) return 1;
+      for (j = 0; j < cl->nsubcls; j++)
+         if (attr->defaultAttrForSubcl[j] == 0) dead[j] = 1;
+   }
+   return 0;
+}
+
+typedef struct PruneFrame {
+   Node* node;
+   int* dead;
+   // subclass branch being visited, -1 before the first
+   int i;
+} PruneFrame;
+
+/**
+ * Propagates the hard rules of the KB and the evidence through the
+ * subclass tree of an object. Subclass branches they make impossible are
+ * blocked (subclMask 0) so later passes of computeLogZ skip them, and
+ * each prune is pushed on the edit stack so it is undone with the
+ * evidence that caused it. The values of the SPN do not change, since
+ * pruned branches are log(0).
+ *
+ * Only the object's own subclass tree is examined, so a contradiction is
+ * found without a pass over the SPN. Those that involve other objects
+ * are still left to computeLogZ.
+ *
+ * @param kb         TML KB
+ * @param node       node for the object with the coarsest class information
+ * @param editsPtr   edit stack to push prunes onto
+ * @return 1 if the object cannot be in any class, 0 otherwise
+ */
+int propagateHardConstraints(TMLKB* kb, Node* node, KBEdit** editsPtr) {
+   PruneFrame* frames;
+   PruneFrame* f;
+   int nframes = 0;
+   int cap = 16;
+   int ret = 0;
+   int j, open, pruned;
+   TMLClass* cl;
+   Node* child;
+
+   frames = (PruneFrame*)malloc(sizeof(PruneFrame)*cap);
+   frames[0].node = node;
+   frames[0].dead = NULL;
+   frames[0].i = -1;
+   nframes = 1;
+   while (nframes > 0) {
+      f = &(frames[nframes-1]);
+      node = f->node;
+      cl = node->cl;
+      if (f->dead == NULL) {
+         f->dead = (int*)malloc(sizeof(int)*(cl->nsubcls > 0 ? cl->nsubcls : 1));
+         for (j = 0; j < cl->nsubcls; j++)
+            f->dead[j] = 0;
+         if (hardConstraintsViolatedAt(node, f->dead) == 1) {
+            free(f->dead);
+            ret = 1;
+            nframes--;
+            continue;
+         }
+      } else {
+         f->dead[f->i] = ret;
+      }
+
+      child = NULL;
+      if (cl->nsubcls != 0 && node->assignedSubcl != -1) {
+         if (f->i == -1) {
+            f->i = node->assignedSubcl;
+            child = (node->subclMask == NULL) ? node->subcl : &(node->subcl[f->i]);
+         }
+      } else if (cl->nsubcls != 0) {
+         for (f->i++; f->i < cl->nsubcls; f->i++) {
+            if (f->dead[f->i] == 1 || (node->subclMask != NULL && node->subclMask[f->i] != 1)) continue;
+            child = &(node->subcl[f->i]);
+            break;
+         }
+      }
+      if (child != NULL) {
+         if (nframes == cap) {
+            cap *= 2;
+            frames = (PruneFrame*)realloc(frames, sizeof(PruneFrame)*cap);
+            f = &(frames[nframes-1]);
+         }
+         frames[nframes].node = child;
+         frames[nframes].dead = NULL;
+         frames[nframes].i = -1;
+         nframes++;
+         continue;
+      }
+
+      ret = 0;
+      if (cl->nsubcls != 0 && node->assignedSubcl != -1) {
+         ret = f->dead[node->assignedSubcl];
+      } else if (cl->nsubcls != 0) {
+         open = 0;
+         for (j = 0; j < cl->nsubcls; j++)
+            if (f->dead[j] == 0 && (node->subclMask == NULL || node->subclMask[j] == 1)) open = 1;
+         if (open == 0) {
+            ret = 1;
+         } else {
+            pruned = 0;
+            for (j = 0; j < cl->nsubcls; j++) {
+               if (f->dead[j] == 0 || (node->subclMask != NULL && node->subclMask[j] != 1)) continue;
+               if (node->subclMask == NULL) {
+                  node->subclMask = (int*)malloc(sizeof(int)*cl->nsubcls);
+                  for (open = 0; open < cl->nsubcls; open++)
+                     node->subclMask[open] = 1;
+               }
+               node->subclMask[j] = 0;
+               *editsPtr = addKBEdit(node, j, NULL, -1, -1, PRUNE, *editsPtr);
+               pruned = 1;
+            }
+            // The object is in the one subclass left open, so it is listed
+            // under that class, as an assigned one would be. The last prune
+            // records it, to take the node out again when it is undone.
+            open = -1;
+            for (j = 0; j < cl->nsubcls && pruned; j++) {
+               if (node->subclMask[j] != 1) continue;
+               open = (open == -1) ? j : -2;
+            }
+            if (open >= 0) {
+               indexObjectUnderClass(kb, cl->subcl[open]->id, &(node->subcl[open]));
+               (*editsPtr)->valIdx = open;
+            }
+         }
+      }
+      free(f->dead);
+      nframes--;
+   }
+   free(frames);
+   return ret;
+}
+
+/**
+ * Constraint propagation pass run once the SPN is filled out from the
+ * fact file. Prunes the subclass branches of every object that the hard
+ * rules and facts make impossible (see propagateHardConstraints). The
+ * prunes follow from the fact file, so they are kept on kb->prunes
+ * rather than on the interactive edit stack.
+ *
+ * @param kb   TML KB
+ * @return number of objects the facts make impossible
+ */
+int propagateHardConstraintsForKB(TMLKB* kb) {
+   Node* node;
+   Node* tmp;
+   int n = 0;
+
+   HASH_ITER(hh_path, kb->objectPathToPtr, node, tmp) {
+      if (propagateHardConstraints(kb, node, &(kb->prunes)) == 1) {
+         printf("The facts for object %s contradict the hard rules of the KB.\n", node->pathname);
+         n++;
+      }
+   }
+   return n;
+}
+
 /**
  * Blocks classes based on the existence of a subpart of node->name
  * called part->name_n
@@ -4991,19 +5282,17 @@ Node* blockClassesForPartQuery(KBEdit** editsPtr, Node* par, Node* subpart, TMLC
    Node* prevobj;
    Node* newobj;
    TMLPart* part;
-   TMLPart* tmp;
+   PartSlot* slot;
    int block;
    int somethingBlocked = 0;
    Node* subcl;
 
-   p = 0;
-   HASH_ITER(hh, par->cl->part, part, tmp) {
-      for (n = 0; n < part->n; n++) {
-         if (par->part[p][n] == subpart) break;
-      }
-      if (n != part->n) break;
-      p++;
-   }
+   slot = findPartSlot(subpart, par, -1);
+   if (slot == NULL) return NULL;
+   n = slot->slot;
+   part = par->cl->part;
+   for (p = 0; p < slot->part; p++)
+      part = (TMLPart*)(part->hh.next);
    if (part->defaultPart != 0 && par->assignedSubcl == -1) {
       subcl = par->subcl;
       if (par->subclMask != NULL) {
@@ -5107,6 +5396,232 @@ Node* blockClassesForPartQuery(KBEdit** editsPtr, Node* par, Node* subpart, TMLC
    return NULL;
 }
 
+///////////////////////
+// The following functions cache the results of probability queries.
+// Each committed edit bumps the KB's evidence epoch and stamps the nodes
+// it affects, so a cached result is only dropped when evidence reaches
+// the part of the SPN its query depends on.
+///////////////////////
+
+typedef struct VisitedNode {
+   Node* node;
+   UT_hash_handle hh;
+} VisitedNode;
+
+static NodeEpoch* getNodeEpoch(TMLKB* kb, Node* node, int create) {
+   NodeEpoch* ne;
+
+   HASH_FIND_PTR(kb->nodeEpochs, &node, ne);
+   if (ne == NULL && create == 1) {
+      ne = (NodeEpoch*)malloc(sizeof(NodeEpoch));
+      ne->node = node;
+      ne->subtree = 0;
+      ne->self = 0;
+      HASH_ADD_PTR(kb->nodeEpochs, node, ne);
+   }
+   return ne;
+}
+
+/**
+ * Bumps the evidence epoch for an edit and stamps the edited node and
+ * its ancestors with it. Edits to the class structure of a node (class,
+ * prune and rename edits) also stamp the node itself.
+ */
+static void markKBEditEpoch(TMLKB* kb, KBEdit* edit) {
+   PtrStack toVisit;
+   NodeEpoch* ne;
+   Node* node;
+   int p;
+
+   kb->epoch++;
+   if ((edit->relStr == NULL && edit->relIdx == -1) || (edit->relStr != NULL && edit->pol == -1))
+      getNodeEpoch(kb, edit->node, 1)->self = kb->epoch;
+   initPtrStack(&toVisit, 32);
+   pushPtrStack(&toVisit, edit->node);
+   while ((node = (Node*)popPtrStack(&toVisit)) != NULL) {
+      ne = getNodeEpoch(kb, node, 1);
+      if (ne->subtree == kb->epoch) continue;
+      ne->subtree = kb->epoch;
+      for (p = 0; p < node->npars; p++)
+         pushPtrStack(&toVisit, node->par[p]);
+   }
+   freePtrStack(&toVisit);
+}
+
+void flushQueryCache(TMLKB* kb) {
+   QueryCacheEntry* entry;
+   QueryCacheEntry* tmp;
+
+   HASH_ITER(hh, kb->queryCache, entry, tmp) {
+      HASH_DEL(kb->queryCache, entry);
+      free(entry->key);
+      free(entry);
+   }
+}
+
+/**
+ * Stamps the edits committed to the KB since the last update. If the
+ * edit stack was replaced rather than pushed onto or undone, every cached
+ * result is dropped.
+ */
+void updateKBEpoch(TMLKB* kb) {
+   KBEdit* edit;
+
+   for (edit = kb->edits; edit != kb->epochEdits && edit != NULL; edit = edit->prev)
+      markKBEditEpoch(kb, edit);
+   if (edit != kb->epochEdits)
+      flushQueryCache(kb);
+   kb->epochEdits = kb->edits;
+}
+
+/**
+ * Stamps the edits above (not including) stop before they are undone.
+ */
+void markUndoneKBEdits(TMLKB* kb, KBEdit* stop) {
+   KBEdit* edit;
+
+   updateKBEpoch(kb);
+   for (edit = kb->edits; edit != stop && edit != NULL; edit = edit->prev)
+      markKBEditEpoch(kb, edit);
+   kb->epochEdits = stop;
+}
+
+/**
+ * A cached result stays valid while no evidence was added in its node's
+ * subtree, and every ancestor of the node where evidence was added since
+ * has a single possible class. Those ancestors are products in the SPN,
+ * so the evidence scales the query's numerator and denominator alike.
+ */
+static int isQueryCacheEntryValid(TMLKB* kb, QueryCacheEntry* entry) {
+   PtrStack toVisit;
+   VisitedNode* visited = NULL;
+   VisitedNode* v;
+   VisitedNode* tmp;
+   NodeEpoch* ne;
+   Node* node = entry->node;
+   int p;
+   int valid = 1;
+
+   ne = getNodeEpoch(kb, node, 0);
+   if (ne != NULL && ne->subtree > entry->epoch) return 0;
+   initPtrStack(&toVisit, 32);
+   for (p = 0; p < node->npars; p++)
+      pushPtrStack(&toVisit, node->par[p]);
+   while (valid == 1 && (node = (Node*)popPtrStack(&toVisit)) != NULL) {
+      HASH_FIND_PTR(visited, &node, v);
+      if (v != NULL) continue;
+      v = (VisitedNode*)malloc(sizeof(VisitedNode));
+      v->node = node;
+      HASH_ADD_PTR(visited, node, v);
+      ne = getNodeEpoch(kb, node, 0);
+      if (ne != NULL) {
+         if (ne->self > entry->epoch) valid = 0;
+         if (node->cl->nsubcls != 0 && node->assignedSubcl == -1 && ne->subtree > entry->epoch) valid = 0;
+      }
+      for (p = 0; p < node->npars; p++)
+         pushPtrStack(&toVisit, node->par[p]);
+   }
+   freePtrStack(&toVisit);
+   HASH_ITER(hh, visited, v, tmp) {
+      HASH_DEL(visited, v);
+      free(v);
+   }
+   return valid;
+}
+
+/**
+ * Looks up the cached result of a query.
+ *
+ * @param kb     TML KB
+ * @param key    normalized query
+ * @param prob   set to the cached probability on a hit
+ * @return 1 on a hit, 0 otherwise
+ */
+int lookupQueryCache(TMLKB* kb, const char* key, double* prob) {
+   QueryCacheEntry* entry;
+
+   updateKBEpoch(kb);
+   HASH_FIND_STR(kb->queryCache, key, entry);
+   if (entry == NULL) return 0;
+   if (entry->epoch != kb->epoch && isQueryCacheEntryValid(kb, entry) == 0) {
+      HASH_DEL(kb->queryCache, entry);
+      free(entry->key);
+      free(entry);
+      return 0;
+   }
+   entry->epoch = kb->epoch;
+   *prob = entry->prob;
+   return 1;
+}
+
+/**
+ * Caches the result of a query about the object at node.
+ */
+void storeQueryCache(TMLKB* kb, const char* key, Node* node, double prob) {
+   QueryCacheEntry* entry;
+
+   HASH_FIND_STR(kb->queryCache, key, entry);
+   if (entry == NULL) {
+      entry = (QueryCacheEntry*)malloc(sizeof(QueryCacheEntry));
+      entry->key = strdup(key);
+      HASH_ADD_KEYPTR(hh, kb->queryCache, entry->key, strlen(entry->key), entry);
+   }
+   entry->node = node;
+   entry->epoch = kb->epoch;
+   entry->prob = prob;
+}
+
+/**
+ * Checks whether the blocking held for a query file is the one a relation
+ * query about topNode and its argument objects would make.
+ */
+static int isSharedQueryBlocking(TMLKB* kb, Node* topNode, Node*** argNodes, int nargs) {
+   QueryBlocking* qb = kb->queryBlocking;
+   int i;
+
+   if (qb == NULL || qb->node != topNode || qb->nargs != nargs) return 0;
+   for (i = 0; i < nargs; i++)
+      if (qb->args[i] != argNodes[i][0]) return 0;
+   return 1;
+}
+
+/**
+ * Keeps the blocking edits of a relation query in place for the next
+ * queries about the same objects.
+ */
+static void holdQueryBlocking(TMLKB* kb, Node* topNode, Node*** argNodes, int nargs, KBEdit* edits, float blockedLogZ) {
+   QueryBlocking* qb = kb->queryBlocking;
+   int i;
+
+   qb->node = topNode;
+   qb->nargs = nargs;
+   qb->args = (nargs == 0) ? NULL : (Node**)malloc(sizeof(Node*)*nargs);
+   for (i = 0; i < nargs; i++)
+      qb->args[i] = argNodes[i][0];
+   qb->edits = edits;
+   qb->blockedLogZ = blockedLogZ;
+}
+
+/**
+ * Undoes the blocking edits held for a query file, if any. Must be called
+ * before anything else reads or changes the KB.
+ */
+void releaseQueryBlocking(TMLKB* kb) {
+   QueryBlocking* qb = kb->queryBlocking;
+   KBEdit* edit;
+
+   if (qb == NULL || qb->node == NULL) return;
+   for (edit = qb->edits; edit != NULL; edit = edit->prev)
+      propagateKBChange(edit->node);
+   propagateKBChange(qb->node);
+   resetKBEdits(kb, qb->edits);
+   free(qb->args);
+   qb->node = NULL;
+   qb->args = NULL;
+   qb->nargs = 0;
+   qb->edits = NULL;
+}
+
 void computeAttributeQueryOrAddEvidenceForObj(TMLKB* kb, Node* obj, TMLAttribute* attr, TMLAttrValue* attrval, int pol, float logZ, int isQuery, int isMultQuery, FILE* outFile) {
    char* best = NULL;
    TMLClass* cl;
@@ -5114,6 +5629,9 @@ void computeAttributeQueryOrAddEvidenceForObj(TMLKB* kb, Node* obj, TMLAttribute
    char* name;
    int correctScan;
    TMLAttrValue* tmpav;
+   char* cacheKey;
+   double cachedProb;
+   char negval[MAX_NAME_LENGTH+2];
 
    if (obj->name != NULL) {
       name = obj->name;
@@ -5164,7 +5682,7 @@ void computeAttributeQueryOrAddEvidenceForObj(TMLKB* kb, Node* obj, TMLAttribute
          }
          if (best != NULL) free(best);
          return;
-      } else if (obj->attrValues[attr->idx] != NULL && obj->attrValues[attr->idx][attrval->idx] < 0) {
+      } else if (obj->attrValues[attr->idx] != NULL && isValueMasked(obj->attrValues[attr->idx], attrval->idx)) {
          if (isMultQuery == 1) {
             if (best != NULL) free(best);
             return;
@@ -5182,23 +5700,43 @@ void computeAttributeQueryOrAddEvidenceForObj(TMLKB* kb, Node* obj, TMLAttribute
          return;
       }
       if (isQuery) {
+         cacheKey = (char*)malloc(sizeof(char)*(strlen(attr->name)+strlen(name)+strlen(attrval->name)+8));
+         sprintf(cacheKey, "%s(%s,%s)", attr->name, name, attrval->name);
+         if (lookupQueryCache(kb, cacheKey, &cachedProb) == 1) {
+            printf("P[%s(%s,%s)] = %f\n", attr->name, name, attrval->name, cachedProb);
+            if (outFile != NULL)
+               fprintf(outFile, "P[%s(%s,%s)] = %f\n", attr->name, name, attrval->name, cachedProb);
+            free(cacheKey);
+            if (best != NULL) free(best);
+            return;
+         }
+         releaseQueryBlocking(kb);
          correctScan = readInObjectAttribute(NULL, obj, name, attr->name, attrval->name);
          if (correctScan == 0) {
-            if (outFile != NULL) fclose(outFile);
+            free(cacheKey);
             if (best != NULL) free(best);
             return;
          }
          newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 1);
+         storeQueryCache(kb, cacheKey, obj, exp(newLogZ - logZ));
+         free(cacheKey);
          removeAttributeToKB(obj, attr->name, attrval->name, pol);
+         propagateKBChange(obj);
          printf("P[%s(%s,%s)] = %f\n", attr->name, name, attrval->name, exp(newLogZ - logZ));
          if (outFile != NULL)
             fprintf(outFile, "P[%s(%s,%s)] = %f\n", attr->name, name, attrval->name, exp(newLogZ - logZ));
          if (best != NULL) free(best);
          return;
       } else {
-         correctScan = readInObjectAttribute(kb, obj, name, attr->name, attrval->name);
+         if (pol == 0) {
+            negval[0] = '!';
+            strncpy(negval+1, attrval->name, MAX_NAME_LENGTH);
+            negval[MAX_NAME_LENGTH+1] = '\0';
+            correctScan = readInObjectAttribute(kb, obj, name, attr->name, negval);
+         } else {
+            correctScan = readInObjectAttribute(kb, obj, name, attr->name, attrval->name);
+         }
          if (correctScan == 0) {
-            if (outFile != NULL) fclose(outFile);
             if (best != NULL) free(best);
             return;
          }
@@ -5363,10 +5901,318 @@ int computeNumRelationGroundings(Node* node, const char* relStr) {
    if (rel == NULL) return 0;
 }
 
-void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* base, char* relName, char* iter, int pol, char* normalizedRelStr, char** args, int p, float logZ, int isQuery, int isClassQuery, char* outputRelStr, FILE* outFile) {
-   int i, j, k, n;
-   Node*** argNodes;
-   int* argLen;
+/**
+ * Returns 1 if the marginals of obj can be read from its own subclass
+ * distributions: it is an object node filling at most one part slot. An
+ * object filling several slots is evaluated once per slot, and is left
+ * to the global evaluation.
+ */
+static int hasLocalMarginals(Node* obj) {
+   return obj->cl->par == NULL && obj->nslots <= 1;
+}
+
+/**
+ * Returns 1 if answering a query about obj would block subclasses of its
+ * superparts (see blockClassesForPartQuery), in which case its marginals
+ * cannot be read locally. Leaves the KB unchanged.
+ */
+static int needsQueryBlocking(TMLKB* kb, Node* obj, TMLClass* newClass) {
+   KBEdit* edits = NULL;
+   int i;
+
+   for (i = 0; i < obj->npars; i++)
+      blockClassesForPartQuery(&edits, obj->par[i], obj, newClass);
+   if (edits == NULL) return 0;
+   resetKBEdits(kb, edits);
+   return 1;
+}
+
+/**
+ * Brings the node values, and with them the subclass distributions kept
+ * by normalizeSPN, up to date with the evidence.
+ */
+static void refreshLocalMarginals(TMLKB* kb) {
+   Node* root = (Node*)(kb->root->ptr);
+
+   releaseQueryBlocking(kb);
+   computeLogZ(root, root->cl, spn_logsum, (kb->mapSet == 1) ? 1 : 0);
+   kb->mapSet = 0;
+}
+
+/**
+ * Makes node keep its subclass distribution from now on, for nodes
+ * created after normalizeSPN. The distribution is filled in by the next
+ * refreshLocalMarginals.
+ */
+static void addSubclLogP(Node* node) {
+   node->subclLogP = (float*)malloc(sizeof(float)*node->cl->nsubcls);
+   propagateKBChange(node);
+}
+
+/**
+ * Probability that an unknown grounding of relName has polarity pol for
+ * the object below node, read from the subclass distributions.
+ *
+ * @param missing   incremented for each node found without a distribution
+ * @return the probability, NAN if some node was not evaluated
+ */
+static double localRelationProb(Node* node, const char* relName, int pol, int* missing) {
+   TMLClass* cl = node->cl;
+   TMLRelation* rel = getRelation(cl, relName);
+   double relProb = 1.0;
+   double prob = 0.0;
+   double total = 0.0;
+   double branchProb;
+   Node* child;
+   int c;
+
+   if (node->changed != 0) return NAN;
+   if (rel != NULL) {
+      if (rel->hard != 0)
+         relProb = ((rel->hard == 1) == (pol == 1)) ? 1.0 : 0.0;
+      else if (pol == 1)
+         relProb = 1.0/(1.0+exp(rel->nwt-rel->pwt));
+      else
+         relProb = 1.0/(1.0+exp(rel->pwt-rel->nwt));
+      if (rel->defaultRel == 0) return relProb;
+   }
+   if (cl->nsubcls == 0) return relProb;
+   if (node->assignedSubcl != -1) {
+      c = node->assignedSubcl;
+      if (rel != NULL && rel->defaultRelForSubcl[c] == 0) return relProb;
+      child = (node->subclMask == NULL) ? node->subcl : &(node->subcl[c]);
+      return localRelationProb(child, relName, pol, missing);
+   }
+   if (node->subclLogP == NULL) {
+      addSubclLogP(node);
+      (*missing)++;
+      return NAN;
+   }
+   for (c = 0; c < cl->nsubcls; c++) {
+      if (node->subclMask != NULL && node->subclMask[c] != 1) continue;
+      if (isinf(node->subclLogP[c])) continue;
+      if (rel != NULL && rel->defaultRelForSubcl[c] == 0)
+         branchProb = relProb;
+      else
+         branchProb = localRelationProb(&(node->subcl[c]), relName, pol, missing);
+      prob += exp(node->subclLogP[c])*branchProb;
+      total += exp(node->subclLogP[c]);
+   }
+   // Renormalized, so that float rounding does not build up with depth
+   return prob/total;
+}
+
+/**
+ * Computes the probability of a relation query about topNode from the
+ * locally normalized SPN. The answer is the same as the one of the
+ * global evaluation, as long as the query blocks no superpart classes.
+ *
+ * @return the probability, NAN if the query must be evaluated globally
+ */
+static double localRelationQueryProb(TMLKB* kb, Node* topNode, const char* relName, int pol, Node*** argNodes, int p) {
+   double prob;
+   int missing = 0;
+   int i;
+
+   if (!hasLocalMarginals(topNode)) return NAN;
+   releaseQueryBlocking(kb);
+   if (needsQueryBlocking(kb, topNode, NULL)) return NAN;
+   for (i = 0; i < p; i++) {
+      if (needsQueryBlocking(kb, argNodes[i][0], NULL)) return NAN;
+   }
+   refreshLocalMarginals(kb);
+   prob = localRelationProb(topNode, relName, pol, &missing);
+   if (missing > 0) {
+      refreshLocalMarginals(kb);
+      missing = 0;
+      prob = localRelationProb(topNode, relName, pol, &missing);
+   }
+   return (missing > 0) ? NAN : prob;
+}
+
+/**
+ * Readies the locally normalized SPN for a query of whether obj is of
+ * class cl, giving the nodes on the way down from prevFinest their
+ * subclass distributions if they have none yet.
+ *
+ * @return 1 if the query can be answered by localClassQueryProb
+ */
+static int prepareLocalClassQuery(TMLKB* kb, Node* obj, Node* prevFinest, TMLClass* cl) {
+   Node* node = prevFinest;
+   TMLClass* tmpcl;
+
+   if (kb->localMarginals != 1 || !hasLocalMarginals(obj)) return 0;
+   if (needsQueryBlocking(kb, obj, cl)) return 0;
+   while (node->cl != cl && node->subcl != NULL) {
+      if (node->subclLogP == NULL) addSubclLogP(node);
+      for (tmpcl = cl; tmpcl != NULL && tmpcl->par != node->cl; tmpcl = tmpcl->par);
+      if (tmpcl == NULL || (node->subclMask != NULL && node->subclMask[tmpcl->subclIdx] != 1)) break;
+      node = &(node->subcl[tmpcl->subclIdx]);
+   }
+   refreshLocalMarginals(kb);
+   return 1;
+}
+
+/**
+ * Computes the probability of a class query from the locally normalized
+ * SPN, once findNodeForClass has assigned the subclasses from prevFinest
+ * down to the queried class. Undoes those assignments if it succeeds.
+ *
+ * @return the probability, NAN if the query must be evaluated globally
+ */
+static double localClassQueryProb(Node* prevFinest, Node* node) {
+   double prob = 1.0;
+   Node* tmp;
+   int subcl;
+
+   for (tmp = prevFinest; tmp != node; tmp = &(tmp->subcl[tmp->assignedSubcl])) {
+      if (tmp->changed != 0 || tmp->subclLogP == NULL) return NAN;
+      prob *= exp(tmp->subclLogP[tmp->assignedSubcl]);
+   }
+   while (prevFinest->assignedSubcl != -1) {
+      subcl = prevFinest->assignedSubcl;
+      prevFinest->assignedSubcl = -1;
+      prevFinest = &(prevFinest->subcl[subcl]);
+   }
+   return prob;
+}
+
+/**
+ * Answers a relation query about an object whose arguments range over all
+ * the parts of some part relations, e.g. Friends(T,Person[1],*), printing
+ * the probability of every grounding that is not already a fact.
+ *
+ * A query fact only changes the relation counts of the object, so every
+ * grounding whose argument nodes need no classes of their parents blocked
+ * has the same probability. It is computed once, without adding a fact
+ * per grounding. Groundings with an argument that exists only in some
+ * subclasses of its parent are computed one at a time, with that
+ * argument's blocking.
+ *
+ * @param kb        TML KB
+ * @param topNode   object of the query
+ * @param node      deepest node of the object's assigned subclasses
+ * @param relName   name of the relation
+ * @param name      name of the object to print
+ * @param pol       polarity of the query
+ * @param argNodes  candidate nodes for each argument
+ * @param argLen    number of candidates for each argument
+ * @param p         number of arguments
+ * @param outFile   file to also print the probabilities to, or NULL
+ */
+static void computeRelationQueryForAllArgs(TMLKB* kb, Node* topNode, Node* node, char* relName, char* name, int pol, Node*** argNodes, int* argLen, int p, FILE* outFile) {
+   char groundStr[MAX_LINE_LENGTH+1];
+   char outputStr[MAX_LINE_LENGTH+1];
+   KBEdit* queryEdits = NULL;
+   KBEdit* argEdits;
+   ObjRelStrsHash* objRelHash;
+   RelationStr_Hash* relStrHash;
+   Node** currArgNodes;
+   Node* argNode;
+   Node* root = (Node*)(kb->root->ptr);
+   char** blocks;
+   int* idx;
+   float sharedBlockedLogZ = NAN;
+   float sharedNewLogZ = NAN;
+   float blockedLogZ;
+   float newLogZ;
+   int blocked, missing;
+   int i, j, k;
+
+   releaseQueryBlocking(kb);
+   for (i = 0; i < topNode->npars; i++)
+      blockClassesForPartQuery(&queryEdits, topNode->par[i], topNode, NULL);
+
+   // Which candidates exist only in some subclasses of their parents
+   blocks = (char**)malloc(sizeof(char*)*p);
+   for (i = 0; i < p; i++) {
+      blocks[i] = (char*)malloc(sizeof(char)*argLen[i]);
+      for (j = 0; j < argLen[i]; j++) {
+         argNode = argNodes[i][j];
+         argEdits = NULL;
+         for (k = 0; argNode != NULL && k < argNode->npars; k++)
+            blockClassesForPartQuery(&argEdits, argNode->par[k], argNode, NULL);
+         blocks[i][j] = (argEdits != NULL);
+         resetKBEdits(kb, argEdits);
+      }
+   }
+
+   HASH_FIND_STR(kb->objToRelFactStrs, topNode->pathname, objRelHash);
+   currArgNodes = (Node**)malloc(sizeof(Node*)*p);
+   idx = (int*)malloc(sizeof(int)*p);
+   for (i = 0; i < p; i++) {
+      idx[i] = 0;
+      if (argLen[i] <= 0) idx[0] = -1;
+   }
+   while (p > 0 && idx[0] != -1) {
+      blocked = 0;
+      missing = 0;
+      for (i = 0; i < p; i++) {
+         currArgNodes[i] = argNodes[i][idx[i]];
+         if (currArgNodes[i] == NULL) missing = 1;
+         else if (blocks[i][idx[i]]) blocked = 1;
+      }
+      if (!missing) {
+         relStrHash = NULL;
+         if (objRelHash != NULL) {
+            writeNormalizedRelStr(groundStr, relName, name, currArgNodes, p, 0, 0);
+            HASH_FIND_STR(objRelHash->hash, groundStr, relStrHash);
+         }
+         if (relStrHash == NULL && blocked) {
+            argEdits = NULL;
+            for (i = 0; i < p; i++) {
+               for (k = 0; k < currArgNodes[i]->npars; k++)
+                  blockClassesForPartQuery(&argEdits, currArgNodes[i]->par[k], currArgNodes[i], NULL);
+            }
+            propagateKBChange(node);
+            blockedLogZ = computeLogZ(root, root->cl, spn_logsum, 1);
+            addRelationToKB(NULL, topNode, relName, pol);
+            propagateKBChange(node);
+            newLogZ = computeLogZ(root, root->cl, spn_logsum, 0);
+            removeRelationToKB(node, relName, pol);
+            resetKBEdits(kb, argEdits);
+            propagateKBChange(node);
+         } else if (relStrHash == NULL) {
+            if (isnan(sharedBlockedLogZ)) {
+               // One full pass with the object's blocking, then one up
+               // the object's path with a fact added
+               propagateKBChange(node);
+               sharedBlockedLogZ = computeLogZ(root, root->cl, spn_logsum, 1);
+               addRelationToKB(NULL, topNode, relName, pol);
+               propagateKBChange(node);
+               sharedNewLogZ = computeLogZ(root, root->cl, spn_logsum, 0);
+               removeRelationToKB(node, relName, pol);
+               propagateKBChange(node);
+            }
+            blockedLogZ = sharedBlockedLogZ;
+            newLogZ = sharedNewLogZ;
+         }
+         if (relStrHash == NULL && !isnan(blockedLogZ) && !isinf(blockedLogZ)) {
+            writeNormalizedRelStr(outputStr, relName, name, currArgNodes, p, 1, 1);
+            printf("P[%s] = %f\n", outputStr, exp(newLogZ - blockedLogZ));
+            if (outFile != NULL)
+               fprintf(outFile, "P[%s] = %f\n", outputStr, exp(newLogZ - blockedLogZ));
+         }
+      }
+      for (i = p-1; i >= 0; i--) {
+         if (++idx[i] < argLen[i]) break;
+         idx[i] = 0;
+      }
+      if (i < 0) idx[0] = -1;
+   }
+   resetKBEdits(kb, queryEdits);
+   propagateKBChange(node);
+   for (i = 0; i < p; i++)
+      free(blocks[i]);
+   free(blocks);
+   free(currArgNodes);
+   free(idx);
+}
+
+void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* base, char* relName, char* iter, int pol, char* normalizedRelStr, char** args, int p, float logZ, int isQuery, int isClassQuery, char* outputRelStr, FILE* outFile) {
+   int i, j, k, n;
+   Node*** argNodes;
+   int* argLen;
    Node** currArgNodes;
    Node*** argParNodes;
    Node** par = NULL;
@@ -5383,23 +6229,25 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
    int relIdx;
    char* partname;
    char* normalizedGroundStr;
-   char* outputGroundStr;
    Node* subpartNode;
    Node* tmpNode;
    int partCl;
    char* partName;
    TMLPart* part;
-   TMLPart* foundpart;
-   TMLPart* tmppart;
    int partArrIdx;
    int partIdx;
    char* partBase;
-   ArraysAccessor* aa;
+   GroundingIter it;
    float blockedLogZ;
    float newLogZ;
-   int combo;
    int recomputeLogZ;
+   int shared = 0;
    KBEdit* queryEdits = NULL;
+   KBEdit* savedEdits;
+   KBEdit* edit;
+   char* cacheKey = NULL;
+   double cachedProb;
+   double prob;
    TMLClass* partcl;
    Name_and_Ptr* partHash;
    int numTraverseParts;
@@ -5471,7 +6319,7 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
          if (subpartNode == NULL)
             subpartNode = findNodeFromAnonName(kb, topNode, partname, 0);
          if (subpartNode == NULL) {
-            if (strcmp(partname, rel->argPartName[i]) == 0) {
+            if (strcmp(partname, rel->argPartName[i]) == 0 || strcmp(partname, "*") == 0) {
                if (isQuery == 0) {
                   printf("Can only add facts about specific objects.\n");
                   for (n = 0; n < i; n++) {
@@ -5484,6 +6332,7 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
                   return;
                }
                abstractQuery = 1;
+                  partname = rel->argPartName[i];
                   tmpNode = node;
                   do {
                      HASH_FIND_STR(tmpNode->cl->part, partname, part);
@@ -5494,11 +6343,7 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
                            break;
                      } else break;
                   } while (TRUE);
-                  partArrIdx = 0;
-                  HASH_ITER(hh, tmpNode->cl->part, foundpart, tmppart) {
-                     if (strcmp(foundpart->name, partname) == 0) break;
-                     partArrIdx++;
-                  }
+                  partArrIdx = part->idx;
                   argNodes[i] = (Node**)malloc(sizeof(Node*)*part->n);
                   argLen[i] = part->n;
                   for (j = 0; j < part->n; j++) {
@@ -5541,11 +6386,7 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
                      if (best != NULL) free(best); 
                      return;
                   }
-                  partArrIdx = 0;
-                  HASH_ITER(hh, tmpNode->cl->part, foundpart, tmppart) {
-                     if (strcmp(foundpart->name, partBase) == 0) break;
-                     partArrIdx++;
-                  }
+                  partArrIdx = part->idx;
 
                   argNodes[i] = (Node**)malloc(sizeof(Node*));
                   argLen[i] = 1;
@@ -5588,16 +6429,8 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
                }
                // TODO: block subclasses which don't have this part
             }
-            partArrIdx = 0;
-            HASH_ITER(hh, tmpNode->cl->part, foundpart, tmppart) {
-               if (strcmp(foundpart->name, partName) == 0) break;
-               partArrIdx++;
-            }
-            n = getPart(tmpNode->cl, partName)->n;
-            for (j = 0; j < n; j++) {
-               if (tmpNode->part[partArrIdx][j] == subpartNode) break;
-            }
-            if (j == n) {
+            partArrIdx = getPart(tmpNode->cl, partName)->idx;
+            if (findPartSlot(subpartNode, tmpNode, partArrIdx) == NULL) {
                printf("Object %s is not a %s part of object %s.\n", partname,
                   partName, name);
                for (n = 0; n < i; n++) {
@@ -5625,6 +6458,7 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
             }
          }
       }
+      savedEdits = kb->edits;
       if (!isQuery) {
          if (topNode->npars != 0) {
          par = (Node**)malloc(sizeof(Node*)*topNode->npars);
@@ -5635,64 +6469,60 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
       }
       
       if (abstractQuery == 1) {
-         if (topNode->npars != 0) {
-            par = (Node**)malloc(sizeof(Node*)*topNode->npars);
-            for (i = 0; i < topNode->npars; i++) {
-               par[i] = blockClassesForPartQuery(&queryEdits, topNode->par[i], topNode, NULL);
-            }
-         }
-         aa = createArraysAccessor((void***)argNodes, p, argLen);
-         n = numCombinationsInArraysAccessor(aa);
-         for (combo = 0; combo < n; combo++) {
-            currArgNodes = (Node**)nextArraysAccessor(aa);
-            if (currArgNodes == NULL) {
-               resetKBEdits(kb, queryEdits);
-               queryEdits = NULL;
-               continue;
-            }
-            normalizedGroundStr = createNormalizedRelStr(kb, relName, name, currArgNodes, p, 0, 0);
-            HASH_FIND_STR(kb->objToRelFactStrs, topNode->pathname, objRelHash);
-            if (objRelHash != NULL) {
-               HASH_FIND_STR(objRelHash->hash, normalizedGroundStr, relStrHash);
-               if (relStrHash != NULL) {
-                  resetKBEdits(kb, queryEdits);
-                  queryEdits = NULL;
-                  continue;
+         computeRelationQueryForAllArgs(kb, topNode, node, relName, name, pol, argNodes, argLen, p, outFile);
+         for (i = 0; i < p; i++)
+            free(argNodes[i]);
+         free(argNodes);
+         free(argLen);
+         free(argParNodes);
+      } else {
+         if (isQuery) {
+            cacheKey = (char*)malloc(sizeof(char)*(strlen(relName)+strlen(name)+((iter == NULL) ? 0 : strlen(iter))+16));
+            sprintf(cacheKey, "%d %s(%s%s)", pol, relName, name, (iter == NULL) ? "" : iter-1);
+            if (lookupQueryCache(kb, cacheKey, &cachedProb) == 1) {
+               if (iter == NULL) {
+                  printf("P[%s(%s)] = %f\n", relName, name, cachedProb);
+                  if (outFile != NULL)
+                     fprintf(outFile, "P[%s(%s)] = %f\n", relName, name, cachedProb);
+               } else {
+                  printf("P[%s(%s%s)] = %f\n", relName, name, iter-1, cachedProb);
+                  if (outFile != NULL)
+                     fprintf(outFile, "P[%s(%s%s)] = %f\n", relName, name, iter-1, cachedProb);
                }
+               for (i = 0; i < p; i++)
+                  free(argNodes[i]);
+               free(argNodes);
+               free(argLen);
+               free(argParNodes);
+               free(cacheKey);
+               if (best != NULL) free(best);
+               return;
             }
-            outputGroundStr = createNormalizedRelStr(kb, relName, name, currArgNodes, p, 1, 1);
-            recomputeLogZ = 0;
-            for (i = 0; i < p; i++) {
-               if (currArgNodes[i]->npars == 0)
-                  argParNodes[i] = NULL;
-               else {
-                  recomputeLogZ = 1;
-                  argParNodes[i] = (Node**)malloc(sizeof(Node*)*currArgNodes[i]->npars);
-                  for (j = 0; j < currArgNodes[i]->npars; j++) {
-                     argParNodes[i][j] = blockClassesForPartQuery(&queryEdits, currArgNodes[i]->par[j], currArgNodes[i], NULL);
-                  }
+            prob = (kb->localMarginals == 1) ? localRelationQueryProb(kb, topNode, relName, pol, argNodes, p) : NAN;
+            if (!isnan(prob)) {
+               storeQueryCache(kb, cacheKey, topNode, prob);
+               if (iter == NULL) {
+                  printf("P[%s(%s)] = %f\n", relName, name, prob);
+                  if (outFile != NULL)
+                     fprintf(outFile, "P[%s(%s)] = %f\n", relName, name, prob);
+               } else {
+                  printf("P[%s(%s%s)] = %f\n", relName, name, iter-1, prob);
+                  if (outFile != NULL)
+                     fprintf(outFile, "P[%s(%s%s)] = %f\n", relName, name, iter-1, prob);
                }
+               for (i = 0; i < p; i++)
+                  free(argNodes[i]);
+               free(argNodes);
+               free(argLen);
+               free(argParNodes);
+               free(cacheKey);
+               if (best != NULL) free(best);
+               return;
             }
-            propagateKBChange(node);
-            if (par == NULL && recomputeLogZ == 0) blockedLogZ = logZ;
-            else blockedLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 1);
-            addRelationToKB(NULL, topNode, relName, pol);
-            propagateKBChange(node);
-            newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 1);
-            if (!isnan(blockedLogZ) && !isinf(blockedLogZ)) {
-               printf("P[%s] = %f\n", outputGroundStr, exp(newLogZ - blockedLogZ));
-               if (outFile != NULL)
-                  fprintf(outFile, "P[%s] = %f\n", outputGroundStr, exp(newLogZ - blockedLogZ));
-            }
-            free(normalizedGroundStr);
-            free(outputGroundStr);
-            removeRelationToKB(node, relName, pol);
-            resetKBEdits(kb, queryEdits);
-            queryEdits = NULL;
-            propagateKBChange(node);
          }
-      } else {
-         if (topNode->npars != 0) {
+         shared = (isQuery && isSharedQueryBlocking(kb, topNode, argNodes, p));
+         if (!shared) releaseQueryBlocking(kb);
+         if (!shared && topNode->npars != 0) {
             par = (Node**)malloc(sizeof(Node*)*topNode->npars);
             for (i = 0; i < topNode->npars; i++) {
                if (isQuery) 
@@ -5702,7 +6532,7 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
             }
          }
          recomputeLogZ = 0;
-         for (i = 0; i < p; i++) {
+         for (i = 0; i < p && !shared; i++) {
             if (argNodes[i][0]->npars == 0)
                argParNodes[i] = NULL;
             else {
@@ -5718,7 +6548,8 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
          }
          propagateKBChange(node);
          if (isQuery) {
-            if (par == NULL && recomputeLogZ == 0) blockedLogZ = logZ;
+            if (shared) blockedLogZ = kb->queryBlocking->blockedLogZ;
+            else if (par == NULL && recomputeLogZ == 0) blockedLogZ = logZ;
             else blockedLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 1);
          }
          if (isQuery)
@@ -5729,6 +6560,8 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
          if (isQuery) {
             newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 1);
             if (!isnan(blockedLogZ) && !isinf(blockedLogZ)) {
+               if (cacheKey != NULL)
+                  storeQueryCache(kb, cacheKey, topNode, exp(newLogZ - blockedLogZ));
                if (iter == NULL) {
                   printf("P[%s(%s)] = %f\n", relName, name, exp(newLogZ - blockedLogZ));
                   if (outFile != NULL)
@@ -5740,16 +6573,19 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
                      fprintf(outFile, "P[%s(%s%s)] = %f\n", relName, name, iter, exp(newLogZ - blockedLogZ));
                }
             }
+            if (cacheKey != NULL)
+               free(cacheKey);
             removeRelationToKB(node, relName, 1);
-            resetKBEdits(kb, queryEdits);
+            if (kb->queryBlocking != NULL && !shared)
+               holdQueryBlocking(kb, topNode, argNodes, p, queryEdits, blockedLogZ);
+            else
+               resetKBEdits(kb, queryEdits);
             propagateKBChange(node);
          } else {
-            currArgNodes = NULL;
-            if (p != 0) {
-               aa = createArraysAccessor((void***)argNodes, p, argLen);
-               currArgNodes = (Node**)nextArraysAccessor(aa);
-            }
+            initGroundingIter(&it, argNodes, argLen, p);
+            currArgNodes = nextGrounding(&it);
             normalizedGroundStr = createNormalizedRelStr(kb, relName, name, currArgNodes, p, 0, 0);
+            freeGroundingIter(&it);
             if (objRelHash == NULL) {
                objRelHash = (ObjRelStrsHash*)malloc(sizeof(ObjRelStrsHash));
                objRelHash->obj = topNode->pathname;
@@ -5765,14 +6601,23 @@ void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* bas
                relStrHash->str = normalizedGroundStr;
             }
             HASH_ADD_KEYPTR(hh, objRelHash->hash, relStrHash->str, strlen(relStrHash->str), relStrHash);
-            newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 1);
+            if (propagateHardConstraints(kb, topNode, &(kb->edits)) == 1)
+               newLogZ = log(0.0);
+            else if (kb->deferLogZ == 1)
+               newLogZ = logZ;
+            else
+               newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 1);
             if (isnan(newLogZ) || isinf(newLogZ)) {
                if (pol == 1)
                   printf("Adding %s(%s) causes a contradiction. The relation has not been added.\n", relName, name);
                else
                   printf("Adding !%s(%s) causes a contradiction. The relation has not been added.\n", relName, name);
-               removeRelationToKB(node, relName, 1);
+               for (edit = kb->edits; edit != savedEdits; edit = edit->prev)
+                  propagateKBChange(edit->node);
+               resetKBEditsTo(kb, savedEdits);
                HASH_DEL(objRelHash->hash, relStrHash);
+               free(relStrHash->str);
+               free(relStrHash);
             } else {
                kb->edits = addKBEdit(topNode, -1, relStrHash->str, -1, -1, pol, kb->edits);
             }
@@ -5797,17 +6642,24 @@ void propagateKBChangeUp(Node* node) {
 
 void propagateKBChangeDown(Node* node) {
    int c;
-   node->changed = 1;
-   if (node->cl->nsubcls == 0) return;
-   if (node->subclMask != NULL) {
-      for (c = 0; c < node->cl->nsubcls; c++)
-         propagateKBChangeDown(&(node->subcl[c]));
-   } else if (node->assignedSubcl != -1) {
-      propagateKBChangeDown(node->subcl);
-   } else {
-      for (c = 0; c < node->cl->nsubcls; c++)
-         propagateKBChangeDown(&(node->subcl[c]));
+   PtrStack toVisit;
+
+   initPtrStack(&toVisit, 32);
+   pushPtrStack(&toVisit, node);
+   while ((node = (Node*)popPtrStack(&toVisit)) != NULL) {
+      node->changed = 1;
+      if (node->cl->nsubcls == 0) continue;
+      if (node->subclMask != NULL) {
+         for (c = 0; c < node->cl->nsubcls; c++)
+            pushPtrStack(&toVisit, &(node->subcl[c]));
+      } else if (node->assignedSubcl != -1) {
+         pushPtrStack(&toVisit, node->subcl);
+      } else {
+         for (c = 0; c < node->cl->nsubcls; c++)
+            pushPtrStack(&toVisit, &(node->subcl[c]));
+      }
    }
+   freePtrStack(&toVisit);
 }
 
 void propagateKBChange(Node* node) {
@@ -5818,13 +6670,10 @@ void propagateKBChange(Node* node) {
 
 void resetOneKBEdit(TMLKB* kb, KBEdit* edit) {
    Node* node;
-   int c;
    int* subclMask;
    ObjRelStrsHash* objRelHash;
    RelationStr_Hash* relStrHash;
    Node* nextNode;
-   QNode* qnode;
-   QNode* classToObjPtrsList;
 
    node = edit->node;
    if (edit->relStr != NULL) {
@@ -5849,21 +6698,15 @@ void resetOneKBEdit(TMLKB* kb, KBEdit* edit) {
          HASH_ADD_KEYPTR(hh, kb->objectNameToPtr, nextNode->name, strlen(nextNode->name), nextNode);
       }
    } else if (edit->relIdx == -1) {
-      if (edit->pol == 1) {
-         c = node->cl->subcl[node->assignedSubcl]->id;
-         classToObjPtrsList = kb->classToObjPtrs[c];
-         kb->classToObjPtrs[c] = classToObjPtrsList->next;
-         free(classToObjPtrsList);
+      if (edit->valIdx != -1)
+         unindexObjectUnderClass(kb, node->cl->subcl[edit->valIdx]->id, &(node->subcl[edit->valIdx]));
+      if (edit->pol == PRUNE) {
+         node->subclMask[edit->subclIdx] = 1;
+      } else if (edit->pol == 1) {
          node->assignedSubcl = -1;
       } else {
          subclMask = &(node->subclMask[edit->subclIdx]);
-         c = node->cl->subcl[edit->subclIdx]->id;
          (*subclMask == -1) ? *subclMask = 1 : (*subclMask)++;
-         classToObjPtrsList = kb->classToObjPtrs[c];
-         qnode = (QNode*)malloc(sizeof(QNode));
-         qnode->ptr = &(node->subcl[edit->subclIdx]);
-         qnode->next = classToObjPtrsList;
-         kb->classToObjPtrs[c] = qnode;
       }
    } else {
       if (edit->pol == 0) {
@@ -5880,13 +6723,10 @@ void resetKBEdits(TMLKB* kb, KBEdit* edits) {
    Node* node;
    KBEdit* edit;
    KBEdit* deledit;
-   int c;
    int* subclMask;
    ObjRelStrsHash* objRelHash;
    RelationStr_Hash* relStrHash;
    Node* nextNode;
-   QNode* qnode;
-   QNode* classToObjPtrsList;
 
    edit = edits;
    while (edit != NULL) {
@@ -5905,24 +6745,18 @@ void resetKBEdits(TMLKB* kb, KBEdit* edits) {
             renameNode(kb, edit->node, NULL);
          }
       } else if (edit->relIdx == -1) {
-         if (edit->pol == 1) {
-            c = node->cl->subcl[node->assignedSubcl]->id;
-            classToObjPtrsList = kb->classToObjPtrs[c];
-            kb->classToObjPtrs[c] = classToObjPtrsList->next;
-            free(classToObjPtrsList);
+         if (edit->valIdx != -1)
+            unindexObjectUnderClass(kb, node->cl->subcl[edit->valIdx]->id, &(node->subcl[edit->valIdx]));
+         if (edit->pol == PRUNE) {
+            node->subclMask[edit->subclIdx] = 1;
+         } else if (edit->pol == 1) {
             node->assignedSubcl = -1;
          } else {
             subclMask = &(node->subclMask[edit->subclIdx]);
-            c = node->cl->subcl[edit->subclIdx]->id;
             (*subclMask == -1) ? *subclMask = 1 : (*subclMask)++;
-            classToObjPtrsList = kb->classToObjPtrs[c];
-            qnode = (QNode*)malloc(sizeof(QNode));
-            qnode->ptr = &(node->subcl[edit->subclIdx]);
-            qnode->next = classToObjPtrsList;
-            kb->classToObjPtrs[c] = qnode;
          }
       } else {
-         if (edit->subclIdx = 0) {
+         if (edit->subclIdx == -1) {
             if (edit->pol == 0) {
                node->relValues[edit->relIdx][0]--;
                node->relValues[edit->relIdx][2]++;
@@ -5932,7 +6766,7 @@ void resetKBEdits(TMLKB* kb, KBEdit* edits) {
             }
          } else {
             if (edit->pol == 0) {
-               node->attrValues[edit->relIdx][edit->valIdx] = 0;
+               unmaskValue(node->attrValues[edit->relIdx], edit->valIdx);
             } else {
                node->assignedAttr[edit->relIdx] = NULL;
             }
@@ -5940,67 +6774,653 @@ void resetKBEdits(TMLKB* kb, KBEdit* edits) {
       }
       deledit = edit;
       edit = edit->prev;
+      if (deledit->expiry != NULL) {
+         pqueue_remove(kb->expiries, deledit->expiry);
+         free(deledit->expiry);
+      }
+      if (deledit->fact != NULL) free(deledit->fact);
       free(deledit);
    }
    kb->mapSet = 0;
 }
 
+/* Takes the edits down to (not including) stop, which must be on the edit stack, out of the online counts */
+static void uncountKBEditsTo(TMLKB* kb, KBEdit* stop) {
+   KBEdit* edit;
+
+   if (kb->onlineDirty == NULL) return;
+   for (edit = kb->edits; edit != stop && edit != kb->countedEdits; edit = edit->prev);
+   if (edit == stop) return; // none of them are counted
+   countKBEdits(kb, kb->countedEdits, stop, -1.0);
+   kb->countedEdits = stop;
+}
+
+/**
+ * Undoes the edits on top of the KB's edit stack down to (not including)
+ * stop, which must be on the stack.
+ *
+ * @param kb     TMLKB struct
+ * @param stop   edit to stop at (NULL undoes all edits)
+ */
+void resetKBEditsTo(TMLKB* kb, KBEdit* stop) {
+   KBEdit* edit = kb->edits;
+
+   if (edit == stop) return;
+   uncountKBEditsTo(kb, stop);
+   markUndoneKBEdits(kb, stop);
+   while (edit->prev != stop) edit = edit->prev;
+   edit->prev = NULL;
+   resetKBEdits(kb, kb->edits);
+   kb->edits = stop;
+}
+
 void resetKB(TMLKB* kb) { 
+   KBEdit* edit;
+
+   for (edit = kb->edits; edit != NULL; edit = edit->prev)
+      propagateKBChange(edit->node);
+   uncountKBEditsTo(kb, NULL);
+   markUndoneKBEdits(kb, NULL);
    resetKBEdits(kb, kb->edits);
    kb->edits = NULL;
+   freeKBSavepoints(kb, NULL);
+   freeKBExpiries(kb);
    propagateKBChange((Node*)(kb->root->ptr));
 }
 
-Node* findNodeForClass(Node* node, TMLClass* cl, const char* objName, const char* clName, FILE* outFile) {
-   int i, c;
-   Node* parNode;
+/**
+ * Sets a savepoint at the top of the KB's edit stack. Savepoints nest:
+ * a scenario's evidence can be rolled back without touching the edits
+ * made before it.
+ *
+ * @param kb     TMLKB struct
+ * @param name   name of the savepoint, NULL if unnamed
+ * @param logZ   current log of Z, restored on rollback
+ */
+void beginKBSavepoint(TMLKB* kb, const char* name, float logZ) {
+   KBSavepoint* sp = (KBSavepoint*)malloc(sizeof(KBSavepoint));
+
+   sp->name = (name == NULL) ? NULL : strdup(name);
+   sp->edits = kb->edits;
+   sp->logZ = logZ;
+   sp->prev = kb->savepoints;
+   kb->savepoints = sp;
+}
 
-   if (cl->par == node->cl) {
-      if (node->assignedSubcl != -1) {
-         if (node->cl->subcl[node->assignedSubcl] == cl) {
-            if (node->subclMask != NULL) {
-               return &(node->subcl[node->assignedSubcl]);
-            } else {
-               return node->subcl;
-            }
-         } else {
-            printf("P[Is(%s,%s)] = 0.0  Object defined to be of a contradictory class.\n", objName, clName);
-            if (outFile != NULL) fprintf(outFile, "P[Is(%s,%s)] = 0.0\n", objName, clName);
-            return NULL;
-         }
-      }
-      for (c = 0; c < node->cl->nsubcls; c++) {
-         if (node->cl->subcl[c] == cl) {
-            if (node->subclMask != NULL && node->subclMask[c] != 1) {
-               printf("P[Is(%s,%s)] = 0.0  Object defined to be not of class %s.\n", objName, clName, clName);
-               if (outFile != NULL) fprintf(outFile, "P[Is(%s,%s)] = 0.0\n", objName, clName);
-               return NULL;
-            }
-            node->assignedSubcl = c;
-            if (node->subclMask == NULL && node->cl->nsubcls != 0) {
-               node->subclMask = (int*)malloc(sizeof(int)*node->cl->nsubcls);
-               for (i = 0; i < node->cl->nsubcls; i++) {
-                  node->subclMask[i] = 1;
-               }
-            }
-            return &(node->subcl[c]);
-         }
-      }
+/**
+ * Frees the savepoints above (not including) stop.
+ */
+void freeKBSavepoints(TMLKB* kb, KBSavepoint* stop) {
+   KBSavepoint* sp;
+
+   while (kb->savepoints != stop) {
+      sp = kb->savepoints;
+      kb->savepoints = sp->prev;
+      if (sp->name != NULL) free(sp->name);
+      free(sp);
    }
-   if (cl->par != NULL) {
-      parNode = findNodeForClass(node, cl->par, objName, clName, outFile);
-      if (parNode != NULL) {
-         if (parNode->assignedSubcl != -1) {
-            if (parNode->cl->subcl[parNode->assignedSubcl] == cl) {
-               return parNode->subcl;
-            }
-            printf("P[Is(%s,%s)] = 0.0  Object defined to be of a contradictory class.\n", objName, clName);
-            if (outFile != NULL) fprintf(outFile, "P[Is(%s,%s)] = 0.0\n", objName, clName);
-            return NULL;
-         }
-         for (c = 0; c < parNode->cl->nsubcls; c++) {
-            if (parNode->cl->subcl[c] == cl) {
-               if (parNode->subclMask != NULL && parNode->subclMask[c] != 1) {
+}
+
+static KBSavepoint* findKBSavepoint(TMLKB* kb, const char* name) {
+   KBSavepoint* sp = kb->savepoints;
+
+   if (name == NULL) return sp;
+   while (sp != NULL && (sp->name == NULL || strcmp(sp->name, name) != 0))
+      sp = sp->prev;
+   return sp;
+}
+
+/**
+ * Undoes the edits made since a savepoint. The savepoint stays set, and
+ * those nested inside it are released. Only the nodes the undone edits
+ * touched, and their ancestors, are marked changed and recomputed, so the
+ * cached log Z of the rest of the SPN stays valid.
+ *
+ * @param kb     TMLKB struct
+ * @param name   name of the savepoint, NULL for the innermost one
+ * @param logZ   current log of Z
+ * @return log of Z at the savepoint, or logZ if there is no such savepoint
+ */
+float rollbackToKBSavepoint(TMLKB* kb, const char* name, float logZ) {
+   KBSavepoint* sp = findKBSavepoint(kb, name);
+   KBEdit* edit;
+   int recompute = (kb->mapSet == 1) ? 1 : 0; // MAP leaves max values in the cache
+
+   if (sp == NULL) {
+      if (name == NULL) printf("No savepoint to roll back to.\n");
+      else printf("Unknown savepoint %s.\n", name);
+      return logZ;
+   }
+   freeKBSavepoints(kb, sp);
+   if (kb->edits == sp->edits && !isnan(sp->logZ)) return sp->logZ;
+   for (edit = kb->edits; edit != sp->edits; edit = edit->prev)
+      propagateKBChange(edit->node);
+   resetKBEditsTo(kb, sp->edits);
+   return computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, recompute);
+}
+
+/**
+ * Removes a savepoint and those nested inside it, keeping their edits.
+ *
+ * @param kb     TMLKB struct
+ * @param name   name of the savepoint, NULL for the innermost one
+ * @return 1 if the savepoint was released, 0 if there is no such savepoint
+ */
+int releaseKBSavepoint(TMLKB* kb, const char* name) {
+   KBSavepoint* sp = findKBSavepoint(kb, name);
+
+   if (sp == NULL) {
+      if (name == NULL) printf("No savepoint to release.\n");
+      else printf("Unknown savepoint %s.\n", name);
+      return 0;
+   }
+   freeKBSavepoints(kb, sp->prev);
+   return 1;
+}
+
+/* Whether two facts are the same, ignoring whitespace and closing parens */
+static int sameKBFact(const char* a, const char* b) {
+   while (1) {
+      while (isspace(*a) || *a == ')') a++;
+      while (isspace(*b) || *b == ')') b++;
+      if (*a != *b) return 0;
+      if (*a == '\0') return 1;
+      a++;
+      b++;
+   }
+}
+
+/* Whether an edit changes an object's class or name, rather than a count */
+static int isStructuralKBEdit(KBEdit* edit) {
+   if (edit->relStr != NULL) return edit->pol == -1;
+   return edit->relIdx == -1;
+}
+
+/* The edits of one fact added to the KB */
+typedef struct KBFactEdits {
+   KBEdit* top; // after removing expired facts, the top of the edit stack right after this fact
+   KBEdit* bottom;
+   int expired;
+} KBFactEdits;
+
+static int isExpiredKBFact(TMLKB* kb, KBEdit* top) {
+   return top->fact != NULL && top->expires != -1 && top->expires <= kb->now;
+}
+
+/* When a timed fact expires, in the index of expiry times */
+typedef struct KBExpiry {
+   double time;
+   size_t pos;
+   KBEdit* top; // the top and bottom edits of the fact
+   KBEdit* bottom;
+} KBExpiry;
+
+static int cmpExpiryPri(pqueue_pri_t next, pqueue_pri_t curr) {
+   return (next > curr);
+}
+
+static pqueue_pri_t getExpiryPri(void* a) {
+   return ((KBExpiry*)a)->time;
+}
+
+static void setExpiryPri(void* a, pqueue_pri_t pri) {
+   ((KBExpiry*)a)->time = pri;
+}
+
+static size_t getExpiryPos(void* a) {
+   return ((KBExpiry*)a)->pos;
+}
+
+static void setExpiryPos(void* a, size_t pos) {
+   ((KBExpiry*)a)->pos = pos;
+}
+
+/* Points an expiry at the edits of the fact just added on top of below */
+static void setKBExpiryEdits(TMLKB* kb, KBExpiry* expiry, KBEdit* below) {
+   KBEdit* bottom;
+
+   for (bottom = kb->edits; bottom->prev != below; bottom = bottom->prev);
+   expiry->top = kb->edits;
+   expiry->bottom = bottom;
+   kb->edits->expiry = expiry;
+}
+
+/* A node, or a pathname, in a KBObjectSet */
+typedef struct KBObjectKey {
+   const void* key;
+   UT_hash_handle hh;
+} KBObjectKey;
+
+/*
+ * The objects a set of edits is about. Whether another edit is about one
+ * of them, a part of one, or an object one of them is part of is then
+ * found from the pathname of its node, without going over the edits.
+ */
+typedef struct KBObjectSet {
+   KBObjectKey* nodes;
+   KBObjectKey* paths; // pathnames of the nodes
+   KBObjectKey* prefixes; // those pathnames, and those of the objects they are parts of
+} KBObjectSet;
+
+static void addKBObjectKey(KBObjectKey** keys, const char* path, size_t n) {
+   KBObjectKey* k;
+
+   HASH_FIND(hh, *keys, path, n, k);
+   if (k != NULL) return;
+   k = (KBObjectKey*)malloc(sizeof(KBObjectKey));
+   k->key = path;
+   HASH_ADD_KEYPTR(hh, *keys, path, n, k);
+}
+
+static void addToKBObjectSet(KBObjectSet* set, Node* node) {
+   const char* path = node->pathname;
+   KBObjectKey* k;
+   size_t n;
+
+   HASH_FIND_PTR(set->nodes, &node, k);
+   if (k != NULL) return;
+   k = (KBObjectKey*)malloc(sizeof(KBObjectKey));
+   k->key = node;
+   HASH_ADD_PTR(set->nodes, key, k);
+   if (path == NULL) return;
+   addKBObjectKey(&(set->paths), path, strlen(path));
+   for (n = 0; path[n] != '\0'; n++)
+      if (path[n] == '.') addKBObjectKey(&(set->prefixes), path, n);
+   addKBObjectKey(&(set->prefixes), path, n);
+}
+
+/* Whether node is in the set, is part of an object in it, or has a part in it */
+static int sharesKBObjectSet(KBObjectSet* set, Node* node) {
+   const char* path = node->pathname;
+   KBObjectKey* k;
+   size_t n;
+
+   HASH_FIND_PTR(set->nodes, &node, k);
+   if (k != NULL) return 1;
+   if (path == NULL) return 0;
+   HASH_FIND(hh, set->prefixes, path, strlen(path), k);
+   if (k != NULL) return 1;
+   for (n = 0; path[n] != '\0'; n++) {
+      if (path[n] != '.') continue;
+      HASH_FIND(hh, set->paths, path, n, k);
+      if (k != NULL) return 1;
+   }
+   return 0;
+}
+
+static void freeKBObjectKeys(KBObjectKey** keys) {
+   KBObjectKey* k;
+   KBObjectKey* tmp;
+
+   HASH_ITER(hh, *keys, k, tmp) {
+      HASH_DEL(*keys, k);
+      free(k);
+   }
+}
+
+static void freeKBObjectSet(KBObjectSet* set) {
+   freeKBObjectKeys(&(set->nodes));
+   freeKBObjectKeys(&(set->paths));
+   freeKBObjectKeys(&(set->prefixes));
+}
+
+/**
+ * Removes the expired facts from the KB, keeping the others. The facts
+ * that only changed counts, or that no later fact depends on, have their
+ * edits undone in place, and only the nodes those touched are recomputed.
+ * If a later fact is about an object an expired fact changed the class or
+ * name of, or pruned a subclass branch of an object the expired fact is
+ * about, the KB is undone to just below the lowest such expired fact and
+ * the facts above it that are not expired are added again. Savepoints
+ * above an expired fact are moved to the matching edits, and their log Z
+ * is recomputed if rolled back to.
+ *
+ * The top edit of each expired fact points to its KBExpiry, which is no
+ * longer in kb->expiries. Only the edits from the top of the stack down to
+ * the lowest expired fact are looked at, once each.
+ *
+ * @param kb         TMLKB struct
+ * @param nexpired   number of expired facts
+ * @param logZ       current log of Z
+ * @return the updated log of Z
+ */
+static float removeExpiredKBFacts(TMLKB* kb, int nexpired, float logZ) {
+   KBFactEdits* facts;
+   KBFactEdits* f;
+   KBFactEdits tmpf;
+   KBObjectSet later = { NULL, NULL, NULL };
+   KBObjectSet laterPrunes = { NULL, NULL, NULL };
+   KBEdit* edit;
+   KBEdit* upper;
+   KBEdit* below;
+   KBEdit* floor;
+   KBSavepoint* sp;
+   char** replayed = NULL;
+   long* replayedExpires = NULL;
+   KBExpiry** replayedExpiry = NULL;
+   int* replayedIdx = NULL;
+   int* spPos;
+   int cap = 16;
+   int nfacts = 0;
+   int nfound = 0;
+   int nreplayed = 0;
+   int nsps = 0;
+   int newFact = 1;
+   int replayFrom = -1;
+   int deferLogZ;
+   int i, j;
+
+   releaseQueryBlocking(kb);
+   for (sp = kb->savepoints; sp != NULL; sp = sp->prev) nsps++;
+   spPos = (int*)malloc(sizeof(int)*(nsps+1));
+   for (j = 0; j < nsps; j++)
+      spPos[j] = -1;
+
+   // Split the edits into facts, from the top of the stack down to the
+   // lowest expired fact. On the way down, savepoints are found, and each
+   // expired fact is checked against the objects of the facts above it.
+   facts = (KBFactEdits*)malloc(sizeof(KBFactEdits)*cap);
+   sp = kb->savepoints;
+   j = 0;
+   for (edit = kb->edits; edit != NULL && (nfound < nexpired || !newFact); edit = edit->prev) {
+      if (newFact) {
+         if (nfacts == cap) {
+            cap *= 2;
+            facts = (KBFactEdits*)realloc(facts, sizeof(KBFactEdits)*cap);
+         }
+         facts[nfacts].top = edit;
+         facts[nfacts].expired = isExpiredKBFact(kb, edit);
+         nfound += facts[nfacts++].expired;
+      }
+      f = &(facts[nfacts-1]);
+      // positions counted from the top until the facts are put in order
+      for (; sp != NULL && sp->edits == edit; sp = sp->prev)
+         spPos[j++] = (edit == f->top) ? nfacts-1 : nfacts;
+      if (!f->expired) {
+         addToKBObjectSet(&later, edit->node);
+         if (edit->pol == PRUNE) addToKBObjectSet(&laterPrunes, edit->node);
+      } else if ((isStructuralKBEdit(edit) && sharesKBObjectSet(&later, edit->node)) || sharesKBObjectSet(&laterPrunes, edit->node)) {
+         replayFrom = nfacts-1;
+      }
+      if (f->expired)
+         newFact = (edit == f->top->expiry->bottom);
+      else
+         newFact = (edit->prev == NULL || edit->prev->fact != NULL);
+      if (newFact) f->bottom = edit;
+   }
+   freeKBObjectSet(&later);
+   freeKBObjectSet(&laterPrunes);
+   if (nfacts == 0) {
+      free(spPos);
+      free(facts);
+      return logZ;
+   }
+   floor = facts[nfacts-1].bottom->prev;
+
+   // Put the facts in order, oldest first
+   for (i = 0; i < nfacts/2; i++) {
+      tmpf = facts[i];
+      facts[i] = facts[nfacts-1-i];
+      facts[nfacts-1-i] = tmpf;
+   }
+   replayFrom = (replayFrom == -1) ? nfacts : nfacts-1-replayFrom;
+   // Index of the fact each savepoint was set after, -1 if before them all
+   for (j = 0; j < nsps; j++)
+      if (spPos[j] != -1) spPos[j] = nfacts-1-spPos[j];
+   for (i = 0; i < nfacts; i++) {
+      if (!facts[i].expired) continue;
+      free(facts[i].top->expiry);
+      facts[i].top->expiry = NULL;
+   }
+
+   updateKBEpoch(kb);
+   if (replayFrom < nfacts) {
+      // Take the facts to add again, oldest first
+      replayed = (char**)malloc(sizeof(char*)*(nfacts-replayFrom));
+      replayedExpires = (long*)malloc(sizeof(long)*(nfacts-replayFrom));
+      replayedExpiry = (KBExpiry**)malloc(sizeof(KBExpiry*)*(nfacts-replayFrom));
+      replayedIdx = (int*)malloc(sizeof(int)*(nfacts-replayFrom));
+      for (i = replayFrom; i < nfacts; i++) {
+         if (facts[i].expired || facts[i].top->fact == NULL) continue;
+         replayed[nreplayed] = facts[i].top->fact;
+         replayedExpires[nreplayed] = facts[i].top->expires;
+         replayedExpiry[nreplayed] = facts[i].top->expiry;
+         replayedIdx[nreplayed++] = i;
+         facts[i].top->fact = NULL;
+         facts[i].top->expiry = NULL;
+      }
+      below = facts[replayFrom].bottom->prev;
+      for (edit = kb->edits; edit != below; edit = edit->prev)
+         propagateKBChange(edit->node);
+      resetKBEditsTo(kb, below);
+      for (i = replayFrom; i < nfacts; i++)
+         facts[i].top = NULL;
+   }
+   upper = NULL;
+   for (i = replayFrom-1; i >= 0; i--) {
+      if (!facts[i].expired) {
+         upper = facts[i].bottom;
+         continue;
+      }
+      below = facts[i].bottom->prev;
+      for (edit = facts[i].top; edit != below; edit = edit->prev) {
+         propagateKBChange(edit->node);
+         markKBEditEpoch(kb, edit);
+      }
+      if (upper == NULL) kb->edits = below;
+      else upper->prev = below;
+      facts[i].bottom->prev = NULL;
+      countKBEdits(kb, facts[i].top, NULL, -1.0);
+      resetKBEdits(kb, facts[i].top);
+      facts[i].top = NULL;
+   }
+   kb->epochEdits = kb->edits;
+   if (kb->onlineDirty != NULL) kb->countedEdits = kb->edits;
+   if (replayFrom < nfacts) {
+      below = kb->edits;
+      deferLogZ = kb->deferLogZ;
+      kb->deferLogZ = 1;
+      for (j = 0; j < nreplayed; j++) {
+         edit = kb->edits;
+         computeQueryOrAddEvidenceToFile(kb, replayed[j], logZ, 0, NULL);
+         if (kb->edits != edit) {
+            kb->edits->expires = replayedExpires[j];
+            if (replayedExpiry[j] != NULL) setKBExpiryEdits(kb, replayedExpiry[j], edit);
+         } else if (replayedExpiry[j] != NULL) {
+            pqueue_remove(kb->expiries, replayedExpiry[j]);
+            free(replayedExpiry[j]);
+         }
+         facts[replayedIdx[j]].top = kb->edits;
+         free(replayed[j]);
+      }
+      kb->deferLogZ = deferLogZ;
+      for (edit = kb->edits; edit != below; edit = edit->prev)
+         propagateKBChange(edit->node);
+      free(replayed);
+      free(replayedExpires);
+      free(replayedExpiry);
+      free(replayedIdx);
+   }
+
+   for (sp = kb->savepoints, j = 0; sp != NULL; sp = sp->prev, j++) {
+      for (i = spPos[j]; i >= 0 && facts[i].top != NULL; i--);
+      if (i < 0) continue; // no fact below the savepoint was removed
+      for (i = spPos[j]; i >= 0 && facts[i].top == NULL; i--);
+      sp->edits = (i < 0) ? floor : facts[i].top;
+      sp->logZ = NAN;
+   }
+   free(spPos);
+   free(facts);
+   return computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1 : 0);
+}
+
+/**
+ * Retracts one fact added to the KB, wherever it is on the edit stack,
+ * keeping the facts added after it (see removeExpiredKBFacts).
+ *
+ * @param kb     TMLKB struct
+ * @param fact   the fact, as it was added
+ * @param logZ   current log of Z
+ * @return the updated log of Z, or logZ if the fact was not found
+ */
+float retractKBFact(TMLKB* kb, const char* fact, float logZ) {
+   KBEdit* top;
+   KBEdit* bottom;
+
+   if (kb->snapshotOf != NULL) {
+      printf("Facts cannot be retracted from a KB snapshot.\n");
+      return logZ;
+   }
+   for (top = kb->edits; top != NULL; top = top->prev)
+      if (top->fact != NULL && sameKBFact(top->fact, fact)) break;
+   if (top == NULL) {
+      printf("No fact %s%s to retract.\n", fact, (strchr(fact, ')') == NULL) ? ")" : "");
+      return logZ;
+   }
+   // The fact expires now, whether or not it was timed
+   if (top->expiry != NULL) {
+      pqueue_remove(kb->expiries, top->expiry);
+   } else {
+      for (bottom = top; bottom->prev != NULL && bottom->prev->fact == NULL; bottom = bottom->prev);
+      top->expiry = (KBExpiry*)malloc(sizeof(KBExpiry));
+      top->expiry->top = top;
+      top->expiry->bottom = bottom;
+   }
+   top->expires = kb->now;
+   return removeExpiredKBFacts(kb, 1, logZ);
+}
+
+/**
+ * Empties the index of when timed facts expire.
+ */
+void freeKBExpiries(TMLKB* kb) {
+   KBExpiry* expiry;
+
+   if (kb->expiries == NULL) return;
+   while ((expiry = (KBExpiry*)pqueue_pop(kb->expiries)) != NULL) {
+      expiry->top->expiry = NULL;
+      free(expiry);
+   }
+}
+
+/**
+ * Moves the KB's clock forward, removing the facts that expire by then.
+ * Expiry times are kept in a heap, so nothing is done until the earliest
+ * one is reached, and the facts expiring together are removed in one pass.
+ *
+ * @param kb     TMLKB struct
+ * @param now    new time, not before the current one
+ * @param logZ   current log of Z
+ * @return the updated log of Z
+ */
+float advanceKBClock(TMLKB* kb, long now, float logZ) {
+   KBExpiry* expiry;
+   int nexpired = 0;
+
+   if (now < kb->now) {
+      printf("Time %ld is before the current time %ld.\n", now, kb->now);
+      return logZ;
+   }
+   kb->now = now;
+   if (kb->expiries == NULL) return logZ;
+   while ((expiry = (KBExpiry*)pqueue_peek(kb->expiries)) != NULL && expiry->time <= now) {
+      pqueue_pop(kb->expiries);
+      nexpired++;
+   }
+   if (nexpired == 0) return logZ;
+   return removeExpiredKBFacts(kb, nexpired, logZ);
+}
+
+/**
+ * Adds a fact that holds from a time on, for a while. The clock is moved
+ * forward to that time first.
+ *
+ * @param kb     TMLKB struct
+ * @param fact   the fact
+ * @param time   when the fact starts to hold, -1 for now
+ * @param ttl    how long the fact holds, -1 for the KB's window (the fact
+ *               holds forever if that is 0)
+ * @param logZ   current log of Z
+ * @return the updated log of Z
+ */
+float addTimedKBFact(TMLKB* kb, char* fact, long time, long ttl, float logZ) {
+   KBEdit* edits;
+   KBExpiry* expiry;
+
+   if (kb->snapshotOf != NULL) {
+      printf("Evidence cannot be added to a KB snapshot.\n");
+      return logZ;
+   }
+   if (time == -1) time = kb->now;
+   if (time < kb->now) {
+      printf("Time %ld is before the current time %ld.\n", time, kb->now);
+      return logZ;
+   }
+   logZ = advanceKBClock(kb, time, logZ);
+   if (ttl == -1) ttl = kb->window;
+   edits = kb->edits;
+   logZ = computeQueryOrAddEvidenceToFile(kb, fact, logZ, 0, NULL);
+   if (ttl <= 0 || kb->edits == edits) return logZ;
+   kb->edits->expires = time + ttl;
+   if (kb->expiries == NULL)
+      kb->expiries = pqueue_init(64, cmpExpiryPri, getExpiryPri, setExpiryPri, getExpiryPos, setExpiryPos);
+   expiry = (KBExpiry*)malloc(sizeof(KBExpiry));
+   expiry->time = (double)kb->edits->expires;
+   setKBExpiryEdits(kb, expiry, edits);
+   pqueue_insert(kb->expiries, expiry);
+   return logZ;
+}
+
+Node* findNodeForClass(Node* node, TMLClass* cl, const char* objName, const char* clName, FILE* outFile) {
+   int i, c;
+   Node* parNode;
+
+   if (cl->par == node->cl) {
+      if (node->assignedSubcl != -1) {
+         if (node->cl->subcl[node->assignedSubcl] == cl) {
+            if (node->subclMask != NULL) {
+               return &(node->subcl[node->assignedSubcl]);
+            } else {
+               return node->subcl;
+            }
+         } else {
+            printf("P[Is(%s,%s)] = 0.0  Object defined to be of a contradictory class.\n", objName, clName);
+            if (outFile != NULL) fprintf(outFile, "P[Is(%s,%s)] = 0.0\n", objName, clName);
+            return NULL;
+         }
+      }
+      for (c = 0; c < node->cl->nsubcls; c++) {
+         if (node->cl->subcl[c] == cl) {
+            if (node->subclMask != NULL && node->subclMask[c] != 1) {
+               printf("P[Is(%s,%s)] = 0.0  Object defined to be not of class %s.\n", objName, clName, clName);
+               if (outFile != NULL) fprintf(outFile, "P[Is(%s,%s)] = 0.0\n", objName, clName);
+               return NULL;
+            }
+            node->assignedSubcl = c;
+            if (node->subclMask == NULL && node->cl->nsubcls != 0) {
+               node->subclMask = (int*)malloc(sizeof(int)*node->cl->nsubcls);
+               for (i = 0; i < node->cl->nsubcls; i++) {
+                  node->subclMask[i] = 1;
+               }
+            }
+            return &(node->subcl[c]);
+         }
+      }
+   }
+   if (cl->par != NULL) {
+      parNode = findNodeForClass(node, cl->par, objName, clName, outFile);
+      if (parNode != NULL) {
+         if (parNode->assignedSubcl != -1) {
+            if (parNode->cl->subcl[parNode->assignedSubcl] == cl) {
+               return parNode->subcl;
+            }
+            printf("P[Is(%s,%s)] = 0.0  Object defined to be of a contradictory class.\n", objName, clName);
+            if (outFile != NULL) fprintf(outFile, "P[Is(%s,%s)] = 0.0\n", objName, clName);
+            return NULL;
+         }
+         for (c = 0; c < parNode->cl->nsubcls; c++) {
+            if (parNode->cl->subcl[c] == cl) {
+               if (parNode->subclMask != NULL && parNode->subclMask[c] != 1) {
                   printf("P[Is(%s,%s)] = 0.0  Object defined to be not of class %s.\n", objName, clName, clName);
                if (outFile != NULL) fprintf(outFile, "P[Is(%s,%s)] = 0.0\n", objName, clName);
                   return NULL;
@@ -6022,14 +7442,54 @@ Node* findNodeForClass(Node* node, TMLClass* cl, const char* objName, const char
    return NULL;
 }
 
+/**
+ * Computes the probability of a class query once findNodeForClass has
+ * assigned the subclasses from prevFinest down to the queried class, and
+ * undoes those assignments.
+ *
+ * @param obj        object the query is about
+ * @param prevFinest finest node of the object's class evidence
+ * @param node       node of the object for the queried class
+ * @param cl         queried class
+ * @param logZ       current log of Z
+ * @return the probability that obj is of class cl
+ */
+static double computeClassQueryProb(TMLKB* kb, Node* obj, Node* prevFinest, Node* node, TMLClass* cl, float logZ) {
+   KBEdit* edits = NULL;
+   Node* par;
+   float newLogZ;
+   int subcl;
+
+   par = obj;
+   while (par->cl->par != NULL) par = *(par->par);
+   if (par->npars != 0) {
+      par = *(par->par);
+      blockClassesForPartQuery(&edits, par, obj, cl);
+   }
+
+   propagateKBChange(node);
+   newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1: 0);
+   propagateKBChange(node);
+
+   while (prevFinest->assignedSubcl != -1) {
+      subcl = prevFinest->assignedSubcl;
+      prevFinest->assignedSubcl = -1;
+      prevFinest = &(prevFinest->subcl[subcl]);
+   }
+   resetKBEdits(kb, edits);
+   return exp(newLogZ - logZ);
+}
+
 void computeClassQueryForObject(TMLKB* kb, const char* objName, Node* obj, const char* clName, TMLClass* cl, float logZ, FILE* outFile) {
    Node* node;
    Node* prevFinest;
    int subcl;
-   float newLogZ;
-   KBEdit* edits = NULL;
-   Node* par;
+   double prob;
+   char* cacheKey;
+   double cachedProb;
+   int local;
 
+   releaseQueryBlocking(kb);
    prevFinest = obj;
    if (cl->level == obj->cl->level) {
       if (cl == obj->cl) {
@@ -6074,81 +7534,455 @@ void computeClassQueryForObject(TMLKB* kb, const char* objName, Node* obj, const
       return;
    }
 
+   local = prepareLocalClassQuery(kb, obj, prevFinest, cl);
    node = findNodeForClass(prevFinest, cl, objName, clName, outFile);
    if (node == NULL) return;
-   par = obj;
-   while (par->cl->par != NULL) par = *(par->par);
-   if (par->npars != 0) {
-      par = *(par->par);
-      blockClassesForPartQuery(&edits, par, obj, cl);
+   cacheKey = (char*)malloc(sizeof(char)*(strlen(objName)+strlen(clName)+8));
+   sprintf(cacheKey, "Is(%s,%s)", objName, clName);
+   if (lookupQueryCache(kb, cacheKey, &cachedProb) == 1) {
+      printf("P[Is(%s,%s)] = %f\n", objName, clName, cachedProb);
+      if (outFile != NULL)
+         fprintf(outFile, "P[Is(%s,%s)] = %f\n", objName, clName, cachedProb);
+      free(cacheKey);
+      while (prevFinest->assignedSubcl != -1) {
+         subcl = prevFinest->assignedSubcl;
+         prevFinest->assignedSubcl = -1;
+         prevFinest = &(prevFinest->subcl[subcl]);
+      }
+      return;
    }
-
-   propagateKBChange(node);
-   newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1: 0);
-   printf("P[Is(%s,%s)] = %f\n", objName, clName, exp(newLogZ - logZ));
+   prob = (local == 1) ? localClassQueryProb(prevFinest, node) : NAN;
+   if (isnan(prob))
+      prob = computeClassQueryProb(kb, obj, prevFinest, node, cl, logZ);
+   storeQueryCache(kb, cacheKey, obj, prob);
+   free(cacheKey);
+   printf("P[Is(%s,%s)] = %f\n", objName, clName, prob);
    if (outFile != NULL)
-      fprintf(outFile, "P[Is(%s,%s)] = %f\n", objName, clName, exp(newLogZ - logZ));
-   propagateKBChange(node);
-
-   while (prevFinest->assignedSubcl != -1) {
-      subcl = prevFinest->assignedSubcl;
-      prevFinest->assignedSubcl = -1;
-      prevFinest = &(prevFinest->subcl[subcl]);
-   }
-   resetKBEdits(kb, edits);
+      fprintf(outFile, "P[Is(%s,%s)] = %f\n", objName, clName, prob);
 }
 
-float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery, const char* output) {
-   FILE* outFile = NULL;
-   char is_fmt_str[50];
-   char has_fmt_str[60];
-   char rel_fmt_str[30];
-   char attr_fmt_str[30];
-   char attrrel_fmt_str[50];
-   char excl[2];
-   int correctScan;
-   int pol;
-   char* iter;
-   QNode* qnode;
-   QNode* classToObjPtrsList;
-   char* best;
+/* Object scored by a ranking query. The best k are kept in a bounded
+ * heap whose top is the worst of them.
+ */
+typedef struct RankedObject {
+   Node* node;
+   int order; // position among the candidates
+   double prob;
+   size_t pos;
+} RankedObject;
 
-   char clName[MAX_NAME_LENGTH+1];
-   TMLClass* cl;
-   char objName[MAX_NAME_LENGTH+1];
-   Node* obj;
-   Node* newnode;
+static int cmpRankedPri(pqueue_pri_t next, pqueue_pri_t curr) {
+   return (next > curr);
+}
 
-   char subObjName[MAX_NAME_LENGTH+1];
-   char subpartRelName[MAX_NAME_LENGTH+1];
-   Node* subObj;
-   int p;
-   Node* par;
-   char* bestParName;
-   char* partName;
-   int i, n;
-   TMLPart* part;
-   int maxParts;
+static pqueue_pri_t getRankedPri(void* a) {
+   return ((RankedObject*)a)->prob;
+}
 
-   char relationName[MAX_NAME_LENGTH+1];
-   char valName[MAX_NAME_LENGTH+1];
-   TMLAttribute* attr;
-   TMLAttrValue* attrval;
-   float newLogZ;
-   TMLClass* tmpcl;
-   QNode* list;
-   Node* tmp;
-   KBEdit* tmpedits = NULL;
-   KBEdit* edit;
-   KBEdit* deledit;
+static void setRankedPri(void* a, pqueue_pri_t pri) {
+   ((RankedObject*)a)->prob = pri;
+}
 
-   if (output != NULL) {
-      outFile = fopen(output, "w");
-      if (outFile == NULL) {
-         printf("Error opening %s\n", output);
-         return logZ;
+static size_t getRankedPos(void* a) {
+   return ((RankedObject*)a)->pos;
+}
+
+static void setRankedPos(void* a, size_t pos) {
+   ((RankedObject*)a)->pos = pos;
+}
+
+static int compareRankedObjects(const void* a, const void* b) {
+   const RankedObject* ra = *(const RankedObject**)a;
+   const RankedObject* rb = *(const RankedObject**)b;
+
+   if (ra->prob != rb->prob) return (ra->prob < rb->prob) ? 1 : -1;
+   return ra->order - rb->order;
+}
+
+/**
+ * Offers an object to the best k of a ranking query.
+ *
+ * @param heap    bounded heap of the best objects so far
+ * @param ranked  array of k entries backing the heap
+ * @param k       number of objects to keep
+ */
+static void offerRankedObject(pqueue_t* heap, RankedObject* ranked, int k, Node* node, int order, double prob) {
+   RankedObject* worst;
+
+   if (pqueue_size(heap) < (size_t)k) {
+      worst = &(ranked[pqueue_size(heap)]);
+      worst->node = node;
+      worst->order = order;
+      worst->prob = prob;
+      pqueue_insert(heap, worst);
+      return;
+   }
+   worst = (RankedObject*)pqueue_peek(heap);
+   if (prob <= worst->prob) return;
+   worst->node = node;
+   worst->order = order;
+   pqueue_change_priority(heap, prob, worst);
+}
+
+/**
+ * Decides a class query from the class evidence of an object alone.
+ * Follows the same checks as computeClassQueryForObject and
+ * findNodeForClass.
+ *
+ * @return 1 if the object is defined to be of the class, 0 if it cannot
+ *         be, -1 if its probability has to be computed
+ */
+static int decideClassQueryForObject(Node* obj, TMLClass* cl) {
+   Node* node = obj;
+   TMLClass* c;
+
+   while (TRUE) {
+      if (cl->level == node->cl->level) return (cl == node->cl);
+      if (node->assignedSubcl == -1) break;
+      if (node->subclMask != NULL)
+         node = &(node->subcl[node->assignedSubcl]);
+      else
+         node = node->subcl;
+   }
+   while (node->cl != cl) {
+      for (c = cl; c->par != NULL && c->par != node->cl; c = c->par);
+      if (c->par == NULL) return 0;
+      if (node->assignedSubcl != -1 && node->assignedSubcl != c->subclIdx) return 0;
+      if (node->subclMask != NULL && node->subclMask[c->subclIdx] != 1) return 0;
+      if (node->assignedSubcl != -1 && node->subclMask == NULL)
+         node = node->subcl;
+      else
+         node = &(node->subcl[c->subclIdx]);
+   }
+   return -1;
+}
+
+/**
+ * Finds the node of an object that defines a relation, looking down its
+ * assigned subclasses as computeRelationQueryOrAddEvidenceForObj does.
+ *
+ * @param node   returns the finest assigned subclass node of the object
+ * @return the node defining the relation, NULL if none does
+ */
+static Node* findRelationNodeForObject(Node* obj, const char* relName, Node** node) {
+   Node* relNode = (getRelation(obj->cl, relName) != NULL) ? obj : NULL;
+
+   *node = obj;
+   while ((*node)->assignedSubcl != -1) {
+      if ((*node)->subclMask == NULL)
+         *node = (*node)->subcl;
+      else
+         *node = &((*node)->subcl[(*node)->assignedSubcl]);
+      if (getRelation((*node)->cl, relName) != NULL) relNode = *node;
+   }
+   return relNode;
+}
+
+/**
+ * Decides a relation query over an object alone from the relation facts
+ * known for the object.
+ *
+ * @return 1 if the fact is known, 0 if its negation is, -1 if neither
+ */
+static int decideRelationQueryForObject(TMLKB* kb, Node* obj, const char* normalizedRelStr, int pol) {
+   ObjRelStrsHash* objRelHash;
+   RelationStr_Hash* relStrHash;
+
+   HASH_FIND_STR(kb->objToRelFactStrs, obj->pathname, objRelHash);
+   if (objRelHash == NULL) return -1;
+   HASH_FIND_STR(objRelHash->hash, normalizedRelStr, relStrHash);
+   if (relStrHash == NULL) return -1;
+   return (relStrHash->pol == pol);
+}
+
+/**
+ * Computes the probability of a relation over an object alone, blocking
+ * the object's superparts the same way as a relation query. This takes
+ * an upward pass with the relation's fact added, and another for the
+ * blocked KB without it, unless the blocking left every class open, in
+ * which case its log Z is logZ. A ranking query evaluates its undecided
+ * objects one at a time this way, with no shared pass over all of them.
+ *
+ * @param obj    object the query is about
+ * @param node   finest assigned subclass node of the object
+ * @return the probability, NAN if the blocked KB is impossible
+ */
+static double computeRelationQueryProb(TMLKB* kb, Node* obj, Node* node, char* relName, int pol, float logZ) {
+   KBEdit* queryEdits = NULL;
+   float blockedLogZ;
+   float newLogZ;
+   int i;
+
+   releaseQueryBlocking(kb);
+   for (i = 0; i < obj->npars; i++)
+      blockClassesForPartQuery(&queryEdits, obj->par[i], obj, NULL);
+   propagateKBChange(node);
+   if (queryEdits == NULL) blockedLogZ = logZ;
+   else blockedLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 1);
+   addRelationToKB(NULL, obj, relName, pol);
+   propagateKBChange(obj);
+   newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 1);
+   removeRelationToKB(obj, relName, pol);
+   resetKBEdits(kb, queryEdits);
+   propagateKBChange(obj);
+   if (isnan(blockedLogZ) || isinf(blockedLogZ)) return NAN;
+   return exp(newLogZ - blockedLogZ);
+}
+
+/**
+ * Answers a ranking query such as top 100 Is(*,Democrat) or top 10
+ * Crime(*): the k objects most likely to make the query true, best
+ * first. The candidates are the objects of the class the query is
+ * about. Objects whose evidence already decides the query are scored
+ * first, without evaluating the SPN, and the rest are only evaluated
+ * while fewer than k objects are known to make the query true.
+ *
+ * @param kb     TMLKB struct
+ * @param k      number of objects to return
+ * @param query  the query, with * in place of the object
+ * @param logZ   current log of Z
+ * @param outFile  file to also print the results to, or NULL
+ */
+void computeTopKQuery(TMLKB* kb, int k, char* query, float logZ, FILE* outFile) {
+   char is_fmt_str[50];
+   char attrrel_fmt_str[50];
+   char objName[MAX_NAME_LENGTH+1];
+   char clName[MAX_NAME_LENGTH+1];
+   char relationName[MAX_NAME_LENGTH+1];
+   char excl[2];
+   char* iter = query;
+   char* cacheKey;
+   char* best;
+   char* name;
+   int correctScan;
+   int pol = 1;
+   TMLClass* cl = NULL;
+   TMLClass* rootcl;
+   Node* obj;
+   Node* node;
+   Node* prevFinest;
+   QNode* qnode;
+   Node** undecided;
+   int* undecidedOrder;
+   int nundecided = 0;
+   char* normalizedRelStr = NULL;
+   pqueue_t* heap;
+   RankedObject* ranked;
+   RankedObject** results;
+   double prob;
+   int ncandidates = 0;
+   int decision;
+   int c, i, n;
+
+   snprintf(is_fmt_str, 50, " Is ( %%%d[^, \t\r\n\v\f] , %%%d[^, \t\r\n\v\f] %%1s", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
+   snprintf(attrrel_fmt_str, 50, "%%%d[^( \t\r\n\v\f] ( %%%d[^, \t\r\n\v\f)] %%1s ", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
+
+   if (k < 1) {
+      printf("The number of objects to rank must be positive.\n");
+      if (outFile != NULL)
+         fprintf(outFile, "The number of objects to rank must be positive.\n");
+      return;
+   }
+   if (sscanf(iter, "%1s", excl) == 1 && excl[0] == '!') {
+      pol = 0;
+      iter = strchr(iter, '!')+1;
+   }
+   correctScan = sscanf(iter, is_fmt_str, objName, clName, excl);
+   if (correctScan == 2) {
+      HASH_FIND_STR(kb->classNameToPtr, clName, cl);
+      if (cl == NULL) {
+         printf("Unknown class %s.\n", clName);
+         if (outFile != NULL)
+            fprintf(outFile, "Unknown class %s.\n", clName);
+         return;
+      }
+   } else {
+      correctScan = sscanf(iter, attrrel_fmt_str, relationName, objName, excl);
+      if (correctScan == 3 && excl[0] == ')') correctScan = 2;
+      if (correctScan == 2 && strcmp(relationName, "Has") == 0) correctScan = 0;
+   }
+   if (correctScan != 2 || strcmp(objName, "*") != 0) {
+      printf("Ranking queries must be of the form top <k> Is(*,<Class>)? or top <k> <Relation>(*)?\n");
+      if (outFile != NULL)
+         fprintf(outFile, "Ranking queries must be of the form top <k> Is(*,<Class>)? or top <k> <Relation>(*)?\n");
+      return;
+   }
+
+   rootcl = (cl == NULL) ? NULL : rootClass(cl);
+   if (cl == NULL)
+      normalizedRelStr = createNormalizedRelStr(kb, relationName, NULL, NULL, 0, 0, 0);
+   n = 0;
+   for (c = 0; c < kb->numClasses; c++) {
+      if (kb->classes[c].par != NULL) continue;
+      if (rootcl != NULL && &(kb->classes[c]) != rootcl) continue;
+      for (qnode = kb->classToObjPtrs[kb->classes[c].id]; qnode != NULL; qnode = qnode->next)
+         n++;
+   }
+   ranked = (RankedObject*)malloc(sizeof(RankedObject)*k);
+   heap = pqueue_init(k, cmpRankedPri, getRankedPri, setRankedPri, getRankedPos, setRankedPos);
+   undecided = (Node**)malloc(sizeof(Node*)*(n+1));
+   undecidedOrder = (int*)malloc(sizeof(int)*(n+1));
+
+   // Score the objects the evidence decides, and set the others aside
+   for (c = 0; c < kb->numClasses; c++) {
+      if (kb->classes[c].par != NULL) continue;
+      if (rootcl != NULL && &(kb->classes[c]) != rootcl) continue;
+      for (qnode = kb->classToObjPtrs[kb->classes[c].id]; qnode != NULL; qnode = qnode->next) {
+         obj = (Node*)(qnode->ptr);
+         if (obj->pathname == NULL) continue;
+         if (cl != NULL) {
+            decision = decideClassQueryForObject(obj, cl);
+            if (decision != -1 && pol == 0) decision = 1-decision;
+         } else {
+            if (findRelationNodeForObject(obj, relationName, &node) == NULL) continue;
+            decision = decideRelationQueryForObject(kb, obj, normalizedRelStr, pol);
+         }
+         if (decision == -1) {
+            undecided[nundecided] = obj;
+            undecidedOrder[nundecided++] = ncandidates;
+         } else {
+            offerRankedObject(heap, ranked, k, obj, ncandidates, decision);
+         }
+         ncandidates++;
+      }
+   }
+
+   // No probability exceeds 1, so once k objects are known to make the
+   // query true the remaining ones need not be evaluated
+   for (i = 0; i < nundecided; i++) {
+      if (pqueue_size(heap) == (size_t)k && ((RankedObject*)pqueue_peek(heap))->prob >= 1.0) break;
+      obj = undecided[i];
+      best = NULL;
+      if (obj->name != NULL) {
+         name = obj->name;
+      } else {
+         best = createBestPathname(kb, obj);
+         name = best;
+      }
+      if (cl != NULL) {
+         cacheKey = (char*)malloc(sizeof(char)*(strlen(name)+strlen(cl->name)+8));
+         sprintf(cacheKey, "Is(%s,%s)", name, cl->name);
+      } else {
+         cacheKey = (char*)malloc(sizeof(char)*(strlen(relationName)+strlen(name)+16));
+         sprintf(cacheKey, "%d %s(%s)", pol, relationName, name);
+      }
+      if (lookupQueryCache(kb, cacheKey, &prob) != 1) {
+         if (cl != NULL) {
+            releaseQueryBlocking(kb);
+            prevFinest = obj;
+            while (prevFinest->assignedSubcl != -1) {
+               if (prevFinest->subclMask != NULL)
+                  prevFinest = &(prevFinest->subcl[prevFinest->assignedSubcl]);
+               else
+                  prevFinest = prevFinest->subcl;
+            }
+            node = findNodeForClass(prevFinest, cl, name, cl->name, NULL);
+            if (node == NULL) prob = 0.0;
+            else prob = computeClassQueryProb(kb, obj, prevFinest, node, cl, logZ);
+         } else {
+            findRelationNodeForObject(obj, relationName, &node);
+            prob = computeRelationQueryProb(kb, obj, node, relationName, pol, logZ);
+         }
+         if (!isnan(prob)) storeQueryCache(kb, cacheKey, obj, prob);
+      }
+      if (cl != NULL && pol == 0) prob = 1.0-prob;
+      if (!isnan(prob)) offerRankedObject(heap, ranked, k, obj, undecidedOrder[i], prob);
+      free(cacheKey);
+      if (best != NULL) free(best);
+   }
+   free(undecided);
+   free(undecidedOrder);
+   if (normalizedRelStr != NULL) free(normalizedRelStr);
+
+   n = pqueue_size(heap);
+   if (ncandidates == 0) {
+      if (cl != NULL) {
+         printf("No objects can be of class %s.\n", cl->name);
+         if (outFile != NULL)
+            fprintf(outFile, "No objects can be of class %s.\n", cl->name);
+      } else {
+         printf("Relation %s not defined for any object.\n", relationName);
+         if (outFile != NULL)
+            fprintf(outFile, "Relation %s not defined for any object.\n", relationName);
+      }
+   }
+   results = (RankedObject**)malloc(sizeof(RankedObject*)*(n+1));
+   for (i = 0; i < n; i++)
+      results[i] = (RankedObject*)pqueue_pop(heap);
+   qsort(results, n, sizeof(RankedObject*), compareRankedObjects);
+   for (i = 0; i < n; i++) {
+      obj = results[i]->node;
+      best = NULL;
+      if (obj->name != NULL) {
+         name = obj->name;
+      } else {
+         best = createBestPathname(kb, obj);
+         name = best;
+      }
+      if (cl != NULL) {
+         printf("P[%sIs(%s,%s)] = %f\n", (pol == 0) ? "!" : "", name, cl->name, results[i]->prob);
+         if (outFile != NULL)
+            fprintf(outFile, "P[%sIs(%s,%s)] = %f\n", (pol == 0) ? "!" : "", name, cl->name, results[i]->prob);
+      } else {
+         printf("P[%s%s(%s)] = %f\n", (pol == 0) ? "!" : "", relationName, name, results[i]->prob);
+         if (outFile != NULL)
+            fprintf(outFile, "P[%s%s(%s)] = %f\n", (pol == 0) ? "!" : "", relationName, name, results[i]->prob);
       }
+      if (best != NULL) free(best);
+   }
+   free(results);
+   pqueue_free(heap);
+   free(ranked);
+}
+
+static float answerQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery, FILE* outFile) {
+   char is_fmt_str[50];
+   char has_fmt_str[60];
+   char rel_fmt_str[30];
+   char attr_fmt_str[30];
+   char attrrel_fmt_str[50];
+   char excl[2];
+   int correctScan;
+   int pol;
+   char* iter;
+   QNode* qnode;
+   char* best;
+
+   char clName[MAX_NAME_LENGTH+1];
+   TMLClass* cl;
+   char objName[MAX_NAME_LENGTH+1];
+   Node* obj;
+   Node* newnode;
+
+   char subObjName[MAX_NAME_LENGTH+1];
+   char subpartRelName[MAX_NAME_LENGTH+1];
+   Node* subObj;
+   int p;
+   Node* par;
+   char* bestParName;
+   char* partName;
+   int i, n, k;
+   TMLPart* part;
+   PartSlot* slot;
+   int maxParts;
+
+   char relationName[MAX_NAME_LENGTH+1];
+   char valName[MAX_NAME_LENGTH+1];
+   TMLAttribute* attr;
+   TMLAttrValue* attrval;
+   float newLogZ;
+   TMLClass* tmpcl;
+   QNode* list;
+   Node* tmp;
+   KBEdit* tmpedits = NULL;
+   KBEdit* edit;
+   KBEdit* deledit;
+
+   if (!isQuery && kb->snapshotOf != NULL) {
+      printf("Error: cannot add evidence to a snapshot of the KB.\n");
+      return logZ;
    }
+   if (!isQuery) releaseQueryBlocking(kb);
    snprintf(is_fmt_str, 50, " Is ( %%%d[^, \t\r\n\v\f] , %%%d[^, \t\r\n\v\f] %%1s", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
    snprintf(has_fmt_str, 60, " Has ( %%%d[^, \t\r\n\v\f] , %%%d[^, \t\r\n\v\f] , %%%d[^, \t\r\n\v\f] %%1s", MAX_NAME_LENGTH, MAX_NAME_LENGTH, MAX_NAME_LENGTH);
    snprintf(rel_fmt_str, 30, "%%%d[^( \t\r\n\v\f] ", MAX_NAME_LENGTH);
@@ -6167,10 +8001,13 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
          printf("Malformed query %s.\n", query);
       else
          printf("Malformed fact %s.\n", query);
-      if (outFile != NULL) fclose(outFile);
       return logZ;
    }
 
+   if (isQuery && sscanf(query, " top %d %n", &k, &n) == 1) { // ranking query
+      computeTopKQuery(kb, k, query+n, logZ, outFile);
+      return logZ;
+   }
    if (excl[0] == '!') {
       pol = 0;
       iter = strchr(query, '!')+1;
@@ -6187,7 +8024,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
          printf("Unknown object %s.\n", objName);
          if (outFile != NULL) {
             fprintf(outFile, "Unknown object %s.\n", objName);
-            fclose(outFile);
          }
          return logZ;
       }
@@ -6195,7 +8031,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
          printf("%s is not a descendant of the top object.\n", objName);
          if (outFile != NULL) {
             fprintf(outFile, "%s is not a descendant of the top object.\n", objName);
-            fclose(outFile);
          }
          return logZ;
       }
@@ -6204,7 +8039,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
          printf("Unknown class %s.\n", clName);
          if (outFile != NULL)
             fprintf(outFile, "Unknown class %s.\n", clName);
-         if (outFile != NULL) fclose(outFile);
          return logZ;
       }
       if (isQuery) {
@@ -6217,7 +8051,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                clName, cl, logZ, outFile);
             free(best);
          }
-         if (outFile != NULL) fclose(outFile);
          return logZ;
       } else {
          if (obj == NULL) {
@@ -6228,19 +8061,9 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                updateClassForNode(kb, &tmpedits, obj->name, obj,
                cl, NULL, -1);
             } else {
-               newnode = blockClassForNode(kb, &tmpedits, obj->name, obj, cl, NULL, -1);
-               if (newnode != NULL) {
-                  classToObjPtrsList = kb->classToObjPtrs[cl->id];
-                  qnode = classToObjPtrsList;
-                  while (qnode != NULL && strcmp(((Node*)(qnode->ptr))->pathname, newnode->pathname) != 0) {
-                     classToObjPtrsList = qnode;
-                     qnode = qnode->next;
-                  }
-                  if (qnode != NULL) {
-                     classToObjPtrsList->next = qnode->next;
-                     free(qnode);
-                  }
-               }
+               // only objects assigned a class are indexed under it, and
+               // blocking an assigned class is refused, so the index is unchanged
+               blockClassForNode(kb, &tmpedits, obj->name, obj, cl, NULL, -1);
             }
             par = obj;
             while (par->cl->par != NULL) par = *(par->par);
@@ -6250,8 +8073,12 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
             }
          }
          propagateKBChange(obj);
-         if (outFile != NULL) fclose(outFile);
-         newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1: 0);
+         if (propagateHardConstraints(kb, obj, &tmpedits) == 1)
+            newLogZ = log(0.0);
+         else if (kb->deferLogZ == 1)
+            newLogZ = logZ;
+         else
+            newLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1: 0);
          if (isinf(newLogZ) || isnan(newLogZ)) {
             printf("That causes the knowledge base to be impossible. Nothing is done.\n");
             resetKBEdits(kb, tmpedits);
@@ -6278,14 +8105,12 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
          printf("Unknown object %s.\n", objName);
          if (outFile != NULL)
             fprintf(outFile, "Unknown object %s.\n", objName);
-         if (outFile != NULL) fclose(outFile);
          return logZ;
       }
       if (obj->pathname == NULL && isQuery) {
          printf("%s is not a descendant of the top object.\n", objName);
          if (outFile != NULL) {
             fprintf(outFile, "%s is not a descendant of the top object.\n", objName);
-            fclose(outFile);
          }
          return logZ;
       }
@@ -6301,14 +8126,12 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                if (outFile != NULL)
                   fprintf(outFile, "The Top Object cannot be a subpart of another object.\n");
             }
-            if (outFile != NULL) fclose(outFile);
             return logZ;
          }
          if (subObj->npars == 0) {
             printf("No.\n");
             if (outFile != NULL) {
                fprintf(outFile, "No.\n");
-               fclose(outFile);
             }
             return logZ;
          }
@@ -6322,7 +8145,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                printf("No. %s is a subpart of %s.\n", subObjName, bestParName);
                if (outFile != NULL) {
                   fprintf(outFile, "No. %s is a subpart of %s.\n", subObjName, bestParName);
-                  fclose(outFile);
                }
                free(bestParName);
                return logZ;
@@ -6330,7 +8152,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                printf("%s is already a subpart of %s.\n", subObjName, bestParName);
                if (outFile != NULL) {
                   fprintf(outFile, "%s is already a subpart of %s.\n", subObjName, bestParName);
-                  fclose(outFile);
                }
                free(bestParName);
                return logZ;
@@ -6351,36 +8172,34 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                   fprintf(outFile, "%s is already a subpart of %s with a different relation.\n", subObjName, objName);
             }
             free(partName);
-            if (outFile != NULL) fclose(outFile);
             return logZ;
          }
-         for (i = 0; i < part->n; i++) {
-            if (par->part[part->idx][i] == subObj) {
-               if (i == (n-1)) {
-                  if (isQuery) {
-                     printf("Yes.\n");
-                     if (outFile != NULL)
-                        fprintf(outFile, "Yes.\n");
-                  } else {
-                     printf("%s is already the %d %s part of %s.\n", subObjName, n, partName, objName);
-                     if (outFile != NULL)
-                        fprintf(outFile, "%s is already the %d %s part of %s.\n", subObjName, n, partName, objName);
-                  }
+         slot = findPartSlot(subObj, par, part->idx);
+         if (slot != NULL) {
+            i = slot->slot;
+            if (i == (n-1)) {
+               if (isQuery) {
+                  printf("Yes.\n");
+                  if (outFile != NULL)
+                     fprintf(outFile, "Yes.\n");
                } else {
-                  if (isQuery) {
-                     printf("No. %s is the %d %s part of %s.\n", subObjName, (i+1), partName, objName);
-                     if (outFile != NULL)
-                        fprintf(outFile, "No. %s is the %d %s part of %s.\n", subObjName, (i+1), partName, objName);
-                  } else {
-                     printf("%s is already the %d %s part of %s.\n", subObjName, (i+1), partName, objName);
-                     if (outFile != NULL)
-                        fprintf(outFile, "%s is already the %d %s part of %s.\n", subObjName, (i+1), partName, objName);
-                  }
+                  printf("%s is already the %d %s part of %s.\n", subObjName, n, partName, objName);
+                  if (outFile != NULL)
+                     fprintf(outFile, "%s is already the %d %s part of %s.\n", subObjName, n, partName, objName);
+               }
+            } else {
+               if (isQuery) {
+                  printf("No. %s is the %d %s part of %s.\n", subObjName, (i+1), partName, objName);
+                  if (outFile != NULL)
+                     fprintf(outFile, "No. %s is the %d %s part of %s.\n", subObjName, (i+1), partName, objName);
+               } else {
+                  printf("%s is already the %d %s part of %s.\n", subObjName, (i+1), partName, objName);
+                  if (outFile != NULL)
+                     fprintf(outFile, "%s is already the %d %s part of %s.\n", subObjName, (i+1), partName, objName);
                }
-               free(partName);
-               if (outFile != NULL) fclose(outFile);
-               return logZ;
             }
+            free(partName);
+            return logZ;
          }
          if (isQuery) {
             printf("No. %s is not subpart of %s with relation %s.\n", subObjName, objName, partName);
@@ -6392,28 +8211,23 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                fprintf(outFile, "%s is already a subpart of %s with a different relation.\n", subObjName, objName, partName);
          }
          free(partName);
-         if (outFile != NULL) fclose(outFile);
          return logZ;
       } else {
          if (isQuery) {
             printf("Unknown object %s.\n", subObjName);
-            if (outFile != NULL) fclose(outFile);
             return logZ;
          }
          if (strpbrk(subObjName, "0123456789") == subObjName) {
             printf("Object names must begin with a letter. %s does not.\n", subObjName);
-            if (outFile != NULL) fclose(outFile);
             return logZ;
          }
          partName = findBasePartName(subpartRelName, &n);
          subObj = findPartDown(obj, partName, n, 1, &maxParts);
-         if (outFile != NULL) fclose(outFile);
          if (subObj == NULL) {
             return logZ;
          }
          if (subObj->name != NULL) {
             printf("%s already has %s as its %d %s part.\n", objName, subObj->name, n, partName);
-            if (outFile != NULL) fclose(outFile);
             free(partName);
             return logZ;
          }
@@ -6425,6 +8239,7 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
          HASH_ADD_KEYPTR(hh, kb->objectNameToPtr, newnode->name, strlen(newnode->name), newnode);
          blockClassesForPartQuery(&(kb->edits), *(newnode->par), newnode, NULL);
          propagateKBChange(obj);
+         if (kb->deferLogZ == 1) return logZ;
          return computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1: 0);
       }
    }
@@ -6440,7 +8255,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
          printf("Malformed query %s.\n", query);
       else
          printf("Malformed fact %s.\n", query);
-      if (outFile != NULL) fclose(outFile);
       return logZ;
    }
    HASH_FIND_STR(kb->objectNameToPtr, objName, obj);
@@ -6454,13 +8268,11 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
             printf("%s is not a descendant of the top object.\n", objName);
             if (outFile != NULL) {
                fprintf(outFile, "%s is not a descendant of the top object.\n", objName);
-               fclose(outFile);
             }
             return logZ;
          } else {
             if (strpbrk(objName, "0123456789") == objName) {
                printf("Object names must begin with a letter. %s does not.\n", objName);
-               if (outFile != NULL) fclose(outFile);
                return logZ;
             }
             obj = initNodeToClass(kb, strdup(objName), cl, cl);
@@ -6472,7 +8284,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
          printf("%s is not a descendant of the top object.\n", objName);
          if (outFile != NULL) {
             fprintf(outFile, "%s is not a descendant of the top object.\n", objName);
-            fclose(outFile);
          }
          return logZ;
       }
@@ -6504,7 +8315,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                   printf("Malformed query %s.\n", query);
                else
                   printf("Malformed fact %s.\n", query);
-               if (outFile != NULL) fclose(outFile);
                return logZ;
             }
             HASH_FIND_STR(attr->vals, valName, attrval);
@@ -6513,7 +8323,7 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                return logZ;
             }
             computeAttributeQueryOrAddEvidenceForObj(kb, obj, attr, attrval, pol, logZ, isQuery, 0, outFile);
-            if (isQuery) return logZ;
+            if (isQuery || kb->deferLogZ == 1) return logZ;
             else return computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1: 0);
          }
       }
@@ -6559,7 +8369,6 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
                   printf("Malformed query %s.\n", query);
                else
                   printf("Malformed fact %s.\n", query);
-               if (outFile != NULL) fclose(outFile);
                return logZ;
             }
             HASH_FIND_STR(attr->vals, valName, attrval);
@@ -6588,548 +8397,5028 @@ float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery,
    iter = strchr(query, '(')+1;
    if (isQuery) {
       computeRelationQueryOrAddEvidence(kb, relationName, iter, pol, logZ, 1, outFile);
-      if (outFile != NULL) fclose(outFile);
       return logZ;
    } else {
       computeRelationQueryOrAddEvidence(kb, relationName, iter, pol, logZ, 0, outFile);
-      if (outFile != NULL) fclose(outFile);
+      if (kb->deferLogZ == 1) return logZ;
       return computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1: 0);
    }
 }
 
-ArraysAccessor* createArraysAccessorForRel(TMLRelation* rel, Node* node) {
-   int a, p, i;
-   Node*** args = (Node***)malloc(sizeof(Node**)*rel->nargs);
-   int* argLen = (int*)malloc(sizeof(int)*rel->nargs);
-   Node* tmpNode;
-   int* argClass = rel->argClass;
-   char** argPartName = rel->argPartName;
-   int clId;
-   char* partName;
-   TMLPart* part;
-   TMLPart* tmpPart;
+float computeQueryOrAddEvidenceToFile(TMLKB* kb, char* query, float logZ, int isQuery, FILE* outFile) {
+   KBEdit* edits = kb->edits;
 
-   for (a = 0; a < rel->nargs; a++) {
-      clId = *argClass;
-      partName = *argPartName;
-      tmpNode = node;
-      while (tmpNode->cl->id != clId) {
-         tmpNode = *(tmpNode->par);
-      }
-      p = 0;
-      HASH_ITER(hh, tmpNode->cl->part, part, tmpPart) {
-         if (strcmp(part->name, partName) == 0) break;
-         p++;
-      }
-      argLen[a] = part->n;
-      args[a] = (Node**)malloc(sizeof(Node*)*part->n);
-      for (i = 0; i < part->n; i++) {
-         args[a][i] = tmpNode->part[p][i];
-      }
+   logZ = answerQueryOrAddEvidence(kb, query, logZ, isQuery, outFile);
+   // Remember the fact on the top of its edits, so it can be retracted
+   if (!isQuery && kb->edits != edits && kb->edits->fact == NULL)
+      kb->edits->fact = strdup(query);
+   if (!isQuery && kb->edits != edits && kb->onlineDirty != NULL) {
+      countKBEdits(kb, kb->edits, edits, 1.0);
+      kb->countedEdits = kb->edits;
+   }
+   return logZ;
+}
+
+float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery, const char* output) {
+   FILE* outFile = NULL;
 
-      argClass++;
-      argPartName++;
+   if (output != NULL) {
+      outFile = fopen(output, "w");
+      if (outFile == NULL) {
+         printf("Error opening %s\n", output);
+         return logZ;
+      }
    }
-   return createArraysAccessor((void***)args, rel->nargs, argLen);
+   logZ = computeQueryOrAddEvidenceToFile(kb, query, logZ, isQuery, outFile);
+   if (outFile != NULL) fclose(outFile);
+   return logZ;
 }
 
-void printMAPStateRec(TMLKB* kb, Node* node, TMLClass* assignedClFromSubpart, FILE* outFile) {
-   int r = 0;
-   TMLRelation* rel;
-   TMLRelation* temprel;
-   TMLAttribute* attr;
-   TMLAttribute* tempattr;
-   TMLAttrValue* attrval;
-   TMLAttrValue* tempval;
-   TMLPart* part;
-   TMLPart* tmp;
-   int nextSubcl = node->assignedSubcl;
-   ArraysAccessor* aa;
-   int ncombo;
-   int c;
-   Node** currArgNodes;
-   char* normalizedGroundStr;
-   char* outputGroundStr;
-   ObjRelStrsHash* objRelHash;
-   RelationStr_Hash* relStrHash;
-   char* name;
-   char* partPtr;
-   int p, i;
-   char* best = NULL;
-   float max;
-   TMLAttrValue* maxVal;
-   int descendantIdx = isDescendant(assignedClFromSubpart, node->cl);
+/* Facts of a fact file loaded into a live KB, in file order */
+typedef struct LoadedFacts {
+   char** facts;
+   int n;
+   int cap;
+} LoadedFacts;
 
-   if (nextSubcl == -1 && node->cl->nsubcls != 0)
-      nextSubcl = node->maxSubcl;
+/* Adds a fact of a loaded fact file, checking for a contradiction only if kb->deferLogZ is 0 */
+static float addLoadedFact(TMLKB* kb, LoadedFacts* lf, const char* fact, float logZ) {
+   if (lf->n == lf->cap) {
+      lf->cap *= 2;
+      lf->facts = (char**)realloc(lf->facts, sizeof(char*)*lf->cap);
+   }
+   lf->facts[lf->n] = strdup(fact);
+   return computeQueryOrAddEvidenceToFile(kb, lf->facts[lf->n++], logZ, 0, NULL);
+}
 
-   if (node->name != NULL)
-      name = node->name;
-   else {
-      best = createBestPathname(kb, node);
-      name = best;
+/* The finest class object objName is known to be in, or cl if it is not in the KB yet */
+static TMLClass* loadedObjectClass(TMLKB* kb, const char* objName, TMLClass* cl) {
+   Node* node;
+
+   HASH_FIND_STR(kb->objectNameToPtr, objName, node);
+   if (node == NULL) node = findNodeFromAnonName(kb, NULL, objName, 0);
+   if (node == NULL) return cl;
+   cl = node->cl;
+   while (cl->nsubcls != 0 && node->assignedSubcl != -1) {
+      cl = cl->subcl[node->assignedSubcl];
+      node = (node->subclMask == NULL) ? node->subcl : &(node->subcl[node->assignedSubcl]);
    }
-   HASH_FIND_STR(kb->objToRelFactStrs, name, objRelHash);
-   HASH_ITER(hh, node->cl->rel, rel, temprel) {
-      if (rel->defaultRel == 0 || rel->defaultRelForSubcl[nextSubcl] == 0) {
-         if (node->relValues[r][2] != 0 || rel->hard != 0) {
-            if (rel->nargs != 0) {
-               aa = createArraysAccessorForRel(rel, node);
-               ncombo = numCombinationsInArraysAccessor(aa);
-               for (c = 0; c < ncombo; c++) {
-                  currArgNodes = (Node**)nextArraysAccessor(aa);
-                  normalizedGroundStr = createNormalizedRelStr(kb, rel->name, node->pathname, currArgNodes, rel->nargs, 0, 0);
-                  outputGroundStr = createNormalizedRelStr(kb, rel->name, name, currArgNodes, rel->nargs, 1, 1);
-                  if (objRelHash != NULL && rel->hard == 0) {
-                     HASH_FIND_STR(objRelHash->hash, normalizedGroundStr, relStrHash);
-                     if (relStrHash != NULL) continue;
-                  }
-                  if (outFile == NULL)
-                     printf("%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputGroundStr);
-                  else
-                     fprintf(outFile, "%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputGroundStr);
-               }
-            } else {
-               normalizedGroundStr = createNormalizedRelStr(kb, rel->name, node->pathname, NULL, 0, 0, 0);
-               outputGroundStr = createNormalizedRelStr(kb, rel->name, name, NULL, 0, 1, 1);
-               if (objRelHash != NULL && rel->hard == 0) {
-                  HASH_FIND_STR(objRelHash->hash, normalizedGroundStr, relStrHash);
-                  if (relStrHash != NULL) continue;
-               }
-               if (outFile == NULL)
-                  printf("%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputGroundStr);
-               else
-                  fprintf(outFile, "%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputGroundStr);
+   return cl;
+}
+
+/**
+ * Adds the facts of one statement in the block of object objName. The
+ * statement is classified as readInOneObject does, against the finest
+ * class the object is known to be in (cl if it is not in the KB yet).
+ */
+static float addLoadedStatement(TMLKB* kb, LoadedFacts* lf, const char* objName, TMLClass* cl, char* line, float logZ) {
+   char fact[MAX_LINE_LENGTH+1];
+   char partName[MAX_NAME_LENGTH+1];
+   char name[MAX_NAME_LENGTH+1];
+   char attrName[MAX_NAME_LENGTH+1];
+   char excl[2];
+   char part_fmt_str[50];
+   char name_fmt_str[15];
+   char* item = line;
+   char* end;
+   char* paren;
+   Node* node;
+   int lineType;
+   int depth;
+
+   snprintf(part_fmt_str, 50, " %%%d[][a-zA-Z0-9:] %%%d[_a-zA-Z0-9:]", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
+   snprintf(name_fmt_str, 15, " %%%ds", MAX_NAME_LENGTH);
+   lineType = determineObjectLineType(kb, loadedObjectClass(kb, objName, cl), line);
+   if (lineType == EMPTY_LINE) return logZ;
+   if (lineType == ERROR) {
+      printf("Error on line \"%s\" in description of object %s. Cannot determine line type.\n", line, objName);
+      return logZ;
+   }
+   if (lineType == ATTRIBUTE) { // attribute name, then its values
+      sscanf(line, name_fmt_str, attrName);
+      item = strstr(line, attrName)+strlen(attrName);
+   }
+   while (*item != '\0') {
+      while (isspace(*item)) item++;
+      depth = 0;
+      for (end = item; *end != '\0' && (*end != ',' || depth > 0); end++) {
+         if (*end == '(') depth++;
+         else if (*end == ')') depth--;
+      }
+      if (*end == ',') *(end++) = '\0';
+      if (sscanf(item, name_fmt_str, name) != 1) {
+         item = end;
+         continue;
+      }
+      if (lineType == ATTRIBUTE) {
+         if (name[0] == '!')
+            snprintf(fact, MAX_LINE_LENGTH, "!%s(%s,%s", attrName, objName, name+1);
+         else
+            snprintf(fact, MAX_LINE_LENGTH, "%s(%s,%s", attrName, objName, name);
+         logZ = addLoadedFact(kb, lf, fact, logZ);
+      } else if (lineType == RELATION) {
+         paren = strchr(item, '(');
+         if (paren == NULL) { // no parentheses, no arguments
+            snprintf(fact, MAX_LINE_LENGTH, "%s(%s", name, objName);
+         } else {
+            *paren = '\0';
+            if (strrchr(paren+1, ')') != NULL) *strrchr(paren+1, ')') = '\0';
+            if (sscanf(paren+1, "%1s", excl) != 1)
+               snprintf(fact, MAX_LINE_LENGTH, "%s(%s", item, objName);
+            else
+               snprintf(fact, MAX_LINE_LENGTH, "%s(%s,%s", item, objName, paren+1);
+         }
+         logZ = addLoadedFact(kb, lf, fact, logZ);
+      } else if (lineType == SUBPART) {
+         if (sscanf(item, part_fmt_str, partName, name) == 2) {
+            HASH_FIND_STR(kb->objectNameToPtr, name, node);
+            if (node == NULL) {
+               snprintf(fact, MAX_LINE_LENGTH, "Has(%s,%s,%s", objName, name, partName);
+               logZ = addLoadedFact(kb, lf, fact, logZ);
             }
          }
+      } else { // class fact
+         if (name[0] == '!')
+            snprintf(fact, MAX_LINE_LENGTH, "!Is(%s,%s", objName, name+1);
+         else
+            snprintf(fact, MAX_LINE_LENGTH, "Is(%s,%s", objName, name);
+         logZ = addLoadedFact(kb, lf, fact, logZ);
       }
-      r++;
+      item = end;
    }
-   HASH_ITER(hh, node->cl->attr, attr, tempattr) {
-      if (attr->defaultAttr == 0 || attr->defaultAttrForSubcl[nextSubcl] == 0) {
-         if (node->assignedAttr[attr->idx] == NULL) {
-            if (node->attrValues[attr->idx] == NULL) {
-               max = attr->vals->wt;
-               maxVal = attr->vals;
-               HASH_ITER(hh, attr->vals, attrval, tempval) {
-                 if (attrval->wt > max) {
-                     max = attrval->wt;
-                     maxVal = attrval;
-                  } 
-               }
-            } else {
-               HASH_ITER(hh, attr->vals, attrval, tempval) {
-                  if (node->attrValues[attr->idx][attrval->idx] >= 0) {
-                     max = attrval->wt;
-                     maxVal = attr->vals;
-                     break;
-                  }
-               }
-               HASH_ITER(hh, attr->vals, attrval, tempval) {
-                  if (node->attrValues[attr->idx][attrval->idx] < 0) continue;
-                  if (attrval->wt > max) {
-                     max = attrval->wt;
-                     maxVal = attrval;
-                  } 
-               }
-            }
-            if (outFile == NULL)
-               printf("%s(%s,%s)\n", attr->name, name, maxVal->name);
-            else
-               fprintf(outFile, "%s(%s,%s)\n", attr->name, name, maxVal->name);
+   return logZ;
+}
+
+/**
+ * Adds the facts of a fact file to a live KB, as if each were entered at
+ * the prompt, but computes log Z once at the end, over the nodes the
+ * facts changed. Named subparts of objects that are already named are
+ * skipped. If the facts together make the KB impossible, they are undone
+ * and added again one at a time, so each contradiction is reported and
+ * only the contradicting facts are left out.
+ *
+ * @param kb                TMLKB struct
+ * @param tmlFactFileName   .db file to load
+ * @param logZ              current log of Z
+ * @return the updated log of Z
+ */
+float loadKBEvidence(TMLKB* kb, const char* tmlFactFileName, float logZ) {
+   FILE* tmlFactFile = fopen(tmlFactFileName, "r");
+   char objName[MAX_NAME_LENGTH+1];
+   char className[MAX_NAME_LENGTH+1];
+   char fact[MAX_LINE_LENGTH+1];
+   char obj_fmt_str[50];
+   char brace[2];
+   char* line;
+   char* restOfLine = NULL;
+   int linenum = 0;
+   int inObject = 0;
+   int deferLogZ = kb->deferLogZ;
+   LoadedFacts lf;
+   KBEdit* before = kb->edits;
+   KBEdit* edit;
+   Node* node;
+   TMLClass* cl;
+   int i;
+
+   if (tmlFactFile == NULL) {
+      printf("Error opening %s\n", tmlFactFileName);
+      return logZ;
+   }
+   if (kb->snapshotOf != NULL) {
+      printf("Error: cannot add evidence to a snapshot of the KB.\n");
+      fclose(tmlFactFile);
+      return logZ;
+   }
+   snprintf(obj_fmt_str, 50, "%%%d[a-zA-Z0-9:] %%%d[]a-zA-Z0-9:[.] %%1[{]", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
+   lf.n = 0;
+   lf.cap = 64;
+   lf.facts = (char**)malloc(sizeof(char*)*lf.cap);
+   kb->deferLogZ = 1;
+   while ((line = getLineToSemicolon(tmlFactFile, &restOfLine, &linenum)) != NULL) {
+      if (!inObject) {
+         if (sscanf(line, obj_fmt_str, className, objName, brace) != 3) {
+            printf("Error on line \"%s\" in fact file: Expected \" ObjectClass ObjectName {\"\n", line);
+            free(line);
+            break;
+         }
+         inObject = 1;
+         HASH_FIND_STR(kb->objectNameToPtr, objName, node);
+         if (node == NULL) node = findNodeFromAnonName(kb, NULL, objName, 0);
+         HASH_FIND_STR(kb->classNameToPtr, className, cl);
+         if (cl != NULL && (node == NULL || node->cl != cl)) {
+            snprintf(fact, MAX_LINE_LENGTH, "Is(%s,%s", objName, className);
+            logZ = addLoadedFact(kb, &lf, fact, logZ);
+         }
+      } else {
+         if (line[strlen(line)-1] == '}') {
+            line[strlen(line)-1] = '\0';
+            inObject = 0;
          }
+         logZ = addLoadedStatement(kb, &lf, objName, cl, line, logZ);
+      }
+      free(line);
+   }
+   if (restOfLine != NULL) free(restOfLine);
+   fclose(tmlFactFile);
+   kb->deferLogZ = deferLogZ;
+   if (kb->deferLogZ == 1) {
+      for (i = 0; i < lf.n; i++) free(lf.facts[i]);
+      free(lf.facts);
+      return logZ;
+   }
+
+   for (edit = kb->edits; edit != before; edit = edit->prev)
+      propagateKBChange(edit->node);
+   logZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1 : 0);
+   if (isinf(logZ) || isnan(logZ)) {
+      printf("The facts in %s contradict each other or the KB. Adding them one at a time.\n", tmlFactFileName);
+      for (edit = kb->edits; edit != before; edit = edit->prev)
+         propagateKBChange(edit->node);
+      resetKBEditsTo(kb, before);
+      logZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1 : 0);
+      for (i = 0; i < lf.n; i++)
+         logZ = computeQueryOrAddEvidenceToFile(kb, lf.facts[i], logZ, 0, NULL);
+   }
+   printf("Read %d facts from %s.\n", lf.n, tmlFactFileName);
+   for (i = 0; i < lf.n; i++) free(lf.facts[i]);
+   free(lf.facts);
+   return logZ;
+}
+
+/* Queries of a query file about the same objects, in file order */
+typedef struct QueryFileGroup {
+   char* key; // arguments of the queries, without whitespace
+   int n;
+   int cap;
+   int* idx;
+   UT_hash_handle hh;
+} QueryFileGroup;
+
+/* Share of the groups of a query file answered by one thread */
+typedef struct QueryFileWorker {
+   TMLKB* kb; // the thread's snapshot of the KB
+   QueryFileGroup** groups;
+   int ngroups;
+   int first; // answers groups first, first+step, ...
+   int step;
+   char** queries;
+   char** results; // NULL if results are only printed to the console
+   float logZ;
+} QueryFileWorker;
+
+static void answerQueryFileGroups(QueryFileWorker* w) {
+   TMLKB* kb = w->kb;
+   QueryFileGroup* group;
+   FILE* resultFile;
+   size_t resultLen;
+   int g, i, k;
+
+   kb->queryBlocking = (QueryBlocking*)malloc(sizeof(QueryBlocking));
+   kb->queryBlocking->node = NULL;
+   kb->queryBlocking->args = NULL;
+   kb->queryBlocking->nargs = 0;
+   kb->queryBlocking->edits = NULL;
+   for (g = w->first; g < w->ngroups; g += w->step) {
+      group = w->groups[g];
+      for (k = 0; k < group->n; k++) {
+         i = group->idx[k];
+         resultFile = NULL;
+         if (w->results != NULL)
+            resultFile = open_memstream(&(w->results[i]), &resultLen);
+         computeQueryOrAddEvidenceToFile(kb, w->queries[i], w->logZ, 1, resultFile);
+         if (resultFile != NULL) fclose(resultFile);
+      }
+      releaseQueryBlocking(kb);
+   }
+   free(kb->queryBlocking);
+   kb->queryBlocking = NULL;
+   kb->mapSet = 0;
+}
+
+static void* runQueryFileWorker(void* arg) {
+   answerQueryFileGroups((QueryFileWorker*)arg);
+   return NULL;
+}
+
+/**
+ * Answers a file of queries, one per line, against the KB. Queries about
+ * the same objects are answered one after the other so that relation
+ * queries can share their blocking and blocked log Z. The results are
+ * written to the output file in the order of the query file.
+ *
+ * With more than one thread, the groups of queries are dealt out to the
+ * threads, each of which answers them on its own snapshot of the KB.
+ * Results printed to the console then come in no particular order.
+ *
+ * @param kb     TMLKB struct
+ * @param queryFileName  file of queries, // comments and blank lines are skipped
+ * @param logZ   current log of Z
+ * @param output file to write the results to, NULL for only the console
+ * @param nthreads  number of threads to answer the queries with
+ * @return 1 on success, 0 on error
+ */
+int computeQueryFile(TMLKB* kb, const char* queryFileName, float logZ, const char* output, int nthreads) {
+   FILE* queryFile = fopen(queryFileName, "r");
+   FILE* outFile = NULL;
+   char line[MAX_LINE_LENGTH+1];
+   char entry[MAX_LINE_LENGTH+1];
+   char query_fmt_str[50];
+   char fact_fmt_str[50];
+   char question[2];
+   char endline[2];
+   char comment[3];
+   char** queries = NULL;
+   char** results = NULL;
+   char* key;
+   char* iter;
+   int nqueries = 0;
+   int cap = 0;
+   int linenum = 0;
+   int ngroups = 0;
+   int i, k, t;
+   QueryFileGroup* groups = NULL;
+   QueryFileGroup* group;
+   QueryFileGroup* tmp;
+   QueryFileGroup** groupArr;
+   QueryFileWorker* workers;
+   pthread_t* threads;
+
+   if (queryFile == NULL) {
+      printf("Error opening %s\n", queryFileName);
+      return 0;
+   }
+   if (output != NULL) {
+      outFile = fopen(output, "w");
+      if (outFile == NULL) {
+         printf("Error opening %s\n", output);
+         fclose(queryFile);
+         return 0;
+      }
+   }
+   snprintf(query_fmt_str, 50, " %%%d[^\r\n)?]) %%1[?] %%1s", MAX_LINE_LENGTH);
+   snprintf(fact_fmt_str, 50, "%%%d[^\r\n?)] %%1[)] %%1s", MAX_LINE_LENGTH);
+
+   while (fgets(line, MAX_LINE_LENGTH, queryFile) != NULL) {
+      linenum++;
+      if (sscanf(line, " %2s", comment) != 1) continue;
+      if (strncmp(comment, "//", 2) == 0) continue;
+      if (sscanf(line, query_fmt_str, entry, question, endline) != 2
+            && sscanf(line, fact_fmt_str, entry, question, endline) != 2) {
+         // Left for computeQueryOrAddEvidence to report as malformed
+         strcpy(entry, line);
+         entry[strcspn(entry, "\r\n")] = '\0';
+      }
+      if (nqueries == cap) {
+         cap = (cap == 0) ? 64 : 2*cap;
+         queries = (char**)realloc(queries, sizeof(char*)*cap);
+      }
+      queries[nqueries] = strdup(entry);
+
+      // Group by the objects the query is about
+      iter = strchr(entry, '(');
+      iter = (iter == NULL) ? entry : iter+1;
+      key = (char*)malloc(sizeof(char)*(strlen(iter)+1));
+      for (k = 0; *iter != '\0'; iter++)
+         if (!isspace(*iter)) key[k++] = *iter;
+      key[k] = '\0';
+      HASH_FIND_STR(groups, key, group);
+      if (group == NULL) {
+         group = (QueryFileGroup*)malloc(sizeof(QueryFileGroup));
+         group->key = key;
+         group->n = 0;
+         group->cap = 4;
+         group->idx = (int*)malloc(sizeof(int)*group->cap);
+         HASH_ADD_KEYPTR(hh, groups, group->key, strlen(group->key), group);
+         ngroups++;
+      } else {
+         free(key);
+      }
+      if (group->n == group->cap) {
+         group->cap *= 2;
+         group->idx = (int*)realloc(group->idx, sizeof(int)*group->cap);
+      }
+      group->idx[group->n++] = nqueries++;
+   }
+   fclose(queryFile);
+
+   if (outFile != NULL) {
+      results = (char**)malloc(sizeof(char*)*nqueries);
+      for (i = 0; i < nqueries; i++)
+         results[i] = NULL;
+   }
+   groupArr = (QueryFileGroup**)malloc(sizeof(QueryFileGroup*)*(ngroups+1));
+   i = 0;
+   HASH_ITER(hh, groups, group, tmp) {
+      groupArr[i++] = group;
+   }
+   if (nthreads > ngroups) nthreads = ngroups;
+   if (nthreads < 1) nthreads = 1;
+   workers = (QueryFileWorker*)malloc(sizeof(QueryFileWorker)*nthreads);
+   for (t = 0; t < nthreads; t++) {
+      workers[t].kb = (nthreads == 1) ? kb : createTMLKBSnapshot(kb);
+      workers[t].groups = groupArr;
+      workers[t].ngroups = ngroups;
+      workers[t].first = t;
+      workers[t].step = nthreads;
+      workers[t].queries = queries;
+      workers[t].results = results;
+      workers[t].logZ = logZ;
+   }
+   if (nthreads == 1) {
+      answerQueryFileGroups(&(workers[0]));
+   } else {
+      threads = (pthread_t*)malloc(sizeof(pthread_t)*nthreads);
+      for (t = 0; t < nthreads; t++)
+         pthread_create(&(threads[t]), NULL, runQueryFileWorker, &(workers[t]));
+      for (t = 0; t < nthreads; t++) {
+         pthread_join(threads[t], NULL);
+         freeTMLKB(workers[t].kb);
+      }
+      free(threads);
+   }
+   free(workers);
+   free(groupArr);
+   HASH_ITER(hh, groups, group, tmp) {
+      HASH_DEL(groups, group);
+      free(group->key);
+      free(group->idx);
+      free(group);
+   }
+
+   for (i = 0; i < nqueries; i++) {
+      if (outFile != NULL) {
+         fputs(results[i], outFile);
+         free(results[i]);
+      }
+      free(queries[i]);
+   }
+   if (outFile != NULL) {
+      fclose(outFile);
+      free(results);
+   }
+   free(queries);
+   return 1;
+}
+
+/**
+ * Parses a query template once so that it can be run on many objects
+ * without re-reading it. The object the query is about is written as a
+ * parameter, e.g. Crime($x), Is($x,Democrat), Mood($x,Good) or
+ * Friends($x,Bob). Other arguments are resolved now, so objects named
+ * after the query is prepared are not seen by it.
+ *
+ * @param kb     TMLKB struct
+ * @param name   name to register the prepared query under
+ * @param query  the template, without the trailing ?
+ * @return the prepared query, NULL if the template is malformed
+ */
+TMLPreparedQuery* prepareTMLQuery(TMLKB* kb, const char* name, const char* query) {
+   TMLPreparedQuery* pq;
+   char is_fmt_str[50];
+   char attrrel_fmt_str[50];
+   char attr_fmt_str[30];
+   char objName[MAX_NAME_LENGTH+1];
+   char clName[MAX_NAME_LENGTH+1];
+   char relationName[MAX_NAME_LENGTH+1];
+   char valName[MAX_NAME_LENGTH+1];
+   char excl[2];
+   char* iter;
+   char** outputArgs;
+   int correctScan;
+   int n;
+
+   snprintf(is_fmt_str, 50, " Is ( %%%d[^, \t\r\n\v\f] , %%%d[^, \t\r\n\v\f] %%1s", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
+   snprintf(attrrel_fmt_str, 50, "%%%d[^( \t\r\n\v\f] ( %%%d[^, \t\r\n\v\f] %%1s ", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
+   snprintf(attr_fmt_str, 30, "%%%d[^ \t\r\n\v\f] %%1s", MAX_NAME_LENGTH);
+
+   pq = (TMLPreparedQuery*)malloc(sizeof(TMLPreparedQuery));
+   pq->name = strdup(name);
+   pq->text = strdup(query);
+   pq->pol = 1;
+   pq->cl = NULL;
+   pq->relName = NULL;
+   pq->valName = NULL;
+   pq->relRest = NULL;
+   pq->normalizedRelStr = NULL;
+   pq->outputRelStr = NULL;
+   pq->args = NULL;
+   pq->nargs = 0;
+   pq->attrs = NULL;
+
+   iter = pq->text;
+   correctScan = sscanf(iter, "%1s", excl);
+   if (correctScan == 1 && excl[0] == '!') {
+      pq->pol = 0;
+      iter = strchr(iter, '!')+1;
+   }
+   correctScan = sscanf(iter, is_fmt_str, objName, clName, excl);
+   if (correctScan == 2) {
+      if (objName[0] != '$') {
+         printf("The object of prepared query %s must be a parameter such as $x.\n", name);
+         freePreparedQuery(pq);
+         return NULL;
+      }
+      HASH_FIND_STR(kb->classNameToPtr, clName, pq->cl);
+      if (pq->cl == NULL) {
+         printf("Unknown class %s.\n", clName);
+         freePreparedQuery(pq);
+         return NULL;
+      }
+   } else {
+      correctScan = sscanf(iter, attrrel_fmt_str, relationName, objName, excl);
+      if (correctScan < 2 || (correctScan == 3 && excl[0] != ',')
+            || strcmp(relationName, "Has") == 0) {
+         printf("Malformed query %s.\n", query);
+         freePreparedQuery(pq);
+         return NULL;
+      }
+      if (objName[0] != '$') {
+         printf("The object of prepared query %s must be a parameter such as $x.\n", name);
+         freePreparedQuery(pq);
+         return NULL;
+      }
+      pq->relName = strdup(relationName);
+      iter = strchr(strchr(iter, '(')+1, ',');
+      if (iter != NULL) {
+         pq->relRest = iter+1;
+         if (sscanf(pq->relRest, attr_fmt_str, valName, excl) == 1)
+            pq->valName = strdup(valName);
       }
+      pq->normalizedRelStr = splitRelArgsAndCreateNormalizedRelStr(kb, pq->relRest, pq->relName, &(pq->nargs), &(pq->args), 0);
+      if (pq->normalizedRelStr == NULL) {
+         free(pq->args);
+         pq->args = NULL;
+         pq->nargs = 0;
+      }
+      pq->outputRelStr = splitRelArgsAndCreateNormalizedRelStr(kb, pq->relRest, pq->relName, &n, &outputArgs, 1);
+      if (pq->outputRelStr != NULL) {
+         for (n--; n >= 0; n--)
+            free(outputArgs[n]);
+         free(outputArgs);
+      }
+   }
+   HASH_ADD_KEYPTR(hh, kb->preparedQueries, pq->name, strlen(pq->name), pq);
+   return pq;
+}
+
+TMLPreparedQuery* findPreparedQuery(TMLKB* kb, const char* name) {
+   TMLPreparedQuery* pq;
+
+   HASH_FIND_STR(kb->preparedQueries, name, pq);
+   return pq;
+}
+
+/**
+ * Finds the node of a named object (or anonymous object path) to bind to
+ * prepared queries.
+ *
+ * @return the node, NULL if unknown
+ */
+Node* findQueryObject(TMLKB* kb, const char* objName) {
+   Node* obj;
+
+   HASH_FIND_STR(kb->objectNameToPtr, objName, obj);
+   if (obj == NULL)
+      obj = findNodeFromAnonName(kb, NULL, objName, 0);
+   return obj;
+}
+
+static PreparedAttr* findPreparedAttr(TMLPreparedQuery* pq, TMLClass* cl) {
+   PreparedAttr* pa;
+
+   HASH_FIND_PTR(pq->attrs, &cl, pa);
+   if (pa == NULL) {
+      pa = (PreparedAttr*)malloc(sizeof(PreparedAttr));
+      pa->cl = cl;
+      pa->attr = getAttribute(cl, pq->relName);
+      pa->attrval = NULL;
+      if (pa->attr != NULL && pq->valName != NULL)
+         HASH_FIND_STR(pa->attr->vals, pq->valName, pa->attrval);
+      HASH_ADD_PTR(pq->attrs, cl, pa);
+   }
+   return pa;
+}
+
+/**
+ * Runs a prepared query on an object.
+ *
+ * @param kb     TMLKB struct
+ * @param pq     prepared query
+ * @param obj    node bound to the query's parameter
+ * @param logZ   current log of Z
+ * @param outFile  file to also print the result to, or NULL
+ */
+void executePreparedQuery(TMLKB* kb, TMLPreparedQuery* pq, Node* obj, float logZ, FILE* outFile) {
+   char* best = NULL;
+   char* name;
+   Node* node;
+   TMLClass* cl;
+   PreparedAttr* pa;
+
+   if (obj->pathname == NULL) {
+      printf("%s is not a descendant of the top object.\n", obj->name);
+      if (outFile != NULL)
+         fprintf(outFile, "%s is not a descendant of the top object.\n", obj->name);
+      return;
+   }
+   if (obj->name != NULL) {
+      name = obj->name;
+   } else {
+      best = createBestPathname(kb, obj);
+      name = best;
+   }
+   if (pq->cl != NULL) {
+      computeClassQueryForObject(kb, name, obj, pq->cl->name, pq->cl, logZ, outFile);
+      if (best != NULL) free(best);
+      return;
+   }
+
+   // Same walk down the object's assigned subclasses as an unprepared query
+   cl = obj->cl;
+   node = obj;
+   while (TRUE) {
+      pa = findPreparedAttr(pq, cl);
+      if (pa->attr != NULL) break;
+      if (cl->nsubcls == 0 || node->assignedSubcl == -1) break;
+      if (node->subclMask == NULL) node = node->subcl;
+      else node = &(node->subcl[node->assignedSubcl]);
+      cl = node->cl;
+   }
+   if (pa->attr != NULL) {
+      if (pq->relRest == NULL) {
+         computeAttributeQueryOrAddEvidenceForObj(kb, obj, pa->attr, NULL, pq->pol, logZ, 1, 1, outFile);
+      } else if (pq->valName == NULL) {
+         printf("Malformed query %s.\n", pq->text);
+         if (outFile != NULL)
+            fprintf(outFile, "Malformed query %s.\n", pq->text);
+      } else if (pa->attrval == NULL) {
+         printf("%s is not a valid value for attribute %s in objects of class %s.\n", pq->valName, pq->relName, name);
+      } else {
+         computeAttributeQueryOrAddEvidenceForObj(kb, obj, pa->attr, pa->attrval, pq->pol, logZ, 1, 0, outFile);
+      }
+   } else if (pq->normalizedRelStr == NULL) {
+      printf("Malformed relation %s(%s%s%s).\n", pq->relName, name, (pq->relRest == NULL) ? "" : ",", (pq->relRest == NULL) ? "" : pq->relRest);
+   } else {
+      computeRelationQueryOrAddEvidenceForObj(kb, obj, name, pq->relName, pq->relRest, pq->pol, pq->normalizedRelStr, pq->args, pq->nargs, logZ, 1, 0, pq->outputRelStr, outFile);
+   }
+   if (best != NULL) free(best);
+}
+
+void freePreparedQuery(TMLPreparedQuery* pq) {
+   PreparedAttr* pa;
+   PreparedAttr* patmp;
+   int n;
+
+   HASH_ITER(hh, pq->attrs, pa, patmp) {
+      HASH_DEL(pq->attrs, pa);
+      free(pa);
+   }
+   if (pq->args != NULL) {
+      for (n = 0; n < pq->nargs; n++)
+         free(pq->args[n]);
+      free(pq->args);
+   }
+   free(pq->normalizedRelStr);
+   free(pq->outputRelStr);
+   free(pq->valName);
+   free(pq->relName);
+   free(pq->text);
+   free(pq->name);
+   free(pq);
+}
+
+/**
+ * Starts a grounding iterator over the candidate arrays of each argument.
+ * The arrays are read in place, not copied or freed.
+ *
+ * @param it      iterator, usually on the caller's stack
+ * @param args    candidate nodes of each argument
+ * @param len     number of candidates of each argument
+ * @param nargs   number of arguments
+ */
+void initGroundingIter(GroundingIter* it, Node*** args, int* len, int nargs) {
+   int a;
+
+   it->nargs = nargs;
+   it->done = 0;
+   it->known = NULL;
+   it->relName = NULL;
+   it->str = NULL;
+   if (nargs <= GROUNDING_ITER_ARITY) {
+      it->args = it->argsArr;
+      it->len = it->lenArr;
+      it->idx = it->idxArr;
+      it->curr = it->currArr;
+   } else {
+      it->args = (Node***)malloc(sizeof(Node**)*nargs);
+      it->len = (int*)malloc(sizeof(int)*nargs);
+      it->idx = (int*)malloc(sizeof(int)*nargs);
+      it->curr = (Node**)malloc(sizeof(Node*)*nargs);
+   }
+   for (a = 0; a < nargs; a++) {
+      it->args[a] = args[a];
+      it->len[a] = len[a];
+      it->idx[a] = 0;
+      if (len[a] <= 0) it->done = 1;
+   }
+}
+
+/**
+ * Starts a grounding iterator over the groundings of a relation of node,
+ * reading each argument's candidates from the part arrays of the node's
+ * ancestor of the argument's class.
+ *
+ * @param it      iterator, usually on the caller's stack
+ * @param rel     relation
+ * @param node    node the relation belongs to
+ */
+void initGroundingIterForRel(GroundingIter* it, TMLRelation* rel, Node* node) {
+   int a, p;
+   Node* tmpNode;
+   TMLPart* part;
+   TMLPart* tmpPart;
+   Node** argsArr[GROUNDING_ITER_ARITY];
+   int lenArr[GROUNDING_ITER_ARITY];
+   Node*** args = argsArr;
+   int* len = lenArr;
+
+   if (rel->nargs > GROUNDING_ITER_ARITY) {
+      args = (Node***)malloc(sizeof(Node**)*rel->nargs);
+      len = (int*)malloc(sizeof(int)*rel->nargs);
+   }
+   for (a = 0; a < rel->nargs; a++) {
+      tmpNode = node;
+      while (tmpNode->cl->id != rel->argClass[a]) {
+         tmpNode = *(tmpNode->par);
+      }
+      p = 0;
+      HASH_ITER(hh, tmpNode->cl->part, part, tmpPart) {
+         if (strcmp(part->name, rel->argPartName[a]) == 0) break;
+         p++;
+      }
+      args[a] = tmpNode->part[p];
+      len[a] = part->n;
+   }
+   initGroundingIter(it, args, len, rel->nargs);
+   if (rel->nargs > GROUNDING_ITER_ARITY) {
+      free(args);
+      free(len);
+   }
+}
+
+/**
+ * Makes nextGrounding skip the groundings that are known facts of an object.
+ *
+ * @param it          grounding iterator
+ * @param objRelHash  facts of the object, or NULL for none
+ * @param relName     name of the relation
+ * @param str         buffer of MAX_LINE_LENGTH+1 chars for the lookups
+ */
+void skipKnownGroundings(GroundingIter* it, ObjRelStrsHash* objRelHash, char* relName, char* str) {
+   it->known = (objRelHash == NULL) ? NULL : objRelHash->hash;
+   it->relName = relName;
+   it->str = str;
+}
+
+/**
+ * Returns the next grounding, skipping those with a missing argument node
+ * and known facts, or NULL when there are no more. The returned array is
+ * owned by the iterator and overwritten by the next call.
+ *
+ * @param it   grounding iterator
+ * @return     argument nodes of the grounding
+ */
+Node** nextGrounding(GroundingIter* it) {
+   RelationStr_Hash* relStrHash;
+   int a;
+
+   while (!it->done) {
+      switch (it->nargs) {
+         case 0:
+            it->done = 1;
+            break;
+         case 1:
+            it->curr[0] = it->args[0][it->idx[0]];
+            if (++it->idx[0] == it->len[0]) it->done = 1;
+            if (it->curr[0] == NULL) continue;
+            break;
+         case 2:
+            it->curr[0] = it->args[0][it->idx[0]];
+            it->curr[1] = it->args[1][it->idx[1]];
+            if (++it->idx[1] == it->len[1]) {
+               it->idx[1] = 0;
+               if (++it->idx[0] == it->len[0]) it->done = 1;
+            }
+            if (it->curr[0] == NULL || it->curr[1] == NULL) continue;
+            break;
+         case 3:
+            it->curr[0] = it->args[0][it->idx[0]];
+            it->curr[1] = it->args[1][it->idx[1]];
+            it->curr[2] = it->args[2][it->idx[2]];
+            if (++it->idx[2] == it->len[2]) {
+               it->idx[2] = 0;
+               if (++it->idx[1] == it->len[1]) {
+                  it->idx[1] = 0;
+                  if (++it->idx[0] == it->len[0]) it->done = 1;
+               }
+            }
+            if (it->curr[0] == NULL || it->curr[1] == NULL || it->curr[2] == NULL) continue;
+            break;
+         default:
+            for (a = 0; a < it->nargs; a++)
+               it->curr[a] = it->args[a][it->idx[a]];
+            for (a = it->nargs-1; a >= 0; a--) {
+               if (++it->idx[a] < it->len[a]) break;
+               it->idx[a] = 0;
+            }
+            if (a < 0) it->done = 1;
+            for (a = 0; a < it->nargs; a++) {
+               if (it->curr[a] == NULL) break;
+            }
+            if (a < it->nargs) continue;
+            break;
+      }
+      if (it->known != NULL) {
+         writeNormalizedRelStr(it->str, it->relName, NULL, it->curr, it->nargs, 0, 0);
+         HASH_FIND_STR(it->known, it->str, relStrHash);
+         if (relStrHash != NULL) continue;
+      }
+      return it->curr;
+   }
+   return NULL;
+}
+
+/**
+ * Frees what a grounding iterator allocated, but not the iterator itself.
+ *
+ * @param it   grounding iterator
+ */
+void freeGroundingIter(GroundingIter* it) {
+   if (it->nargs > GROUNDING_ITER_ARITY) {
+      free(it->args);
+      free(it->len);
+      free(it->idx);
+      free(it->curr);
+   }
+}
+
+/**
+ * Prints the MAP values of the unknown relations and attributes of one node
+ *
+ * @param kb         TML KB
+ * @param node       node being printed
+ * @param nextSubcl  subclass branch taken below node in the MAP state
+ * @param name       name to print for the node
+ * @param outFile    output file, NULL for stdout
+ */
+static void printMAPStateLocal(TMLKB* kb, Node* node, int nextSubcl, char* name, FILE* outFile) {
+   int r = 0;
+   TMLRelation* rel;
+   TMLRelation* temprel;
+   TMLAttribute* attr;
+   TMLAttribute* tempattr;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tempval;
+   GroundingIter it;
+   Node** currArgNodes;
+   char groundStr[MAX_LINE_LENGTH+1];
+   char outputStr[MAX_LINE_LENGTH+1];
+   ObjRelStrsHash* objRelHash;
+   float max;
+   TMLAttrValue* maxVal;
+
+   HASH_FIND_STR(kb->objToRelFactStrs, name, objRelHash);
+   HASH_ITER(hh, node->cl->rel, rel, temprel) {
+      if (rel->defaultRel == 0 || rel->defaultRelForSubcl[nextSubcl] == 0) {
+         if (node->relValues[r][2] != 0 || rel->hard != 0) {
+            initGroundingIterForRel(&it, rel, node);
+            if (rel->hard == 0)
+               skipKnownGroundings(&it, objRelHash, rel->name, groundStr);
+            while ((currArgNodes = nextGrounding(&it)) != NULL) {
+               writeNormalizedRelStr(outputStr, rel->name, name, currArgNodes, rel->nargs, 1, 1);
+               if (outFile == NULL)
+                  printf("%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputStr);
+               else
+                  fprintf(outFile, "%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputStr);
+            }
+            freeGroundingIter(&it);
+         }
+      }
+      r++;
+   }
+   HASH_ITER(hh, node->cl->attr, attr, tempattr) {
+      if (attr->defaultAttr == 0 || attr->defaultAttrForSubcl[nextSubcl] == 0) {
+         if (node->assignedAttr[attr->idx] == NULL) {
+            if (node->attrValues[attr->idx] == NULL) {
+               max = attr->vals->wt;
+               maxVal = attr->vals;
+               HASH_ITER(hh, attr->vals, attrval, tempval) {
+                 if (attrval->wt > max) {
+                     max = attrval->wt;
+                     maxVal = attrval;
+                  } 
+               }
+            } else {
+               HASH_ITER(hh, attr->vals, attrval, tempval) {
+                  if (!isValueMasked(node->attrValues[attr->idx], attrval->idx)) {
+                     max = attrval->wt;
+                     maxVal = attr->vals;
+                     break;
+                  }
+               }
+               HASH_ITER(hh, attr->vals, attrval, tempval) {
+                  if (isValueMasked(node->attrValues[attr->idx], attrval->idx)) continue;
+                  if (attrval->wt > max) {
+                     max = attrval->wt;
+                     maxVal = attrval;
+                  } 
+               }
+            }
+            if (outFile == NULL)
+               printf("%s(%s,%s)\n", attr->name, name, maxVal->name);
+            else
+               fprintf(outFile, "%s(%s,%s)\n", attr->name, name, maxVal->name);
+         }
+      }
+   }
+}
+
+// One step of printMAPStateRec: either printing a node and queueing its
+// parts, or (tail == 1) printing its subclass and descending into it
+typedef struct MAPVisit {
+   Node* node;
+   TMLClass* assignedClFromSubpart;
+   int tail;
+   char* name;
+   char* best;
+} MAPVisit;
+
+static void pushMAPVisit(MAPVisit** visits, int* nvisits, int* cap, Node* node, TMLClass* assignedClFromSubpart,
+   int tail, char* name, char* best) {
+   MAPVisit* v;
+   if (*nvisits == *cap) {
+      *cap *= 2;
+      *visits = (MAPVisit*)realloc(*visits, sizeof(MAPVisit)*(*cap));
+   }
+   v = &((*visits)[*nvisits]);
+   v->node = node;
+   v->assignedClFromSubpart = assignedClFromSubpart;
+   v->tail = tail;
+   v->name = name;
+   v->best = best;
+   (*nvisits)++;
+}
+
+/**
+ * Prints the MAP state of the SPN rooted at node. Nodes are printed in
+ * depth-first order (relations and attributes, then parts, then the MAP
+ * subclass) using a heap stack instead of recursion.
+ */
+void printMAPStateRec(TMLKB* kb, Node* node, TMLClass* assignedClFromSubpart, FILE* outFile) {
+   TMLPart* part;
+   TMLPart* tmp;
+   int nextSubcl;
+   char* name;
+   char* best;
+   int p, i;
+   int from;
+   int descendantIdx;
+   MAPVisit v;
+   MAPVisit* visits;
+   int nvisits = 0;
+   int cap = 64;
+
+   visits = (MAPVisit*)malloc(sizeof(MAPVisit)*cap);
+   pushMAPVisit(&visits, &nvisits, &cap, node, assignedClFromSubpart, 0, NULL, NULL);
+   while (nvisits > 0) {
+      v = visits[--nvisits];
+      node = v.node;
+      nextSubcl = node->assignedSubcl;
+      if (nextSubcl == -1 && node->cl->nsubcls != 0)
+         nextSubcl = node->maxSubcl;
+
+      if (v.tail == 0) {
+         best = NULL;
+         if (node->name != NULL)
+            name = node->name;
+         else {
+            best = createBestPathname(kb, node);
+            name = best;
+         }
+         printMAPStateLocal(kb, node, nextSubcl, name, outFile);
+         pushMAPVisit(&visits, &nvisits, &cap, node, v.assignedClFromSubpart, 1, name, best);
+         from = nvisits;
+         p = 0; 
+         HASH_ITER(hh, node->cl->part, part, tmp) {
+            if (part->defaultPart == 0 || part->defaultPartForSubcl[nextSubcl] == 0) {
+               for (i = 0; i < part->n; i++) {
+                  pushMAPVisit(&visits, &nvisits, &cap, node->part[p][i], part->cl, 0, NULL, NULL);
+               }
+            }
+            p++;
+         }
+         // reverse the parts so they are printed in order
+         for (i = 0; from+i < nvisits-1-i; i++) {
+            v = visits[from+i];
+            visits[from+i] = visits[nvisits-1-i];
+            visits[nvisits-1-i] = v;
+         }
+         continue;
+      }
+
+      name = v.name;
+      assignedClFromSubpart = v.assignedClFromSubpart;
+      descendantIdx = isDescendant(assignedClFromSubpart, node->cl);
+      if (node->cl->nsubcls != 0) {
+         if (node->assignedSubcl != -1) {
+            if (node->subclMask == NULL)
+               pushMAPVisit(&visits, &nvisits, &cap, node->subcl, assignedClFromSubpart, 0, NULL, NULL);
+            else
+               pushMAPVisit(&visits, &nvisits, &cap, &(node->subcl[node->assignedSubcl]), assignedClFromSubpart, 0, NULL, NULL);
+         } else if (descendantIdx != -1) {
+            if (outFile == NULL)
+               printf("Is(%s,%s)\n", name, node->cl->subcl[descendantIdx]->name);
+            else
+               fprintf(outFile, "Is(%s,%s)\n", name, node->cl->subcl[descendantIdx]->name);
+            pushMAPVisit(&visits, &nvisits, &cap, &(node->subcl[descendantIdx]), assignedClFromSubpart, 0, NULL, NULL);
+         } else {
+            if (outFile == NULL)
+               printf("Is(%s,%s)\n", name, node->cl->subcl[node->maxSubcl]->name);
+            else
+               fprintf(outFile, "Is(%s,%s)\n", name, node->cl->subcl[node->maxSubcl]->name);
+            pushMAPVisit(&visits, &nvisits, &cap, &(node->subcl[node->maxSubcl]), assignedClFromSubpart, 0, NULL, NULL);
+         }
+      }
+      if (v.best != NULL) free(v.best);
+   }
+   free(visits);
+}
+
+void printMAPStateForObj(TMLKB* kb, Node* node, FILE* outFile) {
+   int r = 0;
+   TMLRelation* rel;
+   TMLRelation* temprel;
+   int nextSubcl = node->assignedSubcl;
+   GroundingIter it;
+   Node** currArgNodes;
+   char groundStr[MAX_LINE_LENGTH+1];
+   char outputStr[MAX_LINE_LENGTH+1];
+   ObjRelStrsHash* objRelHash;
+   char* name;
+   char* partPtr;
+
+   if (nextSubcl == -1 && node->cl->nsubcls != 0)
+      nextSubcl = node->maxSubcl;
+   if (node->name != NULL)
+      name = node->name;
+   else
+      name = node->pathname;
+   HASH_FIND_STR(kb->objToRelFactStrs, name, objRelHash);
+   HASH_ITER(hh, node->cl->rel, rel, temprel) {
+      if (rel->defaultRel == 0 || rel->defaultRelForSubcl[nextSubcl] == 0) {
+         if (node->relValues[r][2] != 0) {
+            initGroundingIterForRel(&it, rel, node);
+            skipKnownGroundings(&it, objRelHash, rel->name, groundStr);
+            while ((currArgNodes = nextGrounding(&it)) != NULL) {
+               writeNormalizedRelStr(outputStr, rel->name, node->name, currArgNodes, rel->nargs, 1, 1);
+               if (outFile == NULL)
+                  printf("%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputStr);
+               else
+                  fprintf(outFile, "%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputStr);
+            }
+            freeGroundingIter(&it);
+         }
+      }
+      r++;
+   }   
+
+   if (node->cl->nsubcls != 0) {
+      if (node->assignedSubcl != -1) {
+         if (node->subclMask == NULL)
+            printMAPStateForObj(kb, node->subcl, outFile);
+         else
+            printMAPStateForObj(kb, &(node->subcl[node->assignedSubcl]), outFile);
+      } else {
+         if (outFile == NULL)
+            printf("Is(%s,%s)\n", node->name, node->cl->subcl[node->maxSubcl]->name);
+         else
+            fprintf(outFile, "Is(%s,%s)\n", node->name, node->cl->subcl[node->maxSubcl]->name);
+         printMAPStateForObj(kb, &(node->subcl[node->maxSubcl]), outFile);
+      }
+   }
+}
+
+void printMAPState(TMLKB* kb, const char* outFileName) {
+   FILE* outFile = NULL;
+   Node* node;
+   Node* tmp;
+
+   if (outFileName == NULL)
+      printf("MAP state of unknown TML facts:\n");
+   else
+      outFile = fopen(outFileName, "w");
+
+   printMAPStateRec(kb, (Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, outFile);
+}
+
+void computeMAPState(TMLKB* kb, float logZ) {
+   float mapStateLogZ;
+   Node* root = (Node*)(kb->root->ptr);
+   if (kb->mapSet != 1) {
+      computeLogZ(root, root->cl, spn_max, 1);
+      kb->mapSet = 1;
+   } else
+      computeLogZ(root, root->cl, spn_max, 0);
+   
+}
+
+/* Cleaning up the TMLKB structure */
+void freeTMLKB(void* obj) {
+   TMLKB* kb = (TMLKB*)obj;
+   Node* node;
+   Node* tmp;
+   Node* pathNode;
+   QNode* qnode;
+   QNode* next;
+   ObjRelStrsHash* objRelHash;
+   ObjRelStrsHash* objRelTemp;
+   RelationStr_Hash* relStrHash;
+   RelationStr_Hash* relStrTemp;
+   TMLClass* cl;
+   TMLClass* tmpcl;
+   KBEdit* edit;
+   NodeEpoch* nodeEpoch;
+   NodeEpoch* nodeEpochTmp;
+   TMLPreparedQuery* pq;
+   TMLPreparedQuery* pqtmp;
+   int c;
+
+   if (kb->root != NULL) {
+      free(kb->root);
+   }
+
+   HASH_ITER(hh, kb->objectNameToPtr, node, tmp) {
+      HASH_DEL(kb->objectNameToPtr, node);  /* delete it (users advances to next) */
+      if (kb->snapshotOf == NULL) continue;
+      // A snapshot owns its copies of the objects missing from objectPathToPtr
+      if (node->pathname != NULL) {
+         HASH_FIND(hh_path, kb->objectPathToPtr, node->pathname, strlen(node->pathname), pathNode);
+         if (pathNode == node) continue;
+      }
+      freeTreeRootedAtNode(node);
+      free(node->name);
+      free(node->pathname);
+      free(node);
+   } 
+   HASH_ITER(hh_path, kb->objectPathToPtr, node, tmp) {
+      HASH_DELETE(hh_path, kb->objectPathToPtr, node);  /* delete it (users advances to next) */
+      freeTreeRootedAtNode(node);
+      free(node->name);
+      free(node->pathname);
+      free(node);
+   }
+   // A snapshot shares its classes with the KB
+   if (kb->snapshotOf == NULL) {
+      HASH_ITER(hh, kb->classNameToPtr, cl, tmpcl) {
+         HASH_DEL(kb->classNameToPtr, cl);  /* delete it (users advances to next) */
+         freeTMLClass(cl); /* TMLClass owns name_and_ptr->name */
+      }
+      free(kb->classes);
+   }
+   HASH_ITER(hh, kb->objToRelFactStrs, objRelHash, objRelTemp) {
+      HASH_DEL(kb->objToRelFactStrs, objRelHash);
+      HASH_ITER(hh, objRelHash->hash, relStrHash, relStrTemp) {
+         HASH_DEL(objRelHash->hash, relStrHash);
+         free(relStrHash->str);
+         free(relStrHash);
+      }
+      free(objRelHash);
+   }
+
+   for (c = 0; c < kb->numClasses; c++) {
+      qnode = kb->classToObjPtrs[c];
+      while (qnode != NULL) {
+         next = qnode->next;
+         free(qnode);
+         qnode = next;
+      }
+   }
+   free(kb->classToObjPtrs);
+   if (kb->objectsByClass != NULL) {
+      for (c = 0; c < kb->numClasses; c++) {
+         qnode = kb->objectsByClass[c];
+         while (qnode != NULL) {
+            next = qnode->next;
+            free(qnode);
+            qnode = next;
+         }
+      }
+      free(kb->objectsByClass);
+   }
+   freeKBSavepoints(kb, NULL);
+   HASH_ITER(hh, kb->preparedQueries, pq, pqtmp) {
+      HASH_DEL(kb->preparedQueries, pq);
+      freePreparedQuery(pq);
+   }
+   flushQueryCache(kb);
+   HASH_ITER(hh, kb->nodeEpochs, nodeEpoch, nodeEpochTmp) {
+      HASH_DEL(kb->nodeEpochs, nodeEpoch);
+      free(nodeEpoch);
+   }
+   while (kb->prunes != NULL) {
+      edit = kb->prunes;
+      kb->prunes = edit->prev;
+      free(edit);
+   }
+   if (kb->expiries != NULL) {
+      freeKBExpiries(kb);
+      pqueue_free(kb->expiries);
+   }
+   if (kb->kernelLib != NULL) dlclose(kb->kernelLib);
+   free(kb->onlineDirty);
+   free(kb);
+}
+
+///////////////////////
+// The following functions take snapshots of a KB
+// for concurrent read-only queries
+///////////////////////
+
+/* Node of a KB and its copy in a snapshot */
+typedef struct SnapshotNode {
+   Node* node;
+   Node* copy;
+   UT_hash_handle hh;
+} SnapshotNode;
+
+static Node* findSnapshotNode(SnapshotNode* map, Node* node) {
+   SnapshotNode* sn;
+
+   if (node == NULL) return NULL;
+   HASH_FIND_PTR(map, &node, sn);
+   return (sn == NULL) ? NULL : sn->copy;
+}
+
+/**
+ * Copies the evidence of a node and its arrays of parents and parts. The
+ * pointers to other nodes still point into the KB until
+ * relinkSnapshotNodes replaces them. Names other than those of the
+ * object stay shared with the KB.
+ */
+static void copySnapshotNode(Node* copy, Node* node, Node* top, Node* topCopy) {
+   TMLClass* cl = node->cl;
+   TMLPart* part;
+   TMLPart* tmppart;
+   TMLAttribute* attr;
+   TMLAttribute* tmpattr;
+   char* name = topCopy->name;
+   char* pathname = topCopy->pathname;
+   int i;
+
+   memcpy(copy, node, sizeof(Node));
+   // Subclass nodes share the strings of their object
+   if (node->name != NULL && node->name == top->name) copy->name = name;
+   if (node->pathname != NULL && node->pathname == top->pathname) copy->pathname = pathname;
+   copy->subcl = NULL;
+   copy->part = (Node***)malloc(sizeof(Node**)*cl->nparts);
+   i = 0;
+   HASH_ITER(hh, cl->part, part, tmppart) {
+      copy->part[i] = (Node**)malloc(sizeof(Node*)*part->n);
+      memcpy(copy->part[i], node->part[i], sizeof(Node*)*part->n);
+      i++;
+   }
+   copy->relValues = (int**)malloc(sizeof(int*)*cl->nrels);
+   for (i = 0; i < cl->nrels; i++) {
+      copy->relValues[i] = (int*)malloc(sizeof(int)*3);
+      memcpy(copy->relValues[i], node->relValues[i], sizeof(int)*3);
+   }
+   copy->assignedAttr = (TMLAttrValue**)malloc(sizeof(TMLAttrValue*)*cl->nattr);
+   memcpy(copy->assignedAttr, node->assignedAttr, sizeof(TMLAttrValue*)*cl->nattr);
+   copy->attrValues = (TMLValueMask**)malloc(sizeof(TMLValueMask*)*cl->nattr);
+   for (i = 0; i < cl->nattr; i++)
+      copy->attrValues[i] = NULL;
+   HASH_ITER(hh, cl->attr, attr, tmpattr) {
+      if (node->attrValues[attr->idx] == NULL) continue;
+      copy->attrValues[attr->idx] = (TMLValueMask*)malloc(sizeof(TMLValueMask)*valueMaskWords(attr->nvals));
+      memcpy(copy->attrValues[attr->idx], node->attrValues[attr->idx], sizeof(TMLValueMask)*valueMaskWords(attr->nvals));
+   }
+   if (node->subclMask != NULL) {
+      copy->subclMask = (int*)malloc(sizeof(int)*cl->nsubcls);
+      memcpy(copy->subclMask, node->subclMask, sizeof(int)*cl->nsubcls);
+   }
+   if (node->subclLogP != NULL) {
+      copy->subclLogP = (float*)malloc(sizeof(float)*cl->nsubcls);
+      memcpy(copy->subclLogP, node->subclLogP, sizeof(float)*cl->nsubcls);
+   }
+   if (node->par != NULL) {
+      copy->par = (Node**)malloc(sizeof(Node*)*node->npars);
+      memcpy(copy->par, node->par, sizeof(Node*)*node->npars);
+   }
+   if (node->slots != NULL) {
+      copy->slots = (PartSlot*)malloc(sizeof(PartSlot)*node->nslots);
+      memcpy(copy->slots, node->slots, sizeof(PartSlot)*node->nslots);
+   }
+}
+
+/**
+ * Copies the tree of subclass nodes of an object. Visits the same
+ * subclass nodes as freeTreeRootedAtNode.
+ */
+static Node* copySnapshotTree(SnapshotNode** mapPtr, Node* node) {
+   Node* top = node;
+   Node* topCopy = (Node*)malloc(sizeof(Node));
+   Node* copy;
+   SnapshotNode* sn;
+   PtrStack toVisit;
+   int i;
+
+   topCopy->name = (node->name == NULL) ? NULL : strdup(node->name);
+   topCopy->pathname = (node->pathname == NULL) ? NULL : strdup(node->pathname);
+   initPtrStack(&toVisit, 64);
+   pushPtrStack(&toVisit, topCopy);
+   pushPtrStack(&toVisit, node);
+   while ((node = (Node*)popPtrStack(&toVisit)) != NULL) {
+      copy = (Node*)popPtrStack(&toVisit);
+      copySnapshotNode(copy, node, top, topCopy);
+      sn = (SnapshotNode*)malloc(sizeof(SnapshotNode));
+      sn->node = node;
+      sn->copy = copy;
+      HASH_ADD_PTR(*mapPtr, node, sn);
+      if (node->subcl == NULL) continue;
+      if (node->assignedSubcl != -1 && node->subclMask == NULL) {
+         copy->subcl = (Node*)malloc(sizeof(Node));
+         pushPtrStack(&toVisit, copy->subcl);
+         pushPtrStack(&toVisit, node->subcl);
+         continue;
+      }
+      copy->subcl = (Node*)malloc(sizeof(Node)*node->cl->nsubcls);
+      for (i = 0; i < node->cl->nsubcls; i++) {
+         copy->subcl[i].name = NULL;
+         if (node->subclMask != NULL && node->subclMask[i] == 0) continue;
+         pushPtrStack(&toVisit, &(copy->subcl[i]));
+         pushPtrStack(&toVisit, &(node->subcl[i]));
+      }
+   }
+   freePtrStack(&toVisit);
+   return topCopy;
+}
+
+static void relinkSnapshotNodes(SnapshotNode* map) {
+   SnapshotNode* sn;
+   SnapshotNode* tmp;
+   Node* copy;
+   TMLPart* part;
+   TMLPart* tmppart;
+   int i, j;
+
+   HASH_ITER(hh, map, sn, tmp) {
+      copy = sn->copy;
+      for (i = 0; i < copy->npars; i++)
+         copy->par[i] = findSnapshotNode(map, copy->par[i]);
+      for (i = 0; i < copy->nslots; i++)
+         copy->slots[i].par = findSnapshotNode(map, copy->slots[i].par);
+      i = 0;
+      HASH_ITER(hh, copy->cl->part, part, tmppart) {
+         for (j = 0; j < part->n; j++)
+            copy->part[i][j] = findSnapshotNode(map, copy->part[i][j]);
+         i++;
+      }
+   }
+}
+
+/**
+ * Takes a read-only snapshot of a KB, pinned to its current evidence
+ * epoch. Queries evaluate by writing temporary evidence and log Z values
+ * into the nodes they touch, so a snapshot holds its own copy of the
+ * SPN and its evidence. It shares only the classes, which queries do not
+ * change. Each thread can therefore query its own snapshot while the KB
+ * itself takes new evidence. The copy is whole, not copy-on-write, so
+ * taking a snapshot costs time and memory in the size of the SPN.
+ *
+ * Taking the snapshot reads the KB, so it must not overlap a write to it.
+ *
+ * @param kb     TMLKB struct
+ * @return the snapshot, to be freed with freeTMLKB
+ */
+TMLKB* createTMLKBSnapshot(TMLKB* kb) {
+   TMLKB* snap = TMLKBNew();
+   SnapshotNode* map = NULL;
+   SnapshotNode* sn;
+   SnapshotNode* sntmp;
+   Node* node;
+   Node* tmp;
+   Node* copy;
+   QNode* qnode;
+   QNode* tail;
+   QNode* newq;
+   ObjRelStrsHash* objRelHash;
+   ObjRelStrsHash* objRelTmp;
+   ObjRelStrsHash* newObjRelHash;
+   RelationStr_Hash* relStrHash;
+   RelationStr_Hash* relStrTmp;
+   RelationStr_Hash* newRelStrHash;
+   int c;
+
+   snap->snapshotOf = kb;
+   snap->topcl = kb->topcl;
+   snap->numClasses = kb->numClasses;
+   snap->classes = kb->classes;
+   snap->classNameToPtr = kb->classNameToPtr;
+   snap->logZ = kb->logZ;
+   snap->mapSet = kb->mapSet;
+   snap->localMarginals = kb->localMarginals;
+   snap->epoch = kb->epoch;
+   snap->scPct = kb->scPct;
+   snap->relPctT = kb->relPctT;
+   snap->relPctF = kb->relPctF;
+   snap->l0 = kb->l0;
+   snap->l1 = kb->l1;
+
+   HASH_ITER(hh_path, kb->objectPathToPtr, node, tmp) {
+      copy = copySnapshotTree(&map, node);
+      HASH_ADD_KEYPTR(hh_path, snap->objectPathToPtr, copy->pathname, strlen(copy->pathname), copy);
+   }
+   HASH_ITER(hh, kb->objectNameToPtr, node, tmp) {
+      copy = findSnapshotNode(map, node);
+      if (copy == NULL) copy = copySnapshotTree(&map, node); // not a descendant of the top object
+      HASH_ADD_KEYPTR(hh, snap->objectNameToPtr, copy->name, strlen(copy->name), copy);
+   }
+   relinkSnapshotNodes(map);
+
+   snap->root = (Name_and_Ptr*)malloc(sizeof(Name_and_Ptr));
+   snap->root->name = kb->root->name;
+   snap->root->ptr = findSnapshotNode(map, (Node*)(kb->root->ptr));
+
+   snap->classToObjPtrs = (QNode**)malloc(sizeof(QNode*)*kb->numClasses);
+   for (c = 0; c < kb->numClasses; c++) {
+      snap->classToObjPtrs[c] = NULL;
+      tail = NULL;
+      for (qnode = kb->classToObjPtrs[c]; qnode != NULL; qnode = qnode->next) {
+         copy = findSnapshotNode(map, (Node*)(qnode->ptr));
+         if (copy == NULL) continue;
+         newq = (QNode*)malloc(sizeof(QNode));
+         newq->ptr = copy;
+         newq->next = NULL;
+         if (tail == NULL) snap->classToObjPtrs[c] = newq;
+         else tail->next = newq;
+         tail = newq;
+      }
+   }
+
+   HASH_ITER(hh, kb->objToRelFactStrs, objRelHash, objRelTmp) {
+      HASH_FIND(hh_path, snap->objectPathToPtr, objRelHash->obj, strlen(objRelHash->obj), copy);
+      if (copy == NULL) continue;
+      newObjRelHash = (ObjRelStrsHash*)malloc(sizeof(ObjRelStrsHash));
+      newObjRelHash->obj = copy->pathname;
+      newObjRelHash->hash = NULL;
+      HASH_ITER(hh, objRelHash->hash, relStrHash, relStrTmp) {
+         newRelStrHash = (RelationStr_Hash*)malloc(sizeof(RelationStr_Hash));
+         newRelStrHash->str = strdup(relStrHash->str);
+         newRelStrHash->pol = relStrHash->pol;
+         HASH_ADD_KEYPTR(hh, newObjRelHash->hash, newRelStrHash->str, strlen(newRelStrHash->str), newRelStrHash);
+      }
+      HASH_ADD_KEYPTR(hh, snap->objToRelFactStrs, newObjRelHash->obj, strlen(newObjRelHash->obj), newObjRelHash);
+   }
+
+   HASH_ITER(hh, map, sn, sntmp) {
+      HASH_DEL(map, sn);
+      free(sn);
+   }
+   return snap;
+}
+
+///////////////////////
+// The following classes are used to print a new .db file
+// based on evidence added in interactive mode
+///////////////////////
+
+
+void printSubclassesForObj(Node* obj, FILE* outFile) {
+   int c;
+   if (obj->cl->nsubcls == 0) return;
+   if (obj->assignedSubcl != -1) {
+         fprintf(outFile, ", %s", obj->cl->subcl[obj->assignedSubcl]->name);
+         if (obj->subclMask == NULL)
+            printSubclassesForObj(obj->subcl, outFile);
+         else
+            printSubclassesForObj(&(obj->subcl[obj->assignedSubcl]), outFile);
+      return;
+   }
+   if (obj->subclMask == NULL) {
+      for (c = 0; c < obj->cl->nsubcls; c++)
+         printSubclassesForObj(&(obj->subcl[c]), outFile);
+      return;
+   }
+   for (c = 0; c < obj->cl->nsubcls; c++) {
+      if (obj->subclMask[c] != 1)
+         fprintf(outFile, ", !%s", obj->cl->subcl[c]->name);
+      else {
+         printSubclassesForObj(&(obj->subcl[c]), outFile);
+      }
+   }
+}
+
+void printSubpartsForObj(Node* obj, FILE* outFile, int firstPart) {
+   TMLPart* part;
+   TMLPart* tmp;
+   TMLClass* cl = obj->cl;
+   int subcl = obj->assignedSubcl;
+   int p, i;
+   Node* nodePart;
+
+   if (cl->nsubcls == 0 || subcl == -1) {
+      p = 0;
+      HASH_ITER(hh, cl->part, part, tmp) {
+         for (i = 0; i < part->n; i++) {
+            nodePart = obj->part[p][i];
+            if (nodePart->name != NULL) {
+               if (FALSE && part->n == 1) {
+                  if (firstPart == 1) {
+                     fprintf(outFile, "%s %s", nodePart->name, part->name, (i+1));
+                     firstPart = 0;
+                  } else
+                     fprintf(outFile, ", %s %s", nodePart->name, part->name, (i+1));
+               } else {
+                  if (firstPart == 1) {
+                     fprintf(outFile, "%s %s_%d", nodePart->name, part->name, (i+1));
+                     firstPart = 0;
+                  } else
+                     fprintf(outFile, ", %s %s_%d", nodePart->name, part->name, (i+1));
+               }
+            }
+         }
+         p++;
+      } 
+      return;
+   }
+   p = 0;
+   HASH_ITER(hh, cl->part, part, tmp) {
+      if (subcl == -1 || part->defaultPart == 0 || part->defaultPartForSubcl[subcl] == 0) {
+         for (i = 0; i < part->n; i++) {
+            nodePart = obj->part[p][i];
+            if (nodePart->name != NULL) {
+               if (part->n == 1) {
+                  if (firstPart == 1) {
+                     fprintf(outFile, "%s %s", nodePart->name, part->name, (i+1));
+                     firstPart = 0;
+                  } else
+                     fprintf(outFile, ", %s %s", nodePart->name, part->name, (i+1));
+               } else {
+                  if (firstPart == 1) {
+                     fprintf(outFile, "%s %s_%d", nodePart->name, part->name, (i+1));
+                     firstPart = 0;
+                  } else
+                     fprintf(outFile, ", %s %s_%d", nodePart->name, part->name, (i+1));
+               }
+            }
+         }
+      }
+      p++;
+   }
+   if (obj->assignedSubcl != -1) {
+      printSubpartsForObj(obj->subcl, outFile,firstPart);
+      return;
+   }
+   if (obj->subclMask == NULL) {
+      return;
+   }
+   for (i = 0; i < cl->nsubcls; i++) {
+      if (obj->subclMask[i] == 1)
+         printSubpartsForObj(&(obj->subcl[i]), outFile, firstPart);
+   }
+}
+
+void printRelationsForObj(TMLKB* kb, Node* obj, FILE* outFile, int firstRel) {
+   ObjRelStrsHash* objRelHash;
+   RelationStr_Hash* relStrHash; 
+   RelationStr_Hash* tmp; 
+   char* namedStr;
+
+   if (obj->pathname != NULL)
+      HASH_FIND_STR(kb->objToRelFactStrs, obj->pathname, objRelHash);
+   else
+      HASH_FIND_STR(kb->objToRelFactStrs, obj->name, objRelHash);
+   if (objRelHash != NULL) {
+      HASH_ITER(hh, objRelHash->hash, relStrHash, tmp) {
+         namedStr = createNamedRelStr(kb, obj, relStrHash->str);
+         if (firstRel == 1) {
+            fprintf(outFile, "%s%s", ((relStrHash->pol == 1) ? "" : "!"), namedStr);
+            firstRel = 0;
+         } else {
+            fprintf(outFile, ", %s%s", ((relStrHash->pol == 1) ? "" : "!"), namedStr);
+         }
+         free(namedStr);
+      }
+   }
+}
+
+void printObject(TMLKB* kb, Node* node, FILE* outFile) {
+   char* bestPath;
+
+   if (node->name != NULL && strchr(node->name, '.') == NULL)
+      fprintf(outFile, "%s {\n", node->name);
+   else {
+      bestPath = createBestPathname(kb, node);
+      fprintf(outFile, "%s {\n", bestPath);
+      free(bestPath);
+   }
+
+   fprintf(outFile, "%s", node->cl->name);
+   printSubclassesForObj(node, outFile);
+   fprintf(outFile, ";\n");
+
+   printSubpartsForObj(node, outFile, 1);
+   fprintf(outFile, ";\n");      
+
+   printRelationsForObj(kb, node, outFile, 1);
+   fprintf(outFile, ";\n");
+   fprintf(outFile, "}\n\n"); 
+
+   
+}
+
+void printTMLKBRec(TMLKB* kb, Node* node, FILE* outFile) {
+   int p, i;
+   TMLPart* part;
+   TMLPart* tmp;
+
+   if (node->cl->par == NULL)
+      printObject(kb, node, outFile);
+
+   p = 0; 
+   HASH_ITER(hh, node->cl->part, part, tmp) {
+      if (part->defaultPart == 0 || node->assignedSubcl == -1) {
+         for (i = 0; i < part->n; i++) {
+            printTMLKBRec(kb, node->part[p][i], outFile);
+         }
+      }
+      p++;
+   }
+   if (node->cl->nsubcls != 0) {
+      if (node->assignedSubcl != -1) {
+         if (node->subclMask == NULL)
+            printTMLKBRec(kb, node->subcl, outFile);
+         else
+            printTMLKBRec(kb, &(node->subcl[node->assignedSubcl]), outFile);
+      }
+   }
+}
+
+void printTMLKB(TMLKB* kb, const char* fileName) {
+   char line[MAX_NAME_LENGTH+1];
+   char* fileType = strrchr(fileName, '.');
+   FILE* outFile;
+   char db_fmt_str[50];
+   Name_and_Ptr* name_and_ptr;
+   Name_and_Ptr* name_and_ptr_tmp;
+   Node* topNode;
+   Node* node;
+   Node* tmp;
+   int c;
+   char* bestPath;
+
+   if (fileType == NULL || strcmp(fileType, ".db") != 0) {
+      if (fileType != NULL && strcmp(fileType, ".") == 0) {
+         printf("Filename cannot end with a '.'.\n");
+         return;
+      }
+      snprintf(line, MAX_NAME_LENGTH, "%s.db", fileName);
+      outFile = fopen(line, "w");
+   } else {
+      outFile = fopen(fileName, "w");
+   }
+
+   printTMLKBRec(kb, ((Node*)(kb->root->ptr)), outFile);
+   fclose(outFile);
+}
+
+
+/**
+ * Reads in a file of worlds to evaluate as a batch. Worlds are blocks of
+ * lines separated by blank lines. Each line is a fact, in the form used in
+ * interactive mode, or a query ending in '?'. Lines starting with // are
+ * ignored.
+ *
+ * @param worldFileName   name of the world file
+ * @return the batch of worlds, NULL if the file could not be read
+ */
+TMLWorldBatch* readInTMLWorlds(const char* worldFileName) {
+   FILE* worldFile = fopen(worldFileName, "r");
+   TMLWorldBatch* batch;
+   char line[MAX_LINE_LENGTH+1];
+   char entry[MAX_LINE_LENGTH+1];
+   char fact_fmt_str[50];
+   char query_fmt_str[50];
+   char question[2];
+   char endline[2];
+   char comment[3];
+   int linenum = 0;
+   int cap = 16;
+   int inWorld = 0;
+   int w;
+
+   if (worldFile == NULL) {
+      printf("Error opening %s\n", worldFileName);
+      return NULL;
+   }
+   snprintf(fact_fmt_str, 50, "%%%d[^\r\n?)] %%1[)] %%1s", MAX_LINE_LENGTH);
+   snprintf(query_fmt_str, 50, " %%%d[^\r\n)?]) %%1[?] %%1s", MAX_LINE_LENGTH);
+
+   batch = (TMLWorldBatch*)malloc(sizeof(TMLWorldBatch));
+   batch->nworlds = 0;
+   batch->nfacts = (int*)malloc(sizeof(int)*cap);
+   batch->facts = (char***)malloc(sizeof(char**)*cap);
+   batch->nqueries = (int*)malloc(sizeof(int)*cap);
+   batch->queries = (char***)malloc(sizeof(char**)*cap);
+   batch->logZ = NULL;
+   batch->probs = NULL;
+
+   while (fgets(line, MAX_LINE_LENGTH, worldFile) != NULL) {
+      linenum++;
+      if (sscanf(line, " %2s", comment) != 1) {
+         inWorld = 0;
+         continue;
+      }
+      if (strncmp(comment, "//", 2) == 0) continue;
+      if (inWorld == 0) {
+         if (batch->nworlds == cap) {
+            cap *= 2;
+            batch->nfacts = (int*)realloc(batch->nfacts, sizeof(int)*cap);
+            batch->facts = (char***)realloc(batch->facts, sizeof(char**)*cap);
+            batch->nqueries = (int*)realloc(batch->nqueries, sizeof(int)*cap);
+            batch->queries = (char***)realloc(batch->queries, sizeof(char**)*cap);
+         }
+         w = batch->nworlds++;
+         batch->nfacts[w] = 0;
+         batch->facts[w] = NULL;
+         batch->nqueries[w] = 0;
+         batch->queries[w] = NULL;
+         inWorld = 1;
+      }
+      if (sscanf(line, query_fmt_str, entry, question, endline) == 2) {
+         batch->queries[w] = (char**)realloc(batch->queries[w], sizeof(char*)*(batch->nqueries[w]+1));
+         batch->queries[w][batch->nqueries[w]++] = strdup(entry);
+      } else if (sscanf(line, fact_fmt_str, entry, question, endline) == 2) {
+         batch->facts[w] = (char**)realloc(batch->facts[w], sizeof(char*)*(batch->nfacts[w]+1));
+         batch->facts[w][batch->nfacts[w]++] = strdup(entry);
+      } else {
+         printf("Error on line %d in world file: Malformed fact or query %s", linenum, line);
+         fclose(worldFile);
+         freeTMLWorldBatch(batch);
+         return NULL;
+      }
+   }
+   fclose(worldFile);
+   return batch;
+}
+
+/* Evidence of one node in one lane of a batch, copied from the node after
+ * the lane's facts were added to the KB.
+ */
+typedef struct NodeLaneState {
+   int** relValues;
+   TMLAttrValue** assignedAttr;
+   TMLValueMask** attrValues;
+   int assignedSubcl;
+   int* subclMask;
+} NodeLaneState;
+
+/* A node whose subtree differs from the shared KB in some lanes of a batch.
+ * lanes is sorted; state[k] is the node's own evidence in lane lanes[k],
+ * NULL if only nodes below it differ in that lane.
+ */
+typedef struct BatchNode {
+   Node* node;
+   int nlanes;
+   int cap;
+   int* lanes;
+   NodeLaneState** state;
+   UT_hash_handle hh;
+} BatchNode;
+
+static NodeLaneState* copyNodeLaneState(Node* node) {
+   TMLClass* cl = node->cl;
+   NodeLaneState* st = (NodeLaneState*)malloc(sizeof(NodeLaneState));
+   TMLAttribute* attr;
+   TMLAttribute* tmp;
+   int i;
+
+   st->relValues = (int**)malloc(sizeof(int*)*cl->nrels);
+   for (i = 0; i < cl->nrels; i++) {
+      st->relValues[i] = (int*)malloc(sizeof(int)*3);
+      memcpy(st->relValues[i], node->relValues[i], sizeof(int)*3);
+   }
+   st->assignedAttr = (TMLAttrValue**)malloc(sizeof(TMLAttrValue*)*cl->nattr);
+   st->attrValues = (TMLValueMask**)malloc(sizeof(TMLValueMask*)*cl->nattr);
+   HASH_ITER(hh, cl->attr, attr, tmp) {
+      st->assignedAttr[attr->idx] = node->assignedAttr[attr->idx];
+      if (node->attrValues[attr->idx] == NULL) {
+         st->attrValues[attr->idx] = NULL;
+      } else {
+         st->attrValues[attr->idx] = (TMLValueMask*)malloc(sizeof(TMLValueMask)*valueMaskWords(attr->nvals));
+         memcpy(st->attrValues[attr->idx], node->attrValues[attr->idx], sizeof(TMLValueMask)*valueMaskWords(attr->nvals));
+      }
+   }
+   st->assignedSubcl = node->assignedSubcl;
+   if (node->subclMask == NULL) {
+      st->subclMask = NULL;
+   } else {
+      st->subclMask = (int*)malloc(sizeof(int)*cl->nsubcls);
+      memcpy(st->subclMask, node->subclMask, sizeof(int)*cl->nsubcls);
+   }
+   return st;
+}
+
+static void freeNodeLaneState(Node* node, NodeLaneState* st) {
+   int i;
+
+   for (i = 0; i < node->cl->nrels; i++)
+      free(st->relValues[i]);
+   free(st->relValues);
+   for (i = 0; i < node->cl->nattr; i++)
+      if (st->attrValues[i] != NULL) free(st->attrValues[i]);
+   free(st->attrValues);
+   free(st->assignedAttr);
+   if (st->subclMask != NULL) free(st->subclMask);
+   free(st);
+}
+
+/**
+ * Adds lane to node's entry in the batch unless it is already the entry's
+ * last lane.
+ *
+ * @return 1 if the lane was added, 0 otherwise
+ */
+static int addBatchLane(BatchNode** batchNodes, Node* node, int lane, BatchNode** bnPtr) {
+   BatchNode* bn;
+
+   HASH_FIND_PTR(*batchNodes, &node, bn);
+   if (bn == NULL) {
+      bn = (BatchNode*)malloc(sizeof(BatchNode));
+      bn->node = node;
+      bn->nlanes = 0;
+      bn->cap = 4;
+      bn->lanes = (int*)malloc(sizeof(int)*bn->cap);
+      bn->state = (NodeLaneState**)malloc(sizeof(NodeLaneState*)*bn->cap);
+      HASH_ADD_PTR(*batchNodes, node, bn);
+   }
+   *bnPtr = bn;
+   if (bn->nlanes != 0 && bn->lanes[bn->nlanes-1] == lane) return 0;
+   if (bn->nlanes == bn->cap) {
+      bn->cap *= 2;
+      bn->lanes = (int*)realloc(bn->lanes, sizeof(int)*bn->cap);
+      bn->state = (NodeLaneState**)realloc(bn->state, sizeof(NodeLaneState*)*bn->cap);
+   }
+   bn->lanes[bn->nlanes] = lane;
+   bn->state[bn->nlanes] = NULL;
+   bn->nlanes++;
+   return 1;
+}
+
+/**
+ * Records the evidence of a lane: copies the state of every node changed by
+ * edits and adds the lane to the nodes above them.
+ *
+ * @param batchNodes   hash of the nodes of the batch
+ * @param edits        edits made by the lane's facts
+ * @param lane         lane to record
+ * @param touched      collects the changed nodes
+ */
+static void recordBatchLane(BatchNode** batchNodes, KBEdit* edits, int lane, PtrStack* touched) {
+   PtrStack toVisit;
+   BatchNode* bn;
+   Node* node;
+   int p;
+
+   initPtrStack(&toVisit, 32);
+   for (; edits != NULL; edits = edits->prev) {
+      node = edits->node;
+      if (addBatchLane(batchNodes, node, lane, &bn) == 0) {
+         if (bn->state[bn->nlanes-1] == NULL)
+            bn->state[bn->nlanes-1] = copyNodeLaneState(node);
+         continue;
+      }
+      bn->state[bn->nlanes-1] = copyNodeLaneState(node);
+      pushPtrStack(touched, node);
+      for (p = 0; p < node->npars; p++)
+         pushPtrStack(&toVisit, node->par[p]);
+      while ((node = (Node*)popPtrStack(&toVisit)) != NULL) {
+         if (addBatchLane(batchNodes, node, lane, &bn) == 0) continue;
+         for (p = 0; p < node->npars; p++)
+            pushPtrStack(&toVisit, node->par[p]);
+      }
+   }
+   freePtrStack(&toVisit);
+}
+
+/**
+ * One pending node evaluation of computeBatchLogZ, covering all lanes in
+ * which the node's subtree differs from the shared KB. Each lane keeps a
+ * copy of the node with the lane's evidence and a LogZFrame holding its
+ * partial sums, so the per-lane arithmetic is the one computeLogZ does.
+ */
+typedef struct BatchFrame {
+   Node* node;
+   TMLClass* assignedClassBySuperpart;
+   BatchNode* bn;
+   int descendantIdx;
+   int state;
+   Node* views;
+   LogZFrame* lanes;
+   float* subclZ;
+   // child being evaluated: subclass index, or part, its index and slot
+   int i;
+   TMLPart* part;
+   int p;
+   int j;
+   Node* child;
+   TMLClass* childCl;
+   int pending;
+} BatchFrame;
+
+static void pushBatchFrame(BatchFrame** frames, int* nframes, int* cap, BatchNode* bn, TMLClass* assignedClassBySuperpart) {
+   BatchFrame* f;
+   Node* node = bn->node;
+   NodeLaneState* st;
+   LogZFrame* lf;
+   int nsubcls = node->cl->nsubcls;
+   int k, c;
+
+   if (*nframes == *cap) {
+      *cap *= 2;
+      *frames = (BatchFrame*)realloc(*frames, sizeof(BatchFrame)*(*cap));
+   }
+   f = &((*frames)[*nframes]);
+   (*nframes)++;
+   f->node = node;
+   f->bn = bn;
+   f->assignedClassBySuperpart = assignedClassBySuperpart;
+   f->descendantIdx = isDescendant(assignedClassBySuperpart, node->cl);
+   f->state = LOGZ_SUBCL;
+   f->i = -1;
+   f->part = NULL;
+   f->pending = 0;
+   f->views = (Node*)malloc(sizeof(Node)*bn->nlanes);
+   f->lanes = (LogZFrame*)malloc(sizeof(LogZFrame)*bn->nlanes);
+   f->subclZ = (nsubcls == 0) ? NULL : (float*)malloc(sizeof(float)*nsubcls*bn->nlanes);
+   for (k = 0; k < bn->nlanes; k++) {
+      f->views[k] = *node;
+      st = bn->state[k];
+      if (st != NULL) {
+         f->views[k].relValues = st->relValues;
+         f->views[k].assignedAttr = st->assignedAttr;
+         f->views[k].attrValues = st->attrValues;
+         f->views[k].assignedSubcl = st->assignedSubcl;
+         f->views[k].subclMask = st->subclMask;
+      }
+      lf = &(f->lanes[k]);
+      lf->node = &(f->views[k]);
+      lf->logZ = 0.0;
+      lf->subclZ = (nsubcls == 0) ? NULL : &(f->subclZ[k*nsubcls]);
+      for (c = 0; c < nsubcls; c++)
+         lf->subclZ[c] = log(0.0);
+      if (f->descendantIdx != -1 && lf->node->assignedSubcl != -1 && lf->node->assignedSubcl != f->descendantIdx) {
+         lf->logZ = log(0.0);
+         lf->shape = -1;
+      } else if (lf->node->assignedSubcl != -1 && nsubcls != 0) {
+         lf->shape = LOGZ_ASSIGNED;
+      } else if (lf->node->assignedSubcl == -1 && nsubcls != 0 && lf->node->subclMask == NULL) {
+         lf->shape = LOGZ_OPEN;
+      } else if (lf->node->assignedSubcl == -1 && lf->node->subclMask != NULL) {
+         lf->shape = LOGZ_MASKED;
+      } else {
+         lf->shape = LOGZ_LEAF;
+      }
+   }
+}
+
+/**
+ * Returns 1 if lane k of the frame uses the value of the frame's current
+ * child, i.e. subclass branch f->i or part f->part.
+ */
+static int batchLaneUsesChild(BatchFrame* f, int k) {
+   LogZFrame* lf = &(f->lanes[k]);
+   Node* view = lf->node;
+
+   if (lf->shape == -1) return 0;
+   if (f->state == LOGZ_SUBCL) {
+      if (lf->shape == LOGZ_ASSIGNED) return (view->assignedSubcl == f->i);
+      if (lf->shape == LOGZ_MASKED && view->subclMask[f->i] != 1) return 0;
+      return (f->descendantIdx == -1 || f->descendantIdx == f->i);
+   }
+   lf->part = f->part;
+   lf->c = -2;
+   return (nextLogZPartGroup(lf, 1) != -3);
+}
+
+/**
+ * Adds the value v of the frame's current child to lane k, where
+ * computeLogZ would have added it.
+ */
+static void addBatchChildValue(BatchFrame* f, int k, float v) {
+   LogZFrame* lf = &(f->lanes[k]);
+   TMLClass* cl = f->node->cl;
+
+   if (f->state == LOGZ_SUBCL) {
+      if (lf->shape == LOGZ_ASSIGNED)
+         lf->logZ += cl->wt[f->i]+v;
+      else
+         lf->subclZ[f->i] = cl->wt[f->i]+v;
+      return;
+   }
+   lf->part = f->part;
+   lf->c = -2;
+   while ((lf->c = nextLogZPartGroup(lf, 1)) != -3) {
+      if (lf->c == -1)
+         lf->logZ += v;
+      else
+         lf->subclZ[lf->c] += v;
+   }
+}
+
+/**
+ * Adds the value of the frame's current child to every lane that uses it.
+ * Lanes the child's subtree does not differ in get the child's value in
+ * the shared KB.
+ *
+ * @param cbn     batch entry of the child, NULL if it is the same in all lanes
+ * @param cvals   values of the child in the lanes of cbn
+ */
+static void addBatchChild(BatchFrame* f, BatchNode* cbn, float* cvals) {
+   int k;
+   int m = 0;
+   int haveBase = 0;
+   float base = 0.0;
+
+   for (k = 0; k < f->bn->nlanes; k++) {
+      if (batchLaneUsesChild(f, k) == 0) continue;
+      if (cbn != NULL) {
+         while (m < cbn->nlanes && cbn->lanes[m] < f->bn->lanes[k]) m++;
+         if (m < cbn->nlanes && cbn->lanes[m] == f->bn->lanes[k]) {
+            addBatchChildValue(f, k, cvals[m]);
+            continue;
+         }
+      }
+      if (haveBase == 0) {
+         base = computeLogZ(f->child, f->childCl, spn_logsum, 0);
+         haveBase = 1;
+      }
+      addBatchChildValue(f, k, base);
+   }
+}
+
+/**
+ * Advances the frame to its next child used by any of its lanes.
+ *
+ * @return 1 if there is such a child, 0 once all children were evaluated
+ */
+static int nextBatchChild(BatchFrame* f) {
+   Node* node = f->node;
+   Node* view;
+   int k;
+
+   if (f->state == LOGZ_SUBCL) {
+      for (f->i++; f->i < node->cl->nsubcls; f->i++) {
+         for (k = 0; k < f->bn->nlanes; k++)
+            if (batchLaneUsesChild(f, k) == 1) break;
+         if (k == f->bn->nlanes) continue;
+         // the lanes' evidence, not the shared KB's, decides which subclass
+         // nodes exist
+         view = f->lanes[k].node;
+         if (view->subclMask == NULL && view->assignedSubcl != -1)
+            f->child = node->subcl;
+         else
+            f->child = &(node->subcl[f->i]);
+         f->childCl = f->assignedClassBySuperpart;
+         return 1;
+      }
+      for (k = 0; k < f->bn->nlanes; k++)
+         if (f->lanes[k].shape != -1) addLocalLogZ(&(f->lanes[k]));
+      f->state = LOGZ_PARTS;
+      f->part = node->cl->part;
+      f->p = 0;
+      f->j = -1;
+   }
+   while (f->part != NULL) {
+      if (f->j == -1) {
+         for (k = 0; k < f->bn->nlanes; k++)
+            if (batchLaneUsesChild(f, k) == 1) break;
+         if (k == f->bn->nlanes) f->j = f->part->n;
+      }
+      if (++(f->j) < f->part->n) {
+         f->child = node->part[f->p][f->j];
+         f->childCl = f->part->cl;
+         return 1;
+      }
+      f->part = (TMLPart*)(f->part->hh.next);
+      f->p++;
+      f->j = -1;
+   }
+   return 0;
+}
+
+/**
+ * Computes the partition function of every lane of a batch in one
+ * traversal of the nodes that differ from the shared KB. Nodes that are the
+ * same in all lanes are evaluated once, by computeLogZ.
+ *
+ * @param kb          TMLKB struct, holding the shared evidence
+ * @param batchNodes  nodes of the batch
+ * @param nlanes      number of lanes
+ * @param logZ        set to the log of the partition function of each lane
+ */
+static void computeBatchLogZ(TMLKB* kb, BatchNode* batchNodes, int nlanes, float* logZ) {
+   Node* root = (Node*)(kb->root->ptr);
+   BatchFrame* frames;
+   BatchFrame* f;
+   BatchNode* bn;
+   BatchNode* retBn = NULL;
+   float* retVals = NULL;
+   float base;
+   int nframes = 0;
+   int cap = 64;
+   int k;
+
+   base = computeLogZ(root, root->cl, spn_logsum, 0);
+   for (k = 0; k < nlanes; k++)
+      logZ[k] = base;
+   HASH_FIND_PTR(batchNodes, &root, bn);
+   if (bn == NULL) return;
+
+   frames = (BatchFrame*)malloc(sizeof(BatchFrame)*cap);
+   pushBatchFrame(&frames, &nframes, &cap, bn, root->cl);
+   while (nframes > 0) {
+      f = &(frames[nframes-1]);
+      if (f->pending == 1) {
+         addBatchChild(f, retBn, retVals);
+         free(retVals);
+         f->pending = 0;
+      }
+      if (nextBatchChild(f) == 1) {
+         HASH_FIND_PTR(batchNodes, &(f->child), bn);
+         if (bn == NULL) {
+            addBatchChild(f, NULL, NULL);
+         } else {
+            f->pending = 1;
+            pushBatchFrame(&frames, &nframes, &cap, bn, f->childCl);
+         }
+         continue;
+      }
+      retBn = f->bn;
+      retVals = (float*)malloc(sizeof(float)*retBn->nlanes);
+      for (k = 0; k < retBn->nlanes; k++) {
+         if (f->lanes[k].shape == LOGZ_OPEN || f->lanes[k].shape == LOGZ_MASKED)
+            f->lanes[k].logZ += spn_logsum(f->lanes[k].subclZ, f->node->cl->nsubcls, &(f->lanes[k].maxIdx));
+         retVals[k] = f->lanes[k].logZ;
+      }
+      free(f->views);
+      free(f->lanes);
+      if (f->subclZ != NULL) free(f->subclZ);
+      nframes--;
+   }
+   free(frames);
+   for (k = 0; k < retBn->nlanes; k++)
+      logZ[retBn->lanes[k]] = retVals[k];
+   free(retVals);
+}
+
+/**
+ * Evaluates a batch of worlds against the KB. Every world, and every world
+ * with one of its queries added as a fact, is a lane. The facts of each lane
+ * are added to the KB, without recomputing logZ, to record the evidence of
+ * the nodes they change, and undone again. The partition functions of all
+ * lanes are then computed in a single traversal sharing the KB's structure
+ * and evidence. Sets batch->logZ and batch->probs.
+ *
+ * @param kb      TMLKB struct
+ * @param batch   worlds to evaluate
+ */
+void computeWorldBatch(TMLKB* kb, TMLWorldBatch* batch) {
+   Node* root = (Node*)(kb->root->ptr);
+   BatchNode* batchNodes = NULL;
+   BatchNode* bn;
+   BatchNode* tmp;
+   KBEdit* savedEdits = kb->edits;
+   KBEdit* worldEdits;
+   int* onlineDirty = kb->onlineDirty;
+   PtrStack touched;
+   Node* node;
+   float logZ;
+   float* laneLogZ;
+   int* worldLane;
+   int nlanes = 0;
+   int w, q, k;
+
+   logZ = computeLogZ(root, root->cl, spn_logsum, (kb->mapSet == 1) ? 1 : 0);
+   worldLane = (int*)malloc(sizeof(int)*batch->nworlds);
+   batch->logZ = (float*)malloc(sizeof(float)*batch->nworlds);
+   batch->probs = (float**)malloc(sizeof(float*)*batch->nworlds);
+   initPtrStack(&touched, 64);
+
+   kb->deferLogZ = 1;
+   kb->edits = NULL;
+   kb->onlineDirty = NULL; // the worlds are not evidence to learn from
+   for (w = 0; w < batch->nworlds; w++) {
+      for (k = 0; k < batch->nfacts[w]; k++)
+         computeQueryOrAddEvidence(kb, batch->facts[w][k], logZ, 0, NULL);
+      worldEdits = kb->edits;
+      worldLane[w] = nlanes;
+      recordBatchLane(&batchNodes, worldEdits, nlanes++, &touched);
+      batch->probs[w] = (float*)malloc(sizeof(float)*(batch->nqueries[w]+1));
+      for (q = 0; q < batch->nqueries[w]; q++) {
+         computeQueryOrAddEvidence(kb, batch->queries[w][q], logZ, 0, NULL);
+         if (kb->edits == worldEdits) {
+            batch->probs[w][q] = NAN;
+         } else {
+            batch->probs[w][q] = 0.0;
+            recordBatchLane(&batchNodes, kb->edits, worldLane[w]+q+1, &touched);
+            resetKBEditsTo(kb, worldEdits);
+         }
+         nlanes++;
+      }
+      resetKBEdits(kb, kb->edits);
+      kb->edits = NULL;
+   }
+   kb->deferLogZ = 0;
+   kb->edits = savedEdits;
+   kb->onlineDirty = onlineDirty;
+   while ((node = (Node*)popPtrStack(&touched)) != NULL)
+      propagateKBChange(node);
+   freePtrStack(&touched);
+
+   laneLogZ = (float*)malloc(sizeof(float)*nlanes);
+   computeBatchLogZ(kb, batchNodes, nlanes, laneLogZ);
+   for (w = 0; w < batch->nworlds; w++) {
+      batch->logZ[w] = laneLogZ[worldLane[w]];
+      for (q = 0; q < batch->nqueries[w]; q++) {
+         if (isnan(batch->probs[w][q])) continue;
+         batch->probs[w][q] = exp(laneLogZ[worldLane[w]+q+1] - batch->logZ[w]);
+      }
+   }
+   free(laneLogZ);
+   free(worldLane);
+
+   HASH_ITER(hh, batchNodes, bn, tmp) {
+      HASH_DEL(batchNodes, bn);
+      for (k = 0; k < bn->nlanes; k++)
+         if (bn->state[k] != NULL) freeNodeLaneState(bn->node, bn->state[k]);
+      free(bn->state);
+      free(bn->lanes);
+      free(bn);
+   }
+}
+
+/**
+ * Prints the log partition function and query probabilities of each world
+ * of an evaluated batch.
+ *
+ * @param batch    evaluated batch
+ * @param output   optional file to also print to
+ */
+void printWorldBatch(TMLWorldBatch* batch, const char* output) {
+   FILE* outFile = NULL;
+   int w, q;
+
+   if (output != NULL) {
+      outFile = fopen(output, "w");
+      if (outFile == NULL) {
+         printf("Error opening %s\n", output);
+         return;
+      }
+   }
+   for (w = 0; w < batch->nworlds; w++) {
+      if (isnan(batch->logZ[w]) || isinf(batch->logZ[w])) {
+         printf("World %d: The facts make the knowledge base impossible.\n", w+1);
+         if (outFile != NULL)
+            fprintf(outFile, "World %d: The facts make the knowledge base impossible.\n", w+1);
+         continue;
+      }
+      printf("World %d: Log of partition function Z is %f\n", w+1, batch->logZ[w]);
+      if (outFile != NULL)
+         fprintf(outFile, "World %d: Log of partition function Z is %f\n", w+1, batch->logZ[w]);
+      for (q = 0; q < batch->nqueries[w]; q++) {
+         if (isnan(batch->probs[w][q])) {
+            printf("P[%s)] is decided by the facts of world %d.\n", batch->queries[w][q], w+1);
+            if (outFile != NULL)
+               fprintf(outFile, "P[%s)] is decided by the facts of world %d.\n", batch->queries[w][q], w+1);
+         } else {
+            printf("P[%s)] = %f\n", batch->queries[w][q], batch->probs[w][q]);
+            if (outFile != NULL)
+               fprintf(outFile, "P[%s)] = %f\n", batch->queries[w][q], batch->probs[w][q]);
+         }
+      }
+   }
+   if (outFile != NULL) fclose(outFile);
+}
+
+void freeTMLWorldBatch(TMLWorldBatch* batch) {
+   int w, i;
+
+   for (w = 0; w < batch->nworlds; w++) {
+      for (i = 0; i < batch->nfacts[w]; i++)
+         free(batch->facts[w][i]);
+      if (batch->facts[w] != NULL) free(batch->facts[w]);
+      for (i = 0; i < batch->nqueries[w]; i++)
+         free(batch->queries[w][i]);
+      if (batch->queries[w] != NULL) free(batch->queries[w]);
+      if (batch->probs != NULL) free(batch->probs[w]);
+   }
+   free(batch->nfacts);
+   free(batch->facts);
+   free(batch->nqueries);
+   free(batch->queries);
+   if (batch->logZ != NULL) free(batch->logZ);
+   if (batch->probs != NULL) free(batch->probs);
+   free(batch);
+}
+
+/**
+ * Sets up lanes for nvecs weight vectors over the parameters of the KB,
+ * each lane holding the KB's current weights. Parameters are ordered by
+ * class, in the order classes are declared: the weights of the class's
+ * subclasses, the positive and negative weights of each of its soft
+ * relations, then the weight of each value of each of its attributes.
+ * Weights are the ones the KB uses, i.e. including those inherited from
+ * the relations and attributes a class overrides.
+ *
+ * @param kb      TMLKB struct
+ * @param nvecs   number of weight vectors
+ * @return the weight lanes
+ */
+TMLWeightLanes* createTMLWeightLanes(TMLKB* kb, int nvecs) {
+   TMLWeightLanes* wl = (TMLWeightLanes*)malloc(sizeof(TMLWeightLanes));
+   TMLClass* cl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   int c, i, r, w;
+   int n = 0;
+
+   wl->nvecs = nvecs;
+   wl->nclasses = kb->numClasses;
+   wl->classOffset = (int*)malloc(sizeof(int)*kb->numClasses);
+   wl->relOffset = (int**)malloc(sizeof(int*)*kb->numClasses);
+   wl->attrOffset = (int**)malloc(sizeof(int*)*kb->numClasses);
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      wl->classOffset[c] = n;
+      n += cl->nsubcls;
+      wl->relOffset[c] = (int*)malloc(sizeof(int)*(cl->nrels+1));
+      r = 0;
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         if (rel->hard == 0) {
+            wl->relOffset[c][r] = n;
+            n += 2;
+         } else
+            wl->relOffset[c][r] = -1;
+         r++;
+      }
+      wl->attrOffset[c] = (int*)malloc(sizeof(int)*(cl->nattr+1));
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         wl->attrOffset[c][attr->idx] = n;
+         n += attr->nvals;
+      }
+   }
+   wl->nparams = n;
+   wl->wts = (float*)malloc(sizeof(float)*(n > 0 ? n : 1)*nvecs);
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      for (i = 0; i < cl->nsubcls; i++)
+         for (w = 0; w < nvecs; w++)
+            wl->wts[(wl->classOffset[c]+i)*nvecs+w] = cl->wt[i];
+      r = 0;
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         if (wl->relOffset[c][r] != -1) {
+            for (w = 0; w < nvecs; w++) {
+               wl->wts[wl->relOffset[c][r]*nvecs+w] = rel->pwt;
+               wl->wts[(wl->relOffset[c][r]+1)*nvecs+w] = rel->nwt;
+            }
+         }
+         r++;
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         HASH_ITER(hh, attr->vals, attrval, tmpv) {
+            for (w = 0; w < nvecs; w++)
+               wl->wts[(wl->attrOffset[c][attr->idx]+attrval->idx)*nvecs+w] = attrval->wt;
+         }
+      }
+   }
+   return wl;
+}
+
+void freeTMLWeightLanes(TMLWeightLanes* wl) {
+   int c;
+
+   for (c = 0; c < wl->nclasses; c++) {
+      free(wl->relOffset[c]);
+      free(wl->attrOffset[c]);
+   }
+   free(wl->relOffset);
+   free(wl->attrOffset);
+   free(wl->classOffset);
+   free(wl->wts);
+   free(wl);
+}
+
+/**
+ * Prints the parameters of the KB, one per line, in the order weight
+ * vectors list them, with their current weights.
+ */
+void printTMLWeightLayout(TMLKB* kb, FILE* outFile) {
+   TMLClass* cl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   int c, i;
+
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      for (i = 0; i < cl->nsubcls; i++)
+         fprintf(outFile, "   %s: subclass %s %f\n", cl->name, cl->subcl[i]->name, cl->wt[i]);
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         if (rel->hard != 0) continue;
+         fprintf(outFile, "   %s: %s %f\n", cl->name, rel->name, rel->pwt);
+         fprintf(outFile, "   %s: !%s %f\n", cl->name, rel->name, rel->nwt);
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         HASH_ITER(hh, attr->vals, attrval, tmpv)
+            fprintf(outFile, "   %s: %s %s %f\n", cl->name, attr->name, attrval->name, attrval->wt);
+      }
+   }
+}
+
+/**
+ * Reads in a file of weight vectors, one per line, each listing a weight
+ * for every parameter of the KB in the order of printTMLWeightLayout.
+ * Blank lines and lines starting with // are ignored.
+ *
+ * @param kb               TMLKB struct
+ * @param weightFileName   name of the weight file
+ * @return the weight lanes, NULL if the file could not be read
+ */
+TMLWeightLanes* readInTMLWeightVectors(TMLKB* kb, const char* weightFileName) {
+   FILE* weightFile = fopen(weightFileName, "r");
+   TMLWeightLanes* wl;
+   char line[MAX_LINE_LENGTH+1];
+   char comment[3];
+   char* iter;
+   char* end;
+   float* vecs = NULL;
+   int nvecs = 0;
+   int linenum = 0;
+   int n, i, w;
+
+   if (weightFile == NULL) {
+      printf("Error opening %s\n", weightFileName);
+      return NULL;
+   }
+   wl = createTMLWeightLanes(kb, 1);
+   while (fgets(line, MAX_LINE_LENGTH, weightFile) != NULL) {
+      linenum++;
+      if (sscanf(line, " %2s", comment) != 1 || strncmp(comment, "//", 2) == 0) continue;
+      vecs = (float*)realloc(vecs, sizeof(float)*(wl->nparams > 0 ? wl->nparams : 1)*(nvecs+1));
+      n = 0;
+      iter = line;
+      while (1) {
+         while (*iter == ',' || *iter == ' ' || *iter == '\t' || *iter == '\r' || *iter == '\n') iter++;
+         if (*iter == '\0') break;
+         if (n < wl->nparams)
+            vecs[nvecs*wl->nparams+n] = strtof(iter, &end);
+         else
+            strtof(iter, &end);
+         if (end == iter) {
+            n = -1;
+            break;
+         }
+         n++;
+         iter = end;
+      }
+      if (n != wl->nparams) {
+         if (n == -1)
+            printf("Error on line %d in weight file: Malformed weight.\n", linenum);
+         else
+            printf("Error on line %d in weight file: Expected %d weights, found %d. Weights are in the order:\n", linenum, wl->nparams, n);
+         if (n != -1) printTMLWeightLayout(kb, stdout);
+         fclose(weightFile);
+         free(vecs);
+         freeTMLWeightLanes(wl);
+         return NULL;
+      }
+      nvecs++;
+   }
+   fclose(weightFile);
+   freeTMLWeightLanes(wl);
+   if (nvecs == 0) {
+      printf("No weight vectors in %s.\n", weightFileName);
+      return NULL;
+   }
+   wl = createTMLWeightLanes(kb, nvecs);
+   for (w = 0; w < nvecs; w++)
+      for (i = 0; i < wl->nparams; i++)
+         wl->wts[i*nvecs+w] = vecs[w*wl->nparams+i];
+   free(vecs);
+   return wl;
+}
+
+/*
+ * Rebuilds the index of object nodes by class if evidence was added or
+ * undone, or objects were filled out, since it was built
+ */
+static void indexObjectsByClass(TMLKB* kb) {
+   Node* node;
+   Node* tmp;
+   QNode* qnode;
+   QNode* next;
+   int c;
+
+   updateKBEpoch(kb);
+   if (kb->objectsByClass != NULL && kb->indexedEpoch == kb->epoch && kb->indexedEdits == kb->edits
+         && kb->nindexedObjects == HASH_CNT(hh_path, kb->objectPathToPtr))
+      return;
+   if (kb->objectsByClass == NULL) {
+      kb->objectsByClass = (QNode**)malloc(sizeof(QNode*)*kb->numClasses);
+      for (c = 0; c < kb->numClasses; c++)
+         kb->objectsByClass[c] = NULL;
+   }
+   for (c = 0; c < kb->numClasses; c++) {
+      for (qnode = kb->objectsByClass[c]; qnode != NULL; qnode = next) {
+         next = qnode->next;
+         free(qnode);
+      }
+      kb->objectsByClass[c] = NULL;
+   }
+   HASH_ITER(hh_path, kb->objectPathToPtr, node, tmp) {
+      qnode = (QNode*)malloc(sizeof(QNode));
+      qnode->ptr = node;
+      qnode->next = kb->objectsByClass[node->cl->id];
+      kb->objectsByClass[node->cl->id] = qnode;
+   }
+   kb->nindexedObjects = HASH_CNT(hh_path, kb->objectPathToPtr);
+   kb->indexedEpoch = kb->epoch;
+   kb->indexedEdits = kb->edits;
+}
+
+/**
+ * Marks changed the nodes of a class, whose values depend on its weights,
+ * and their ancestors. The objects of the class's root class are found in
+ * an index, and each is followed down its subclass nodes to the class's
+ * node, if it has one.
+ */
+static void markClassNodesChanged(TMLKB* kb, TMLClass* cl) {
+   TMLClass* top = rootClass(cl);
+   TMLClass** chain = (TMLClass**)malloc(sizeof(TMLClass*)*(cl->level+1));
+   TMLClass* tmpcl;
+   QNode* qnode;
+   Node* node;
+   int n = 0;
+   int i, k;
+
+   for (tmpcl = cl; tmpcl != top; tmpcl = tmpcl->par)
+      chain[n++] = tmpcl;
+   indexObjectsByClass(kb);
+   for (qnode = kb->objectsByClass[top->id]; qnode != NULL; qnode = qnode->next) {
+      node = (Node*)(qnode->ptr);
+      for (k = n-1; k >= 0 && node != NULL; k--) {
+         // Follow the branches computeLogZ does, which are filled out
+         i = chain[k]->subclIdx;
+         if (node->subcl == NULL)
+            node = NULL;
+         else if (node->assignedSubcl != -1 && node->assignedSubcl != i)
+            node = NULL;
+         else if (node->assignedSubcl != -1 && node->subclMask == NULL)
+            node = node->subcl;
+         else if (node->assignedSubcl == -1 && node->subclMask != NULL && node->subclMask[i] != 1)
+            node = NULL;
+         else
+            node = &(node->subcl[i]);
+         if (node != NULL && node->cl != chain[k]) node = NULL;
+      }
+      if (node != NULL) propagateKBChangeUp(node);
+   }
+   free(chain);
+   cl->localKernel = NULL; // generated for the old weights
+}
+
+/* Changes one weight of a class, returning 1 if it was changed */
+static int changeClassWeight(float* wt, float newWt) {
+   if (*wt == newWt) return 0;
+   *wt = newWt;
+   return 1;
+}
+
+/**
+ * Adds delta to the weights the descendants of a class inherit from one of
+ * its relations (valName NULL) or attribute values. A class that overrides
+ * a relation or attribute holds the sum of its own weight and the nearest
+ * ancestor's, as readInRelations and readInAttribute build it, so
+ * every descendant that overrides it moves with the class.
+ */
+static void shiftInheritedWeights(TMLKB* kb, TMLClass* cl, const char* name, const char* valName, int neg, float delta) {
+   TMLClass* sub;
+   TMLRelation* rel;
+   TMLAttribute* attr;
+   TMLAttrValue* attrval;
+   int i;
+
+   for (i = 0; i < cl->nsubcls; i++) {
+      sub = cl->subcl[i];
+      if (valName == NULL) {
+         rel = getRelation(sub, name);
+         if (rel != NULL) {
+            if (neg) rel->nwt += delta;
+            else rel->pwt += delta;
+            markClassNodesChanged(kb, sub);
+         }
+      } else {
+         attr = getAttribute(sub, name);
+         attrval = NULL;
+         if (attr != NULL) HASH_FIND_STR(attr->vals, valName, attrval);
+         if (attrval != NULL) {
+            attrval->wt += delta;
+            compileTMLAttribute(attr);
+            markClassNodesChanged(kb, sub);
+         }
+      }
+      shiftInheritedWeights(kb, sub, name, valName, neg, delta);
+   }
+}
+
+/* Updates log Z after the weights of some classes changed */
+static float updateLogZForWeights(TMLKB* kb) {
+   releaseQueryBlocking(kb);
+   flushQueryCache(kb);
+   return computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, (kb->mapSet == 1) ? 1 : 0);
+}
+
+/**
+ * Sets one weight of the KB in place, without rebuilding the SPN. Only
+ * the nodes of the class the weight belongs to are recomputed. Weights
+ * are named as printTMLWeightLayout prints them:
+ *    <Class>: subclass <Subclass>
+ *    <Class>: <Relation>   or   <Class>: !<Relation>
+ *    <Class>: <Attribute> <Value>
+ * and are the ones the KB uses, i.e. including those inherited from the
+ * relations a class overrides. The descendants that override the relation
+ * or attribute keep their own part of the weight, so they move by the
+ * same amount.
+ *
+ * @param kb      TMLKB struct
+ * @param param   the weight to set
+ * @param wt      its new value
+ * @param logZ    current log of Z
+ * @return the updated log of Z, or logZ if there is no such weight
+ */
+float setTMLWeight(TMLKB* kb, const char* param, float wt, float logZ) {
+   char clName[MAX_NAME_LENGTH+1];
+   char name[MAX_NAME_LENGTH+1];
+   char valName[MAX_NAME_LENGTH+1];
+   char excl[2];
+   char fmt_str[50];
+   TMLClass* cl;
+   TMLRelation* rel;
+   TMLAttribute* attr;
+   TMLAttrValue* attrval;
+   int correctScan;
+   int changed = 0;
+   float delta;
+   int i;
+
+   snprintf(fmt_str, 50, " %%%d[^: \t] : %%%ds %%%ds %%1s", MAX_NAME_LENGTH, MAX_NAME_LENGTH, MAX_NAME_LENGTH);
+   correctScan = sscanf(param, fmt_str, clName, name, valName, excl);
+   if (correctScan != 2 && correctScan != 3) {
+      printf("Malformed weight %s.\n", param);
+      return logZ;
+   }
+   HASH_FIND_STR(kb->classNameToPtr, clName, cl);
+   if (cl == NULL) {
+      printf("Unknown class %s.\n", clName);
+      return logZ;
+   }
+   if (correctScan == 3 && strcmp(name, "subclass") == 0) {
+      for (i = 0; i < cl->nsubcls; i++)
+         if (strcmp(cl->subcl[i]->name, valName) == 0) break;
+      if (i == cl->nsubcls) {
+         printf("%s is not a subclass of %s.\n", valName, clName);
+         return logZ;
+      }
+      changed = changeClassWeight(&(cl->wt[i]), wt);
+   } else if (correctScan == 3) {
+      HASH_FIND_STR(cl->attr, name, attr);
+      if (attr == NULL) {
+         printf("Attribute %s not defined for class %s.\n", name, clName);
+         return logZ;
+      }
+      HASH_FIND_STR(attr->vals, valName, attrval);
+      if (attrval == NULL) {
+         printf("%s is not a valid value for attribute %s in objects of class %s.\n", valName, name, clName);
+         return logZ;
+      }
+      delta = wt-attrval->wt;
+      changed = changeClassWeight(&(attrval->wt), wt);
+      if (changed) compileTMLAttribute(attr);
+      if (changed) shiftInheritedWeights(kb, cl, name, valName, 0, delta);
+   } else {
+      HASH_FIND_STR(cl->rel, (name[0] == '!') ? name+1 : name, rel);
+      if (rel == NULL) {
+         printf("Relation %s not defined for class %s.\n", (name[0] == '!') ? name+1 : name, clName);
+         return logZ;
+      }
+      if (rel->hard != 0) {
+         printf("Relation %s is hard in class %s and has no weight.\n", rel->name, clName);
+         return logZ;
+      }
+      delta = wt-((name[0] == '!') ? rel->nwt : rel->pwt);
+      changed = changeClassWeight((name[0] == '!') ? &(rel->nwt) : &(rel->pwt), wt);
+      if (changed) shiftInheritedWeights(kb, cl, rel->name, NULL, name[0] == '!', delta);
+   }
+   if (!changed) return logZ;
+   markClassNodesChanged(kb, cl);
+   return updateLogZForWeights(kb);
+}
+
+/* Sets the weights of a class to one weight vector of some weight lanes,
+ * returning 1 if any of them changed */
+static int setClassWeightsFromLanes(TMLClass* cl, TMLWeightLanes* wl, int w) {
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   int W = wl->nvecs;
+   int c = cl->id;
+   int changed = 0;
+   int attrChanged;
+   int i, r;
+
+   for (i = 0; i < cl->nsubcls; i++)
+      changed |= changeClassWeight(&(cl->wt[i]), wl->wts[(wl->classOffset[c]+i)*W+w]);
+   r = 0;
+   HASH_ITER(hh, cl->rel, rel, tmp) {
+      if (wl->relOffset[c][r] != -1) {
+         changed |= changeClassWeight(&(rel->pwt), wl->wts[wl->relOffset[c][r]*W+w]);
+         changed |= changeClassWeight(&(rel->nwt), wl->wts[(wl->relOffset[c][r]+1)*W+w]);
+      }
+      r++;
+   }
+   HASH_ITER(hh, cl->attr, attr, tmpa) {
+      attrChanged = 0;
+      HASH_ITER(hh, attr->vals, attrval, tmpv)
+         attrChanged |= changeClassWeight(&(attrval->wt), wl->wts[(wl->attrOffset[c][attr->idx]+attrval->idx)*W+w]);
+      if (attrChanged) compileTMLAttribute(attr);
+      changed |= attrChanged;
+   }
+   return changed;
+}
+
+/**
+ * Makes one weight vector of some weight lanes the KB's weights, without
+ * rebuilding the SPN. Only the nodes of the classes whose weights differ
+ * are recomputed.
+ *
+ * @param kb     TMLKB struct
+ * @param wl     weight lanes over the parameters of the KB
+ * @param w      the weight vector to use
+ * @param logZ   current log of Z
+ * @return the updated log of Z
+ */
+float setTMLWeightVector(TMLKB* kb, TMLWeightLanes* wl, int w, float logZ) {
+   TMLClass* cl;
+   int nchanged = 0;
+   int c;
+
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      if (setClassWeightsFromLanes(cl, wl, w)) {
+         markClassNodesChanged(kb, cl);
+         nchanged++;
+      }
+   }
+   if (nchanged == 0) return logZ;
+   return updateLogZForWeights(kb);
+}
+
+/**
+ * Reloads the KB's weights from a weight file holding one weight vector
+ * (see readInTMLWeightVectors), without rebuilding the SPN.
+ *
+ * @param kb               TMLKB struct
+ * @param weightFileName   name of the weight file
+ * @param logZ             current log of Z
+ * @return the updated log of Z, or logZ if the file could not be read
+ */
+float reloadTMLWeights(TMLKB* kb, const char* weightFileName, float logZ) {
+   TMLWeightLanes* wl = readInTMLWeightVectors(kb, weightFileName);
+
+   if (wl == NULL) return logZ;
+   if (wl->nvecs > 1)
+      printf("Using the first of the %d weight vectors in %s.\n", wl->nvecs, weightFileName);
+   logZ = setTMLWeightVector(kb, wl, 0, logZ);
+   freeTMLWeightLanes(wl);
+   return logZ;
+}
+
+/* One pending node evaluation of computeWeightLanesLogZ. The LogZFrame
+ * walks the node's children exactly as computeLogZ does; the lanes hold
+ * the partial sums of each weight vector.
+ */
+typedef struct WeightFrame {
+   LogZFrame f;
+   float* logZ;
+   float* subclZ;
+} WeightFrame;
+
+static void pushWeightFrame(WeightFrame** frames, int* nframes, int* cap, Node* node, TMLClass* assignedClassBySuperpart) {
+   WeightFrame* wf;
+
+   if (*nframes == *cap) {
+      *cap *= 2;
+      *frames = (WeightFrame*)realloc(*frames, sizeof(WeightFrame)*(*cap));
+   }
+   wf = &((*frames)[*nframes]);
+   wf->f.node = node;
+   wf->f.assignedClassBySuperpart = assignedClassBySuperpart;
+   wf->f.state = LOGZ_ENTER;
+   (*nframes)++;
+}
+
+/**
+ * Lane version of addLocalLogZ: adds the relation and attribute weights of
+ * the frame's node under each weight vector. Weights derived from a
+ * parameter alone (the log-sum of a relation's two weights, or of all of
+ * an attribute's values) are computed once per node and lane.
+ *
+ * @param args   scratch space for the values of the largest attribute
+ */
+static void addLocalWeightLanes(WeightFrame* wf, TMLWeightLanes* wl, float* args) {
+   LogZFrame* f = &(wf->f);
+   Node* node = f->node;
+   TMLClass* cl = node->cl;
+   int** relValues = node->relValues;
+   int W = wl->nvecs;
+   int* relVals;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   float* pwt;
+   float* nwt;
+   float* vwt;
+   double relwt;
+   float attrwt;
+   TMLValueMask* mask;
+   int r = 0;
+   int j, w, toSubcl;
+
+   HASH_ITER(hh, cl->rel, rel, tmp) {
+      relVals = *relValues;
+      relValues++;
+      toSubcl = (f->shape == LOGZ_OPEN || f->shape == LOGZ_MASKED) && rel->defaultRel != 0;
+      if (f->shape == LOGZ_ASSIGNED && rel->defaultRel != 0 && rel->defaultRelForSubcl[node->assignedSubcl] != 0) {
+         r++;
+         continue;
+      }
+      if (wl->relOffset[cl->id][r] == -1) {
+         pwt = NULL;
+         nwt = NULL;
+      } else {
+         pwt = &(wl->wts[wl->relOffset[cl->id][r]*W]);
+         nwt = &(wl->wts[(wl->relOffset[cl->id][r]+1)*W]);
+      }
+      r++;
+      for (w = 0; w < W; w++) {
+         if (rel->hard == 0)
+            relwt = ((relVals[0] != 0) ? relVals[0]*nwt[w] : 0.0)
+               +((relVals[1] != 0) ? relVals[1]*pwt[w] : 0.0)
+               +((relVals[2] != 0) ? relVals[2]*logsum_float(pwt[w],nwt[w]) : 0.0);
+         else
+            relwt = relWeight(relVals, rel);
+         if (toSubcl == 0) {
+            wf->logZ[w] += relwt;
+            continue;
+         }
+         for (j = 0; j < cl->nsubcls; j++) {
+            if (f->shape == LOGZ_MASKED && node->subclMask[j] != 1) continue;
+            if (rel->defaultRelForSubcl[j] == 0)
+               wf->subclZ[w*cl->nsubcls+j] += relwt;
+         }
+      }
+   }
+   HASH_ITER(hh, cl->attr, attr, tmpa) {
+      toSubcl = (f->shape == LOGZ_OPEN || f->shape == LOGZ_MASKED) && attr->defaultAttr != 0;
+      if (f->shape == LOGZ_ASSIGNED && attr->defaultAttr != 0 && attr->defaultAttrForSubcl[node->assignedSubcl] != 0)
+         continue;
+      vwt = &(wl->wts[wl->attrOffset[cl->id][attr->idx]*W]);
+      mask = node->attrValues[attr->idx];
+      for (w = 0; w < W; w++) {
+         if (node->assignedAttr[attr->idx] != NULL) {
+            attrwt = vwt[node->assignedAttr[attr->idx]->idx*W+w];
+         } else {
+            HASH_ITER(hh, attr->vals, attrval, tmpv) {
+               if (mask != NULL && isValueMasked(mask, attrval->idx))
+                  args[attrval->idx] = log(0.0);
+               else
+                  args[attrval->idx] = vwt[attrval->idx*W+w];
+            }
+            attrwt = logsumarr_float(args, attr->nvals);
+         }
+         if (toSubcl == 0) {
+            wf->logZ[w] += attrwt;
+            continue;
+         }
+         for (j = 0; j < cl->nsubcls; j++) {
+            if (f->shape == LOGZ_MASKED && node->subclMask[j] != 1) continue;
+            if (attr->defaultAttrForSubcl[j] == 0)
+               wf->subclZ[w*cl->nsubcls+j] += attrwt;
+         }
+      }
+   }
+}
+
+/**
+ * Computes the partition function of the KB under each weight vector of
+ * wl in a single traversal of the SPN. Each node carries one value per
+ * weight vector; the evidence and structure are shared by all of them.
+ * The KB's own weights and cached values are left unchanged.
+ *
+ * A lane holding the KB's own weights (createTMLWeightLanes) gives the
+ * KB's log Z exactly. Weights read from a file are only as precise as
+ * they were written: an inherited weight the KB sums in float, such as
+ * 0.7+0.2, is read back as the nearest float to 0.9, so log Z can differ
+ * from the KB's in its last digits.
+ *
+ * @param kb     TMLKB struct
+ * @param wl     weight vectors
+ * @param logZ   set to the log of the partition function under each vector
+ */
+void computeWeightLanesLogZ(TMLKB* kb, TMLWeightLanes* wl, float* logZ) {
+   Node* root = (Node*)(kb->root->ptr);
+   WeightFrame* frames;
+   WeightFrame* wf;
+   LogZFrame* f;
+   Node* node;
+   Node* child;
+   TMLClass* cl;
+   float* ret = NULL;
+   float* cwt;
+   float* args;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   int W = wl->nvecs;
+   int nframes = 0;
+   int cap = 64;
+   int maxVals = 1;
+   int w, c;
+
+   for (c = 0; c < kb->numClasses; c++) {
+      HASH_ITER(hh, kb->classes[c].attr, attr, tmpa) {
+         if (attr->nvals > maxVals) maxVals = attr->nvals;
+      }
+   }
+   args = (float*)malloc(sizeof(float)*maxVals);
+   frames = (WeightFrame*)malloc(sizeof(WeightFrame)*cap);
+   pushWeightFrame(&frames, &nframes, &cap, root, root->cl);
+   while (nframes > 0) {
+      wf = &(frames[nframes-1]);
+      f = &(wf->f);
+      node = f->node;
+      cl = node->cl;
+      if (f->state == LOGZ_ENTER) {
+         f->descendantIdx = isDescendant(f->assignedClassBySuperpart, cl);
+         wf->logZ = (float*)malloc(sizeof(float)*W);
+         if (f->descendantIdx != -1 && node->assignedSubcl != -1 && node->assignedSubcl != f->descendantIdx) {
+            for (w = 0; w < W; w++)
+               wf->logZ[w] = log(0.0);
+            ret = wf->logZ;
+            nframes--;
+            continue;
+         }
+         for (w = 0; w < W; w++)
+            wf->logZ[w] = 0.0;
+         wf->subclZ = NULL;
+         f->i = -1;
+         f->part = cl->part;
+         f->p = 0;
+         f->c = -2;
+         f->j = -1;
+         f->pending = 0;
+         if (node->assignedSubcl != -1 && cl->nsubcls != 0) {
+            f->shape = LOGZ_ASSIGNED;
+            f->state = LOGZ_SUBCL;
+            if (node->subclMask == NULL)
+               child = node->subcl;
+            else
+               child = &(node->subcl[node->assignedSubcl]);
+            pushWeightFrame(&frames, &nframes, &cap, child, f->assignedClassBySuperpart);
+         } else if (node->assignedSubcl == -1 && cl->nsubcls != 0) {
+            f->shape = (node->subclMask == NULL) ? LOGZ_OPEN : LOGZ_MASKED;
+            f->state = LOGZ_SUBCL;
+            wf->subclZ = (float*)malloc(sizeof(float)*cl->nsubcls*W);
+         } else {
+            f->shape = LOGZ_LEAF;
+            f->state = LOGZ_PARTS;
+            addLocalWeightLanes(wf, wl, args);
+         }
+         continue;
+      }
+
+      if (f->state == LOGZ_SUBCL) {
+         cwt = &(wl->wts[wl->classOffset[cl->id]*W]);
+         if (f->shape == LOGZ_ASSIGNED) {
+            for (w = 0; w < W; w++)
+               wf->logZ[w] += cwt[node->assignedSubcl*W+w]+ret[w];
+            free(ret);
+         } else {
+            if (f->i >= 0) {
+               for (w = 0; w < W; w++)
+                  wf->subclZ[w*cl->nsubcls+f->i] = cwt[f->i*W+w]+ret[w];
+               free(ret);
+            }
+            for (f->i++; f->i < cl->nsubcls; f->i++) {
+               if ((f->shape == LOGZ_MASKED && node->subclMask[f->i] != 1)
+                     || (f->descendantIdx != -1 && f->descendantIdx != f->i)) {
+                  for (w = 0; w < W; w++)
+                     wf->subclZ[w*cl->nsubcls+f->i] = log(0.0);
+               } else
+                  break;
+            }
+            if (f->i < cl->nsubcls) {
+               pushWeightFrame(&frames, &nframes, &cap, &(node->subcl[f->i]), f->assignedClassBySuperpart);
+               continue;
+            }
+         }
+         addLocalWeightLanes(wf, wl, args);
+         f->state = LOGZ_PARTS;
+      }
+
+      // LOGZ_PARTS
+      if (f->pending == 1) {
+         for (w = 0; w < W; w++) {
+            if (f->c == -1)
+               wf->logZ[w] += ret[w];
+            else
+               wf->subclZ[w*cl->nsubcls+f->c] += ret[w];
+         }
+         free(ret);
+         f->pending = 0;
+      }
+      child = nextLogZPartNode(f);
+      if (child != NULL) {
+         f->pending = 1;
+         pushWeightFrame(&frames, &nframes, &cap, child, f->part->cl);
+         continue;
+      }
+      if (wf->subclZ != NULL) {
+         for (w = 0; w < W; w++)
+            wf->logZ[w] += spn_logsum(&(wf->subclZ[w*cl->nsubcls]), cl->nsubcls, &c);
+         free(wf->subclZ);
+      }
+      ret = wf->logZ;
+      nframes--;
+   }
+   free(frames);
+   free(args);
+   memcpy(logZ, ret, sizeof(float)*W);
+   free(ret);
+}
+
+/**
+ * Computes the probability of a query under each weight vector, as the
+ * ratio of the partition functions with and without the query added as a
+ * fact.
+ *
+ * @param kb      TMLKB struct
+ * @param wl      weight vectors
+ * @param query   ground fact to query, in the form used in interactive mode
+ * @param logZ    log partition functions of the KB under each vector
+ * @param probs   set to the probability of the query under each vector
+ * @return 1 if the query was computed, 0 if the KB's facts already decide it
+ */
+int computeWeightLanesQuery(TMLKB* kb, TMLWeightLanes* wl, char* query, float* logZ, float* probs) {
+   Node* root = (Node*)(kb->root->ptr);
+   KBEdit* savedEdits = kb->edits;
+   KBEdit* edit;
+   int* onlineDirty = kb->onlineDirty;
+   float* queryLogZ;
+   int w;
+
+   kb->deferLogZ = 1;
+   kb->onlineDirty = NULL; // the query is not evidence to learn from
+   computeQueryOrAddEvidence(kb, query, root->logZ, 0, NULL);
+   kb->deferLogZ = 0;
+   if (kb->edits == savedEdits) {
+      kb->onlineDirty = onlineDirty;
+      return 0;
+   }
+   queryLogZ = (float*)malloc(sizeof(float)*wl->nvecs);
+   computeWeightLanesLogZ(kb, wl, queryLogZ);
+   for (w = 0; w < wl->nvecs; w++)
+      probs[w] = exp(queryLogZ[w] - logZ[w]);
+   free(queryLogZ);
+   for (edit = kb->edits; edit != savedEdits; edit = edit->prev)
+      propagateKBChange(edit->node);
+   resetKBEditsTo(kb, savedEdits);
+   kb->onlineDirty = onlineDirty;
+   return 1;
+}
+
+/**
+ * Prints the log partition function, and the probability of the query if
+ * there is one, under each weight vector.
+ *
+ * @param query    query, NULL if none
+ * @param probs    probabilities of the query, NULL if its facts decide it
+ * @param output   optional file to also print to
+ */
+void printWeightLanes(TMLWeightLanes* wl, float* logZ, const char* query, float* probs, const char* output) {
+   FILE* outFile = NULL;
+   int w;
+
+   if (output != NULL) {
+      outFile = fopen(output, "w");
+      if (outFile == NULL) {
+         printf("Error opening %s\n", output);
+         return;
+      }
+   }
+   if (query != NULL && probs == NULL) {
+      printf("P[%s)] is decided by the facts.\n", query);
+      if (outFile != NULL)
+         fprintf(outFile, "P[%s)] is decided by the facts.\n", query);
+   }
+   for (w = 0; w < wl->nvecs; w++) {
+      printf("Weight vector %d: Log of partition function Z is %f\n", w+1, logZ[w]);
+      if (outFile != NULL)
+         fprintf(outFile, "Weight vector %d: Log of partition function Z is %f\n", w+1, logZ[w]);
+      if (query == NULL || probs == NULL) continue;
+      printf("P[%s)] = %f\n", query, probs[w]);
+      if (outFile != NULL)
+         fprintf(outFile, "P[%s)] = %f\n", query, probs[w]);
+   }
+   if (outFile != NULL) fclose(outFile);
+}
+
+///////////////////////
+// The following functions generate C code specialized to the rules
+// of a KB for the local weights of computeLogZ, and load it back in
+///////////////////////
+
+// Version of the node layout generated code reads, part of the signature
+// so kernels generated for an older layout are not loaded
+#define TML_KERNEL_VERSION 2
+
+/**
+ * Returns a hash of the class, relation and attribute names and weights of
+ * the KB. A generated kernel is only loaded into a KB with the same
+ * signature as the one it was generated from.
+ */
+unsigned long computeModelSignature(TMLKB* kb) {
+   unsigned long sig = 14695981039346656037UL;
+   TMLClass* cl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   unsigned char* bytes;
+   char* s;
+   int version = TML_KERNEL_VERSION;
+   int c, i, n;
+
+#define SIG_BYTES(ptr,len) for (bytes = (unsigned char*)(ptr), n = 0; n < (int)(len); n++) \
+      sig = (sig ^ bytes[n])*1099511628211UL
+#define SIG_STR(str) do { \
+      for (s = (str); *s != '\0'; s++) sig = (sig ^ (unsigned char)*s)*1099511628211UL; \
+      sig = (sig ^ 0xff)*1099511628211UL; \
+   } while (0)
+
+   SIG_BYTES(&version, sizeof(int));
+   SIG_BYTES(&kb->numClasses, sizeof(int));
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      SIG_STR(cl->name);
+      SIG_BYTES(&cl->nsubcls, sizeof(int));
+      SIG_BYTES(&cl->nrels, sizeof(int));
+      SIG_BYTES(&cl->nattr, sizeof(int));
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         SIG_STR(rel->name);
+         SIG_BYTES(&rel->pwt, sizeof(float));
+         SIG_BYTES(&rel->nwt, sizeof(float));
+         SIG_BYTES(&rel->hard, sizeof(int));
+         SIG_BYTES(&rel->defaultRel, sizeof(int));
+         if (rel->defaultRel != 0)
+            SIG_BYTES(rel->defaultRelForSubcl, sizeof(int)*cl->nsubcls);
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         SIG_STR(attr->name);
+         SIG_BYTES(&attr->idx, sizeof(int));
+         SIG_BYTES(&attr->defaultAttr, sizeof(int));
+         if (attr->defaultAttr != 0)
+            SIG_BYTES(attr->defaultAttrForSubcl, sizeof(int)*cl->nsubcls);
+         HASH_ITER(hh, attr->vals, attrval, tmpv) {
+            SIG_STR(attrval->name);
+            SIG_BYTES(&attrval->idx, sizeof(int));
+            SIG_BYTES(&attrval->wt, sizeof(float));
+         }
+      }
+      for (i = 0; i < cl->nsubcls; i++)
+         SIG_STR(cl->subcl[i]->name);
+   }
+#undef SIG_BYTES
+#undef SIG_STR
+   return sig;
+}
+
+/**
+ * Prints the statements adding the value of a relation or attribute
+ * (held in variable var) where addLocalLogZ would add it.
+ */
+static void printKernelPlacement(FILE* outFile, TMLClass* cl, int isDefault, int* defaultForSubcl, const char* var) {
+   int j, first;
+
+   if (isDefault == 0) {
+      fprintf(outFile, "   *logZ += %s;\n", var);
+      return;
+   }
+   for (j = 0; j < cl->nsubcls && defaultForSubcl[j] != 0; j++);
+   if (j == cl->nsubcls) {
+      // every subclass overrides it
+      fprintf(outFile, "   if (shape == LOGZ_LEAF) *logZ += %s;\n", var);
+      return;
+   }
+   first = 1;
+   fprintf(outFile, "   if (shape == LOGZ_ASSIGNED) {\n");
+   for (j = 0; j < cl->nsubcls; j++) {
+      if (defaultForSubcl[j] != 0) continue;
+      fprintf(outFile, first ? "      if (node->assignedSubcl == %d" : " || node->assignedSubcl == %d", j);
+      first = 0;
+   }
+   fprintf(outFile, ") *logZ += %s;\n", var);
+   fprintf(outFile, "   } else if (shape == LOGZ_LEAF) {\n");
+   fprintf(outFile, "      *logZ += %s;\n", var);
+   fprintf(outFile, "   } else {\n");
+   for (j = 0; j < cl->nsubcls; j++) {
+      if (defaultForSubcl[j] != 0) continue;
+      fprintf(outFile, "      if (shape == LOGZ_OPEN || node->subclMask[%d] == 1) subclZ[%d] += %s;\n", j, j, var);
+   }
+   fprintf(outFile, "   }\n");
+}
+
+/**
+ * Prints the kernel of class cl: its relations unrolled in the order of
+ * relValues, with their weights and defaults folded into constants.
+ */
+static void printClassKernel(FILE* outFile, TMLClass* cl) {
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   float* args;
+   int r, maxVals;
+
+   maxVals = 1;
+   HASH_ITER(hh, cl->attr, attr, tmpa) {
+      if (attr->nvals > maxVals) maxVals = attr->nvals;
+   }
+   fprintf(outFile, "/* %s */\n", cl->name);
+   fprintf(outFile, "static void tml_local_%d(Node* node, int shape, float* logZ, float* subclZ) {\n", cl->id);
+   if (cl->nrels > 0)
+      fprintf(outFile, "   int** rv = node->relValues;\n   double w;\n");
+   if (cl->nattr > 0)
+      fprintf(outFile, "   TMLValueMask* mask;\n   float a;\n   float args[%d];\n", maxVals);
+   r = 0;
+   HASH_ITER(hh, cl->rel, rel, tmp) {
+      fprintf(outFile, "\n   /* %s */\n", rel->name);
+      if (rel->hard == 1) {
+         fprintf(outFile, "   w = (rv[%d][0] != 0) ? log(0.0) : 0.0;\n", r);
+      } else if (rel->hard == -1) {
+         fprintf(outFile, "   w = (rv[%d][1] != 0) ? log(0.0) : 0.0;\n", r);
+      } else {
+         fprintf(outFile, "   w = ((rv[%d][0] != 0) ? rv[%d][0]*%.9ef : 0.0)\n", r, r, rel->nwt);
+         fprintf(outFile, "      + ((rv[%d][1] != 0) ? rv[%d][1]*%.9ef : 0.0)\n", r, r, rel->pwt);
+         fprintf(outFile, "      + ((rv[%d][2] != 0) ? rv[%d][2]*%.17e : 0.0);\n", r, r, logsum_float(rel->pwt, rel->nwt));
+      }
+      printKernelPlacement(outFile, cl, rel->defaultRel, rel->defaultRelForSubcl, "w");
+      r++;
+   }
+   HASH_ITER(hh, cl->attr, attr, tmpa) {
+      args = (float*)malloc(sizeof(float)*attr->nvals);
+      HASH_ITER(hh, attr->vals, attrval, tmpv) {
+         args[attrval->idx] = attrval->wt;
+      }
+      fprintf(outFile, "\n   /* %s */\n", attr->name);
+      fprintf(outFile, "   mask = node->attrValues[%d];\n", attr->idx);
+      fprintf(outFile, "   if (node->assignedAttr[%d] != NULL) {\n", attr->idx);
+      fprintf(outFile, "      a = node->assignedAttr[%d]->wt;\n", attr->idx);
+      fprintf(outFile, "   } else if (mask == NULL) {\n");
+      fprintf(outFile, "      a = %.9ef;\n", (float)logsumarr_float(args, attr->nvals));
+      fprintf(outFile, "   } else {\n");
+      HASH_ITER(hh, attr->vals, attrval, tmpv) {
+         fprintf(outFile, "      args[%d] = isValueMasked(mask, %d) ? log(0.0) : %.9ef;\n", attrval->idx, attrval->idx, attrval->wt);
+      }
+      fprintf(outFile, "      a = logsumarr_float(args, %d);\n", attr->nvals);
+      fprintf(outFile, "   }\n");
+      printKernelPlacement(outFile, cl, attr->defaultAttr, attr->defaultAttrForSubcl, "a");
+      free(args);
+   }
+   fprintf(outFile, "}\n\n");
+}
+
+/**
+ * Writes C code with a kernel per class of the KB for the relation and
+ * attribute weights that computeLogZ adds at each node. The file is
+ * compiled into a shared library (make kernel KERNEL=<file>) and loaded
+ * with loadTMLKernel.
+ * @param kb       KB to generate the kernels for
+ * @param rulesName name of the rule file, noted in the generated code
+ * @param fileName name of the C file to write
+ * @return 1 if the file was written, 0 otherwise
+ */
+int printTMLKernel(TMLKB* kb, const char* rulesName, const char* fileName) {
+   FILE* outFile = fopen(fileName, "w");
+   int c;
+
+   if (outFile == NULL) {
+      printf("Error opening %s\n", fileName);
+      return 0;
+   }
+   fprintf(outFile, "/* Generated by al -codegen from %s. Do not edit. */\n", rulesName);
+   fprintf(outFile, "#include <stdlib.h>\n#include <math.h>\n#include \"Node.h\"\n\n");
+   fprintf(outFile, "unsigned long tml_kernel_signature = %luUL;\n", computeModelSignature(kb));
+   fprintf(outFile, "int tml_kernel_nclasses = %d;\n\n", kb->numClasses);
+   for (c = 0; c < kb->numClasses; c++)
+      printClassKernel(outFile, &(kb->classes[c]));
+   fprintf(outFile, "const char* tml_kernel_classes[] = {\n");
+   for (c = 0; c < kb->numClasses; c++)
+      fprintf(outFile, "   \"%s\",\n", kb->classes[c].name);
+   fprintf(outFile, "};\n\n");
+   fprintf(outFile, "TMLLocalKernel tml_kernel_local[] = {\n");
+   for (c = 0; c < kb->numClasses; c++)
+      fprintf(outFile, "   tml_local_%d,\n", kb->classes[c].id);
+   fprintf(outFile, "};\n");
+   fclose(outFile);
+   return 1;
+}
+
+/**
+ * Loads a kernel library compiled from the output of printTMLKernel and
+ * installs its kernels in the classes of the KB. Must be called before
+ * the SPN is evaluated.
+ * @param kb             KB the kernel was generated from
+ * @param kernelFileName path of the shared library
+ * @return 1 if the kernels were installed, 0 otherwise
+ */
+int loadTMLKernel(TMLKB* kb, const char* kernelFileName) {
+   void* lib = dlopen(kernelFileName, RTLD_NOW);
+   unsigned long* sig;
+   int* nclasses;
+   const char** classes;
+   TMLLocalKernel* kernels;
+   int c;
+
+   if (lib == NULL) {
+      printf("Error loading kernel %s: %s\n", kernelFileName, dlerror());
+      return 0;
+   }
+   sig = (unsigned long*)dlsym(lib, "tml_kernel_signature");
+   nclasses = (int*)dlsym(lib, "tml_kernel_nclasses");
+   classes = (const char**)dlsym(lib, "tml_kernel_classes");
+   kernels = (TMLLocalKernel*)dlsym(lib, "tml_kernel_local");
+   if (sig == NULL || nclasses == NULL || classes == NULL || kernels == NULL) {
+      printf("Error loading kernel %s: not generated by -codegen\n", kernelFileName);
+      dlclose(lib);
+      return 0;
+   }
+   if (*sig != computeModelSignature(kb) || *nclasses != kb->numClasses) {
+      printf("Kernel %s was generated for a different model.\n", kernelFileName);
+      dlclose(lib);
+      return 0;
+   }
+   for (c = 0; c < kb->numClasses; c++) {
+      if (strcmp(classes[c], kb->classes[c].name) != 0) {
+         printf("Kernel %s was generated for a different model.\n", kernelFileName);
+         dlclose(lib);
+         return 0;
+      }
+   }
+   for (c = 0; c < kb->numClasses; c++)
+      kb->classes[c].localKernel = kernels[c];
+   if (kb->kernelLib != NULL) dlclose(kb->kernelLib);
+   kb->kernelLib = lib;
+   return 1;
+}
+
+/* Sets the MAP counts of a class, its relations and attribute values to zero */
+void resetMAPCountsForClass(TMLClass* cls) {
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+
+   cls->mapCnt = 0;
+   HASH_ITER(hh, cls->rel, rel, tmp) {
+      rel->mapPcnt = 0;
+      rel->mapNcnt = 0;
+   }
+   HASH_ITER(hh, cls->attr, attr, tmpa) {
+      HASH_ITER(hh, attr->vals, attrval, tmpv)
+         attrval->mapCnt = 0;
+   }
+}
+
+/* Sets the MAP counts of the classes of the KB to zero */
+void resetMAPCounts(TMLKB* kb) {
+   int c;
+
+   for (c = 0; c < kb->numClasses; c++)
+      resetMAPCountsForClass(&(kb->classes[c]));
+}
+
+/* Returns the value an unassigned attribute of a node takes in the MAP
+ * state, as printMAPStateLocal picks it */
+static TMLAttrValue* mapAttrValue(Node* node, TMLAttribute* attr) {
+   TMLValueMask* mask = node->attrValues[attr->idx];
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   TMLAttrValue* maxVal = NULL;
+
+   HASH_ITER(hh, attr->vals, attrval, tmpv) {
+      if (mask != NULL && isValueMasked(mask, attrval->idx)) continue;
+      if (maxVal == NULL || attrval->wt > maxVal->wt)
+         maxVal = attrval;
+   }
+   return maxVal;
+}
+
+/**
+ * Adds the MAP state of the SPN rooted at an object's node to the MAP
+ * counts of the classes: each object and class pair in the MAP state
+ * counts once for the class (mapCnt), and each grounding of a soft
+ * relation and value of an attribute whose weights apply to it, known or
+ * decoded, for the relation or value. The MAP state must have just been
+ * computed by computeMAPState. The SPN is walked down the branches
+ * printMAPStateRec prints, but nothing is printed and unknown groundings
+ * are counted without being enumerated.
+ *
+ * @param kb     TMLKB struct
+ * @param node   top node of the object
+ */
+void setMAPCountsForObj(TMLKB* kb, Node* node) {
+   MAPVisit* visits;
+   MAPVisit v;
+   TMLClass* cl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLPart* part;
+   TMLPart* tmppart;
+   int* rv;
+   int nvisits = 0;
+   int cap = 64;
+   int next, d, p, i, r;
+
+   visits = (MAPVisit*)malloc(sizeof(MAPVisit)*cap);
+   pushMAPVisit(&visits, &nvisits, &cap, node, node->cl, 0, NULL, NULL);
+   while (nvisits > 0) {
+      v = visits[--nvisits];
+      node = v.node;
+      cl = node->cl;
+      d = isDescendant(v.assignedClFromSubpart, cl);
+      next = node->assignedSubcl;
+      if (next == -1 && cl->nsubcls != 0)
+         next = (d != -1) ? d : node->maxSubcl;
+      if ((d != -1 && node->assignedSubcl != -1 && node->assignedSubcl != d)
+            || (cl->nsubcls != 0 && next == -1))
+         continue; // no state of the node is possible
+      cl->mapCnt++;
+
+      r = 0;
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         rv = node->relValues[r++];
+         if (rel->hard != 0 || (rel->defaultRel != 0 && rel->defaultRelForSubcl[next] != 0)) continue;
+         rel->mapPcnt += rv[1] + ((rel->pwt > rel->nwt) ? rv[2] : 0);
+         rel->mapNcnt += rv[0] + ((rel->pwt > rel->nwt) ? 0 : rv[2]);
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         if (attr->defaultAttr != 0 && attr->defaultAttrForSubcl[next] != 0) continue;
+         attrval = node->assignedAttr[attr->idx];
+         if (attrval == NULL) attrval = mapAttrValue(node, attr);
+         if (attrval != NULL) attrval->mapCnt++;
+      }
+
+      p = 0;
+      HASH_ITER(hh, cl->part, part, tmppart) {
+         if (part->defaultPart == 0 || part->defaultPartForSubcl[next] == 0) {
+            for (i = 0; i < part->n; i++)
+               pushMAPVisit(&visits, &nvisits, &cap, node->part[p][i], part->cl, 0, NULL, NULL);
+         }
+         p++;
+      }
+      if (cl->nsubcls != 0) {
+         if (node->assignedSubcl != -1 && node->subclMask == NULL)
+            pushMAPVisit(&visits, &nvisits, &cap, node->subcl, v.assignedClFromSubpart, 0, NULL, NULL);
+         else
+            pushMAPVisit(&visits, &nvisits, &cap, &(node->subcl[next]), v.assignedClFromSubpart, 0, NULL, NULL);
+      }
+   }
+   free(visits);
+}
+
+/* Sets the MAP counts of the classes of the KB to the counts of its MAP
+ * state (see setMAPCountsForObj) */
+void setMAPCounts(TMLKB* kb) {
+   resetMAPCounts(kb);
+   setMAPCountsForObj(kb, (Node*)(kb->root->ptr));
+}
+
+/* Makes the MAP counts of the KB its counts, returning how many changed */
+static int useMAPCounts(TMLKB* kb) {
+   TMLClass* cl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   int nchanged = 0;
+   int c, i;
+
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      for (i = 0; i < cl->nsubcls; i++) {
+         if (cl->cnt[i] != cl->subcl[i]->mapCnt) nchanged++;
+         cl->cnt[i] = cl->subcl[i]->mapCnt;
+      }
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         if (rel->pcnt != rel->mapPcnt || rel->ncnt != rel->mapNcnt) nchanged++;
+         rel->pcnt = rel->mapPcnt;
+         rel->ncnt = rel->mapNcnt;
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         HASH_ITER(hh, attr->vals, attrval, tmpv) {
+            if (attrval->cnt != attrval->mapCnt) nchanged++;
+            attrval->cnt = attrval->mapCnt;
+         }
+      }
+   }
+   return nchanged;
+}
+
+/* Sets the observed counts of the classes of the KB to zero */
+void resetObservedCounts(TMLKB* kb) {
+   TMLClass* cl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   int c, i;
+
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      for (i = 0; i < cl->nsubcls; i++)
+         cl->cnt[i] = 0;
+      cl->totalcnt = 0;
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         rel->pcnt = 0;
+         rel->ncnt = 0;
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         HASH_ITER(hh, attr->vals, attrval, tmpv)
+            attrval->cnt = 0;
+      }
+   }
+}
+
+/**
+ * Adds what the evidence observes about an object to the counts of its
+ * classes: the subclass it is known to be in, and the known groundings
+ * of the relations and the values of the attributes whose weights apply
+ * to it. The object's subclass nodes are followed down as long as its
+ * subclass is known. Unknown groundings and values are not counted.
+ *
+ * @param kb     TMLKB struct
+ * @param node   top node of the object
+ */
+void setObservedCountsForObj(TMLKB* kb, Node* node) {
+   addObservedCountsForObj(kb, node, 1.0);
+}
+
+/**
+ * Adds sign times what the evidence observes about an object to the
+ * counts of its classes (see setObservedCountsForObj), so an object's
+ * observations can be taken back out of them. Under online learning the
+ * classes are marked as having changed counts.
+ *
+ * @param kb     TMLKB struct
+ * @param node   top node of the object
+ * @param sign   1 to add the observations, -1 to remove them
+ */
+void addObservedCountsForObj(TMLKB* kb, Node* node, float sign) {
+   TMLClass* cl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   int** relValues;
+   int a;
+
+   while (node != NULL) {
+      cl = node->cl;
+      a = (cl->nsubcls != 0) ? node->assignedSubcl : -1;
+      cl->totalcnt += (int)sign;
+      if (kb->onlineDirty != NULL) kb->onlineDirty[cl->id] = 1;
+      relValues = node->relValues;
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         // Same relations as computeLogZ weighs at the node
+         if (rel->hard == 0 && (cl->nsubcls == 0 || rel->defaultRel == 0
+               || (a != -1 && rel->defaultRelForSubcl[a] == 0))) {
+            rel->pcnt += sign*(*relValues)[1];
+            rel->ncnt += sign*(*relValues)[0];
+         }
+         relValues++;
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         attrval = node->assignedAttr[attr->idx];
+         if (attrval != NULL && (cl->nsubcls == 0 || attr->defaultAttr == 0
+               || (a != -1 && attr->defaultAttrForSubcl[a] == 0)))
+            attrval->cnt += sign;
+      }
+      if (a == -1) break;
+      cl->cnt[a] += sign;
+      if (node->subcl == NULL) break;
+      node = (node->subclMask == NULL) ? node->subcl : &(node->subcl[a]);
+   }
+}
+
+/**
+ * Adds the observations of every object of the KB to the counts of its
+ * classes (see setObservedCountsForObj). The SPN must be filled out.
+ */
+void setObservedCounts(TMLKB* kb) {
+   Node* node;
+   Node* tmp;
+
+   HASH_ITER(hh_path, kb->objectPathToPtr, node, tmp) {
+      setObservedCountsForObj(kb, node);
+   }
+}
+
+/**
+ * Adds the observed counts of one KB to those of another read in from
+ * the same rule file.
+ *
+ * @param kb     TMLKB struct to add the counts to
+ * @param from   TMLKB struct to add the counts of
+ */
+void mergeObservedCounts(TMLKB* kb, TMLKB* from) {
+   TMLClass* cl;
+   TMLClass* fromcl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLRelation* fromrel;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttribute* fromattr;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   TMLAttrValue* fromval;
+   int c, i;
+
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      fromcl = &(from->classes[c]);
+      for (i = 0; i < cl->nsubcls; i++)
+         cl->cnt[i] += fromcl->cnt[i];
+      cl->totalcnt += fromcl->totalcnt;
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         fromrel = getRelation(fromcl, rel->name);
+         rel->pcnt += fromrel->pcnt;
+         rel->ncnt += fromrel->ncnt;
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         fromattr = getAttribute(fromcl, attr->name);
+         HASH_ITER(hh, attr->vals, attrval, tmpv) {
+            HASH_FIND_STR(fromattr->vals, attrval->name, fromval);
+            attrval->cnt += fromval->cnt;
+         }
+      }
+   }
+}
+
+/**
+ * Sets the weights of a soft relation to the log of the fraction of its
+ * counted groundings that are true and false, after adding the relation
+ * pseudocounts of the KB.
+ */
+void updateWtsForRel(TMLKB* kb, TMLRelation* rel) {
+   float total = rel->pcnt + rel->ncnt + kb->relPctT + kb->relPctF;
+
+   if (rel->hard != 0 || total <= 0) return;
+   rel->pwt = log((rel->pcnt + kb->relPctT)/total);
+   rel->nwt = log((rel->ncnt + kb->relPctF)/total);
+}
+
+/**
+ * Sets the weights of a class to the log frequencies of its counts, after
+ * adding the pseudocounts of the KB: the weight of each subclass and of
+ * each value of its attributes (with the subclass pseudocount), and the
+ * weights of its soft relations (see updateWtsForRel). Since the
+ * weights at every sum node then sum to one, they are the maximum
+ * likelihood weights for fully observed data.
+ */
+void updateWtsForClass(TMLKB* kb, TMLClass* cls) {
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   float total;
+   int i;
+
+   total = cls->nsubcls*kb->scPct;
+   for (i = 0; i < cls->nsubcls; i++)
+      total += cls->cnt[i];
+   if (total > 0) {
+      for (i = 0; i < cls->nsubcls; i++)
+         cls->wt[i] = log((cls->cnt[i] + kb->scPct)/total);
+   }
+   HASH_ITER(hh, cls->rel, rel, tmp) {
+      updateWtsForRel(kb, rel);
+   }
+   HASH_ITER(hh, cls->attr, attr, tmpa) {
+      total = attr->nvals*kb->scPct;
+      HASH_ITER(hh, attr->vals, attrval, tmpv)
+         total += attrval->cnt;
+      if (total <= 0) continue;
+      HASH_ITER(hh, attr->vals, attrval, tmpv)
+         attrval->wt = log((attrval->cnt + kb->scPct)/total);
+      compileTMLAttribute(attr);
+   }
+   cls->localKernel = NULL; // generated for the old weights
+}
+
+/* Sets the weights of every class of the KB from its counts */
+void updateWts(TMLKB* kb) {
+   int c;
+
+   for (c = 0; c < kb->numClasses; c++)
+      updateWtsForClass(kb, &(kb->classes[c]));
+}
+
+/* Orders pointers by address */
+static int comparePtrs(const void* a, const void* b) {
+   const void* pa = *(const void**)a;
+   const void* pb = *(const void**)b;
+
+   if (pa == pb) return 0;
+   return (pa < pb) ? -1 : 1;
+}
+
+/**
+ * Updates the observed counts of the KB for a run of edits of its edit
+ * stack, from top down to (not including) stop, that are in effect: by
+ * sign times what the objects they touch observe with them, less what
+ * those objects observe without them (see addObservedCountsForObj). The
+ * edits are taken out of the objects' nodes and put back to find the
+ * latter, so the cost depends on the edits and the objects' classes, not
+ * on the size of the KB. Does nothing unless online learning is on (see
+ * startOnlineLearning).
+ *
+ * @param kb     TMLKB struct
+ * @param top    newest edit of the run
+ * @param stop   edit below the run
+ * @param sign   1 if the edits were just made, -1 if about to be undone
+ */
+void countKBEdits(TMLKB* kb, KBEdit* top, KBEdit* stop, float sign) {
+   KBEdit** edits;
+   KBEdit* edit;
+   Node** objs;
+   Node* node;
+   Node* obj;
+   int* savedSubcl;
+   TMLAttrValue** savedAttr;
+   int nedits = 0;
+   int nobjs = 0;
+   int i, k;
+
+   if (kb->onlineDirty == NULL || top == stop) return;
+   releaseQueryBlocking(kb);
+   for (edit = top; edit != stop; edit = edit->prev) nedits++;
+   edits = (KBEdit**)malloc(sizeof(KBEdit*)*nedits);
+   objs = (Node**)malloc(sizeof(Node*)*nedits);
+   savedSubcl = (int*)malloc(sizeof(int)*nedits);
+   savedAttr = (TMLAttrValue**)malloc(sizeof(TMLAttrValue*)*nedits);
+   for (edit = top, i = 0; edit != stop; edit = edit->prev, i++) {
+      edits[i] = edit;
+      if (edit->node->pathname == NULL) continue;
+      HASH_FIND(hh_path, kb->objectPathToPtr, edit->node->pathname, strlen(edit->node->pathname), obj);
+      if (obj != NULL) objs[nobjs++] = obj;
+   }
+   qsort(objs, nobjs, sizeof(Node*), comparePtrs);
+   for (i = 0, k = 0; i < nobjs; i++)
+      if (k == 0 || objs[i] != objs[k-1]) objs[k++] = objs[i];
+   nobjs = k;
+
+   for (k = 0; k < nobjs; k++)
+      addObservedCountsForObj(kb, objs[k], sign);
+   // Take the edits out, newest first, as resetKBEdits would
+   for (i = 0; i < nedits; i++) {
+      edit = edits[i];
+      node = edit->node;
+      if (edit->relStr != NULL) continue;
+      if (edit->relIdx == -1) {
+         if (edit->pol == 1) {
+            savedSubcl[i] = node->assignedSubcl;
+            node->assignedSubcl = -1;
+         }
+      } else if (edit->subclIdx == -1) {
+         node->relValues[edit->relIdx][(edit->pol == 0) ? 0 : 1]--;
+         node->relValues[edit->relIdx][2]++;
+      } else if (edit->pol != 0) {
+         savedAttr[i] = node->assignedAttr[edit->relIdx];
+         node->assignedAttr[edit->relIdx] = NULL;
+      }
+   }
+   for (k = 0; k < nobjs; k++)
+      addObservedCountsForObj(kb, objs[k], -sign);
+   // and put them back, oldest first
+   for (i = nedits-1; i >= 0; i--) {
+      edit = edits[i];
+      node = edit->node;
+      if (edit->relStr != NULL) continue;
+      if (edit->relIdx == -1) {
+         if (edit->pol == 1)
+            node->assignedSubcl = savedSubcl[i];
+      } else if (edit->subclIdx == -1) {
+         node->relValues[edit->relIdx][(edit->pol == 0) ? 0 : 1]++;
+         node->relValues[edit->relIdx][2]--;
+      } else if (edit->pol != 0) {
+         node->assignedAttr[edit->relIdx] = savedAttr[i];
+      }
+   }
+   kb->onlinePending++;
+   free(edits);
+   free(objs);
+   free(savedSubcl);
+   free(savedAttr);
+}
+
+/* Sets the observed counts of the KB to those of its current evidence, with no class changed since */
+static void recountOnlineCounts(TMLKB* kb) {
+   releaseQueryBlocking(kb);
+   resetObservedCounts(kb);
+   setObservedCounts(kb);
+   memset(kb->onlineDirty, 0, sizeof(int)*kb->numClasses);
+   kb->onlinePending = 0;
+   kb->countedEdits = kb->edits;
+}
+
+/* Returns 1 if the class has observed objects or any observed count
+ * that is not zero */
+static int hasObservedCounts(TMLClass* cl) {
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   int i;
+
+   if (cl->totalcnt != 0) return 1;
+   for (i = 0; i < cl->nsubcls; i++)
+      if (cl->cnt[i] != 0) return 1;
+   HASH_ITER(hh, cl->rel, rel, tmp) {
+      if (rel->pcnt != 0 || rel->ncnt != 0) return 1;
+   }
+   HASH_ITER(hh, cl->attr, attr, tmpa) {
+      HASH_ITER(hh, attr->vals, attrval, tmpv)
+         if (attrval->cnt != 0) return 1;
+   }
+   return 0;
+}
+
+/**
+ * Starts online weight learning: the observed counts of the classes are
+ * set to those of the KB's evidence (see setObservedCounts), and from
+ * then on follow it as facts are added, retracted, expired or rolled
+ * back (see countKBEdits), one fact at a time. Every so many facts the
+ * weights of the classes whose counts changed are re-estimated from them
+ * (see updateOnlineWeights); the other classes keep their weights. The
+ * classes the evidence already in the KB has counts for are re-estimated
+ * along with them, the first time. Starting it again recounts the
+ * evidence.
+ *
+ * @param kb      TMLKB struct, already filled out by fillOutSPN
+ * @param every   facts between re-estimates, 0 to re-estimate only when
+ *                asked
+ */
+void startOnlineLearning(TMLKB* kb, int every) {
+   int c;
+
+   if (kb->snapshotOf != NULL) {
+      printf("Online learning cannot be started on a KB snapshot.\n");
+      return;
    }
-   p = 0; 
-   HASH_ITER(hh, node->cl->part, part, tmp) {
-      if (part->defaultPart == 0 || part->defaultPartForSubcl[nextSubcl] == 0) {
-         for (i = 0; i < part->n; i++) {
-            printMAPStateRec(kb, node->part[p][i], part->cl, outFile);
-         }
+   if (kb->onlineDirty == NULL)
+      kb->onlineDirty = (int*)malloc(sizeof(int)*kb->numClasses);
+   kb->onlineEvery = every;
+   recountOnlineCounts(kb);
+   for (c = 0; c < kb->numClasses; c++)
+      kb->onlineDirty[c] = hasObservedCounts(&(kb->classes[c]));
+}
+
+/* Stops online weight learning, keeping the weights learned so far */
+void stopOnlineLearning(TMLKB* kb) {
+   free(kb->onlineDirty);
+   kb->onlineDirty = NULL;
+   kb->onlineEvery = 0;
+   kb->onlinePending = 0;
+   kb->countedEdits = NULL;
+}
+
+/**
+ * Re-estimates the weights of the classes whose counts changed under
+ * online learning, if as many facts as its schedule says were counted
+ * since the last time, or if forced. Each class's weights are set to the
+ * log frequencies of its counts (see updateWtsForClass), and only its
+ * nodes are recomputed (see setTMLWeightVector).
+ *
+ * @param kb      TMLKB struct
+ * @param logZ    current log of Z
+ * @param force   1 to re-estimate regardless of the schedule
+ * @return the updated log of Z
+ */
+float updateOnlineWeights(TMLKB* kb, float logZ, int force) {
+   TMLClass* cl;
+   KBSavepoint* sp;
+   int nchanged = 0;
+   int c;
+
+   if (kb->onlineDirty == NULL) return logZ;
+   if (!force && (kb->onlineEvery == 0 || kb->onlinePending < kb->onlineEvery)) return logZ;
+   for (c = 0; c < kb->numClasses; c++) {
+      if (kb->onlineDirty[c] == 0) continue;
+      cl = &(kb->classes[c]);
+      updateWtsForClass(kb, cl);
+      markClassNodesChanged(kb, cl);
+      kb->onlineDirty[c] = 0;
+      nchanged++;
+   }
+   kb->onlinePending = 0;
+   if (nchanged == 0) return logZ;
+   for (sp = kb->savepoints; sp != NULL; sp = sp->prev)
+      sp->logZ = NAN; // computed with the old weights
+   printf("Re-estimated the weights of %d class%s from the online counts.\n", nchanged, (nchanged == 1) ? "" : "es");
+   return updateLogZForWeights(kb);
+}
+
+/**
+ * Learns the weights of the KB by hard EM from its evidence: the MAP
+ * state of the unknown classes, relations and attribute values is
+ * computed (see computeMAPState), the MAP state's counts taken as if it
+ * had been observed (see setMAPCounts), and the weights set to their log
+ * frequencies (see updateWts), until the counts, and so the MAP state,
+ * stop changing. Each iteration costs one max-product pass over the SPN
+ * rather than the two passes of learnTMLWeightsEM.
+ *
+ * @param kb        TMLKB struct, already filled out by fillOutSPN
+ * @param maxIters  most iterations to run
+ * @return log of Z with the learned weights
+ */
+float learnWts(TMLKB* kb, int maxIters) {
+   Node* root = (Node*)(kb->root->ptr);
+   int nchanged = 1;
+   int it;
+
+   releaseQueryBlocking(kb);
+   flushQueryCache(kb);
+   for (it = 1; it <= maxIters && nchanged > 0; it++) {
+      kb->mapSet = 0; // weights changed since the last MAP state
+      computeMAPState(kb, root->logZ);
+      setMAPCounts(kb);
+      nchanged = useMAPCounts(kb);
+      printf("Hard EM iteration %d: max-product log Z %f, %d counts changed\n", it, root->logZ, nchanged);
+      if (nchanged > 0) updateWts(kb);
+   }
+   kb->mapSet = 0;
+   if (kb->onlineDirty != NULL) recountOnlineCounts(kb); // the MAP counts replaced them
+   return computeLogZ(root, root->cl, spn_logsum, 1);
+}
+
+/* Share of the fact files of weight learning counted by one thread */
+typedef struct LearnWorker {
+   TMLKB* kb; // the thread's counts, on a KB of the rules alone
+   const char* rulesName;
+   char** factFiles;
+   int nfiles;
+   int first; // counts files first, first+step, ...
+   int step;
+   int failed; // 1 if one of its files could not be read in
+} LearnWorker;
+
+static void countLearnFiles(LearnWorker* w) {
+   TMLKB* fileKB;
+   Node* root;
+   int f;
+
+   for (f = w->first; f < w->nfiles; f += w->step) {
+      fileKB = TMLKBNew();
+      readInTMLRules(fileKB, w->rulesName);
+      if (readInTMLFacts(fileKB, w->factFiles[f]) == 0) {
+         freeTMLKB(fileKB);
+         w->failed = 1;
+         return;
       }
-      p++;
+      root = (Node*)(fileKB->root->ptr);
+      fillOutSPN(fileKB, root, root->cl, fileKB->root->name);
+      resetObservedCounts(fileKB);
+      setObservedCounts(fileKB);
+      mergeObservedCounts(w->kb, fileKB);
+      freeTMLKB(fileKB);
    }
+}
 
-   if (node->cl->nsubcls != 0) {
-      if (node->assignedSubcl != -1) {
-         if (node->subclMask == NULL)
-            printMAPStateRec(kb, node->subcl, assignedClFromSubpart, outFile);
-         else
-            printMAPStateRec(kb, &(node->subcl[node->assignedSubcl]), assignedClFromSubpart, outFile);
-      } else if (descendantIdx != -1) {
-         if (outFile == NULL)
-            printf("Is(%s,%s)\n", name, node->cl->subcl[descendantIdx]->name);
-         else
-            fprintf(outFile, "Is(%s,%s)\n", name, node->cl->subcl[descendantIdx]->name);
-         printMAPStateRec(kb, &(node->subcl[descendantIdx]), assignedClFromSubpart, outFile);
-      } else {
-         if (outFile == NULL)
-            printf("Is(%s,%s)\n", name, node->cl->subcl[node->maxSubcl]->name);
-         else
-            fprintf(outFile, "Is(%s,%s)\n", name, node->cl->subcl[node->maxSubcl]->name);
-         printMAPStateRec(kb, &(node->subcl[node->maxSubcl]), assignedClFromSubpart, outFile);
+static void* runLearnWorker(void* arg) {
+   countLearnFiles((LearnWorker*)arg);
+   return NULL;
+}
+
+/**
+ * Splits a list of fact file names separated by commas, checking that
+ * each can be opened.
+ *
+ * @param factFileNames  names of the fact files, separated by commas
+ * @param names          set to the buffer the returned names point into,
+ *                       to be freed with the array
+ * @param nfiles         set to the number of fact files
+ * @return the names of the fact files, NULL if one could not be opened
+ */
+static char** splitFactFileNames(const char* factFileNames, char** names, int* nfiles) {
+   char** factFiles = NULL;
+   char* iter;
+   char* comma;
+   FILE* factFile;
+
+   *names = strdup(factFileNames);
+   *nfiles = 0;
+   for (iter = *names; iter != NULL; iter = (comma != NULL) ? comma+1 : NULL) {
+      comma = strchr(iter, ',');
+      if (comma != NULL) *comma = '\0';
+      if (*iter == '\0') continue;
+      factFile = fopen(iter, "r");
+      if (factFile == NULL) {
+         printf("Error opening %s\n", iter);
+         free(factFiles);
+         free(*names);
+         return NULL;
       }
+      fclose(factFile);
+      factFiles = (char**)realloc(factFiles, sizeof(char*)*(*nfiles+1));
+      factFiles[(*nfiles)++] = iter;
    }
-   if (best != NULL) free(best);
+   if (*nfiles == 0) {
+      printf("Error: no fact files given.\n");
+      free(*names);
+      return NULL;
+   }
+   return factFiles;
 }
 
-void printMAPStateForObj(TMLKB* kb, Node* node, FILE* outFile) {
-   int r = 0;
+/**
+ * Warns about the parameters of each class that no fact file gave an
+ * observed count: the subclasses of a class none of whose objects was
+ * observed in a subclass, and the soft relations and attributes never
+ * observed for it. updateWts sets their weights from the pseudocounts
+ * alone, i.e. uniform.
+ */
+static void warnUnobservedCounts(TMLKB* kb) {
+   TMLClass* cl;
    TMLRelation* rel;
-   TMLRelation* temprel;
-   int nextSubcl = node->assignedSubcl;
-   ArraysAccessor* aa;
-   int ncombo;
-   int c;
-   Node** currArgNodes;
-   char* normalizedGroundStr;
-   char* outputGroundStr;
-   ObjRelStrsHash* objRelHash;
-   RelationStr_Hash* relStrHash;
-   char* name;
-   char* partPtr;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   float total;
+   int c, i, n;
 
-   if (nextSubcl == -1 && node->cl->nsubcls != 0)
-      nextSubcl = node->maxSubcl;
-   if (node->name != NULL)
-      name = node->name;
-   else
-      name = node->pathname;
-   HASH_FIND_STR(kb->objToRelFactStrs, name, objRelHash);
-   HASH_ITER(hh, node->cl->rel, rel, temprel) {
-      if (rel->defaultRel == 0 || rel->defaultRelForSubcl[nextSubcl] == 0) {
-         if (node->relValues[r][2] != 0) {
-            if (rel->nargs != 0) {
-               aa = createArraysAccessorForRel(rel, node);
-               ncombo = numCombinationsInArraysAccessor(aa);
-               for (c = 0; c < ncombo; c++) {
-                  currArgNodes = (Node**)nextArraysAccessor(aa);
-                  normalizedGroundStr = createNormalizedRelStr(kb, rel->name, name, currArgNodes, rel->nargs, 0, 0);
-                  outputGroundStr = createNormalizedRelStr(kb, rel->name, node->name, currArgNodes, rel->nargs, 1, 1);
-                  if (objRelHash != NULL) {
-                     HASH_FIND_STR(objRelHash->hash, normalizedGroundStr, relStrHash);
-                     if (relStrHash != NULL) continue;
-                  }
-                  if (outFile == NULL)
-                     printf("%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputGroundStr);
-                  else
-                     fprintf(outFile, "%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputGroundStr);
-               }
-            } else {
-               normalizedGroundStr = createNormalizedRelStr(kb, rel->name, node->name, NULL, 0, 0, 0);
-               outputGroundStr = createNormalizedRelStr(kb, rel->name, node->name, NULL, 0, 1, 1);
-               if (objRelHash != NULL) {
-                  HASH_FIND_STR(objRelHash->hash, normalizedGroundStr, relStrHash);
-                  if (relStrHash != NULL) continue;
-               }
-               if (outFile == NULL)
-                  printf("%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputGroundStr);
-               else
-                  fprintf(outFile, "%s%s\n", ((rel->pwt > rel->nwt) ? "" : "!"), outputGroundStr);
-            }
-         }
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      n = 0;
+      total = 0;
+      for (i = 0; i < cl->nsubcls; i++)
+         total += cl->cnt[i];
+      if (cl->nsubcls != 0 && total == 0) {
+         printf("Warning: class %s has no observed counts for its subclasses", cl->name);
+         n++;
       }
-      r++;
-   }   
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         if (rel->hard != 0 || rel->pcnt + rel->ncnt != 0) continue;
+         if (n++ == 0) printf("Warning: class %s has no observed counts for %s", cl->name, rel->name);
+         else printf(", %s", rel->name);
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         total = 0;
+         HASH_ITER(hh, attr->vals, attrval, tmpv)
+            total += attrval->cnt;
+         if (total != 0) continue;
+         if (n++ == 0) printf("Warning: class %s has no observed counts for %s", cl->name, attr->name);
+         else printf(", %s", attr->name);
+      }
+      if (n != 0) printf("; their weights are uniform.\n");
+   }
+}
 
-   if (node->cl->nsubcls != 0) {
-      if (node->assignedSubcl != -1) {
-         if (node->subclMask == NULL)
-            printMAPStateForObj(kb, node->subcl, outFile);
-         else
-            printMAPStateForObj(kb, &(node->subcl[node->assignedSubcl]), outFile);
+/**
+ * Learns the weights of the KB in closed form from fully observed fact
+ * files: the classes, relations and attribute values observed in every
+ * file are counted, and the weights set to their log frequencies (see
+ * updateWts). The KB holds the rules alone, and each fact file is read
+ * into a KB of its own.
+ *
+ * With more than one thread, the files are dealt out to the threads,
+ * each of which counts them into a KB of its own, and the counts are
+ * merged at the end.
+ *
+ * @param kb             TMLKB struct read in from the rule file
+ * @param rulesName      name of the rule file
+ * @param factFileNames  names of the fact files, separated by commas
+ * @param nthreads       number of threads to count the files with
+ * @return 1 on success, 0 if a fact file could not be opened or read in,
+ *         in which case the weights are left as they were
+ */
+int learnTMLWeights(TMLKB* kb, const char* rulesName, const char* factFileNames, int nthreads) {
+   char* names;
+   char** factFiles;
+   int nfiles;
+   int t;
+   int failed = 0;
+   LearnWorker* workers;
+   pthread_t* threads;
+
+   factFiles = splitFactFileNames(factFileNames, &names, &nfiles);
+   if (factFiles == NULL) return 0;
+   resetObservedCounts(kb);
+   if (nthreads > nfiles) nthreads = nfiles;
+   if (nthreads < 1) nthreads = 1;
+   workers = (LearnWorker*)malloc(sizeof(LearnWorker)*nthreads);
+   for (t = 0; t < nthreads; t++) {
+      if (nthreads == 1) {
+         workers[t].kb = kb;
       } else {
-         if (outFile == NULL)
-            printf("Is(%s,%s)\n", node->name, node->cl->subcl[node->maxSubcl]->name);
+         workers[t].kb = TMLKBNew();
+         readInTMLRules(workers[t].kb, rulesName);
+         resetObservedCounts(workers[t].kb);
+      }
+      workers[t].rulesName = rulesName;
+      workers[t].factFiles = factFiles;
+      workers[t].nfiles = nfiles;
+      workers[t].first = t;
+      workers[t].step = nthreads;
+      workers[t].failed = 0;
+   }
+   if (nthreads == 1) {
+      countLearnFiles(&(workers[0]));
+      failed = workers[0].failed;
+   } else {
+      threads = (pthread_t*)malloc(sizeof(pthread_t)*nthreads);
+      for (t = 0; t < nthreads; t++)
+         pthread_create(&(threads[t]), NULL, runLearnWorker, &(workers[t]));
+      for (t = 0; t < nthreads; t++) {
+         pthread_join(threads[t], NULL);
+         mergeObservedCounts(kb, workers[t].kb);
+         freeTMLKB(workers[t].kb);
+         failed |= workers[t].failed;
+      }
+      free(threads);
+   }
+   if (!failed) {
+      warnUnobservedCounts(kb);
+      updateWts(kb);
+   }
+   free(workers);
+   free(factFiles);
+   free(names);
+   return !failed;
+}
+
+/* Prints the arguments of a relation as its rule file entry lists them */
+static void printTMLRelationArgs(FILE* outFile, TMLRelation* rel) {
+   int a;
+
+   fprintf(outFile, "(");
+   for (a = 0; a < rel->nargs; a++)
+      fprintf(outFile, "%s%s", (a == 0) ? "" : ",", rel->argPartName[a]);
+   fprintf(outFile, ")");
+}
+
+/**
+ * Prints the relations and attribute lines of a class with the weights
+ * the KB holds. A relation or attribute that overrides an ancestor's has
+ * the ancestor's weights added to each of its entries when it is read in
+ * (see readInRelations and readInAttribute), so they are taken off here.
+ */
+static void printTMLClassWeights(FILE* outFile, TMLClass* cl) {
+   TMLClass* tmpcl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLRelation* inh;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttribute* inhattr;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   TMLAttrValue* found;
+   int first = 1;
+
+   HASH_ITER(hh, cl->rel, rel, tmp) {
+      inh = NULL;
+      for (tmpcl = cl->par; tmpcl != NULL && inh == NULL; tmpcl = tmpcl->par)
+         inh = getRelation(tmpcl, rel->name);
+      fprintf(outFile, "%s", first ? "relations " : ", ");
+      first = 0;
+      if (rel->hard != 0) {
+         fprintf(outFile, "%s%s", (rel->hard == -1) ? "!" : "", rel->name);
+         printTMLRelationArgs(outFile, rel);
+         continue;
+      }
+      fprintf(outFile, "%s", rel->name);
+      printTMLRelationArgs(outFile, rel);
+      fprintf(outFile, " %f, !%s", (inh != NULL) ? rel->pwt-2*inh->pwt : rel->pwt, rel->name);
+      printTMLRelationArgs(outFile, rel);
+      fprintf(outFile, " %f", (inh != NULL) ? rel->nwt-2*inh->nwt : rel->nwt);
+   }
+   if (!first) fprintf(outFile, ";\n");
+   HASH_ITER(hh, cl->attr, attr, tmpa) {
+      inhattr = NULL;
+      for (tmpcl = cl->par; tmpcl != NULL && inhattr == NULL; tmpcl = tmpcl->par)
+         inhattr = getAttribute(tmpcl, attr->name);
+      fprintf(outFile, "%s", attr->name);
+      first = 1;
+      HASH_ITER(hh, attr->vals, attrval, tmpv) {
+         HASH_FIND_STR(attr->vals, attrval->name, found);
+         if (found != attrval) continue;
+         if (inhattr != NULL)
+            HASH_FIND_STR(inhattr->vals, attrval->name, found);
          else
-            fprintf(outFile, "Is(%s,%s)\n", node->name, node->cl->subcl[node->maxSubcl]->name);
-         printMAPStateForObj(kb, &(node->subcl[node->maxSubcl]), outFile);
+            found = NULL;
+         fprintf(outFile, "%s%s %f", first ? " " : ", ", attrval->name, (found != NULL) ? attrval->wt-found->wt : attrval->wt);
+         first = 0;
       }
+      fprintf(outFile, ";\n");
    }
 }
 
-void printMAPState(TMLKB* kb, const char* outFileName) {
-   FILE* outFile = NULL;
-   Node* node;
-   Node* tmp;
+/**
+ * Writes the rule file of the KB with its current weights, e.g. after
+ * learnTMLWeights. The classes and their subparts are copied from the
+ * rule file the KB was read in from; the subclass, relation and
+ * attribute lines are written from the KB, with every relation of each
+ * class given both its positive and negative weight. Comments are not
+ * copied.
+ *
+ * @param kb         TMLKB struct read in from the rule file
+ * @param rulesName  name of the rule file
+ * @param fileName   name of the rule file to write
+ * @return 1 if the file was written, 0 otherwise
+ */
+int writeTMLRules(TMLKB* kb, const char* rulesName, const char* fileName) {
+   FILE* rulesFile = fopen(rulesName, "r");
+   FILE* outFile;
+   char className[MAX_NAME_LENGTH+1];
+   char keyword[MAX_NAME_LENGTH+1];
+   char bracket[2];
+   char cl_fmt_str[50];
+   char keyword_fmt_str[15];
+   char* fullline;
+   char* line;
+   char* iter;
+   char* restOfLine = NULL;
+   int linenum = 0;
+   int i;
+   TMLClass* cl;
 
-   if (outFileName == NULL)
-      printf("MAP state of unknown TML facts:\n");
-   else
-      outFile = fopen(outFileName, "w");
+   if (rulesFile == NULL) {
+      snprintf(className, MAX_NAME_LENGTH+1, "%s.tml", rulesName);
+      rulesFile = fopen(className, "r");
+      if (rulesFile == NULL) {
+         printf("Error opening %s\n", rulesName);
+         return 0;
+      }
+   }
+   outFile = fopen(fileName, "w");
+   if (outFile == NULL) {
+      printf("Error opening %s\n", fileName);
+      fclose(rulesFile);
+      return 0;
+   }
+   snprintf(cl_fmt_str, 50, " class %%%d[a-zA-Z0-9._:] %%1[{]", MAX_NAME_LENGTH);
+   snprintf(keyword_fmt_str, 15, " %%%ds", MAX_NAME_LENGTH);
+   while ((fullline = getLineToSemicolon(rulesFile, &restOfLine, &linenum)) != NULL) {
+      cl = NULL;
+      if (sscanf(fullline, cl_fmt_str, className, bracket) == 2)
+         HASH_FIND_STR(kb->classNameToPtr, className, cl);
+      free(fullline);
+      if (cl == NULL) {
+         printf("Error on line %d in rule file: Expected a class of the KB.\n", linenum);
+         if (restOfLine != NULL) free(restOfLine);
+         fclose(rulesFile);
+         fclose(outFile);
+         return 0;
+      }
+      fprintf(outFile, "class %s {\n", cl->name);
+      while ((line = getLineToSemicolon(rulesFile, &restOfLine, &linenum)) != NULL && strchr(line, '}') == NULL) {
+         if (sscanf(line, keyword_fmt_str, keyword) == 1) {
+            if (strcmp(keyword, "subclasses") == 0 && cl->nsubcls > 0) {
+               fprintf(outFile, "subclasses");
+               for (i = 0; i < cl->nsubcls; i++)
+                  fprintf(outFile, "%s %s %f", (i == 0) ? "" : ",", cl->subcl[i]->name, cl->wt[i]);
+               fprintf(outFile, ";\n");
+            } else if (strcmp(keyword, "subparts") == 0) {
+               for (iter = line; *iter != '\0'; iter++)
+                  if (*iter == '\r' || *iter == '\n') *iter = ' ';
+               for (iter = line; isspace(*iter); iter++);
+               fprintf(outFile, "%s;\n", iter);
+            }
+         }
+         free(line);
+      }
+      if (line != NULL) free(line);
+      printTMLClassWeights(outFile, cl);
+      fprintf(outFile, "}\n\n");
+   }
+   fclose(rulesFile);
+   fclose(outFile);
+   return 1;
+}
 
-   printMAPStateRec(kb, (Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, outFile);
+/* Node visited by the downward pass of EM, with the probability mass of
+ * the evidence's explanations that pass through it */
+typedef struct EMVisit {
+   Node* node;
+   TMLClass* assignedClassBySuperpart;
+   float reach;
+} EMVisit;
+
+static void pushEMVisit(EMVisit** visits, int* nvisits, int* cap, Node* node, TMLClass* assignedClassBySuperpart, float reach) {
+   EMVisit* v;
+
+   if (*nvisits == *cap) {
+      *cap *= 2;
+      *visits = (EMVisit*)realloc(*visits, sizeof(EMVisit)*(*cap));
+   }
+   v = &((*visits)[*nvisits]);
+   v->node = node;
+   v->assignedClassBySuperpart = assignedClassBySuperpart;
+   v->reach = reach;
+   (*nvisits)++;
 }
 
-void computeMAPState(TMLKB* kb, float logZ) {
-   float mapStateLogZ;
-   Node* root = (Node*)(kb->root->ptr);
-   if (kb->mapSet != 1) {
-      computeLogZ(root, root->cl, spn_max, 1);
-      kb->mapSet = 1;
-   } else
-      computeLogZ(root, root->cl, spn_max, 0);
-   
+/**
+ * Returns the share of a node's reach that a relation, attribute or part
+ * weight of its class is counted with: all of it where computeLogZ adds
+ * the weight to the node's own logZ, and otherwise the probability of the
+ * subclass branches that do not override it.
+ */
+static float localReach(int shape, int assignedSubcl, int isDefault, int* defaultForSubcl, float* probs, int nsubcls, float reach) {
+   float sum = 0.0;
+   int c;
+
+   if (shape == LOGZ_LEAF || isDefault == 0) return reach;
+   if (shape == LOGZ_ASSIGNED)
+      return (defaultForSubcl[assignedSubcl] == 0) ? reach : 0.0;
+   for (c = 0; c < nsubcls; c++)
+      if (defaultForSubcl[c] == 0) sum += probs[c];
+   return reach*sum;
 }
 
-/* Cleaning up the TMLKB structure */
-void freeTMLKB(void* obj) {
-   TMLKB* kb = (TMLKB*)obj;
+/**
+ * Adds the expected counts of the subclasses, soft relations and
+ * attribute values below a node given the evidence to counts, indexed as
+ * the parameters of wl. The SPN is walked down from the node along the
+ * branches computeLogZ evaluates, each node weighted by the probability
+ * of reaching it, which subclLogP gives at every sum node: the logZ of
+ * the SPN must have just been computed with spn_logsum after
+ * trackSubclLogP. Unknown groundings of a relation and unknown values of
+ * an attribute are split by their posterior.
+ *
+ * @param wl        weight lanes over the parameters of the KB
+ * @param counts    expected count of each parameter
+ * @param start     node to start from, with its reach
+ * @param deferred  if not NULL, the part nodes of start are added to it
+ *                  instead of being walked down
+ */
+static void addExpectedCounts(TMLWeightLanes* wl, float* counts, EMVisit start, EMVisit** deferred, int* ndeferred, int* dcap) {
+   EMVisit* visits;
+   EMVisit v;
    Node* node;
-   Node* tmp;
-   QNode* qnode;
-   QNode* next;
-   ObjRelStrsHash* objRelHash;
-   ObjRelStrsHash* objRelTemp;
-   RelationStr_Hash* relStrHash;
-   RelationStr_Hash* relStrTemp;
+   Node* child;
    TMLClass* cl;
-   TMLClass* tmpcl;
-   int c;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLPart* part;
+   TMLPart* tmppart;
+   TMLValueMask* mask;
+   float* probs = NULL;
+   float w, q, sum;
+   int* rv;
+   int nvisits = 0;
+   int cap = 64;
+   int nprobs = 0;
+   int top = 1;
+   int shape, a, d, c, off, p, j, r;
+
+   visits = (EMVisit*)malloc(sizeof(EMVisit)*cap);
+   pushEMVisit(&visits, &nvisits, &cap, start.node, start.assignedClassBySuperpart, start.reach);
+   while (nvisits > 0) {
+      v = visits[--nvisits];
+      node = v.node;
+      cl = node->cl;
+      a = node->assignedSubcl;
+      d = isDescendant(v.assignedClassBySuperpart, cl);
+      if (v.reach <= 0 || (d != -1 && a != -1 && a != d)) {
+         top = 0;
+         continue;
+      }
+      if (a != -1 && cl->nsubcls != 0)
+         shape = LOGZ_ASSIGNED;
+      else if (a == -1 && cl->nsubcls != 0 && node->subclMask == NULL)
+         shape = LOGZ_OPEN;
+      else if (a == -1 && node->subclMask != NULL)
+         shape = LOGZ_MASKED;
+      else
+         shape = LOGZ_LEAF;
+      if (cl->nsubcls > nprobs) {
+         nprobs = cl->nsubcls;
+         probs = (float*)realloc(probs, sizeof(float)*nprobs);
+      }
+      for (c = 0; c < cl->nsubcls; c++) {
+         if (shape == LOGZ_ASSIGNED)
+            probs[c] = (c == a) ? 1.0 : 0.0;
+         else
+            probs[c] = (node->subclLogP != NULL) ? exp(node->subclLogP[c]) : 0.0;
+         if (!(probs[c] > 0)) probs[c] = 0.0; // blocked branch, or no explanation at all
+      }
 
-   if (kb->root != NULL) {
-      free(kb->root);
-   }
+      // Subclasses
+      if (shape != LOGZ_LEAF) {
+         for (c = 0; c < cl->nsubcls; c++) {
+            if (probs[c] == 0) continue;
+            counts[wl->classOffset[cl->id]+c] += v.reach*probs[c];
+            child = (shape == LOGZ_ASSIGNED && node->subclMask == NULL) ? node->subcl : &(node->subcl[c]);
+            pushEMVisit(&visits, &nvisits, &cap, child, v.assignedClassBySuperpart, v.reach*probs[c]);
+         }
+      }
 
-   HASH_ITER(hh, kb->objectNameToPtr, node, tmp) {
-      HASH_DEL(kb->objectNameToPtr, node);  /* delete it (users advances to next) */
-   } 
-   HASH_ITER(hh_path, kb->objectPathToPtr, node, tmp) {
-      HASH_DELETE(hh_path, kb->objectPathToPtr, node);  /* delete it (users advances to next) */
-      freeTreeRootedAtNode(node);
-      free(node->name);
-      free(node->pathname);
-      free(node);
-   }
-   HASH_ITER(hh, kb->classNameToPtr, cl, tmpcl) {
-      HASH_DEL(kb->classNameToPtr, cl);  /* delete it (users advances to next) */
-      freeTMLClass(cl); /* TMLClass owns name_and_ptr->name */
-   }
-   free(kb->classes);
-   HASH_ITER(hh, kb->objToRelFactStrs, objRelHash, objRelTemp) {
-      HASH_DEL(kb->objToRelFactStrs, objRelHash);
-      HASH_ITER(hh, objRelHash->hash, relStrHash, relStrTemp) {
-         HASH_DEL(objRelHash->hash, relStrHash);
-         free(relStrHash->str);
-         free(relStrHash);
+      // Relations
+      r = 0;
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         off = wl->relOffset[cl->id][r];
+         rv = node->relValues[r];
+         r++;
+         if (off == -1) continue;
+         w = localReach(shape, a, rel->defaultRel, rel->defaultRelForSubcl, probs, cl->nsubcls, v.reach);
+         if (w <= 0) continue;
+         q = exp(rel->pwt - logsum_float(rel->pwt, rel->nwt));
+         counts[off] += w*(rv[1] + rv[2]*q);
+         counts[off+1] += w*(rv[0] + rv[2]*(1-q));
       }
-      free(objRelHash);
+
+      // Attributes
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         w = localReach(shape, a, attr->defaultAttr, attr->defaultAttrForSubcl, probs, cl->nsubcls, v.reach);
+         if (w <= 0) continue;
+         off = wl->attrOffset[cl->id][attr->idx];
+         if (node->assignedAttr[attr->idx] != NULL) {
+            counts[off+node->assignedAttr[attr->idx]->idx] += w;
+            continue;
+         }
+         mask = node->attrValues[attr->idx];
+         sum = maskedAttrLogSum(attr, mask);
+         for (j = 0; j < attr->nvals; j++) {
+            if (mask != NULL && isValueMasked(mask, j)) continue;
+            counts[off+j] += w*exp(attr->wts[j] - sum);
+         }
+      }
+
+      // Parts
+      p = 0;
+      HASH_ITER(hh, cl->part, part, tmppart) {
+         w = localReach(shape, a, part->defaultPart, part->defaultPartForSubcl, probs, cl->nsubcls, v.reach);
+         if (w > 0) {
+            for (j = 0; j < part->n; j++) {
+               if (top && deferred != NULL)
+                  pushEMVisit(deferred, ndeferred, dcap, node->part[p][j], part->cl, w);
+               else
+                  pushEMVisit(&visits, &nvisits, &cap, node->part[p][j], part->cl, w);
+            }
+         }
+         p++;
+      }
+      top = 0;
    }
+   free(probs);
+   free(visits);
+}
 
-   for (c = 0; c < kb->numClasses; c++) {
-      qnode = kb->classToObjPtrs[c];
-      while (qnode != NULL) {
-         next = qnode->next;
-         free(qnode);
-         qnode = next;
-      }
+/* Share of the top-level parts of the KB one thread of EM evaluates */
+typedef struct EMWorker {
+   TMLWeightLanes* wl;
+   EMVisit* visits;
+   int nvisits;
+   int first; // evaluates visits first, first+step, ...
+   int step;
+   int up; // 1: computes the logZ of the visits' nodes, 0: their expected counts
+   float* counts; // the thread's expected counts
+} EMWorker;
+
+static void evaluateEMShare(EMWorker* w) {
+   int i;
+
+   for (i = w->first; i < w->nvisits; i += w->step) {
+      if (w->up)
+         computeLogZ(w->visits[i].node, w->visits[i].assignedClassBySuperpart, spn_logsum, 0);
+      else
+         addExpectedCounts(w->wl, w->counts, w->visits[i], NULL, NULL, NULL);
    }
-   free(kb->classToObjPtrs);
-   free(kb);
 }
 
-///////////////////////
-// The following classes are used to print a new .db file
-// based on evidence added in interactive mode
-///////////////////////
+static void* runEMWorker(void* arg) {
+   evaluateEMShare((EMWorker*)arg);
+   return NULL;
+}
 
+static void runEMWorkers(EMWorker* workers, int nthreads) {
+   pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t)*nthreads);
+   int t;
 
-void printSubclassesForObj(Node* obj, FILE* outFile) {
-   int c;
-   if (obj->cl->nsubcls == 0) return;
-   if (obj->assignedSubcl != -1) {
-         fprintf(outFile, ", %s", obj->cl->subcl[obj->assignedSubcl]->name);
-         if (obj->subclMask == NULL)
-            printSubclassesForObj(obj->subcl, outFile);
-         else
-            printSubclassesForObj(&(obj->subcl[obj->assignedSubcl]), outFile);
-      return;
-   }
-   if (obj->subclMask == NULL) {
-      for (c = 0; c < obj->cl->nsubcls; c++)
-         printSubclassesForObj(&(obj->subcl[c]), outFile);
-      return;
-   }
-   for (c = 0; c < obj->cl->nsubcls; c++) {
-      if (obj->subclMask[c] != 1)
-         fprintf(outFile, ", !%s", obj->cl->subcl[c]->name);
-      else {
-         printSubclassesForObj(&(obj->subcl[c]), outFile);
-      }
-   }
+   for (t = 0; t < nthreads; t++)
+      pthread_create(&(threads[t]), NULL, runEMWorker, &(workers[t]));
+   for (t = 0; t < nthreads; t++)
+      pthread_join(threads[t], NULL);
+   free(threads);
 }
 
-void printSubpartsForObj(Node* obj, FILE* outFile, int firstPart) {
+/**
+ * E-step of EM: computes the logZ of the KB with its current weights in
+ * an upward pass, and the expected count of each parameter given the
+ * evidence in a downward one (see addExpectedCounts).
+ *
+ * With more than one thread, the top-level parts, i.e. the part nodes of
+ * the root object, are dealt out to the threads in both passes. Every
+ * node is marked changed first, so the upward pass at the root only
+ * evaluates what the threads did not.
+ *
+ * @param kb        TMLKB struct
+ * @param wl        weight lanes over the parameters of the KB
+ * @param counts    set to the expected count of each parameter
+ * @param nthreads  number of threads
+ * @return log of Z
+ */
+static float computeExpectedCounts(TMLKB* kb, TMLWeightLanes* wl, float* counts, int nthreads) {
+   Node* root = (Node*)(kb->root->ptr);
+   Node* obj;
+   EMVisit start;
+   EMVisit* visits;
+   EMWorker* workers;
    TMLPart* part;
-   TMLPart* tmp;
-   TMLClass* cl = obj->cl;
-   int subcl = obj->assignedSubcl;
-   int p, i;
-   Node* nodePart;
-
-   if (cl->nsubcls == 0 || subcl == -1) {
-      p = 0;
-      HASH_ITER(hh, cl->part, part, tmp) {
-         for (i = 0; i < part->n; i++) {
-            nodePart = obj->part[p][i];
-            if (nodePart->name != NULL) {
-               if (FALSE && part->n == 1) {
-                  if (firstPart == 1) {
-                     fprintf(outFile, "%s %s", nodePart->name, part->name, (i+1));
-                     firstPart = 0;
-                  } else
-                     fprintf(outFile, ", %s %s", nodePart->name, part->name, (i+1));
-               } else {
-                  if (firstPart == 1) {
-                     fprintf(outFile, "%s %s_%d", nodePart->name, part->name, (i+1));
-                     firstPart = 0;
-                  } else
-                     fprintf(outFile, ", %s %s_%d", nodePart->name, part->name, (i+1));
-               }
-            }
-         }
-         p++;
-      } 
-      return;
+   TMLPart* tmppart;
+   int nvisits = 0;
+   int cap = 16;
+   int p, j, t, i;
+   float logZ;
+
+   start.node = root;
+   start.assignedClassBySuperpart = root->cl;
+   start.reach = 1.0;
+   for (i = 0; i < wl->nparams; i++)
+      counts[i] = 0.0;
+   if (nthreads <= 1) {
+      logZ = computeLogZ(root, root->cl, spn_logsum, 1);
+      addExpectedCounts(wl, counts, start, NULL, NULL, NULL);
+      return logZ;
    }
+
+   // Upward pass
+   for (obj = kb->objectPathToPtr; obj != NULL; obj = (Node*)(obj->hh_path.next))
+      propagateKBChangeDown(obj);
+   visits = (EMVisit*)malloc(sizeof(EMVisit)*cap);
    p = 0;
-   HASH_ITER(hh, cl->part, part, tmp) {
-      if (subcl == -1 || part->defaultPart == 0 || part->defaultPartForSubcl[subcl] == 0) {
-         for (i = 0; i < part->n; i++) {
-            nodePart = obj->part[p][i];
-            if (nodePart->name != NULL) {
-               if (part->n == 1) {
-                  if (firstPart == 1) {
-                     fprintf(outFile, "%s %s", nodePart->name, part->name, (i+1));
-                     firstPart = 0;
-                  } else
-                     fprintf(outFile, ", %s %s", nodePart->name, part->name, (i+1));
-               } else {
-                  if (firstPart == 1) {
-                     fprintf(outFile, "%s %s_%d", nodePart->name, part->name, (i+1));
-                     firstPart = 0;
-                  } else
-                     fprintf(outFile, ", %s %s_%d", nodePart->name, part->name, (i+1));
-               }
-            }
-         }
-      }
+   HASH_ITER(hh, root->cl->part, part, tmppart) {
+      for (j = 0; j < part->n; j++)
+         pushEMVisit(&visits, &nvisits, &cap, root->part[p][j], part->cl, 1.0);
       p++;
    }
-   if (obj->assignedSubcl != -1) {
-      printSubpartsForObj(obj->subcl, outFile,firstPart);
-      return;
-   }
-   if (obj->subclMask == NULL) {
-      return;
-   }
-   for (i = 0; i < cl->nsubcls; i++) {
-      if (obj->subclMask[i] == 1)
-         printSubpartsForObj(&(obj->subcl[i]), outFile, firstPart);
-   }
+   workers = (EMWorker*)malloc(sizeof(EMWorker)*nthreads);
+   for (t = 0; t < nthreads; t++) {
+      workers[t].wl = wl;
+      workers[t].visits = visits;
+      workers[t].nvisits = nvisits;
+      workers[t].first = t;
+      workers[t].step = nthreads;
+      workers[t].up = 1;
+      workers[t].counts = NULL;
+   }
+   runEMWorkers(workers, nthreads);
+   logZ = computeLogZ(root, root->cl, spn_logsum, 0);
+
+   // Downward pass
+   nvisits = 0;
+   addExpectedCounts(wl, counts, start, &visits, &nvisits, &cap);
+   for (t = 0; t < nthreads; t++) {
+      workers[t].visits = visits;
+      workers[t].nvisits = nvisits;
+      workers[t].up = 0;
+      workers[t].counts = (float*)calloc((wl->nparams > 0) ? wl->nparams : 1, sizeof(float));
+   }
+   runEMWorkers(workers, nthreads);
+   for (t = 0; t < nthreads; t++) {
+      for (i = 0; i < wl->nparams; i++)
+         counts[i] += workers[t].counts[i];
+      free(workers[t].counts);
+   }
+   free(workers);
+   free(visits);
+   return logZ;
 }
 
-void printRelationsForObj(TMLKB* kb, Node* obj, FILE* outFile, int firstRel) {
-   ObjRelStrsHash* objRelHash;
-   RelationStr_Hash* relStrHash; 
-   RelationStr_Hash* tmp; 
-   char* namedStr;
+/* Sets the counts of the classes of the KB to the parameter counts of wl */
+static void setCountsFromLanes(TMLKB* kb, TMLWeightLanes* wl, float* counts) {
+   TMLClass* cl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   int c, i, r;
 
-   if (obj->pathname != NULL)
-      HASH_FIND_STR(kb->objToRelFactStrs, obj->pathname, objRelHash);
-   else
-      HASH_FIND_STR(kb->objToRelFactStrs, obj->name, objRelHash);
-   if (objRelHash != NULL) {
-      HASH_ITER(hh, objRelHash->hash, relStrHash, tmp) {
-         namedStr = createNamedRelStr(kb, obj, relStrHash->str);
-         if (firstRel == 1) {
-            fprintf(outFile, "%s%s", ((relStrHash->pol == 1) ? "" : "!"), namedStr);
-            firstRel = 0;
-         } else {
-            fprintf(outFile, ", %s%s", ((relStrHash->pol == 1) ? "" : "!"), namedStr);
+   for (c = 0; c < kb->numClasses; c++) {
+      cl = &(kb->classes[c]);
+      for (i = 0; i < cl->nsubcls; i++)
+         cl->cnt[i] = counts[wl->classOffset[c]+i];
+      r = 0;
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         if (wl->relOffset[c][r] != -1) {
+            rel->pcnt = counts[wl->relOffset[c][r]];
+            rel->ncnt = counts[wl->relOffset[c][r]+1];
          }
-         free(namedStr);
+         r++;
+      }
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         HASH_ITER(hh, attr->vals, attrval, tmpv)
+            attrval->cnt = counts[wl->attrOffset[c][attr->idx]+attrval->idx];
       }
    }
 }
 
-void printObject(TMLKB* kb, Node* node, FILE* outFile) {
-   char* bestPath;
+/**
+ * Learns the weights of the KB by EM from its evidence, in which the
+ * classes of objects, relation groundings and attribute values may be
+ * unknown. Each iteration computes the expected counts of the parameters
+ * given the evidence under the current weights (see
+ * computeExpectedCounts), and sets the weights to their log frequencies,
+ * smoothed by the pseudocounts of the KB (see updateWts). The log Z of
+ * the evidence, i.e. its log likelihood once the weights are normalized,
+ * is printed for each iteration.
+ *
+ * @param kb        TMLKB struct, already filled out by fillOutSPN
+ * @param iters     number of iterations
+ * @param nthreads  number of threads to split the top-level parts over
+ * @return log of Z with the learned weights
+ */
+float learnTMLWeightsEM(TMLKB* kb, int iters, int nthreads) {
+   Node* root = (Node*)(kb->root->ptr);
+   TMLWeightLanes* wl = createTMLWeightLanes(kb, 1);
+   float* counts = (float*)malloc(sizeof(float)*((wl->nparams > 0) ? wl->nparams : 1));
+   float logZ;
+   int it;
 
-   if (node->name != NULL && strchr(node->name, '.') == NULL)
-      fprintf(outFile, "%s {\n", node->name);
-   else {
-      bestPath = createBestPathname(kb, node);
-      fprintf(outFile, "%s {\n", bestPath);
-      free(bestPath);
-   }
+   releaseQueryBlocking(kb);
+   flushQueryCache(kb);
+   kb->mapSet = 0;
+   trackSubclLogP(kb);
+   for (it = 1; it <= iters; it++) {
+      logZ = computeExpectedCounts(kb, wl, counts, nthreads);
+      printf("EM iteration %d: log Z of the evidence %f\n", it, logZ);
+      setCountsFromLanes(kb, wl, counts);
+      updateWts(kb);
+   }
+   logZ = computeLogZ(root, root->cl, spn_logsum, 1);
+   if (kb->onlineDirty != NULL) recountOnlineCounts(kb); // the expected counts replaced them
+   free(counts);
+   freeTMLWeightLanes(wl);
+   return logZ;
+}
 
-   fprintf(outFile, "%s", node->cl->name);
-   printSubclassesForObj(node, outFile);
-   fprintf(outFile, ";\n");
+/* One fact file of discriminative weight learning, read in twice */
+typedef struct CLLExample {
+   TMLKB* clamped; // with all its facts
+   TMLKB* free; // with the facts of the target withheld
+} CLLExample;
+
+/* Share of a mini-batch one thread of discriminative learning evaluates */
+typedef struct CLLWorker {
+   CLLExample* examples;
+   int* batch; // indices of the examples of the mini-batch
+   int nbatch;
+   int first; // evaluates batch[first], batch[first+step], ...
+   int step;
+   TMLWeightLanes* wl;
+   float* grad; // the thread's gradient
+   float* counts;
+   float cll; // the thread's conditional log likelihood
+} CLLWorker;
 
-   printSubpartsForObj(node, outFile, 1);
-   fprintf(outFile, ";\n");      
+/**
+ * Adds the gradient of the conditional log likelihood of the target's
+ * facts in one example, given its other facts, to w->grad. The log
+ * likelihood is the difference of the logZ of the example with and
+ * without the target's facts, so its gradient is the difference of
+ * their expected counts (see computeExpectedCounts).
+ */
+static void addExampleGradient(CLLWorker* w, CLLExample* ex) {
+   TMLWeightLanes* wl = w->wl;
+   float logZ;
+   int c, i;
+
+   for (c = 0; c < wl->nclasses; c++) {
+      setClassWeightsFromLanes(&(ex->clamped->classes[c]), wl, 0);
+      setClassWeightsFromLanes(&(ex->free->classes[c]), wl, 0);
+   }
+   logZ = computeExpectedCounts(ex->clamped, wl, w->counts, 1);
+   for (i = 0; i < wl->nparams; i++)
+      w->grad[i] += w->counts[i];
+   logZ -= computeExpectedCounts(ex->free, wl, w->counts, 1);
+   for (i = 0; i < wl->nparams; i++)
+      w->grad[i] -= w->counts[i];
+   w->cll += logZ;
+}
 
-   printRelationsForObj(kb, node, outFile, 1);
-   fprintf(outFile, ";\n");
-   fprintf(outFile, "}\n\n"); 
+static void evaluateCLLShare(CLLWorker* w) {
+   int i;
 
-   
+   for (i = w->first; i < w->nbatch; i += w->step)
+      addExampleGradient(w, &(w->examples[w->batch[i]]));
 }
 
-void printTMLKBRec(TMLKB* kb, Node* node, FILE* outFile) {
-   int p, i;
-   TMLPart* part;
-   TMLPart* tmp;
+static void* runCLLWorker(void* arg) {
+   evaluateCLLShare((CLLWorker*)arg);
+   return NULL;
+}
 
-   if (node->cl->par == NULL)
-      printObject(kb, node, outFile);
+/* Returns 1 if name is a class of the KB with subclasses, or a relation
+ * or attribute of one of its classes */
+static int isCLLTarget(TMLKB* kb, const char* name) {
+   TMLClass* cl;
+   int c;
 
-   p = 0; 
-   HASH_ITER(hh, node->cl->part, part, tmp) {
-      if (part->defaultPart == 0 || node->assignedSubcl == -1) {
-         for (i = 0; i < part->n; i++) {
-            printTMLKBRec(kb, node->part[p][i], outFile);
+   HASH_FIND_STR(kb->classNameToPtr, name, cl);
+   if (cl != NULL) return (cl->nsubcls != 0);
+   for (c = 0; c < kb->numClasses; c++) {
+      if (getRelation(&(kb->classes[c]), name) != NULL
+            || getAttribute(&(kb->classes[c]), name) != NULL)
+         return 1;
+   }
+   return 0;
+}
+
+/**
+ * Marks in owned the parameters of the lanes that belong to a target of
+ * discriminative learning (see isCLLTarget): the weights of a relation or
+ * of the values of an attribute in every class that defines it, or the
+ * subclass weights of a class and of the classes below it, along with
+ * the relation and attribute weights of the classes below it, which only
+ * apply to objects once their subclass below the target is known.
+ */
+static void markCLLTargetParams(TMLKB* kb, TMLWeightLanes* wl, const char* target, char* owned) {
+   TMLClass* targetcl;
+   TMLClass* cl;
+   TMLClass* tmpcl;
+   TMLRelation* rel;
+   TMLRelation* tmp;
+   TMLAttribute* attr;
+   TMLAttribute* tmpa;
+   TMLAttrValue* attrval;
+   TMLAttrValue* tmpv;
+   int c, i, r, inTarget, belowTarget;
+
+   for (i = 0; i < wl->nparams; i++)
+      owned[i] = 0;
+   HASH_FIND_STR(kb->classNameToPtr, target, targetcl);
+   for (c = 0; c < wl->nclasses; c++) {
+      cl = &(kb->classes[c]);
+      inTarget = 0;
+      for (tmpcl = cl; tmpcl != NULL && !inTarget; tmpcl = tmpcl->par)
+         inTarget = (tmpcl == targetcl);
+      belowTarget = (inTarget && cl != targetcl);
+      if (inTarget) {
+         for (i = 0; i < cl->nsubcls; i++)
+            owned[wl->classOffset[c]+i] = 1;
+      }
+      r = 0;
+      HASH_ITER(hh, cl->rel, rel, tmp) {
+         if (wl->relOffset[c][r] != -1 && (belowTarget || strcmp(rel->name, target) == 0)) {
+            owned[wl->relOffset[c][r]] = 1;
+            owned[wl->relOffset[c][r]+1] = 1;
          }
+         r++;
       }
-      p++;
-   }
-   if (node->cl->nsubcls != 0) {
-      if (node->assignedSubcl != -1) {
-         if (node->subclMask == NULL)
-            printTMLKBRec(kb, node->subcl, outFile);
-         else
-            printTMLKBRec(kb, &(node->subcl[node->assignedSubcl]), outFile);
+      HASH_ITER(hh, cl->attr, attr, tmpa) {
+         if (!belowTarget && strcmp(attr->name, target) != 0) continue;
+         HASH_ITER(hh, attr->vals, attrval, tmpv)
+            owned[wl->attrOffset[c][attr->idx]+attrval->idx] = 1;
       }
    }
 }
 
-void printTMLKB(TMLKB* kb, const char* fileName) {
-   char line[MAX_NAME_LENGTH+1];
-   char* fileType = strrchr(fileName, '.');
-   FILE* outFile;
-   char db_fmt_str[50];
-   Name_and_Ptr* name_and_ptr;
-   Name_and_Ptr* name_and_ptr_tmp;
-   Node* topNode;
-   Node* node;
-   Node* tmp;
-   int c;
-   char* bestPath;
-
-   if (fileType == NULL || strcmp(fileType, ".db") != 0) {
-      if (fileType != NULL && strcmp(fileType, ".") == 0) {
-         printf("Filename cannot end with a '.'.\n");
-         return;
+/**
+ * Learns the weights of the KB discriminatively: they are fit to the
+ * conditional log likelihood of the facts about a target in each fact
+ * file given the file's other facts, less the L1 penalty l0*|w| and the
+ * L2 penalty l1*w^2/2 of the KB. The target is a class, whose facts are
+ * the subclasses of its objects, or a relation or attribute. Each fact
+ * file is read in with and without the target's facts (see
+ * TMLKB.withheld), and the exact gradient for every weight is the
+ * difference of the expected counts of the two (see addExampleGradient).
+ *
+ * Only the weights that belong to the target are learned (see
+ * markCLLTargetParams); the others keep their values from the rule file.
+ * They take a gradient step per mini-batch of fact files, with the
+ * penalties scaled by the batch's share of the files; the L1 penalty is
+ * applied by soft thresholding, so it sets weights to exactly zero. The
+ * files of a mini-batch are dealt out to the threads.
+ *
+ * @param kb             TMLKB struct read in from the rule file
+ * @param rulesName      name of the rule file
+ * @param factFileNames  names of the fact files, separated by commas
+ * @param target         class, relation or attribute to predict
+ * @param iters          number of passes over the fact files
+ * @param batchSize      fact files per mini-batch, all of them if < 1
+ * @param rate           step size
+ * @param nthreads       number of threads to evaluate a mini-batch with
+ * @return 1 on success, 0 if the target is unknown or a fact file could
+ *         not be opened or read in, in which case the weights are left as
+ *         they were
+ */
+int learnTMLWeightsCLL(TMLKB* kb, const char* rulesName, const char* factFileNames, const char* target,
+   int iters, int batchSize, float rate, int nthreads) {
+   char* names;
+   char** factFiles;
+   int nfiles;
+   CLLExample* examples;
+   CLLWorker* workers;
+   pthread_t* threads;
+   TMLWeightLanes* wl;
+   TMLKB* exkb;
+   Node* root;
+   int* batch;
+   float* grad;
+   char* owned;
+   float cll, share, wt;
+   int it, f, t, i, k, start, nbatch, nt;
+
+   if (!isCLLTarget(kb, target)) {
+      printf("Unknown target %s: expected a class with subclasses, a relation or an attribute.\n", target);
+      return 0;
+   }
+   factFiles = splitFactFileNames(factFileNames, &names, &nfiles);
+   if (factFiles == NULL) return 0;
+   examples = (CLLExample*)malloc(sizeof(CLLExample)*nfiles);
+   for (f = 0; f < nfiles; f++) {
+      for (k = 0; k < 2; k++) {
+         exkb = TMLKBNew();
+         readInTMLRules(exkb, rulesName);
+         if (k == 1) exkb->withheld = target;
+         if (readInTMLFacts(exkb, factFiles[f]) == 0) {
+            exkb->withheld = NULL;
+            freeTMLKB(exkb);
+            if (k == 1) freeTMLKB(examples[f].clamped);
+            for (i = 0; i < f; i++) {
+               freeTMLKB(examples[i].clamped);
+               freeTMLKB(examples[i].free);
+            }
+            free(examples);
+            free(factFiles);
+            free(names);
+            return 0;
+         }
+         exkb->withheld = NULL;
+         root = (Node*)(exkb->root->ptr);
+         fillOutSPN(exkb, root, root->cl, exkb->root->name);
+         trackSubclLogP(exkb);
+         if (k == 0)
+            examples[f].clamped = exkb;
+         else
+            examples[f].free = exkb;
+      }
+   }
+
+   if (batchSize < 1 || batchSize > nfiles) batchSize = nfiles;
+   if (nthreads > batchSize) nthreads = batchSize;
+   if (nthreads < 1) nthreads = 1;
+   wl = createTMLWeightLanes(kb, 1);
+   grad = (float*)malloc(sizeof(float)*((wl->nparams > 0) ? wl->nparams : 1));
+   owned = (char*)malloc((wl->nparams > 0) ? wl->nparams : 1);
+   markCLLTargetParams(kb, wl, target, owned);
+   batch = (int*)malloc(sizeof(int)*batchSize);
+   workers = (CLLWorker*)malloc(sizeof(CLLWorker)*nthreads);
+   threads = (pthread_t*)malloc(sizeof(pthread_t)*nthreads);
+   for (t = 0; t < nthreads; t++) {
+      workers[t].examples = examples;
+      workers[t].batch = batch;
+      workers[t].first = t;
+      workers[t].wl = wl;
+      workers[t].grad = (float*)malloc(sizeof(float)*((wl->nparams > 0) ? wl->nparams : 1));
+      workers[t].counts = (float*)malloc(sizeof(float)*((wl->nparams > 0) ? wl->nparams : 1));
+   }
+   for (it = 1; it <= iters; it++) {
+      cll = 0.0;
+      for (start = 0; start < nfiles; start += batchSize) {
+         nbatch = (nfiles-start < batchSize) ? nfiles-start : batchSize;
+         for (i = 0; i < nbatch; i++)
+            batch[i] = start+i;
+         nt = (nthreads < nbatch) ? nthreads : nbatch;
+         for (t = 0; t < nt; t++) {
+            workers[t].nbatch = nbatch;
+            workers[t].step = nt;
+            workers[t].cll = 0.0;
+            for (k = 0; k < wl->nparams; k++)
+               workers[t].grad[k] = 0.0;
+         }
+         if (nt == 1) {
+            evaluateCLLShare(&(workers[0]));
+         } else {
+            for (t = 0; t < nt; t++)
+               pthread_create(&(threads[t]), NULL, runCLLWorker, &(workers[t]));
+            for (t = 0; t < nt; t++)
+               pthread_join(threads[t], NULL);
+         }
+         for (k = 0; k < wl->nparams; k++)
+            grad[k] = 0.0;
+         for (t = 0; t < nt; t++) {
+            cll += workers[t].cll;
+            for (k = 0; k < wl->nparams; k++)
+               grad[k] += workers[t].grad[k];
+         }
+         share = (float)nbatch/nfiles;
+         for (k = 0; k < wl->nparams; k++) {
+            if (!owned[k]) continue;
+            wt = wl->wts[k] + rate*(grad[k] - share*kb->l1*wl->wts[k]);
+            if (wt > rate*share*kb->l0)
+               wt -= rate*share*kb->l0;
+            else if (wt < -rate*share*kb->l0)
+               wt += rate*share*kb->l0;
+            else
+               wt = 0.0;
+            wl->wts[k] = wt;
+         }
       }
-      snprintf(line, MAX_NAME_LENGTH, "%s.db", fileName);
-      outFile = fopen(line, "w");
-   } else {
-      outFile = fopen(fileName, "w");
+      printf("Iteration %d: conditional log likelihood of the target %f\n", it, cll);
+   }
+   for (i = 0; i < kb->numClasses; i++) {
+      setClassWeightsFromLanes(&(kb->classes[i]), wl, 0);
+      kb->classes[i].localKernel = NULL; // generated for the old weights
    }
 
-   printTMLKBRec(kb, ((Node*)(kb->root->ptr)), outFile);
-   fclose(outFile);
+   for (t = 0; t < nthreads; t++) {
+      free(workers[t].grad);
+      free(workers[t].counts);
+   }
+   free(workers);
+   free(threads);
+   free(batch);
+   free(grad);
+   free(owned);
+   freeTMLWeightLanes(wl);
+   for (f = 0; f < nfiles; f++) {
+      freeTMLKB(examples[f].clamped);
+      freeTMLKB(examples[f].free);
+   }
+   free(examples);
+   free(factFiles);
+   free(names);
+   return 1;
 }
-
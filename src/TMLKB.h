@@ -46,11 +46,109 @@ typedef struct KBEdit {
    int subclIdx;
    int valIdx;
    int pol;
+   char* fact; // on the top edit of each fact added, the fact; otherwise NULL
+   long expires; // on the top edit of a timed fact, when it expires; otherwise -1
+   struct KBExpiry* expiry; // on the top edit of a timed fact, its entry in kb->expiries; otherwise NULL
    struct KBEdit* prev;
 } KBEdit;
 
 KBEdit* addKBEdit(Node* node, int subclIdx, char* relStr, int relIdx, int valIdx, int pol, KBEdit* prev);
 
+// Groundings of relations with at most this many arguments are enumerated
+// from arrays held in the iterator itself
+#define GROUNDING_ITER_ARITY 3
+
+/* Iterator over the groundings of a relation: every combination of one
+ * candidate node per argument. It is meant to live on the stack; it reads
+ * the candidate arrays in place and only allocates for relations with more
+ * than GROUNDING_ITER_ARITY arguments. Since args, len, idx and curr may
+ * point into the iterator, it must not be copied.
+ */
+typedef struct GroundingIter {
+   int nargs;
+   int done;
+   Node*** args;    // candidate nodes of each argument
+   int* len;        // number of candidates of each argument
+   int* idx;        // candidate of each argument in the next grounding
+   Node** curr;     // current grounding
+   RelationStr_Hash* known; // facts of the object whose groundings are skipped
+   char* relName;
+   char* str;       // buffer of MAX_LINE_LENGTH+1 chars for known lookups
+   Node** argsArr[GROUNDING_ITER_ARITY];
+   int lenArr[GROUNDING_ITER_ARITY];
+   int idxArr[GROUNDING_ITER_ARITY];
+   Node* currArr[GROUNDING_ITER_ARITY];
+} GroundingIter;
+
+/* Cached result of a probability query, valid for the evidence epoch
+ * it was computed or last checked at.
+ */
+typedef struct QueryCacheEntry {
+   char* key; // normalized query
+   Node* node; // node of the object the query is about
+   unsigned long epoch;
+   double prob;
+   UT_hash_handle hh;
+} QueryCacheEntry;
+
+/* Last evidence epochs at which edits reached a node */
+typedef struct NodeEpoch {
+   Node* node;
+   unsigned long subtree; // an edit in the node's subtree, or at the node
+   unsigned long self; // an edit to the node's class structure
+   UT_hash_handle hh;
+} NodeEpoch;
+
+/* Blocking edits of a relation query, kept in place while the following
+ * queries are about the same objects so that the blocked log Z is only
+ * computed once for them (see computeQueryFile).
+ */
+typedef struct QueryBlocking {
+   Node* node; // object of the query holding the blocking, NULL if none
+   Node** args; // its argument objects
+   int nargs;
+   KBEdit* edits;
+   float blockedLogZ;
+} QueryBlocking;
+
+/* Attribute a prepared query resolves to for objects of a class */
+typedef struct PreparedAttr {
+   TMLClass* cl;
+   TMLAttribute* attr; // NULL if the class has no such attribute
+   TMLAttrValue* attrval; // NULL if all values are queried or the value is unknown
+   UT_hash_handle hh;
+} PreparedAttr;
+
+/* A query template parsed once, such as Crime($x) or Is($x,Adult), whose
+ * parameter $x is the object the query is about. Everything but the
+ * object is resolved when the query is prepared.
+ */
+typedef struct TMLPreparedQuery {
+   char* name;
+   char* text; // the template, owns the strings relRest points into
+   int pol;
+   TMLClass* cl; // class of a class query, NULL otherwise
+   char* relName; // relation or attribute name
+   char* valName; // attribute value, NULL if none
+   char* relRest; // arguments after the object, NULL if none
+   char* normalizedRelStr;
+   char* outputRelStr;
+   char** args;
+   int nargs;
+   PreparedAttr* attrs; // per class of the bound objects
+   UT_hash_handle hh;
+} TMLPreparedQuery;
+
+/* A savepoint on the edit stack. Rolling back to it undoes the edits
+ * made since, leaving the edits below it in place.
+ */
+typedef struct KBSavepoint {
+   char* name; // NULL if unnamed
+   KBEdit* edits; // top of the edit stack when the savepoint was set
+   float logZ; // log of Z when the savepoint was set
+   struct KBSavepoint* prev;
+} KBSavepoint;
+
 /* Structure for a TML Knowledge Base
  */
 typedef struct TMLKB {
@@ -91,6 +189,57 @@ typedef struct TMLKB {
    // Stack of edits made to the KB (used in interactive mode)
    KBEdit* edits;
 
+   // Stack of savepoints on the edit stack, innermost first
+   KBSavepoint* savepoints;
+
+   // Cache of query results and the evidence epochs that tell which are
+   // still valid. epochEdits is the top of the edit stack when the epochs
+   // were last updated.
+   QueryCacheEntry* queryCache;
+   NodeEpoch* nodeEpochs;
+   unsigned long epoch;
+   KBEdit* epochEdits;
+
+   // Prepared queries by name
+   TMLPreparedQuery* preparedQueries;
+
+   // Blocking shared between queries, NULL unless answering a query file
+   QueryBlocking* queryBlocking;
+
+   // Object nodes by the id of their class, for finding the nodes a
+   // weight change affects, and how many objects there were, the evidence
+   // epoch and the top of the edit stack when it was built (NULL until a
+   // weight is changed)
+   QNode** objectsByClass;
+   unsigned int nindexedObjects;
+   unsigned long indexedEpoch;
+   KBEdit* indexedEdits;
+
+   // Clock of timed facts, the default time timed facts hold for (0 if
+   // they hold forever), and a heap of when timed facts expire
+   long now;
+   long window;
+   struct pqueue_t* expiries;
+
+   // KB this is a read-only snapshot of (see createTMLKBSnapshot), NULL
+   // if this is not a snapshot
+   struct TMLKB* snapshotOf;
+
+   // If 1, adding a fact does not recompute logZ or check it for a
+   // contradiction (used while capturing the worlds of a batch)
+   int deferLogZ;
+
+   // If 1, the SPN keeps its subclass branches locally normalized (see
+   // normalizeSPN) and simple marginals are read from them
+   int localMarginals;
+
+   // Subclass branches pruned by the hard rules given the fact file
+   KBEdit* prunes;
+
+   // Shared library holding the generated kernels of the classes, if one
+   // was loaded with loadTMLKernel
+   void* kernelLib;
+
    // Subclass pseudocount
    int scPct;
 
@@ -98,18 +247,68 @@ typedef struct TMLKB {
    int relPctT;
    int relPctF;
 
-   // l0, l1 penalties
+   // l0, l1 penalties: the weights of the L1 and L2 penalties of
+   // discriminative weight learning (see learnTMLWeightsCLL), 0 by default
    float l0;
    float l1;
 
+   // If not NULL, the class, relation or attribute whose facts
+   // readInTMLFacts skips: the subclass facts of objects of the class, or
+   // the groundings of the relation or values of the attribute. Not owned
+   const char* withheld;
+
+   // Online weight learning (see startOnlineLearning). If not NULL, the
+   // observed counts of the classes follow the evidence as facts are
+   // added and retracted, and onlineDirty[c] is 1 if those of class c
+   // changed since its weights were last re-estimated from them
+   int* onlineDirty;
+   int onlineEvery; // facts between re-estimates, 0 if only when asked
+   int onlinePending; // facts counted since the last re-estimate
+   KBEdit* countedEdits; // top of the edits the counts follow
+
 } TMLKB;
 
+/* A batch of independent worlds evaluated against the same KB.
+ * Each world is a set of facts added on top of the KB's evidence and
+ * the queries to answer given those facts.
+ */
+typedef struct TMLWorldBatch {
+   int nworlds;
+   int* nfacts;
+   char*** facts;
+   int* nqueries;
+   char*** queries;
+   // Results: log of the partition function of each world and, for each
+   // world, the probability of each of its queries (NAN if the world's
+   // facts already decide the query)
+   float* logZ;
+   float** probs;
+} TMLWorldBatch;
+
+/* Lanes of weight vectors over the parameters of a KB, evaluated together
+ * in one traversal. wts[i*nvecs+w] is parameter i in vector w.
+ */
+typedef struct TMLWeightLanes {
+   int nvecs;
+   int nparams;
+   float* wts;
+   int nclasses;
+   // Per class id: index of the weight of its first subclass
+   int* classOffset;
+   // Per class id and relation (in hash order): index of the positive
+   // weight, followed by the negative one. -1 for hard relations
+   int** relOffset;
+   // Per class id and attribute idx: index of the weight of value 0
+   int** attrOffset;
+} TMLWeightLanes;
+
 TMLKB* TMLKBNew();
 void fillOutSubclasses(Node* node);
 char* findBasePartName(char* str, int* num);
 char* createBestPathname(TMLKB* kb, Node* node);
 char* createNamedRelStr(TMLKB* kb, Node* node, char* normalizedStr);
 char* createNormalizedRelStr(TMLKB* kb, char* relation, char* object, Node** argNodes, int nargs, int addBase, int useNames);
+void writeNormalizedRelStr(char* str, char* relation, char* object, Node** argNodes, int nargs, int addBase, int useNames);
 char* splitRelArgsAndCreateNormalizedRelStr(TMLKB* kb, char* relStr, char* relation, int* nargs, char*** args, int useNames);
 Node* findNodeFromAnonName(TMLKB* kb, Node* base, const char* name, int init);
 //Node* findNodeFromAnonName_TML1(TMLKB* kb, const char* name);
@@ -129,6 +328,7 @@ Node* findAndInitPartDown(TMLKB* kb, Node* node, const char* name, int n, const
 Node* findPartDown(Node* node, const char* name, int n, int print, int* maxParts);
 void renameNode(TMLKB* kb, Node* node, char* newName);
 float fillOutSPN(TMLKB* kb, Node* node, TMLClass* assignedClassBySuperpart, char* anonName);
+float normalizeSPN(TMLKB* kb);
 int checkForLostRoot(TMLClass* cl);
 int readInOneTMLClass(TMLKB* kb, const char* className, TMLClass** rootCl, FILE* tmlRuleFile, int linenum, int id, int counts, int first);
 int pushDefaultRelationDown(TMLKB* kb, TMLClass* cl, TMLRelation* rel);
@@ -139,11 +339,25 @@ void addPartGroundLitCount(TMLClass* cl);
 int readInClassRelations(TMLKB* kb, TMLClass* cl, FILE* tmlRuleFile, char* line, int linenum, int counts);
 void readInTMLRules(TMLKB* kb, const char* tmlRuleFileName);
 Node* addClassEvidenceForObj(TMLKB* kb, char* objectName, Node* node, char* className, int pol, FILE* tmlFactFile, int linenum); 
-void readInTMLFacts(TMLKB* kb, const char* tmlFactFileName);
+int readInTMLFacts(TMLKB* kb, const char* tmlFactFileName);
 TMLClass* getTopClass(TMLKB* kb);
 void resetOneKBEdit(TMLKB* kb, KBEdit* edit);
 void resetKBEdits(TMLKB* kb, KBEdit* edits);
+void resetKBEditsTo(TMLKB* kb, KBEdit* stop);
 void resetKB(TMLKB* kb);
+void beginKBSavepoint(TMLKB* kb, const char* name, float logZ);
+float rollbackToKBSavepoint(TMLKB* kb, const char* name, float logZ);
+int releaseKBSavepoint(TMLKB* kb, const char* name);
+void freeKBSavepoints(TMLKB* kb, KBSavepoint* stop);
+float retractKBFact(TMLKB* kb, const char* fact, float logZ);
+void freeKBExpiries(TMLKB* kb);
+float advanceKBClock(TMLKB* kb, long now, float logZ);
+float addTimedKBFact(TMLKB* kb, char* fact, long time, long ttl, float logZ);
+void flushQueryCache(TMLKB* kb);
+void updateKBEpoch(TMLKB* kb);
+void markUndoneKBEdits(TMLKB* kb, KBEdit* stop);
+int lookupQueryCache(TMLKB* kb, const char* key, double* prob);
+void storeQueryCache(TMLKB* kb, const char* key, Node* node, double prob);
 void propagateKBChange(Node* node);
 void propagateKBChangeUp(Node* node);
 void propagateKBChangeDown(Node* node);
@@ -161,9 +375,23 @@ int computeNumRelationGroundings(Node* node, const char* relStr);
 void computeRelationQueryOrAddEvidenceForObj(TMLKB* kb, Node* topNode, char* base, char* rel, char* rest, int pol, char* normalizedRelStr, char** args, int p, float logZ, int isQuery, int isClassQuery, char* outputRelStr, FILE* outFile);
 void computeRelationQueryOrAddEvidence(TMLKB* kb, char* rel, char* iter, int pol, float logZ, int isQuery, FILE* outputFile);
 void computeClassQueryForObject(TMLKB* kb, const char* objName, Node* obj, const char* clName, TMLClass* cl, float logZ, FILE* outputFile);
+void computeTopKQuery(TMLKB* kb, int k, char* query, float logZ, FILE* outFile);
+float computeQueryOrAddEvidenceToFile(TMLKB* kb, char* query, float logZ, int isQuery, FILE* outFile);
+float loadKBEvidence(TMLKB* kb, const char* tmlFactFileName, float logZ);
 float computeQueryOrAddEvidence(TMLKB* kb, char* query, float logZ, int isQuery, const char* output);
+void releaseQueryBlocking(TMLKB* kb);
+int computeQueryFile(TMLKB* kb, const char* queryFileName, float logZ, const char* output, int nthreads);
+TMLPreparedQuery* prepareTMLQuery(TMLKB* kb, const char* name, const char* query);
+TMLPreparedQuery* findPreparedQuery(TMLKB* kb, const char* name);
+Node* findQueryObject(TMLKB* kb, const char* objName);
+void executePreparedQuery(TMLKB* kb, TMLPreparedQuery* pq, Node* obj, float logZ, FILE* outFile);
+void freePreparedQuery(TMLPreparedQuery* pq);
 void computeObjIndptQuery(TMLKB* kb, char* query, float logZ, int isQuery);
-ArraysAccessor* createArraysAccessorForRel(TMLRelation* rel, Node* node);
+void initGroundingIter(GroundingIter* it, Node*** args, int* len, int nargs);
+void initGroundingIterForRel(GroundingIter* it, TMLRelation* rel, Node* node);
+void skipKnownGroundings(GroundingIter* it, ObjRelStrsHash* objRelHash, char* relName, char* str);
+Node** nextGrounding(GroundingIter* it);
+void freeGroundingIter(GroundingIter* it);
 void printMAPStateForObj(TMLKB* kb, Node* node, FILE* outFile);
 void printMAPStateRec(TMLKB* kb, Node* node, TMLClass* assignedClFromSubpart, FILE* outFile);
 void computeMAPState(TMLKB* kb, float logZ);
@@ -173,12 +401,33 @@ TMLClass* addClass(TMLKB* kb, char* className, int id, int subclIdx);
 TMLKB* readInTMLKBFromList(const char* tmlRuleFileName);
 
 void freeTMLKB(void* obj);
+TMLKB* createTMLKBSnapshot(TMLKB* kb);
 void printSubclassesForObj(Node* obj, FILE* outFile);
 void printSubpartsForObj(Node* obj, FILE* outFile, int firstPart);
 void printRelationsForObj(TMLKB* kb, Node* obj, FILE* outFile, int firstRel);
 void printObject(TMLKB* kb, Node* node, FILE* outFile);
 void printTMLKB(TMLKB* kb, const char* fileName);
 
+TMLWorldBatch* readInTMLWorlds(const char* worldFileName);
+void computeWorldBatch(TMLKB* kb, TMLWorldBatch* batch);
+void printWorldBatch(TMLWorldBatch* batch, const char* output);
+void freeTMLWorldBatch(TMLWorldBatch* batch);
+TMLWeightLanes* createTMLWeightLanes(TMLKB* kb, int nvecs);
+void printTMLWeightLayout(TMLKB* kb, FILE* outFile);
+TMLWeightLanes* readInTMLWeightVectors(TMLKB* kb, const char* weightFileName);
+void computeWeightLanesLogZ(TMLKB* kb, TMLWeightLanes* wl, float* logZ);
+float setTMLWeight(TMLKB* kb, const char* param, float wt, float logZ);
+float setTMLWeightVector(TMLKB* kb, TMLWeightLanes* wl, int w, float logZ);
+float reloadTMLWeights(TMLKB* kb, const char* weightFileName, float logZ);
+int computeWeightLanesQuery(TMLKB* kb, TMLWeightLanes* wl, char* query, float* logZ, float* probs);
+void printWeightLanes(TMLWeightLanes* wl, float* logZ, const char* query, float* probs, const char* output);
+void freeTMLWeightLanes(TMLWeightLanes* wl);
+int propagateHardConstraints(TMLKB* kb, Node* node, KBEdit** editsPtr);
+int propagateHardConstraintsForKB(TMLKB* kb);
+unsigned long computeModelSignature(TMLKB* kb);
+int printTMLKernel(TMLKB* kb, const char* rulesName, const char* fileName);
+int loadTMLKernel(TMLKB* kb, const char* kernelFileName);
+
 void setMAPCountsForObj(TMLKB* kb, Node* node);
 void setMAPCounts(TMLKB* kb);
 void resetMAPCountsForClass(TMLClass* cls);
@@ -186,6 +435,20 @@ void resetMAPCounts(TMLKB* kb);
 void updateWtsForRel(TMLKB* kb, TMLRelation* rel);
 void updateWtsForClass(TMLKB* kb, TMLClass* cls);
 void updateWts(TMLKB* kb);
-void learnWts(TMLKB* kb, float logZ);
+float learnWts(TMLKB* kb, int maxIters);
+void resetObservedCounts(TMLKB* kb);
+void setObservedCountsForObj(TMLKB* kb, Node* node);
+void addObservedCountsForObj(TMLKB* kb, Node* node, float sign);
+void setObservedCounts(TMLKB* kb);
+void mergeObservedCounts(TMLKB* kb, TMLKB* from);
+int learnTMLWeights(TMLKB* kb, const char* rulesName, const char* factFileNames, int nthreads);
+int writeTMLRules(TMLKB* kb, const char* rulesName, const char* fileName);
+float learnTMLWeightsEM(TMLKB* kb, int iters, int nthreads);
+int learnTMLWeightsCLL(TMLKB* kb, const char* rulesName, const char* factFileNames, const char* target,
+   int iters, int batchSize, float rate, int nthreads);
+void countKBEdits(TMLKB* kb, KBEdit* top, KBEdit* stop, float sign);
+void startOnlineLearning(TMLKB* kb, int every);
+void stopOnlineLearning(TMLKB* kb);
+float updateOnlineWeights(TMLKB* kb, float logZ, int force);
 
 #endif
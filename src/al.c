@@ -1,12 +1,34 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <ctype.h>
 #include "TMLClass.h"
 #include "TMLKB.h"
 
 #define MAX_LINE_LENGTH 10000
 #define MAX_NAME_LENGTH 1000
 
+/* Prints the command line flags of al */
+static void printUsage() {
+   printf("Incorrect arguments to Alchemy Lite. Use flags:\n"
+      "   -i     Rule file\n"
+      "   -e     Fact file\n"
+      "   -q     Query [If flag is not present and -map is not present, begins interactive mode]\n"
+      "   -qf    (Optional) File of queries to answer, one per line, instead of -q\n"
+      "   -threads (Optional) Number of threads to answer a query file with\n"
+      "   -o     (Optional) Output file\n"
+      "   -map   (Optional) Print MAP relations and classes\n"
+      "   -b     (Optional) World file of fact and query blocks to evaluate as a batch\n"
+      "   -w     (Optional) File of weight vectors to evaluate the KB (and query) under\n"
+      "   -codegen (Optional) Write C kernels specialized to the rule file and exit\n"
+      "   -kernel  (Optional) Shared library compiled from -codegen output to evaluate with\n"
+      "   -local   (Optional) Answer simple marginals from a locally normalized SPN\n"
+      "   -learn   (Optional) Learn weights from fully observed fact files (-e a.db,b.db) and write the rule file with them\n"
+      "   -em      (Optional) Number of EM iterations to learn weights from partially labeled evidence with (with -learn, write the rule file with them)\n"
+      "   -hardem  (Optional) Most hard EM iterations, over MAP states, to learn weights from partially labeled evidence with (with -learn, write the rule file with them)\n"
+      "   -cll     (Optional) Class, relation or attribute to learn weights for discriminatively, by its conditional likelihood given the other facts (with -learn)\n"
+      "   -iters, -batch, -rate, -l1, -l2 (Optional) Passes over the fact files, fact files per mini-batch, step size, and L1 and L2 penalties (0 by default) of -cll\n");
+}
 
 int main(int argc, char *argv[]) { 
    TMLKB* kb;
@@ -23,6 +45,24 @@ int main(int argc, char *argv[]) {
    char print_fmt_str[50];
    char map_fmt_str[50];
    char em_fmt_str[50];
+   char hardem_fmt_str[50];
+   char begin_fmt_str[50];
+   char rollback_fmt_str[50];
+   char release_fmt_str[50];
+   char retract_fmt_str[50];
+   char timed_fmt_str[50];
+   char ttl_fmt_str[50];
+   char time_fmt_str[50];
+   char window_fmt_str[50];
+   char load_fmt_str[50];
+   char weight_fmt_str[50];
+   char weights_fmt_str[50];
+   char online_fmt_str[50];
+   int onlineEvery;
+   long factTime;
+   float wt;
+   char prepare_fmt_str[60];
+   char exec_fmt_str[50];
    char query[MAX_LINE_LENGTH+1];
    char outfile[MAX_LINE_LENGTH+1];
    char* p;
@@ -33,80 +73,337 @@ int main(int argc, char *argv[]) {
    int rulesIdx = -1;
    int evidIdx = -1;
    int queryIdx = -1;
+   int queryFileIdx = -1;
+   int nthreads = -1;
    int outputIdx = -1;
    int map = -1;
+   int batchIdx = -1;
+   TMLWorldBatch* batch;
+   int weightsIdx = -1;
+   TMLWeightLanes* wl;
+   float* wlLogZ;
+   float* wlProbs;
+   int codegenIdx = -1;
+   int kernelIdx = -1;
+   int local = -1;
+   int learnIdx = -1;
+   int emIters = -1;
+   int hardEMIters = -1;
+   int cllIdx = -1;
+   int cllIters = -1;
+   int cllBatch = -1;
+   float cllRate = -1.0;
+   float l1 = -1.0;
+   float l2 = -1.0;
+   TMLPreparedQuery* pq;
 
    kb = TMLKBNew();
    if (argc < 3) {
-      printf("Incorrect arguments to Alchemy Lite. Use flags:\n   -i     Rule file\n   -e     Fact file\n   -q     Query [If flag is not present and -map is not present, begins interactive mode]\n   -o     (Optional) Output file\n   -map   (Optional) Print MAP relations and classes\n");
-      return;
+      printUsage();
+      return 1;
    }
    for (a = 1; a < argc; a++) {
       if (strcmp(argv[a],"-i") == 0) {
-         if (a == argc) {
-            printf("Incorrect arguments to Alchemy Lite. Use flags:\n   -i     Rule file\n   -e     Fact file\n   -q     Query [If flag is not present and -map is not present, begins interactive mode]\n   -o     (Optional) Output file\n   -map   (Optional) Print MAP relations and classes\n");
-            return;
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
          }
          if (rulesIdx != -1) {
             printf("Incorrect arguments to Alchemy Lite. Please specify only one rule file.\n");
-            return;
+            return 1;
          }
          rulesIdx = ++a;
       } else if (strcmp(argv[a],"-e") == 0) {
-         if (a == argc) {
-            printf("Incorrect arguments to Alchemy Lite. Use flags:\n   -i     Rule file\n   -e     Fact file\n   -q     Query [If flag is not present and -map is not present, begins interactive mode]\n   -o     (Optional) Output file\n   -map   (Optional) Print MAP relations and classes\n");
-            return;
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
          }
          if (evidIdx != -1) {
             printf("Incorrect arguments to Alchemy Lite. Please specify only one fact file.\n");
-            return;
+            return 1;
          }
          evidIdx = ++a;
       } else if (strcmp(argv[a],"-q") == 0) {
-         if (a == argc) {
-            printf("Incorrect arguments to Alchemy Lite. Use flags:\n   -i     Rule file\n   -e     Fact file\n   -q     Query [If flag is not present and -map is not present, begins interactive mode]\n   -o     (Optional) Output file\n   -map   (Optional) Print MAP relations and classes\n");
-            return;
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
          }
          if (queryIdx != -1) {
             printf("Incorrect arguments to Alchemy Lite. Please specify only one query. If more than one query is desired, please use interactive mode (by not specifying a query on the command line.\n");
-            return;
+            return 1;
          }
          queryIdx = ++a;
+      } else if (strcmp(argv[a], "-qf") == 0) {
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
+         }
+         if (queryFileIdx != -1) {
+            printf("Incorrect arguments to Alchemy Lite. Please specify only one query file.\n");
+            return 1;
+         }
+         queryFileIdx = ++a;
+      } else if (strcmp(argv[a], "-threads") == 0) {
+         if (a+1 == argc || atoi(argv[a+1]) < 1) {
+            printUsage();
+            return 1;
+         }
+         nthreads = atoi(argv[++a]);
       } else if(strcmp(argv[a], "-o") == 0) {
-         if (a == argc) {
-            printf("Incorrect arguments to Alchemy Lite. Use flags:\n   -i     Rule file\n   -e     Fact file\n   -q     Query [If flag is not present and -map is not present, begins interactive mode]\n   -o     (Optional) Output file\n   -map   (Optional) Print MAP relations and classes\n");
-            return;
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
          }
          if (outputIdx != -1) {
             printf("Incorrect arguments to Alchemy Lite. Please specify at most one output file.\n");
-            return;
+            return 1;
          }
          outputIdx = ++a;
       } else if (strcmp(argv[a], "-map") == 0) {
          map = 1;
+      } else if (strcmp(argv[a], "-local") == 0) {
+         local = 1;
+      } else if (strcmp(argv[a], "-b") == 0) {
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
+         }
+         if (batchIdx != -1) {
+            printf("Incorrect arguments to Alchemy Lite. Please specify only one world file.\n");
+            return 1;
+         }
+         batchIdx = ++a;
+      } else if (strcmp(argv[a], "-w") == 0) {
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
+         }
+         if (weightsIdx != -1) {
+            printf("Incorrect arguments to Alchemy Lite. Please specify only one weight file.\n");
+            return 1;
+         }
+         weightsIdx = ++a;
+      } else if (strcmp(argv[a], "-codegen") == 0) {
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
+         }
+         if (codegenIdx != -1) {
+            printf("Incorrect arguments to Alchemy Lite. Please specify at most one codegen file.\n");
+            return 1;
+         }
+         codegenIdx = ++a;
+      } else if (strcmp(argv[a], "-kernel") == 0) {
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
+         }
+         if (kernelIdx != -1) {
+            printf("Incorrect arguments to Alchemy Lite. Please specify at most one kernel.\n");
+            return 1;
+         }
+         kernelIdx = ++a;
+      } else if (strcmp(argv[a], "-learn") == 0) {
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
+         }
+         if (learnIdx != -1) {
+            printf("Incorrect arguments to Alchemy Lite. Please specify at most one learned rule file.\n");
+            return 1;
+         }
+         learnIdx = ++a;
+      } else if (strcmp(argv[a], "-em") == 0) {
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
+         }
+         emIters = atoi(argv[++a]);
+         if (emIters < 1) {
+            printf("Incorrect arguments to Alchemy Lite. Please specify a positive number of EM iterations.\n");
+            return 1;
+         }
+      } else if (strcmp(argv[a], "-hardem") == 0) {
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
+         }
+         hardEMIters = atoi(argv[++a]);
+         if (hardEMIters < 1) {
+            printf("Incorrect arguments to Alchemy Lite. Please specify a positive number of EM iterations.\n");
+            return 1;
+         }
+      } else if (strcmp(argv[a], "-cll") == 0) {
+         if (a+1 == argc) {
+            printUsage();
+            return 1;
+         }
+         if (cllIdx != -1) {
+            printf("Incorrect arguments to Alchemy Lite. Please specify at most one target of discriminative learning.\n");
+            return 1;
+         }
+         cllIdx = ++a;
+      } else if (strcmp(argv[a], "-iters") == 0 || strcmp(argv[a], "-batch") == 0) {
+         if (a+1 == argc || atoi(argv[a+1]) < 1) {
+            printUsage();
+            return 1;
+         }
+         if (strcmp(argv[a], "-iters") == 0)
+            cllIters = atoi(argv[++a]);
+         else
+            cllBatch = atoi(argv[++a]);
+      } else if (strcmp(argv[a], "-rate") == 0) {
+         if (a+1 == argc || atof(argv[a+1]) <= 0.0) {
+            printUsage();
+            return 1;
+         }
+         cllRate = atof(argv[++a]);
+      } else if (strcmp(argv[a], "-l1") == 0 || strcmp(argv[a], "-l2") == 0) {
+         if (a+1 == argc || atof(argv[a+1]) < 0.0) {
+            printUsage();
+            return 1;
+         }
+         if (strcmp(argv[a], "-l1") == 0)
+            l1 = atof(argv[++a]);
+         else
+            l2 = atof(argv[++a]);
       } else {
-         printf("Incorrect arguments to Alchemy Lite. Use flags:\n   -i     Rule file\n   -e     Fact file\n   -q     Query [If flag is not present and -map is not present, begins interactive mode]\n   -o     (Optional) Output file\n   -map   (Optional) Print MAP relations and classes\n");
-         return;
+         printUsage();
+         return 1;
       }
    }
+   if (queryFileIdx != -1 && (queryIdx != -1 || map == 1 || batchIdx != -1 || weightsIdx != -1)) {
+      printf("Please use a query file on its own, without -q, -map, -b or -w.\n");
+      return 1;
+   }
+   if (learnIdx != -1 && (queryIdx != -1 || queryFileIdx != -1 || map == 1 || batchIdx != -1 || weightsIdx != -1
+         || codegenIdx != -1 || kernelIdx != -1 || local == 1)) {
+      printf("Please use -learn on its own, with only -i, -e, -em, -hardem, -cll and -threads.\n");
+      return 1;
+   }
+   if ((emIters != -1 || hardEMIters != -1) && codegenIdx != -1) {
+      printf("Please use -codegen without -em or -hardem.\n");
+      return 1;
+   }
+   if (emIters != -1 && hardEMIters != -1) {
+      printf("Please use either -em or -hardem.\n");
+      return 1;
+   }
+   if (cllIdx != -1 && (learnIdx == -1 || emIters != -1 || hardEMIters != -1)) {
+      printf("Please use -cll with -learn, without -em or -hardem.\n");
+      return 1;
+   }
+   if (cllIdx == -1 && (cllIters != -1 || cllBatch != -1 || cllRate != -1.0 || l1 != -1.0 || l2 != -1.0)) {
+      printf("Please use -iters, -batch, -rate, -l1 and -l2 with -cll.\n");
+      return 1;
+   }
+   if (nthreads != -1 && queryFileIdx == -1 && learnIdx == -1 && emIters == -1) {
+      printf("Please use -threads with a query file, -learn or -em.\n");
+      return 1;
+   }
    if (queryIdx != -1 && map == 1) {
       printf("Please use either a query or MAP inference.\n");
-      return;
+      return 1;
+   }
+   if (weightsIdx != -1 && (batchIdx != -1 || map == 1)) {
+      printf("Please use a weight file with a query or on its own.\n");
+      return 1;
+   }
+   if (batchIdx != -1 && (queryIdx != -1 || map == 1)) {
+      printf("Please use either a world file, a query or MAP inference.\n");
+      return 1;
    }
    snprintf(add_fmt_str, 50, "%%%d[^\r\n?)] %%1[)] %%1s", MAX_LINE_LENGTH);
    readInTMLRules(kb, argv[rulesIdx]);
+   if (cllIdx != -1) {
+      if (l1 != -1.0) kb->l0 = l1;
+      if (l2 != -1.0) kb->l1 = l2;
+      if (learnTMLWeightsCLL(kb, argv[rulesIdx], argv[evidIdx], argv[cllIdx], (cllIters != -1) ? cllIters : 100,
+            cllBatch, (cllRate != -1.0) ? cllRate : 0.01, (nthreads != -1) ? nthreads : 1) == 1
+            && writeTMLRules(kb, argv[rulesIdx], argv[learnIdx]) == 1)
+         printf("Learned weights written to %s\n", argv[learnIdx]);
+      freeTMLKB(kb);
+      return 0;
+   }
+   if (learnIdx != -1 && emIters == -1 && hardEMIters == -1) {
+      if (learnTMLWeights(kb, argv[rulesIdx], argv[evidIdx], (nthreads != -1) ? nthreads : 1) == 1
+            && writeTMLRules(kb, argv[rulesIdx], argv[learnIdx]) == 1)
+         printf("Learned weights written to %s\n", argv[learnIdx]);
+      freeTMLKB(kb);
+      return 0;
+   }
+   if (codegenIdx != -1) {
+      if (printTMLKernel(kb, argv[rulesIdx], argv[codegenIdx]) == 1)
+         printf("Kernels written to %s\n", argv[codegenIdx]);
+      freeTMLKB(kb);
+      return 0;
+   }
+   if (kernelIdx != -1 && loadTMLKernel(kb, argv[kernelIdx]) == 0) {
+      freeTMLKB(kb);
+      return 1;
+   }
    printf("Reading in .db file...\n");
-   readInTMLFacts(kb, argv[evidIdx]);
+   if (readInTMLFacts(kb, argv[evidIdx]) == 0) {
+      freeTMLKB(kb);
+      return 1;
+   }
    initialLogZ = fillOutSPN(kb, (Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, kb->root->name);
+   propagateHardConstraintsForKB(kb);
+   if (local == 1)
+      initialLogZ = normalizeSPN(kb);
    logZ = initialLogZ;
+   if (emIters != -1 || hardEMIters != -1) {
+      if (emIters != -1)
+         initialLogZ = learnTMLWeightsEM(kb, emIters, (nthreads != -1) ? nthreads : 1);
+      else
+         initialLogZ = learnWts(kb, hardEMIters);
+      logZ = initialLogZ;
+      if (learnIdx != -1) {
+         if (writeTMLRules(kb, argv[rulesIdx], argv[learnIdx]) == 1)
+            printf("Learned weights written to %s\n", argv[learnIdx]);
+         freeTMLKB(kb);
+         return 0;
+      }
+   }
    printf("TML Knowledge Base successfully read in.\n");
    printf("   (Log of partition function Z is %f)\n", logZ);
-   if (queryIdx != -1) {
+   if (weightsIdx != -1) {
+      wl = readInTMLWeightVectors(kb, argv[weightsIdx]);
+      if (wl != NULL) {
+         wlLogZ = (float*)malloc(sizeof(float)*wl->nvecs);
+         wlProbs = NULL;
+         computeWeightLanesLogZ(kb, wl, wlLogZ);
+         if (queryIdx != -1) {
+            correctScan = sscanf(argv[queryIdx], add_fmt_str, query, question, endline);
+            wlProbs = (float*)malloc(sizeof(float)*wl->nvecs);
+            if (computeWeightLanesQuery(kb, wl, query, wlLogZ, wlProbs) == 0) {
+               free(wlProbs);
+               wlProbs = NULL;
+            }
+         }
+         printWeightLanes(wl, wlLogZ, (queryIdx != -1) ? query : NULL, wlProbs, (outputIdx != -1) ? argv[outputIdx] : NULL);
+         if (wlProbs != NULL) free(wlProbs);
+         free(wlLogZ);
+         freeTMLWeightLanes(wl);
+      }
+   } else if (queryFileIdx != -1) {
+      computeQueryFile(kb, argv[queryFileIdx], logZ, (outputIdx != -1) ? argv[outputIdx] : NULL, (nthreads != -1) ? nthreads : 1);
+   } else if (queryIdx != -1) {
       correctScan = sscanf(argv[queryIdx], add_fmt_str, query, question, endline);
       if (outputIdx == -1)
          computeQueryOrAddEvidence(kb, query, logZ, 1, NULL);
       else
          computeQueryOrAddEvidence(kb, query, logZ, 1, argv[outputIdx]);
+   } else if (batchIdx != -1) {
+      batch = readInTMLWorlds(argv[batchIdx]);
+      if (batch != NULL) {
+         computeWorldBatch(kb, batch);
+         if (outputIdx == -1)
+            printWorldBatch(batch, NULL);
+         else
+            printWorldBatch(batch, argv[outputIdx]);
+         freeTMLWorldBatch(batch);
+      }
    } else if (map == 1) {
       computeMAPState(kb, logZ);
       if (outputIdx == -1)
@@ -118,17 +415,50 @@ int main(int argc, char *argv[]) {
       snprintf(query_fmt_str, 50, " %%%d[^\r\n)?]) %%1[?] %%1s", MAX_NAME_LENGTH);
       snprintf(queryout_fmt_str, 50, " %%%d[^\r\n)?]) ? %%%d[^\r\n?)]", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
       snprintf(map_fmt_str, 50, " MAP %%%d[^\r\n]", MAX_NAME_LENGTH);
-      snprintf(em_fmt_str, 50, " EM %%%d[^\r\n]", MAX_NAME_LENGTH);
+      snprintf(em_fmt_str, 50, " EM %%d %%%d[^ \t\r\n] %%1s", MAX_NAME_LENGTH);
+      snprintf(hardem_fmt_str, 50, " HardEM %%d %%%d[^ \t\r\n] %%1s", MAX_NAME_LENGTH);
+      snprintf(begin_fmt_str, 50, " begin %%%d[^ \t\r\n] %%1s", MAX_NAME_LENGTH);
+      snprintf(rollback_fmt_str, 50, " rollback to %%%d[^ \t\r\n] %%1s", MAX_NAME_LENGTH);
+      snprintf(release_fmt_str, 50, " release %%%d[^ \t\r\n] %%1s", MAX_NAME_LENGTH);
+      snprintf(retract_fmt_str, 50, " retract %%%d[^\r\n?)] %%1[)] %%1s", MAX_LINE_LENGTH);
+      snprintf(timed_fmt_str, 50, "%%%d[^\r\n?)] %%1[)] @ %%ld %%1s", MAX_LINE_LENGTH);
+      snprintf(ttl_fmt_str, 50, "%%%d[^\r\n?)] %%1[)] for %%ld %%1s", MAX_LINE_LENGTH);
+      snprintf(time_fmt_str, 50, " time %%ld %%1s");
+      snprintf(window_fmt_str, 50, " window %%ld %%1s");
+      snprintf(load_fmt_str, 50, " load %%%d[^ \t\r\n] %%1s", MAX_NAME_LENGTH);
+      snprintf(weight_fmt_str, 50, " weight %%%d[^\r\n]", MAX_LINE_LENGTH);
+      snprintf(weights_fmt_str, 50, " weights %%%d[^ \t\r\n] %%1s", MAX_LINE_LENGTH);
+      snprintf(online_fmt_str, 50, " online %%d %%1s");
+      snprintf(prepare_fmt_str, 60, " prepare %%%d[^ \t\r\n] %%%d[^\r\n)?]) %%1[?] %%1s", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
+      snprintf(exec_fmt_str, 50, " exec %%%d[^ \t\r\n] %%%d[^ \t\r\n] %%1s", MAX_NAME_LENGTH, MAX_NAME_LENGTH);
       printf("Welcome to the Alchemy Lite interactive prompt!\n");
       printf("    To add evidence, enter: <TMLFact>\n");
+      printf("    To add all the evidence in a fact file, enter: load <Filename>\n");
+      printf("    To retract evidence added earlier, enter: retract <TMLFact>\n");
+      printf("    To add evidence that holds from a time, or for a while, enter: <TMLFact> @ <Time> or <TMLFact> for <Duration>\n");
+      printf("    To move the clock forward, expiring old evidence, enter: time <Time>\n");
+      printf("    To make new evidence expire after a sliding window, enter: window <Duration>\n");
+      printf("    To change a weight of the TML KB, enter: weight <Class>: <Parameter> <Weight>\n");
+      printf("    To reload the weights of the TML KB from a weight file, enter: weights <Filename>\n");
       printf("    To query the TML KB, enter: <Query>? [optionalOutputFilename]\n");
+      printf("    To find the k objects most likely to satisfy a query, enter: top <k> <Query about *>?\n");
       printf("    To find the MAP state, enter: MAP [optionalOutputFilename]\n");
+      printf("    To learn the weights by EM from the evidence, enter: EM <Iterations> [optionalRuleFilename]\n");
+      printf("    To learn the weights by hard EM over MAP states, enter: HardEM <MaxIterations> [optionalRuleFilename]\n");
+      printf("    To keep learning the weights as evidence comes and goes, re-estimating them every so many facts, enter: online <Facts>\n");
+      printf("    To re-estimate them now, enter: reestimate, or to stop, enter: online off\n");
       printf("    To reset the TML KB, enter \"r\" or \"reset\"\n");
+      printf("    To set a savepoint for a what-if scenario, enter: begin [optionalName]\n");
+      printf("    To undo the evidence added since a savepoint, enter: rollback [to <Name>]\n");
+      printf("    To keep that evidence and drop the savepoint, enter: release [optionalName]\n");
+      printf("    To prepare a query about any object $x, enter: prepare <Name> <Query>?\n");
+      printf("    To run a prepared query on an object, enter: exec <Name> <Object>\n");
       printf("    To save the updated set of TML facts to .db file, enter: save <Filename>\n");
       printf("    To see these options again, enter: help\n");
       printf("    To quit, enter \"q\" or \"quit\"\n");
       printf("\n");
       while (1) {
+         logZ = updateOnlineWeights(kb, logZ, 0);
          printf("> ");
          fflush(stdout);
          p = fgets(inputBuffer, MAX_LINE_LENGTH, stdin);
@@ -143,14 +473,91 @@ int main(int argc, char *argv[]) {
          }
          if (strcmp(inputBuffer, "r\n") == 0) {
             resetKB(kb);
+            if (isnan(initialLogZ) || kb->onlineDirty != NULL) // weights changed since it was computed
+               initialLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 0);
             logZ = initialLogZ;
             continue;
          }
          if (strcmp(inputBuffer, "reset\n") == 0) {
             resetKB(kb);
+            if (isnan(initialLogZ) || kb->onlineDirty != NULL) // weights changed since it was computed
+               initialLogZ = computeLogZ((Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, spn_logsum, 0);
             logZ = initialLogZ;
             continue;
          }
+         if (strcmp(inputBuffer, "online off\n") == 0) {
+            stopOnlineLearning(kb);
+            initialLogZ = NAN;
+            continue;
+         }
+         if (strcmp(inputBuffer, "reestimate\n") == 0) {
+            if (kb->onlineDirty == NULL)
+               printf("Online learning is not on. To start it, enter: online <Facts>\n");
+            logZ = updateOnlineWeights(kb, logZ, 1);
+            initialLogZ = NAN;
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, online_fmt_str, &onlineEvery, endline);
+         if (correctScan == 1 && onlineEvery >= 0) {
+            startOnlineLearning(kb, onlineEvery);
+            continue;
+         }
+         if (strcmp(inputBuffer, "begin\n") == 0) {
+            beginKBSavepoint(kb, NULL, logZ);
+            continue;
+         }
+         if (strcmp(inputBuffer, "rollback\n") == 0) {
+            logZ = rollbackToKBSavepoint(kb, NULL, logZ);
+            continue;
+         }
+         if (strcmp(inputBuffer, "release\n") == 0) {
+            releaseKBSavepoint(kb, NULL);
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, rollback_fmt_str, query, endline);
+         if (correctScan == 1) {
+            logZ = rollbackToKBSavepoint(kb, query, logZ);
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, begin_fmt_str, query, endline);
+         if (correctScan == 1) {
+            beginKBSavepoint(kb, query, logZ);
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, release_fmt_str, query, endline);
+         if (correctScan == 1) {
+            releaseKBSavepoint(kb, query);
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, retract_fmt_str, query, question, endline);
+         if (correctScan == 2) {
+            logZ = retractKBFact(kb, query, logZ);
+            kb->mapSet = 0;
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, prepare_fmt_str, outfile, query, question, endline);
+         if (correctScan == 3) {
+            pq = findPreparedQuery(kb, outfile);
+            if (pq != NULL) {
+               HASH_DEL(kb->preparedQueries, pq);
+               freePreparedQuery(pq);
+            }
+            prepareTMLQuery(kb, outfile, query);
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, exec_fmt_str, outfile, query, endline);
+         if (correctScan == 2) {
+            pq = findPreparedQuery(kb, outfile);
+            node = findQueryObject(kb, query);
+            if (pq == NULL)
+               printf("Unknown prepared query %s.\n", outfile);
+            else if (node == NULL)
+               printf("Unknown object %s.\n", query);
+            else
+               executePreparedQuery(kb, pq, node, logZ, NULL);
+            kb->mapSet = 0;
+            continue;
+         }
          correctScan = sscanf(inputBuffer, map_fmt_str, query);
          if (correctScan == 1) {
             computeMAPState(kb, logZ);
@@ -158,6 +565,22 @@ int main(int argc, char *argv[]) {
             kb->mapSet = 1;
             continue;
          }
+         correctScan = sscanf(inputBuffer, em_fmt_str, &emIters, outfile, endline);
+         if ((correctScan == 1 || correctScan == 2) && emIters > 0) {
+            logZ = learnTMLWeightsEM(kb, emIters, 1);
+            initialLogZ = NAN;
+            if (correctScan == 2 && writeTMLRules(kb, argv[rulesIdx], outfile) == 1)
+               printf("Learned weights written to %s\n", outfile);
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, hardem_fmt_str, &hardEMIters, outfile, endline);
+         if ((correctScan == 1 || correctScan == 2) && hardEMIters > 0) {
+            logZ = learnWts(kb, hardEMIters);
+            initialLogZ = NAN;
+            if (correctScan == 2 && writeTMLRules(kb, argv[rulesIdx], outfile) == 1)
+               printf("Learned weights written to %s\n", outfile);
+            continue;
+         }
          correctScan = sscanf(inputBuffer, print_fmt_str, query, endline);
          if (correctScan == 2) {
             // SAVE KB
@@ -176,18 +599,88 @@ int main(int argc, char *argv[]) {
             kb->mapSet = 0;
             continue;
          }
+         correctScan = sscanf(inputBuffer, load_fmt_str, outfile, endline);
+         if (correctScan == 1) {
+            logZ = loadKBEvidence(kb, outfile, logZ);
+            kb->mapSet = 0;
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, weights_fmt_str, outfile, endline);
+         if (correctScan == 1) {
+            logZ = reloadTMLWeights(kb, outfile, logZ);
+            initialLogZ = NAN;
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, weight_fmt_str, query);
+         if (correctScan == 1) {
+            // The weight is the last token, the rest names the parameter
+            p = query + strlen(query);
+            while (p > query && isspace(*(p-1))) p--;
+            *p = '\0';
+            while (p > query && !isspace(*(p-1))) p--;
+            if (p == query || sscanf(p, "%f %1s", &wt, endline) != 1) {
+               printf("Malformed weight %s.\n", query);
+               continue;
+            }
+            *p = '\0';
+            logZ = setTMLWeight(kb, query, wt, logZ);
+            initialLogZ = NAN;
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, time_fmt_str, &factTime, endline);
+         if (correctScan == 1) {
+            logZ = advanceKBClock(kb, factTime, logZ);
+            kb->mapSet = 0;
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, window_fmt_str, &factTime, endline);
+         if (correctScan == 1 && factTime >= 0) {
+            kb->window = factTime;
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, timed_fmt_str, query, question, &factTime, endline);
+         if (correctScan == 3 && factTime >= 0) {
+            logZ = addTimedKBFact(kb, query, factTime, -1, logZ);
+            kb->mapSet = 0;
+            continue;
+         }
+         correctScan = sscanf(inputBuffer, ttl_fmt_str, query, question, &factTime, endline);
+         if (correctScan == 3 && factTime > 0) {
+            logZ = addTimedKBFact(kb, query, -1, factTime, logZ);
+            kb->mapSet = 0;
+            continue;
+         }
          correctScan = sscanf(inputBuffer, add_fmt_str, query, question, endline);
          if (correctScan == 2) {
-            logZ = computeQueryOrAddEvidence(kb, query, logZ, 0, NULL);
+            if (kb->window > 0)
+               logZ = addTimedKBFact(kb, query, -1, -1, logZ);
+            else
+               logZ = computeQueryOrAddEvidence(kb, query, logZ, 0, NULL);
             kb->mapSet = 0;
             continue;
          }
          if (!strcmp(inputBuffer, "help\n") == 0)
             printf("Malformed request\n");
          printf("    To add evidence, enter: <TMLFact>\n");
+         printf("    To add the evidence in a fact file, enter: load <Filename>\n");
+         printf("    To retract evidence added earlier, enter: retract <TMLFact>\n");
+         printf("    To add timed evidence, enter: <TMLFact> @ <Time> or <TMLFact> for <Duration>\n");
+         printf("    To move the clock forward, enter: time <Time>\n");
+         printf("    To set the window new evidence expires after, enter: window <Duration>\n");
+         printf("    To change a weight, enter: weight <Class>: <Parameter> <Weight>\n");
+         printf("    To reload the weights from a weight file, enter: weights <Filename>\n");
          printf("    To query the TML KB, enter: <Query>? [optionalOutputFilename]\n");
+         printf("    To rank objects by a query, enter: top <k> <Query about *>?\n");
          printf("    To find the MAP state, enter: MAP [optionalOutputFilename]\n");
+         printf("    To learn the weights by EM, enter: EM <Iterations> [optionalRuleFilename]\n");
+         printf("    To learn the weights by hard EM, enter: HardEM <MaxIterations> [optionalRuleFilename]\n");
+         printf("    To learn the weights online, enter: online <Facts>, reestimate, or online off\n");
          printf("    To reset the TML KB, enter: reset\n");
+         printf("    To set a savepoint, enter: begin [optionalName]\n");
+         printf("    To undo the evidence added since a savepoint, enter: rollback [to <Name>]\n");
+         printf("    To drop a savepoint, enter: release [optionalName]\n");
+         printf("    To prepare a query about any object $x, enter: prepare <Name> <Query>?\n");
+         printf("    To run a prepared query on an object, enter: exec <Name> <Object>\n");
          printf("    To save the updated TML KB to file, enter: save <Filename>\n");
          printf("    To quit, enter: quit\n");
          printf("\n");
@@ -1351,3 +1351,46 @@ int numCombinationsInIntAccessor(const IntAccessor* aa) {
    }
    return n;
 }
+
+void initPtrStack(PtrStack* st, int cap) {
+   if (cap < 1) cap = 1;
+   st->items_ = (void**)malloc(sizeof(void*)*cap);
+   st->n_ = 0;
+   st->cap_ = cap;
+}
+
+void pushPtrStack(PtrStack* st, void* ptr) {
+   if (st->n_ == st->cap_) {
+      st->cap_ *= 2;
+      st->items_ = (void**)realloc(st->items_, sizeof(void*)*st->cap_);
+   }
+   st->items_[st->n_++] = ptr;
+}
+
+// Returns NULL when the stack is empty
+void* popPtrStack(PtrStack* st) {
+   if (st->n_ == 0) return NULL;
+   return st->items_[--st->n_];
+}
+
+// Reverses the items pushed since the stack held from items, so that
+// children pushed in order are popped in order
+void reversePtrStackFrom(PtrStack* st, int from) {
+   int i = from;
+   int j = st->n_-1;
+   void* tmp;
+   while (i < j) {
+      tmp = st->items_[i];
+      st->items_[i] = st->items_[j];
+      st->items_[j] = tmp;
+      i++;
+      j--;
+   }
+}
+
+void freePtrStack(PtrStack* st) {
+   free(st->items_);
+   st->items_ = NULL;
+   st->n_ = 0;
+   st->cap_ = 0;
+}
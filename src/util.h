@@ -141,4 +141,19 @@ void resetIntAccessor(IntAccessor* aa);
 void freeIntAccessor(IntAccessor* aa);
 int numCombinationsInIntAccessor(const IntAccessor* aa);
 
+// Pointer Stack
+// Growable stack used by the SPN traversals in place of recursion,
+// so the depth of a KB is bounded by memory rather than the C stack.
+typedef struct PtrStack {
+   void** items_;
+   int n_;
+   int cap_;
+} PtrStack;
+
+void initPtrStack(PtrStack* st, int cap);
+void pushPtrStack(PtrStack* st, void* ptr);
+void* popPtrStack(PtrStack* st);
+void reversePtrStackFrom(PtrStack* st, int from);
+void freePtrStack(PtrStack* st);
+
 #endif
@@ -0,0 +1,267 @@
+#!/bin/sh
+#
+# Regression tests for Alchemy Lite. Run with "make test", or:
+#
+#    sh test/run.sh [path to al]
+#
+# Each test compares a fast path of al against the slower one it must agree
+# with, to 1e-5 unless noted.
+
+AL=${1:-bin/al}
+DIR=$(dirname "$0")
+TMP=${TMPDIR:-/tmp}/al-test.$$
+fails=0
+
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+
+pass() { echo "ok   $1"; }
+fail() { echo "FAIL $1: $2"; fails=$((fails+1)); }
+
+# close A B [TOL]: succeeds if the numbers A and B agree to TOL
+close() {
+   awk -v a="$1" -v b="$2" -v t="${3:-1e-5}" \
+      'BEGIN { d = a-b; if (d < 0) d = -d; exit !(a != "" && b != "" && d <= t) }'
+}
+
+# probs FILE: the answers printed to FILE, one "query probability" per line
+probs() { sed -n 's/.*P\[\(.*\)\] = \([0-9.e+-]*\).*/\1 \2/p' "$1"; }
+
+# same_probs NAME A B: checks that the answer files A and B hold the same
+# queries with the same probabilities
+same_probs() {
+   if [ "$(cut -d' ' -f1 "$2")" != "$(cut -d' ' -f1 "$3")" ] || [ ! -s "$2" ]; then
+      fail "$1" "queries differ: $(tr '\n' ' ' < "$2")/ $(tr '\n' ' ' < "$3")"
+      return
+   fi
+   paste -d' ' "$2" "$3" | while read -r q a q2 b; do
+      close "$a" "$b" || { echo "$q $a $b"; break; }
+   done > "$TMP/diff"
+   if [ -s "$TMP/diff" ]; then fail "$1" "$(cat "$TMP/diff")"; else pass "$1"; fi
+}
+
+# A batch of worlds answers each world as if its facts were added on their
+# own, even when the worlds assign the same object conflicting classes.
+test_batch_conflicting_worlds() {
+   "$AL" -i "$DIR/town.tml" -e "$DIR/town.db" -b "$DIR/conflicting-worlds.txt" > "$TMP/batch.out"
+   grep -v '^//' "$DIR/conflicting-worlds.txt" | awk -v RS= -v dir="$TMP" '{ print > (dir "/world." NR) }'
+   w=1
+   while [ -f "$TMP/world.$w" ]; do
+      awk -v w="World $w:" 'index($0, "World ") == 1 { on = (index($0, w) == 1); next } on' \
+         "$TMP/batch.out" > "$TMP/batch.$w"
+      probs "$TMP/batch.$w" > "$TMP/batch.$w.p"
+      { grep -v '?$' "$TMP/world.$w"; grep '?$' "$TMP/world.$w"; echo q; } \
+         | "$AL" -i "$DIR/town.tml" -e "$DIR/town.db" > "$TMP/single.$w"
+      probs "$TMP/single.$w" > "$TMP/single.$w.p"
+      same_probs "batch world $w" "$TMP/batch.$w.p" "$TMP/single.$w.p"
+      "$AL" -i "$DIR/town.tml" -e "$DIR/town.db" -b "$TMP/world.$w" > "$TMP/alone.$w"
+      a=$(sed -n "s/^World $w: Log of partition function Z is //p" "$TMP/batch.out")
+      b=$(sed -n 's/^World 1: Log of partition function Z is //p' "$TMP/alone.$w")
+      if close "$a" "$b"; then pass "batch world $w log Z"; else fail "batch world $w log Z" "$a, alone $b"; fi
+      w=$((w+1))
+   done
+}
+
+# A weight file holding the KB's own weights, as al prints them, gives the
+# KB's log Z. The printed weights are rounded, so this holds to a tolerance
+# that grows with log Z.
+test_weight_lanes_kb_weights() {
+   echo 0 > "$TMP/one.w"
+   "$AL" -i "$1" -e "$2" -w "$TMP/one.w" > "$TMP/layout.out"
+   sed -n 's/^   [A-Za-z0-9]*: .* \([-0-9.]*\)$/\1/p' "$TMP/layout.out" | tr '\n' ' ' > "$TMP/kb.w"
+   "$AL" -i "$1" -e "$2" -w "$TMP/kb.w" > "$TMP/lanes.out"
+   a=$(sed -n 's/^   (Log of partition function Z is \(.*\))$/\1/p' "$TMP/layout.out")
+   b=$(sed -n 's/^Weight vector 1: Log of partition function Z is //p' "$TMP/lanes.out")
+   if close "$a" "$b" "$3"; then pass "weight lanes $(basename "$2")"; else fail "weight lanes $(basename "$2")" "KB $a, lane $b"; fi
+}
+
+# Undoing a class block restores the object's answers, and leaves the
+# objects indexed under each class as they were.
+test_block_undo() {
+   printf 'Happy(Bob)?\nHappy(Child)?\nq\n' | "$AL" -i "$DIR/town.tml" -e "$DIR/town.db" > "$TMP/fresh.out"
+   printf '!Is(Bob,Adult)\nreset\n!Is(Bob,Child)\nreset\nHappy(Bob)?\nHappy(Child)?\nq\n' \
+      | "$AL" -i "$DIR/town.tml" -e "$DIR/town.db" > "$TMP/undone.out"
+   probs "$TMP/fresh.out" > "$TMP/fresh.p"
+   probs "$TMP/undone.out" > "$TMP/undone.p"
+   same_probs "block undo" "$TMP/fresh.p" "$TMP/undone.p"
+}
+
+# An object that hard rules leave in one subclass answers the queries
+# about that class, until the evidence that pruned the others is undone.
+test_prune_index() {
+   printf 'Tired(Bob)\nHappy(Bob)?\nHappy(Alice)?\nHappy(Bob)?\nHappy(Alice)?\nreset\nHappy(Alice)?\nq\n' \
+      | "$AL" -i "$DIR/prune.tml" -e "$DIR/prune.db" > "$TMP/objects.out"
+   printf 'Tired(Bob)\nHappy(Adult)?\nIs(Bob,Adult)\nHappy(Adult)?\nreset\nHappy(Adult)?\nq\n' \
+      | "$AL" -i "$DIR/prune.tml" -e "$DIR/prune.db" > "$TMP/class.out"
+   probs "$TMP/objects.out" > "$TMP/objects.p"
+   probs "$TMP/class.out" > "$TMP/class.p"
+   same_probs "prune index" "$TMP/objects.p" "$TMP/class.p"
+}
+
+# Retracting a fact, or rolling it back, also undoes the subclass branches
+# its evidence pruned.
+test_prune_undo() {
+   printf 'Happy(Bob)\nHappy(Adult)?\nIs(Bob,Adult)?\nHappy(Adult)?\nIs(Bob,Adult)?\nq\n' \
+      | "$AL" -i "$DIR/prune.tml" -e "$DIR/prune.db" > "$TMP/fresh.out"
+   printf 'Tired(Bob)\nHappy(Bob)\nretract Tired(Bob)\nHappy(Adult)?\nIs(Bob,Adult)?\nbegin\nTired(Bob)\nrollback\nHappy(Adult)?\nIs(Bob,Adult)?\nq\n' \
+      | "$AL" -i "$DIR/prune.tml" -e "$DIR/prune.db" > "$TMP/undone.out"
+   probs "$TMP/fresh.out" > "$TMP/fresh.p"
+   probs "$TMP/undone.out" > "$TMP/undone.p"
+   same_probs "prune undo" "$TMP/fresh.p" "$TMP/undone.p"
+}
+
+# Timed facts expire when the clock reaches their time, and a retracted
+# timed fact is not expired a second time.
+test_timed_expiry() {
+   printf 'Happy(Bob)\nHappy(Adult)?\nIs(Bob,Adult)?\nTired(Bob)?\nHappy(Adult)?\nIs(Bob,Adult)?\nTired(Bob)?\nq\n' \
+      | "$AL" -i "$DIR/prune.tml" -e "$DIR/prune.db" > "$TMP/fresh.out"
+   printf 'Tired(Bob) for 5\nHappy(Bob)\nIs(Bob,Adult) for 3\nretract Tired(Bob)\ntime 3\nHappy(Adult)?\nIs(Bob,Adult)?\nTired(Bob)?\nTired(Alice) for 2\ntime 6\nHappy(Adult)?\nIs(Bob,Adult)?\nTired(Bob)?\nq\n' \
+      | "$AL" -i "$DIR/prune.tml" -e "$DIR/prune.db" > "$TMP/timed.out"
+   probs "$TMP/fresh.out" > "$TMP/fresh.p"
+   probs "$TMP/timed.out" > "$TMP/timed.p"
+   same_probs "timed expiry" "$TMP/fresh.p" "$TMP/timed.p"
+}
+
+# Loading a fact file into a live KB gives the answers of a KB read with
+# those facts, for class, relation and attribute lines alike.
+test_load() {
+   q='Mood(Bob)?\nTired(Bob)?\nTired(Alice)?\nWarm(H1)?\nq\n'
+   printf "load $DIR/load.db\n$q" | "$AL" -i "$DIR/town.tml" -e "$DIR/town.db" > "$TMP/loaded.out"
+   cat "$DIR/town.db" "$DIR/load.db" > "$TMP/all.db"
+   printf "$q" | "$AL" -i "$DIR/town.tml" -e "$TMP/all.db" > "$TMP/read.out"
+   probs "$TMP/loaded.out" > "$TMP/loaded.p"
+   probs "$TMP/read.out" > "$TMP/read.p"
+   same_probs "load" "$TMP/read.p" "$TMP/loaded.p"
+}
+
+# Setting a weight at the prompt gives the answers of the KB read with that
+# weight, including in the subclasses that override the relation.
+test_set_weight() {
+   q='Happy(Bob)?\nTired(Alice)?\nq\n'
+   printf "weight Person: Happy 1.0\nweight Adult: !Tired 0.9\n$q" \
+      | "$AL" -i "$DIR/town.tml" -e "$DIR/town.db" > "$TMP/set.out"
+   sed 's/relations Happy() 0.7;/relations Happy() 1.0;/; s/!Tired() 0.4/!Tired() 0.9/' "$DIR/town.tml" > "$TMP/edited.tml"
+   printf "$q" | "$AL" -i "$TMP/edited.tml" -e "$DIR/town.db" > "$TMP/edited.out"
+   probs "$TMP/set.out" > "$TMP/set.p"
+   probs "$TMP/edited.out" > "$TMP/edited.p"
+   same_probs "set weight" "$TMP/edited.p" "$TMP/set.p"
+}
+
+# A snapshot, such as each -qf thread queries, keeps answering as of when
+# it was taken while the KB takes and retracts evidence on another thread.
+test_snapshot_write() {
+   src="$DIR/../src"
+   if ! cc -O2 -I"$src" -o "$TMP/snapshot" "$DIR/snapshot.c" "$src/Node.c" "$src/TMLClass.c" \
+         "$src/TMLKB.c" "$src/util.c" "$src/pqueue.c" -lm -ldl -lpthread 2> "$TMP/cc.err"; then
+      fail "snapshot write" "$(head -1 "$TMP/cc.err")"
+      return
+   fi
+   if "$TMP/snapshot" "$DIR/town.tml" "$DIR/town.db" > /dev/null 2> "$TMP/snapshot.err"; then
+      pass "snapshot write"
+   else
+      fail "snapshot write" "$(tail -1 "$TMP/snapshot.err")"
+   fi
+}
+
+# Learning from fully observed facts sets each weight to the log of its
+# smoothed frequency, here P(Adult) = (2+1)/(3+2), and the rule file it
+# writes reads back in with those probabilities, here
+# P(Happy | Child) = (1+1)/(1+2).
+test_learn() {
+   "$AL" -i "$DIR/town.tml" -e "$DIR/learn.db" -learn "$TMP/learned.tml" > /dev/null
+   w=$(sed -n 's/^subclasses Adult \([-0-9.]*\),.*/\1/p' "$TMP/learned.tml")
+   if close "$w" "$(awk 'BEGIN { print log(3/5) }')"; then pass "learn"; else fail "learn" "Adult weight $w"; fi
+   printf 'Town T {\nPerson[1] A;\n}\n\nPerson A {\nChild;\n}\n' > "$TMP/child.db"
+   p=$(printf 'Happy(A)?\nq\n' | "$AL" -i "$TMP/learned.tml" -e "$TMP/child.db" | sed -n 's/.*P\[Happy(A)\] = //p')
+   if close "$p" 0.666667; then pass "learn re-read"; else fail "learn re-read" "P(Happy | Child) $p"; fi
+}
+
+# EM never lowers the log likelihood of the evidence once the weights are
+# normalized, i.e. after its first iteration, and leaves the weights of
+# fully observed parameters at their smoothed frequencies. Hard EM stops
+# once its MAP counts stop changing, never lowering the max-product log Z.
+test_em() {
+   "$AL" -i "$DIR/town.tml" -e "$DIR/learn.db" -em 6 -learn "$TMP/em.tml" > "$TMP/em.out"
+   if sed -n 's/^EM iteration [0-9]*: log Z of the evidence //p' "$TMP/em.out" \
+         | awk 'NR > 2 && $1 < prev-1e-4 { bad = 1 } { prev = $1 } END { exit bad || NR != 6 }'; then
+      pass "em log Z"
+   else
+      fail "em log Z" "$(grep '^EM' "$TMP/em.out" | tr '\n' ' ')"
+   fi
+   w=$(sed -n 's/^subclasses Adult \([-0-9.]*\),.*/\1/p' "$TMP/em.tml")
+   if close "$w" "$(awk 'BEGIN { print log(3/5) }')"; then pass "em observed"; else fail "em observed" "Adult weight $w"; fi
+   "$AL" -i "$DIR/town.tml" -e "$DIR/learn.db" -hardem 10 -learn "$TMP/hardem.tml" > "$TMP/hardem.out"
+   if sed -n 's/^Hard EM iteration [0-9]*: max-product log Z \([-0-9.]*\), \([0-9]*\) counts changed/\1 \2/p' "$TMP/hardem.out" \
+         | awk 'NR > 2 && $1 < prev-1e-4 { bad = 1 } { prev = $1; last = $2 } END { exit bad || last != 0 }'; then
+      pass "hard em"
+   else
+      fail "hard em" "$(grep '^Hard EM' "$TMP/hardem.out" | tr '\n' ' ')"
+   fi
+}
+
+# Discriminative learning of a relation fits its conditional probability
+# alone: with no penalties, P(Happy | Adult) goes to the 2 in 3 of the
+# facts, and the answers that do not involve Happy keep their values.
+test_cll_relation() {
+   "$AL" -i "$DIR/town.tml" -e "$DIR/cll.db" -learn "$TMP/cll.tml" -cll Happy -iters 200 -rate 0.1 > /dev/null
+   printf 'Town T {\nPerson[1] A;\n}\n\nPerson A {\nAdult;\n}\n' > "$TMP/adult.db"
+   p=$(printf 'Happy(A)?\nq\n' | "$AL" -i "$TMP/cll.tml" -e "$TMP/adult.db" | sed -n 's/.*P\[Happy(A)\] = //p')
+   if close "$p" 0.666667 1e-3; then pass "cll relation"; else fail "cll relation" "P(Happy | Adult) $p"; fi
+   q='Warm(H1)?\nMood(Bob)?\nq\n'
+   printf "$q" | "$AL" -i "$DIR/town.tml" -e "$DIR/town.db" > "$TMP/before.out"
+   printf "$q" | "$AL" -i "$TMP/cll.tml" -e "$DIR/town.db" > "$TMP/after.out"
+   probs "$TMP/before.out" > "$TMP/before.p"
+   probs "$TMP/after.out" > "$TMP/after.p"
+   same_probs "cll relation leaves other weights" "$TMP/before.p" "$TMP/after.p"
+}
+
+# A class can be the target of discriminative learning when its subclasses
+# have relations of their own, whose facts are withheld with the subclasses.
+test_cll_class_target() {
+   sed 's/relations Tired() 1.0;/relations Tired() 1.0, Commutes() 0.5;/' "$DIR/town.tml" > "$TMP/commute.tml"
+   "$AL" -i "$TMP/commute.tml" -e "$DIR/commute.db" -learn "$TMP/learned.tml" -cll Adult -iters 20 -rate 0.1 > "$TMP/cll.out"
+   first=$(sed -n 's/^Iteration 1: conditional log likelihood of the target //p' "$TMP/cll.out")
+   last=$(sed -n 's/^Iteration 20: conditional log likelihood of the target //p' "$TMP/cll.out")
+   if [ ! -f "$TMP/learned.tml" ]; then
+      fail "cll class target" "$(head -1 "$TMP/cll.out")"
+   elif awk -v a="$first" -v b="$last" 'BEGIN { exit !(b > a) }'; then
+      pass "cll class target"
+   else
+      fail "cll class target" "conditional log likelihood $first, then $last"
+   fi
+}
+
+# Re-estimating the weights online takes in the evidence the KB held when
+# online learning started, as well as the facts added since.
+test_online_reestimate() {
+   q='Happy(Bob)?\nTired(Alice)?\nMood(Bob)?\nWarm(H1)?\nq\n'
+   printf "online 0\nload $DIR/load.db\nreestimate\n$q" \
+      | "$AL" -i "$DIR/town.tml" -e "$DIR/town.db" > "$TMP/online.out"
+   cat "$DIR/town.db" "$DIR/load.db" > "$TMP/all.db"
+   printf "online 0\nreestimate\n$q" | "$AL" -i "$DIR/town.tml" -e "$TMP/all.db" > "$TMP/started.out"
+   probs "$TMP/online.out" > "$TMP/online.p"
+   probs "$TMP/started.out" > "$TMP/started.p"
+   same_probs "online reestimate" "$TMP/online.p" "$TMP/started.p"
+}
+
+test_batch_conflicting_worlds
+test_block_undo
+test_prune_index
+test_prune_undo
+test_timed_expiry
+test_load
+test_set_weight
+test_online_reestimate
+test_snapshot_write
+test_learn
+test_em
+test_cll_relation
+test_cll_class_target
+test_weight_lanes_kb_weights "$DIR/town.tml" "$DIR/town.db" 1e-5
+test_weight_lanes_kb_weights "$DIR/../tutorial/voting.tml" "$DIR/../tutorial/voting.db" 1e-3
+
+if [ $fails -ne 0 ]; then
+   echo "$fails test(s) failed"
+   exit 1
+fi
+echo "all tests passed"
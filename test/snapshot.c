@@ -0,0 +1,110 @@
+/*
+ * Checks that a snapshot of a KB answers queries as of when it was taken,
+ * while the KB itself takes and retracts evidence on another thread.
+ * Built and run by run.sh:
+ *
+ *    snapshot <rule file> <fact file>
+ *
+ * Exits with 0 if every answer of the snapshot matched the KB's answer
+ * before the writes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "TMLKB.h"
+
+#define ROUNDS 50
+
+static char* queries[] = { "Happy(Bob", "Is(Bob,Adult", "Tired(Bob", "Is(H1,Big", "Warm(H1" };
+static char* facts[] = { "Happy(Bob", "Is(Bob,Adult", "Is(H1,Big" };
+#define NQUERIES (sizeof(queries)/sizeof(queries[0]))
+#define NFACTS (sizeof(facts)/sizeof(facts[0]))
+
+typedef struct SnapshotReader {
+   TMLKB* snap;
+   float logZ;
+   char** expected;
+   int mismatches;
+} SnapshotReader;
+
+/* Answers a query on a KB, returning what it printed */
+static char* answer(TMLKB* kb, char* query, float logZ) {
+   char* result = NULL;
+   size_t len;
+   FILE* out = open_memstream(&result, &len);
+
+   computeQueryOrAddEvidenceToFile(kb, query, logZ, 1, out);
+   fclose(out);
+   return result;
+}
+
+static void* readSnapshot(void* arg) {
+   SnapshotReader* r = (SnapshotReader*)arg;
+   char* result;
+   int round;
+   size_t q;
+
+   for (round = 0; round < ROUNDS; round++) {
+      for (q = 0; q < NQUERIES; q++) {
+         result = answer(r->snap, queries[q], r->logZ);
+         if (strcmp(result, r->expected[q]) != 0) {
+            if (r->mismatches++ == 0)
+               fprintf(stderr, "%s: snapshot answered %s, expected %s", queries[q], result, r->expected[q]);
+         }
+         free(result);
+      }
+   }
+   return NULL;
+}
+
+int main(int argc, char* argv[]) {
+   TMLKB* kb;
+   SnapshotReader r;
+   pthread_t reader;
+   char* expected[NQUERIES];
+   float logZ;
+   int round;
+   size_t q, f;
+
+   if (argc != 3) {
+      fprintf(stderr, "Usage: snapshot <rule file> <fact file>\n");
+      return 2;
+   }
+   kb = TMLKBNew();
+   readInTMLRules(kb, argv[1]);
+   if (readInTMLFacts(kb, argv[2]) == 0) {
+      freeTMLKB(kb);
+      return 2;
+   }
+   logZ = fillOutSPN(kb, (Node*)(kb->root->ptr), ((Node*)(kb->root->ptr))->cl, kb->root->name);
+   propagateHardConstraintsForKB(kb);
+   for (q = 0; q < NQUERIES; q++)
+      expected[q] = answer(kb, queries[q], logZ);
+
+   r.snap = createTMLKBSnapshot(kb);
+   r.logZ = logZ;
+   r.expected = expected;
+   r.mismatches = 0;
+   pthread_create(&reader, NULL, readSnapshot, &r);
+   for (round = 0; round < ROUNDS; round++) {
+      for (f = 0; f < NFACTS; f++)
+         logZ = computeQueryOrAddEvidenceToFile(kb, facts[f], logZ, 0, NULL);
+      for (q = 0; q < NQUERIES; q++)
+         free(answer(kb, queries[q], logZ));
+      for (f = 0; f < NFACTS; f++)
+         logZ = retractKBFact(kb, facts[NFACTS-1-f], logZ);
+   }
+   pthread_join(reader, NULL);
+
+   freeTMLKB(r.snap);
+   for (q = 0; q < NQUERIES; q++)
+      free(expected[q]);
+   freeTMLKB(kb);
+   if (r.mismatches != 0) {
+      fprintf(stderr, "%d of %d snapshot answers changed while the KB was written\n", r.mismatches, (int)(ROUNDS*NQUERIES));
+      return 1;
+   }
+   return 0;
+}